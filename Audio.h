@@ -0,0 +1,259 @@
+#ifndef AUDIO_H
+#define AUDIO_H
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <spawn.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/wait.h>
+
+#define AUDIO_PLAYER "mpg123"
+#define AUDIO_ENV "ROGUE_AUDIO"
+
+extern char **environ;
+
+// One mpg123 for the whole session, started with posix_spawn in remote
+// control mode (-R) and driven by short commands on its stdin. The pipe is
+// non-blocking, so a stuck player drops a command instead of stalling the
+// input loop. A watcher thread reads the player's status lines and reloads
+// the track when it ends, which is how tracks loop in remote mode. Before an
+// execv the player and both pipes are handed to the next program through
+// AUDIO_ENV, so music keeps playing across Menu and Map.
+typedef struct {
+    pthread_mutex_t lock;
+    pid_t pid;
+    int control;
+    int status;
+    bool playing;
+    char track[256];
+    int available;
+} Audio;
+
+static Audio audio = {.lock = PTHREAD_MUTEX_INITIALIZER, .pid = -1, .control = -1, .status = -1, .available = -1};
+
+// Whether mpg123 is on PATH, looked up once without starting a shell.
+static inline bool audio_available() {
+    if (audio.available >= 0) return audio.available;
+    audio.available = 0;
+    const char *path = getenv("PATH");
+    char dir[512], candidate[600];
+    while (path != NULL && *path != '\0') {
+        const char *end = strchr(path, ':');
+        size_t len = end ? (size_t)(end - path) : strlen(path);
+        if (len > 0 && len < sizeof(dir)) {
+            memcpy(dir, path, len);
+            dir[len] = '\0';
+            snprintf(candidate, sizeof(candidate), "%s/%s", dir, AUDIO_PLAYER);
+            if (access(candidate, X_OK) == 0) {
+                audio.available = 1;
+                break;
+            }
+        }
+        path = end ? end + 1 : NULL;
+    }
+    return audio.available;
+}
+
+static inline void audio_close_locked() {
+    if (audio.control >= 0) close(audio.control);
+    audio.control = -1;
+    audio.pid = -1;
+}
+
+static inline bool audio_send_locked(const char *command) {
+    if (audio.control < 0) return false;
+    size_t len = strlen(command);
+    ssize_t written = write(audio.control, command, len);
+    if (written == (ssize_t)len) return true;
+    // EAGAIN means the player is not reading; the command is dropped. Any
+    // other error means it has gone and is started again on the next play.
+    if (written < 0 && errno != EAGAIN) {
+        audio_close_locked();
+    }
+    return false;
+}
+
+static inline void *audio_watcher(void *arg) {
+    int status = (int)(intptr_t)arg;
+    pthread_mutex_lock(&audio.lock);
+    pid_t pid = audio.pid;
+    pthread_mutex_unlock(&audio.lock);
+    char buffer[512];
+    size_t used = 0;
+    while (true) {
+        ssize_t n = read(status, buffer + used, sizeof(buffer) - 1 - used);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) break;
+        used += n;
+        buffer[used] = '\0';
+        char *line = buffer;
+        char *newline;
+        while ((newline = strchr(line, '\n')) != NULL) {
+            *newline = '\0';
+            // "@P 0": playback stopped, either at the end of the track or
+            // because of STOP, which clears `playing` first.
+            if (strncmp(line, "@P 0", 4) == 0) {
+                pthread_mutex_lock(&audio.lock);
+                if (audio.playing && audio.pid == pid) {
+                    char command[300];
+                    snprintf(command, sizeof(command), "LOAD %s\n", audio.track);
+                    audio_send_locked(command);
+                }
+                pthread_mutex_unlock(&audio.lock);
+            }
+            line = newline + 1;
+        }
+        used = strlen(line);
+        memmove(buffer, line, used);
+        if (used == sizeof(buffer) - 1) used = 0;
+    }
+    close(status);
+    pthread_mutex_lock(&audio.lock);
+    if (audio.pid == pid) {
+        audio_close_locked();
+        audio.status = -1;
+    }
+    pthread_mutex_unlock(&audio.lock);
+    waitpid(pid, NULL, 0);
+    return NULL;
+}
+
+static inline bool audio_watch_locked() {
+    // A player that dies turns writes into EPIPE instead of a fatal signal.
+    signal(SIGPIPE, SIG_IGN);
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, audio_watcher, (void*)(intptr_t)audio.status) != 0) {
+        return false;
+    }
+    pthread_detach(thread);
+    return true;
+}
+
+// Takes over a player handed down by the program that exec'd this one.
+static inline bool audio_adopt_locked() {
+    const char *value = getenv(AUDIO_ENV);
+    if (value == NULL) return false;
+    long pid;
+    int control, status;
+    char track[256] = "";
+    int fields = sscanf(value, "%ld %d %d %255[^\n]", &pid, &control, &status, track);
+    unsetenv(AUDIO_ENV);
+    if (fields < 3 || pid <= 0 || kill((pid_t)pid, 0) != 0 ||
+        fcntl(control, F_GETFD) < 0 || fcntl(status, F_GETFD) < 0) {
+        return false;
+    }
+    fcntl(control, F_SETFD, FD_CLOEXEC);
+    fcntl(status, F_SETFD, FD_CLOEXEC);
+    audio.pid = (pid_t)pid;
+    audio.control = control;
+    audio.status = status;
+    audio.playing = fields == 4;
+    snprintf(audio.track, sizeof(audio.track), "%s", track);
+    if (!audio_watch_locked()) {
+        audio_close_locked();
+        return false;
+    }
+    return true;
+}
+
+static inline bool audio_pipe(int fds[2]) {
+    if (pipe(fds) != 0) return false;
+    fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+    fcntl(fds[1], F_SETFD, FD_CLOEXEC);
+    return true;
+}
+
+static inline bool audio_spawn_locked() {
+    if (audio.pid > 0) return true;
+    if (audio_adopt_locked()) return true;
+    if (!audio_available()) return false;
+    int control[2], status[2];
+    if (!audio_pipe(control)) return false;
+    if (!audio_pipe(status)) {
+        close(control[0]);
+        close(control[1]);
+        return false;
+    }
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_adddup2(&actions, control[0], STDIN_FILENO);
+    posix_spawn_file_actions_adddup2(&actions, status[1], STDOUT_FILENO);
+    posix_spawn_file_actions_addopen(&actions, STDERR_FILENO, "/dev/null", O_WRONLY, 0);
+    char *argv[] = {AUDIO_PLAYER, "-q", "-R", NULL};
+    pid_t pid;
+    int error = posix_spawnp(&pid, AUDIO_PLAYER, &actions, NULL, argv, environ);
+    posix_spawn_file_actions_destroy(&actions);
+    close(control[0]);
+    close(status[1]);
+    if (error != 0) {
+        close(control[1]);
+        close(status[0]);
+        return false;
+    }
+    fcntl(control[1], F_SETFL, O_NONBLOCK);
+    audio.pid = pid;
+    audio.control = control[1];
+    audio.status = status[0];
+    audio.playing = false;
+    audio.track[0] = '\0';
+    // Status lines are only needed for "@P"; drop the per-frame ones.
+    audio_send_locked("SILENCE\n");
+    if (!audio_watch_locked()) {
+        audio_send_locked("QUIT\n");
+        close(audio.status);
+        audio.status = -1;
+        audio_close_locked();
+        return false;
+    }
+    return true;
+}
+
+// Plays `path` on a loop; a track that is already playing carries on.
+static inline bool audio_play(const char *path) {
+    pthread_mutex_lock(&audio.lock);
+    bool ok = audio_spawn_locked();
+    if (ok && !(audio.playing && strcmp(audio.track, path) == 0)) {
+        char command[300];
+        snprintf(audio.track, sizeof(audio.track), "%s", path);
+        snprintf(command, sizeof(command), "LOAD %s\n", audio.track);
+        audio.playing = true;
+        ok = audio_send_locked(command);
+    }
+    pthread_mutex_unlock(&audio.lock);
+    return ok;
+}
+
+static inline void audio_stop() {
+    pthread_mutex_lock(&audio.lock);
+    if (audio.pid > 0 || audio_adopt_locked()) {
+        audio.playing = false;
+        audio_send_locked("STOP\n");
+    }
+    pthread_mutex_unlock(&audio.lock);
+}
+
+// Call right before execv: keeps the player's pipes open across the exec
+// and tells the next program where to find them and what is playing.
+static inline void audio_export() {
+    pthread_mutex_lock(&audio.lock);
+    if (audio.pid > 0 && audio.control >= 0 && audio.status >= 0) {
+        char value[320];
+        if (audio.playing) {
+            snprintf(value, sizeof(value), "%ld %d %d %s", (long)audio.pid, audio.control, audio.status, audio.track);
+        } else {
+            snprintf(value, sizeof(value), "%ld %d %d", (long)audio.pid, audio.control, audio.status);
+        }
+        fcntl(audio.control, F_SETFD, 0);
+        fcntl(audio.status, F_SETFD, 0);
+        setenv(AUDIO_ENV, value, 1);
+    }
+    pthread_mutex_unlock(&audio.lock);
+}
+
+#endif
@@ -0,0 +1,457 @@
+#ifndef DATABASE_H
+#define DATABASE_H
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include <sqlite3.h>
+
+#ifndef DATABASE_FILE
+#define DATABASE_FILE "game_data.db"
+#endif
+#define SCORE_TEXT_FILE "user_score.txt"
+#define ACCOUNT_TEXT_FILE "user_data.txt"
+
+typedef struct {
+    char username[50];
+    int level;
+    int hit;
+    int strength;
+    int gold;
+    int armor;
+    int exp;
+    int games_played;
+} UserScore;
+
+// One connection to game_data.db per process, opened on first use (or by
+// db_open() at startup) in WAL mode and closed at exit. Every statement is
+// prepared once and reused through bind and reset. Map.c writes from its
+// save thread, so callers hold the database lock between db_begin() and
+// db_end().
+#define SCORE_COLUMNS "username, level, hit, strength, gold, armor, exp, games_played"
+enum {
+    STMT_SCORE_LOAD,
+    STMT_SCORE_SAVE,
+    STMT_SCORE_IMPORT,
+    STMT_SCORE_INIT,
+    STMT_SCORE_PAGE,
+    STMT_SCORE_COUNT,
+    STMT_SCORE_RANK,
+    STMT_STATS_SAVE,
+    STMT_STATS_ALL,
+    STMT_ACCOUNT_ADD,
+    STMT_ACCOUNT_IMPORT,
+    STMT_ACCOUNT_EXISTS,
+    STMT_ACCOUNT_LOAD,
+    STMT_ACCOUNT_SET_PASSWORD,
+    STMT_COUNT
+};
+static const char *const db_statements[STMT_COUNT] = {
+    [STMT_SCORE_LOAD] = "SELECT level, hit, strength, gold, armor, exp, games_played "
+                        "FROM user_scores WHERE username = ?",
+    [STMT_SCORE_SAVE] = "INSERT INTO user_scores (" SCORE_COLUMNS ") VALUES (?, ?, ?, ?, ?, ?, ?, ?) "
+                        "ON CONFLICT(username) DO UPDATE SET level = excluded.level, hit = excluded.hit, "
+                        "strength = excluded.strength, gold = excluded.gold, armor = excluded.armor, "
+                        "exp = excluded.exp, games_played = excluded.games_played",
+    [STMT_SCORE_IMPORT] = "INSERT OR IGNORE INTO user_scores (" SCORE_COLUMNS ") "
+                          "VALUES (?, ?, ?, ?, ?, ?, ?, ?)",
+    [STMT_SCORE_INIT] = "INSERT OR IGNORE INTO user_scores (username) VALUES (?)",
+    [STMT_SCORE_PAGE] = "SELECT " SCORE_COLUMNS " FROM user_scores "
+                        "ORDER BY exp DESC, username LIMIT ? OFFSET ?",
+    [STMT_SCORE_COUNT] = "SELECT COUNT(*) FROM user_scores",
+    [STMT_SCORE_RANK] = "SELECT (SELECT COUNT(*) FROM user_scores WHERE exp > s.exp) + "
+                        "(SELECT COUNT(*) FROM user_scores WHERE exp = s.exp AND username < s.username) + 1 "
+                        "FROM user_scores AS s WHERE s.username = ?",
+    [STMT_STATS_SAVE] = "INSERT OR REPLACE INTO user_stats "
+                        "(username, level, health, strength, gold, armor, exp, games_played, "
+                        "difficulty, current_weapon, normal_food, crimson_flask, cerulean_flask) "
+                        "VALUES (?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?)",
+    [STMT_STATS_ALL] = "SELECT * FROM user_stats",
+    [STMT_ACCOUNT_ADD] = "INSERT INTO accounts (username, password, email) VALUES (?, ?, ?)",
+    [STMT_ACCOUNT_IMPORT] = "INSERT OR IGNORE INTO accounts (username, password, email) VALUES (?, ?, ?)",
+    [STMT_ACCOUNT_EXISTS] = "SELECT 1 FROM accounts WHERE username = ? OR email = ?",
+    [STMT_ACCOUNT_LOAD] = "SELECT password, email FROM accounts WHERE username = ?",
+    [STMT_ACCOUNT_SET_PASSWORD] = "UPDATE accounts SET password = ? WHERE username = ?",
+};
+typedef struct {
+    pthread_mutex_t lock;
+    sqlite3 *db;
+    bool failed;
+    sqlite3_stmt *stmts[STMT_COUNT];
+} Database;
+static Database database = {.lock = PTHREAD_MUTEX_INITIALIZER};
+
+static inline bool db_exec(const char *sql) {
+    char *err_msg = NULL;
+    if (sqlite3_exec(database.db, sql, 0, 0, &err_msg) != SQLITE_OK) {
+        fprintf(stderr, "SQL error: %s\n", err_msg);
+        sqlite3_free(err_msg);
+        return false;
+    }
+    return true;
+}
+static inline void score_defaults(UserScore *score, const char *username) {
+    memset(score, 0, sizeof(*score));
+    snprintf(score->username, sizeof(score->username), "%s", username);
+    score->level = 1;
+    score->hit = 12;
+    score->strength = 16;
+}
+// Binds `score` to a statement taking SCORE_COLUMNS in order and runs it.
+static inline bool score_write(sqlite3_stmt *stmt, const UserScore *score) {
+    sqlite3_bind_text(stmt, 1, score->username, -1, SQLITE_TRANSIENT);
+    sqlite3_bind_int(stmt, 2, score->level);
+    sqlite3_bind_int(stmt, 3, score->hit);
+    sqlite3_bind_int(stmt, 4, score->strength);
+    sqlite3_bind_int(stmt, 5, score->gold);
+    sqlite3_bind_int(stmt, 6, score->armor);
+    sqlite3_bind_int(stmt, 7, score->exp);
+    sqlite3_bind_int(stmt, 8, score->games_played);
+    bool ok = sqlite3_step(stmt) == SQLITE_DONE;
+    sqlite3_reset(stmt);
+    sqlite3_clear_bindings(stmt);
+    return ok;
+}
+static inline sqlite3_stmt *db_prepare(int id) {
+    if (database.stmts[id] == NULL &&
+        sqlite3_prepare_v3(database.db, db_statements[id], -1, SQLITE_PREPARE_PERSISTENT,
+                           &database.stmts[id], NULL) != SQLITE_OK) {
+        fprintf(stderr, "Failed to prepare statement: %s\n", sqlite3_errmsg(database.db));
+        database.stmts[id] = NULL;
+    }
+    return database.stmts[id];
+}
+// Reads the blocks of user_score.txt ("Username: x", then one "Key: value"
+// line per stat) into the table in one transaction. Rows already in the
+// table are newer than the file and are kept. The file is renamed once
+// imported.
+static inline bool score_import_text(const char *filename) {
+    FILE *file = fopen(filename, "r");
+    if (file == NULL) return true;
+    sqlite3_stmt *stmt = db_prepare(STMT_SCORE_IMPORT);
+    if (stmt == NULL || !db_exec("BEGIN")) {
+        fclose(file);
+        return false;
+    }
+    bool ok = true;
+    UserScore score;
+    bool reading = false;
+    char line[256];
+    while (ok && fgets(line, sizeof(line), file)) {
+        char username[50];
+        if (sscanf(line, "Username: %49s", username) == 1) {
+            if (reading) ok = score_write(stmt, &score);
+            score_defaults(&score, username);
+            reading = true;
+        } else if (reading) {
+            sscanf(line, "Level: %d", &score.level);
+            sscanf(line, "Hit: %d", &score.hit);
+            sscanf(line, "Strength: %d", &score.strength);
+            sscanf(line, "Gold: %d", &score.gold);
+            sscanf(line, "Armor: %d", &score.armor);
+            sscanf(line, "Exp: %d", &score.exp);
+            sscanf(line, "Games Played: %d", &score.games_played);
+        }
+    }
+    if (ok && reading) ok = score_write(stmt, &score);
+    fclose(file);
+    if (!ok) {
+        db_exec("ROLLBACK");
+        return false;
+    }
+    if (!db_exec("COMMIT")) return false;
+    char imported[256];
+    snprintf(imported, sizeof(imported), "%s.imported", filename);
+    rename(filename, imported);
+    return true;
+}
+static inline bool account_write(sqlite3_stmt *stmt, const char *username, const char *password,
+                                 const char *email) {
+    sqlite3_bind_text(stmt, 1, username, -1, SQLITE_TRANSIENT);
+    sqlite3_bind_text(stmt, 2, password, -1, SQLITE_TRANSIENT);
+    sqlite3_bind_text(stmt, 3, email, -1, SQLITE_TRANSIENT);
+    bool ok = sqlite3_step(stmt) == SQLITE_DONE;
+    sqlite3_reset(stmt);
+    sqlite3_clear_bindings(stmt);
+    return ok;
+}
+// Copies one field of an account record; false if it does not fit.
+static inline bool account_field(char *dest, size_t size, const char *value) {
+    size_t len = strlen(value);
+    if (len >= size) return false;
+    memcpy(dest, value, len + 1);
+    return true;
+}
+// Writes the record read so far. One with a field too long for the menu's
+// buffers is reported and skipped, since a cut-off username could land on
+// another account and a cut-off password would never match.
+static inline bool account_flush(sqlite3_stmt *stmt, const char *username, const char *password,
+                                 const char *email, bool too_long, const char *filename, int record) {
+    if (too_long) {
+        fprintf(stderr, "Skipping account %d of %s: a field is too long\n", record, filename);
+        return true;
+    }
+    return username[0] == '\0' || account_write(stmt, username, password, email);
+}
+// Reads the "Username:", "Password:", "Email:" blocks of user_data.txt
+// into the accounts table in one transaction, then renames the file.
+static inline bool account_import_text(const char *filename) {
+    FILE *file = fopen(filename, "r");
+    if (file == NULL) return true;
+    sqlite3_stmt *stmt = db_prepare(STMT_ACCOUNT_IMPORT);
+    if (stmt == NULL || !db_exec("BEGIN")) {
+        fclose(file);
+        return false;
+    }
+    bool ok = true;
+    bool too_long = false;
+    int record = 0;
+    char username[50] = "", password[50] = "", email[100] = "";
+    char line[256];
+    while (ok && fgets(line, sizeof(line), file)) {
+        line[strcspn(line, "\r\n")] = '\0';
+        if (strncmp(line, "Username: ", 10) == 0) {
+            if (record > 0) ok = account_flush(stmt, username, password, email, too_long, filename, record);
+            record++;
+            password[0] = email[0] = '\0';
+            too_long = !account_field(username, sizeof(username), line + 10);
+        } else if (strncmp(line, "Password: ", 10) == 0) {
+            if (!account_field(password, sizeof(password), line + 10)) too_long = true;
+        } else if (strncmp(line, "Email: ", 7) == 0) {
+            if (!account_field(email, sizeof(email), line + 7)) too_long = true;
+        }
+    }
+    if (ok && record > 0) ok = account_flush(stmt, username, password, email, too_long, filename, record);
+    fclose(file);
+    if (!ok) {
+        db_exec("ROLLBACK");
+        return false;
+    }
+    if (!db_exec("COMMIT")) return false;
+    char imported[256];
+    snprintf(imported, sizeof(imported), "%s.imported", filename);
+    rename(filename, imported);
+    return true;
+}
+static inline void db_close_locked() {
+    for (int i = 0; i < STMT_COUNT; i++) {
+        sqlite3_finalize(database.stmts[i]);
+        database.stmts[i] = NULL;
+    }
+    sqlite3_close(database.db);
+    database.db = NULL;
+}
+static inline void db_close() {
+    pthread_mutex_lock(&database.lock);
+    db_close_locked();
+    pthread_mutex_unlock(&database.lock);
+}
+static inline bool db_open_locked() {
+    if (database.db != NULL) return true;
+    if (database.failed) return false;
+    if (sqlite3_open(DATABASE_FILE, &database.db) != SQLITE_OK) {
+        fprintf(stderr, "Cannot open database: %s\n", sqlite3_errmsg(database.db));
+        db_close_locked();
+        database.failed = true;
+        return false;
+    }
+    sqlite3_busy_timeout(database.db, 1000);
+    bool ok = db_exec("PRAGMA journal_mode = WAL") &&
+              db_exec("PRAGMA synchronous = NORMAL") &&
+              db_exec("PRAGMA temp_store = MEMORY") &&
+              db_exec("CREATE TABLE IF NOT EXISTS user_scores ("
+                      "username TEXT PRIMARY KEY,"
+                      "level INTEGER NOT NULL DEFAULT 1,"
+                      "hit INTEGER NOT NULL DEFAULT 12,"
+                      "strength INTEGER NOT NULL DEFAULT 16,"
+                      "gold INTEGER NOT NULL DEFAULT 0,"
+                      "armor INTEGER NOT NULL DEFAULT 0,"
+                      "exp INTEGER NOT NULL DEFAULT 0,"
+                      "games_played INTEGER NOT NULL DEFAULT 0"
+                      ")") &&
+              db_exec("CREATE INDEX IF NOT EXISTS user_scores_by_exp "
+                      "ON user_scores (exp DESC, username)") &&
+              db_exec("CREATE TABLE IF NOT EXISTS user_stats ("
+                      "username TEXT PRIMARY KEY,"
+                      "level INTEGER,"
+                      "health INTEGER,"
+                      "strength INTEGER,"
+                      "gold INTEGER,"
+                      "armor INTEGER,"
+                      "exp INTEGER,"
+                      "games_played INTEGER,"
+                      "difficulty INTEGER,"
+                      "current_weapon INTEGER,"
+                      "normal_food INTEGER,"
+                      "crimson_flask INTEGER,"
+                      "cerulean_flask INTEGER"
+                      ")") &&
+              db_exec("CREATE TABLE IF NOT EXISTS accounts ("
+                      "username TEXT PRIMARY KEY,"
+                      "password TEXT NOT NULL,"
+                      "email TEXT NOT NULL"
+                      ")") &&
+              db_exec("CREATE UNIQUE INDEX IF NOT EXISTS accounts_by_email ON accounts (email)") &&
+              score_import_text(SCORE_TEXT_FILE) &&
+              account_import_text(ACCOUNT_TEXT_FILE);
+    if (!ok) {
+        db_close_locked();
+        database.failed = true;
+        return false;
+    }
+    atexit(db_close);
+    return true;
+}
+// Opens the database now rather than on first use. Returns false if it
+// cannot be opened.
+static inline bool db_open() {
+    pthread_mutex_lock(&database.lock);
+    bool ok = db_open_locked();
+    pthread_mutex_unlock(&database.lock);
+    return ok;
+}
+// Locks the database and returns the cached statement `id`, ready to bind.
+// Every non-NULL result must be handed back to db_end(). Returns NULL,
+// unlocked, if the database or statement is unavailable.
+static inline sqlite3_stmt *db_begin(int id) {
+    pthread_mutex_lock(&database.lock);
+    sqlite3_stmt *stmt = db_open_locked() ? db_prepare(id) : NULL;
+    if (stmt == NULL) pthread_mutex_unlock(&database.lock);
+    return stmt;
+}
+static inline void db_end(sqlite3_stmt *stmt) {
+    sqlite3_reset(stmt);
+    sqlite3_clear_bindings(stmt);
+    pthread_mutex_unlock(&database.lock);
+}
+
+// Per-user stats live in the user_scores table, keyed by username, so
+// updating one user is a single indexed UPSERT.
+
+// Loads `username`'s stats into `score`. Returns false, leaving the
+// defaults in `score`, if the user has none yet.
+static inline bool score_load(const char *username, UserScore *score) {
+    score_defaults(score, username);
+    sqlite3_stmt *stmt = db_begin(STMT_SCORE_LOAD);
+    if (stmt == NULL) return false;
+    sqlite3_bind_text(stmt, 1, username, -1, SQLITE_TRANSIENT);
+    bool found = sqlite3_step(stmt) == SQLITE_ROW;
+    if (found) {
+        score->level = sqlite3_column_int(stmt, 0);
+        score->hit = sqlite3_column_int(stmt, 1);
+        score->strength = sqlite3_column_int(stmt, 2);
+        score->gold = sqlite3_column_int(stmt, 3);
+        score->armor = sqlite3_column_int(stmt, 4);
+        score->exp = sqlite3_column_int(stmt, 5);
+        score->games_played = sqlite3_column_int(stmt, 6);
+    }
+    db_end(stmt);
+    return found;
+}
+static inline bool score_save(const UserScore *score) {
+    sqlite3_stmt *stmt = db_begin(STMT_SCORE_SAVE);
+    if (stmt == NULL) return false;
+    bool ok = score_write(stmt, score);
+    db_end(stmt);
+    return ok;
+}
+// Adds a row with the starting stats unless the user already has one.
+static inline bool score_init(const char *username) {
+    sqlite3_stmt *stmt = db_begin(STMT_SCORE_INIT);
+    if (stmt == NULL) return false;
+    sqlite3_bind_text(stmt, 1, username, -1, SQLITE_TRANSIENT);
+    bool ok = sqlite3_step(stmt) == SQLITE_DONE;
+    db_end(stmt);
+    return ok;
+}
+// The leaderboard orders users by exp, highest first, then by name. The
+// user_scores_by_exp index serves both the pages and the rank count, so
+// neither reads the whole table.
+
+// Fills `scores` with up to `count` users starting at rank `offset` + 1.
+// Returns the number read.
+static inline int score_page(UserScore *scores, int offset, int count) {
+    sqlite3_stmt *stmt = db_begin(STMT_SCORE_PAGE);
+    if (stmt == NULL) return 0;
+    int read = 0;
+    sqlite3_bind_int(stmt, 1, count);
+    sqlite3_bind_int(stmt, 2, offset);
+    while (read < count && sqlite3_step(stmt) == SQLITE_ROW) {
+        UserScore *score = &scores[read++];
+        snprintf(score->username, sizeof(score->username), "%s", sqlite3_column_text(stmt, 0));
+        score->level = sqlite3_column_int(stmt, 1);
+        score->hit = sqlite3_column_int(stmt, 2);
+        score->strength = sqlite3_column_int(stmt, 3);
+        score->gold = sqlite3_column_int(stmt, 4);
+        score->armor = sqlite3_column_int(stmt, 5);
+        score->exp = sqlite3_column_int(stmt, 6);
+        score->games_played = sqlite3_column_int(stmt, 7);
+    }
+    db_end(stmt);
+    return read;
+}
+static inline int score_count() {
+    sqlite3_stmt *stmt = db_begin(STMT_SCORE_COUNT);
+    if (stmt == NULL) return 0;
+    int count = sqlite3_step(stmt) == SQLITE_ROW ? sqlite3_column_int(stmt, 0) : 0;
+    db_end(stmt);
+    return count;
+}
+// Returns `username`'s 1-based position on the leaderboard, or 0 if the
+// user has no score.
+static inline int score_rank(const char *username) {
+    sqlite3_stmt *stmt = db_begin(STMT_SCORE_RANK);
+    if (stmt == NULL) return 0;
+    sqlite3_bind_text(stmt, 1, username, -1, SQLITE_TRANSIENT);
+    int rank = sqlite3_step(stmt) == SQLITE_ROW ? sqlite3_column_int(stmt, 0) : 0;
+    db_end(stmt);
+    return rank;
+}
+
+// Accounts are keyed by username, with a unique index on email, so a login
+// or a password reset reads or writes one row. Passwords are stored as
+// entered, as user_data.txt did.
+
+// Returns whether an account already uses `username` or `email`.
+static inline bool account_exists(const char *username, const char *email) {
+    sqlite3_stmt *stmt = db_begin(STMT_ACCOUNT_EXISTS);
+    if (stmt == NULL) return false;
+    sqlite3_bind_text(stmt, 1, username, -1, SQLITE_TRANSIENT);
+    sqlite3_bind_text(stmt, 2, email, -1, SQLITE_TRANSIENT);
+    bool exists = sqlite3_step(stmt) == SQLITE_ROW;
+    db_end(stmt);
+    return exists;
+}
+static inline bool account_add(const char *username, const char *password, const char *email) {
+    sqlite3_stmt *stmt = db_begin(STMT_ACCOUNT_ADD);
+    if (stmt == NULL) return false;
+    bool ok = account_write(stmt, username, password, email);
+    db_end(stmt);
+    return ok;
+}
+// Copies `username`'s password and email into the given buffers, which may
+// be NULL. Returns false if there is no such account.
+static inline bool account_load(const char *username, char *password, size_t password_size,
+                                char *email, size_t email_size) {
+    sqlite3_stmt *stmt = db_begin(STMT_ACCOUNT_LOAD);
+    if (stmt == NULL) return false;
+    sqlite3_bind_text(stmt, 1, username, -1, SQLITE_TRANSIENT);
+    bool found = sqlite3_step(stmt) == SQLITE_ROW;
+    if (found) {
+        if (password) snprintf(password, password_size, "%s", sqlite3_column_text(stmt, 0));
+        if (email) snprintf(email, email_size, "%s", sqlite3_column_text(stmt, 1));
+    }
+    db_end(stmt);
+    return found;
+}
+static inline bool account_set_password(const char *username, const char *password) {
+    sqlite3_stmt *stmt = db_begin(STMT_ACCOUNT_SET_PASSWORD);
+    if (stmt == NULL) return false;
+    sqlite3_bind_text(stmt, 1, password, -1, SQLITE_TRANSIENT);
+    sqlite3_bind_text(stmt, 2, username, -1, SQLITE_TRANSIENT);
+    bool ok = sqlite3_step(stmt) == SQLITE_DONE && sqlite3_changes(database.db) == 1;
+    db_end(stmt);
+    return ok;
+}
+#endif
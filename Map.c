@@ -5,11 +5,23 @@
 #include <stdbool.h>
 #include <sys/types.h>  
 #include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
 #include <string.h>
+#include <stdint.h>
 #include <ctype.h>
 #include <string.h>
 #include <locale.h>
 #include <sqlite3.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include "Rng.h"
+#include "Database.h"
+#include "Settings.h"
+#include "Session.h"
+#include "Audio.h"
+#include "TimerWheel.h"
 #define MAXROOMS 9
 #define MIN_ROOM_SIZE 6
 #define MAX_ROOM_SIZE 10
@@ -20,10 +32,25 @@
 #define DIFFICULTY_EASY 1
 #define DIFFICULTY_MEDIUM 2
 #define DIFFICULTY_HARD 3
+#define IDX(y, x) ((y) * NUMCOLS + (x))
+#define LAYER_CELLS (NUMLINES * NUMCOLS)
+#define BITSET_STRIDE ((NUMCOLS + 63) / 64)
+#define BITSET_WORDS (NUMLINES * BITSET_STRIDE)
 int NUMCOLS;
 int NUMLINES;
 char current_username[50] = "";
 static bool fast_travel_mode = false;
+static int last_arrow = -1;
+static clock_t last_arrow_time = 0;
+// How the running game ended; play_game() returns it to the launcher.
+typedef enum {
+    GAME_RUNNING,
+    GAME_QUIT,
+    GAME_WON,
+    GAME_LOST,
+    GAME_FAILED
+} GameResult;
+static GameResult game_result = GAME_RUNNING;
 int difficulty;
 typedef struct {
     int x, y;
@@ -61,6 +88,7 @@ typedef struct {
     Coord center; 
     bool gone; 
     bool connected; 
+    bool discovered;
     int doors[4]; 
 } Room;
 typedef enum {
@@ -90,11 +118,19 @@ typedef struct {
     const char* symbol;
     int color;
     bool owned;          
-    int active_durations[5];  
-    bool is_active;      
-    int moves_remaining;    
     int count; 
 } Talisman;
+// Everything that happens after a number of turns is a timer on the map's
+// TimerWheel, one id per kind. Talismans take one id each, by type.
+typedef enum {
+    TIMER_HUNGER,
+    TIMER_TALISMAN,
+    TIMER_CRIMSON_FLASK = TIMER_TALISMAN + TALISMAN_COUNT,
+    TIMER_CERULEAN_FLASK,
+    TIMER_KINDS
+} TimerKind;
+#define HUNGER_PERIOD 100
+#define EFFECT_TURNS 10
 
 typedef struct {
     Room rooms[MAXROOMS];
@@ -103,25 +139,35 @@ typedef struct {
     int num_secret_rooms;          
     Room* stair_room;           
     int stair_x, stair_y;         
-    char **tiles;                 
-    char **visible_tiles;         
-    bool **explored;             
-    bool **traps;                    
-    bool **discovered_traps;
-    bool **secret_walls;         
+    void *cells;
+    char *tiles;                 
+    char *visible_tiles;         
+    uint64_t *explored;             
+    uint64_t *traps;                    
+    uint64_t *discovered_traps;
+    uint64_t *secret_walls;         
+    unsigned char *room_ids;
+    unsigned char *monster_ids;
+    int *dirty_cells;
+    uint64_t *dirty_bits;
+    int dirty_count;
+    int dirty_visible;
+    bool visibility_stale;
+    bool save_dirty;             // may differ from the last save checkpoint
+    Rng rng;
     Coord stairs_up;                  
     Coord stairs_down;
     Coord secret_entrance;          
     Room *current_secret_room;      
     bool stairs_placed;
-    char **backup_tiles;
-    char **backup_visible_tiles; 
-    bool **backup_explored;
-    bool **secret_stairs;  
+    char *backup_tiles;
+    char *backup_visible_tiles; 
+    uint64_t *backup_explored;
+    uint64_t *secret_stairs;  
     Room *secret_stair_room; 
     Coord secret_stair_entrance; 
-    bool **coins;     
-    int **coin_values;
+    uint64_t *coins;     
+    int *coin_values;
     int talisman_type;
     Monster monsters[MONSTER_COUNT];
     int num_monsters;
@@ -133,6 +179,20 @@ typedef struct {
     Monster arena_monsters[3]; 
 } Level;
 
+// Next level being built on a worker thread while the player is still on
+// the current one. `level` is a spare buffer swapped in at the stairs.
+typedef struct {
+    pthread_t thread;
+    bool running;
+    atomic_bool done;
+    atomic_bool cancel;
+    int level_number;
+    Coord stairs;
+    Room room;
+    char *room_tiles;
+    Level level;
+} Pregen;
+
 typedef struct {
     Level *levels;        
     int current_level;   
@@ -141,7 +201,7 @@ typedef struct {
     int prev_stair_y;
     bool debug_mode;
     char current_message[MAX_MESSAGE_LENGTH];
-    int message_timer;
+    int message_timer;  // keys left to show current_message
     int health;
     int strength;
     int gold;
@@ -152,7 +212,6 @@ typedef struct {
     int games_played;
     int food_count;     
     int hunger;          
-    int hunger_timer;   
     bool food_menu_open;
     Weapon weapons[5];
     WeaponType current_weapon;
@@ -166,29 +225,85 @@ typedef struct {
     int food_freshness[5]; 
     bool food_is_rotten[5];
     FoodType food_types[5]; 
-    int moves_remaining;  
     int normal_food;    
     int crimson_flask;    
     int cerulean_flask;      
     int rotten_food;  
     int difficulty;
+    Level *visibility_level;
+    bool visibility_debug;
+    uint64_t seed;
+    Rng rng;
+    uint64_t journal_id;  // ties savegame.journal to the save it continues
+    Pregen *pregen;
+    TimerWheel timers;  // hunger and timed effects, see run_timers()
 } Map;
 
+// Rejected attempts in the generator's bounded retry loops, and how often
+// generate_map() had to start over. Read by MapBench.
+typedef struct {
+    atomic_long room_retries;
+    atomic_long room_resets;
+    atomic_long restarts;
+    atomic_long stair_retries;
+    atomic_long placement_retries;
+} GenStats;
+GenStats gen_stats;
+#define GEN_STAT(field) atomic_fetch_add_explicit(&gen_stats.field, 1, memory_order_relaxed)
+
+static inline bool bit_test(const uint64_t *set, int y, int x) {
+    return (set[y * BITSET_STRIDE + (x >> 6)] >> (x & 63)) & 1;
+}
+static inline void bit_set(uint64_t *set, int y, int x) {
+    set[y * BITSET_STRIDE + (x >> 6)] |= (uint64_t)1 << (x & 63);
+}
+static inline void bit_clear(uint64_t *set, int y, int x) {
+    set[y * BITSET_STRIDE + (x >> 6)] &= ~((uint64_t)1 << (x & 63));
+}
+static inline void bit_assign(uint64_t *set, int y, int x, bool value) {
+    if (value) bit_set(set, y, x);
+    else bit_clear(set, y, x);
+}
+static inline uint64_t *bit_row(uint64_t *set, int y) {
+    return set + y * BITSET_STRIDE;
+}
+
 // Function declarations
 void update_monsters(Map *map);
 void set_message(Map *map, const char *message);
 void add_stairs(Level *level, Room *room, bool is_up);
 void copy_room(Room *dest, Room *src);
+void index_room(Level *level, int index);
+Room *room_at(Level *level, int x, int y);
+void explore_cell(Level *level, int y, int x);
+void mark_dirty(Level *level, int y, int x);
+void set_tile(Level *level, int y, int x, char tile);
+void clear_dirty(Level *level);
+Monster *monster_at(Level *level, int x, int y);
+void place_monster(Level *level, Monster *monster);
+void remove_monster(Level *level, Monster *monster);
+void move_monster(Level *level, Monster *monster, int x, int y);
+void index_monsters(Level *level);
 void transition_to_next_level(Map *map);
 void handle_input(Map *map, int input);
+size_t level_cells_bytes();
+bool alloc_level_cells(Level *level);
+void clear_level_cells(Level *level);
+void carve_level_cells(Level *level);
 Map* create_map();
+void seed_map(Map *map, uint64_t seed);
 void free_map(Map* map);
 bool rooms_overlap(Room *r1, Room *r2);
-void draw_room(Level *level, Room *room);
+void draw_room(Level *level, Room *room, int level_number);
 void connect_rooms(Level *level, Room *r1, Room *r2);
 void update_visibility(Map *map);
 void generate_map(Map *map);
-void generate_remaining_rooms(Map *map);
+void generate_remaining_rooms(Level *current, int level_number, atomic_bool *cancel);
+void build_level(Level *next, Room *room, const char *room_tiles, int stair_x, int stair_y,
+                 int level_number, atomic_bool *cancel);
+void start_pregen(Map *map);
+void stop_pregen(Map *map);
+bool take_pregen(Map *map, Level *current, Level *next);
 bool check_for_stairs(Level *level);
 bool is_valid_secret_wall(Level *level, int x, int y);
 void add_secret_walls_to_room(Level *level, Room *room);
@@ -212,99 +327,61 @@ void cast_magic_wand(Map *map, int dir_x, int dir_y);
 void shoot_arrow(Map *map, int dir_x, int dir_y);
 int calculate_damage(Map *map, int base_damage);
 void display_talisman_menu(WINDOW *win, Map *map);
-void update_talisman_effects(Map *map);
+bool talisman_active(Map *map, int type);
+void start_effect(Map *map, int kind);
+void refresh_effects(Map *map);
+void run_timers(Map *map);
 void eat_food_from_slot(Map *map, int slot);
 void consume_food(Map *map, int type);
 int get_difficulty_from_settings();
 void create_fighting_room(Level *level);
 void play_background_music(const char* music_number);
+void invalidate_frame();
+void frame_touch(int x, int y);
+void frame_rescan();
+bool save_pending();
+bool journal_stop();
+void journal_start(Map *map, bool fresh, bool after_save);
+void journal_end();
+uint64_t new_journal_id();
+int game_getch();
+clock_t game_clock();
+void effect_begin();
+void effect_queue(int x, int y, const char *glyph, int pair, int duration);
+void game_step(Map **map_ptr, int ch);
+Map* load_game_data(const char *data, size_t size);
+GameResult play_game(bool resume_wait, bool seeded, uint64_t seed);
+bool wait_for_save();
 // Function delarations
 void init_database() {
-    sqlite3 *db;
-    char *err_msg = 0;
-    int rc = sqlite3_open("game_data.db", &db);
-    if (rc != SQLITE_OK) {
-        fprintf(stderr, "Cannot open database: %s\n", sqlite3_errmsg(db));
-        sqlite3_close(db);
-        return;
-    }
-    const char *sql = "CREATE TABLE IF NOT EXISTS user_stats ("
-                      "username TEXT PRIMARY KEY,"
-                      "level INTEGER,"
-                      "health INTEGER,"
-                      "strength INTEGER,"
-                      "gold INTEGER,"
-                      "armor INTEGER,"
-                      "exp INTEGER,"
-                      "games_played INTEGER,"
-                      "difficulty INTEGER,"
-                      "current_weapon INTEGER,"
-                      "normal_food INTEGER,"
-                      "crimson_flask INTEGER,"
-                      "cerulean_flask INTEGER"
-                      ");";
-    
-    rc = sqlite3_exec(db, sql, 0, 0, &err_msg);
-    
-    if (rc != SQLITE_OK) {
-        fprintf(stderr, "SQL error: %s\n", err_msg);
-        sqlite3_free(err_msg);
-    }
-    sqlite3_close(db);
+    db_open();
 }
 
 void save_to_database(Map* map) {
-    sqlite3 *db;
-    char *err_msg = 0;
-    int rc = sqlite3_open("game_data.db", &db);
-    if (rc != SQLITE_OK) {
-        fprintf(stderr, "Cannot open database: %s\n", sqlite3_errmsg(db));
-        return;
-    }
-    char *sql = sqlite3_mprintf(
-        "INSERT OR REPLACE INTO user_stats "
-        "(username, level, health, strength, gold, armor, exp, games_played, "
-        "difficulty, current_weapon, normal_food, crimson_flask, cerulean_flask) "
-        "VALUES ('%q', %d, %d, %d, %d, %d, %d, %d, %d, %d, %d, %d, %d);",
-        current_username,
-        map->current_level,
-        map->health,
-        map->strength,
-        map->gold,
-        map->armor,
-        map->exp,
-        map->games_played + 1,
-        map->difficulty,
-        map->current_weapon,
-        map->normal_food,
-        map->crimson_flask,
-        map->cerulean_flask
-    );
-    rc = sqlite3_exec(db, sql, 0, 0, &err_msg);
-    if (rc != SQLITE_OK) {
-        fprintf(stderr, "SQL error: %s\n", err_msg);
-        sqlite3_free(err_msg);
-    }
-    sqlite3_free(sql);
-    sqlite3_close(db);
+    sqlite3_stmt *stmt = db_begin(STMT_STATS_SAVE);
+    if (stmt == NULL) return;
+    sqlite3_bind_text(stmt, 1, current_username, -1, SQLITE_TRANSIENT);
+    sqlite3_bind_int(stmt, 2, map->current_level);
+    sqlite3_bind_int(stmt, 3, map->health);
+    sqlite3_bind_int(stmt, 4, map->strength);
+    sqlite3_bind_int(stmt, 5, map->gold);
+    sqlite3_bind_int(stmt, 6, map->armor);
+    sqlite3_bind_int(stmt, 7, map->exp);
+    sqlite3_bind_int(stmt, 8, map->games_played + 1);
+    sqlite3_bind_int(stmt, 9, map->difficulty);
+    sqlite3_bind_int(stmt, 10, map->current_weapon);
+    sqlite3_bind_int(stmt, 11, map->normal_food);
+    sqlite3_bind_int(stmt, 12, map->crimson_flask);
+    sqlite3_bind_int(stmt, 13, map->cerulean_flask);
+    if (sqlite3_step(stmt) != SQLITE_DONE) {
+        fprintf(stderr, "SQL error: %s\n", sqlite3_errmsg(database.db));
+    }
+    db_end(stmt);
 }
 
 void view_database() {
-    sqlite3 *db;
-    char *err_msg = 0;
-    int rc = sqlite3_open("game_data.db", &db);
-    if (rc != SQLITE_OK) {
-        fprintf(stderr, "Cannot open database: %s\n", sqlite3_errmsg(db));
-        return;
-    }
-    const char *sql = "SELECT * FROM user_stats;";
-    sqlite3_stmt *stmt;
-    rc = sqlite3_prepare_v2(db, sql, -1, &stmt, 0);
-    if (rc != SQLITE_OK) {
-        fprintf(stderr, "Failed to fetch data: %s\n", sqlite3_errmsg(db));
-        sqlite3_close(db);
-        return;
-    }
+    sqlite3_stmt *stmt = db_begin(STMT_STATS_ALL);
+    if (stmt == NULL) return;
     printf("\nDatabase Contents:\n");
     printf("%-20s %-6s %-6s %-6s %-6s %-6s %-6s %-6s\n", 
            "Username", "Level", "Health", "Str", "Gold", "Armor", "Exp", "Games");
@@ -320,18 +397,12 @@ void view_database() {
                sqlite3_column_int(stmt, 6),
                sqlite3_column_int(stmt, 7));
     }
-    
-    sqlite3_finalize(stmt);
-    sqlite3_close(db);
+    db_end(stmt);
 }
 void play_background_music(const char* music_number) {
-    char command[256];
-    system("pkill mpg123 2>/dev/null");
-    snprintf(command, sizeof(command), "mpg123 -q -l 0 %s.mp3 &", music_number);
-    system(command);
-    clear();
-    refresh();
-    curs_set(0);
+    char path[64];
+    snprintf(path, sizeof(path), "%s.mp3", music_number);
+    audio_play(path);
 }
 static char* get_current_time(void) {
     static char buffer[26];
@@ -346,6 +417,7 @@ bool save_game_json(Map *map, const char *filename) {
     fprintf(file, "{\n");
     fprintf(file, "  \"metadata\": {\n");
     fprintf(file, "    \"version\": 1,\n");
+    fprintf(file, "    \"seed\": %llu,\n", (unsigned long long)map->seed);
     fprintf(file, "    \"username\": \"%s\",\n", current_username);
     fprintf(file, "    \"save_date\": \"%s\"\n", get_current_time());
     fprintf(file, "  },\n");
@@ -375,11 +447,8 @@ bool save_game_json(Map *map, const char *filename) {
         fprintf(file, "        \"type\": %d,\n", map->talismans[i].type);
         fprintf(file, "        \"owned\": %s,\n", map->talismans[i].owned ? "true" : "false");
         fprintf(file, "        \"count\": %d,\n", map->talismans[i].count);
-        fprintf(file, "        \"durations\": [");
-        for (int j = 0; j < 5; j++) {
-            fprintf(file, "%d%s", map->talismans[i].active_durations[j], j < 4 ? "," : "");
-        }
-        fprintf(file, "]\n");
+        fprintf(file, "        \"durations\": [%u]\n",
+                timer_remaining(&map->timers, TIMER_TALISMAN + i));
         fprintf(file, "      }%s\n", i < TALISMAN_COUNT-1 ? "," : "");
     }
     fprintf(file, "    ],\n");
@@ -454,10 +523,10 @@ bool save_game_json(Map *map, const char *filename) {
         for (int y = 0; y < NUMLINES; y++) {
             fprintf(file, "        \"");
             for (int x = 0; x < NUMCOLS; x++) {
-                if (level->tiles[y][x] == '\"' || level->tiles[y][x] == '\\') {
-                    fprintf(file, "\\%c", level->tiles[y][x]);
+                if (level->tiles[IDX(y, x)] == '\"' || level->tiles[IDX(y, x)] == '\\') {
+                    fprintf(file, "\\%c", level->tiles[IDX(y, x)]);
                 } else {
-                    fprintf(file, "%c", level->tiles[y][x]);
+                    fprintf(file, "%c", level->tiles[IDX(y, x)]);
                 }
             }
             fprintf(file, "\"%s\n", y < NUMLINES-1 ? "," : "");
@@ -467,7 +536,7 @@ bool save_game_json(Map *map, const char *filename) {
         for (int y = 0; y < NUMLINES; y++) {
             fprintf(file, "        \"");
             for (int x = 0; x < NUMCOLS; x++) {
-                fprintf(file, "%d", level->explored[y][x] ? 1 : 0);
+                fprintf(file, "%d", bit_test(level->explored, y, x) ? 1 : 0);
             }
             fprintf(file, "\"%s\n", y < NUMLINES-1 ? "," : "");
         }
@@ -476,10 +545,10 @@ bool save_game_json(Map *map, const char *filename) {
         for (int y = 0; y < NUMLINES; y++) {
             fprintf(file, "        \"");
             for (int x = 0; x < NUMCOLS; x++) {
-                if (level->visible_tiles[y][x] == '\"' || level->visible_tiles[y][x] == '\\') {
-                    fprintf(file, "\\%c", level->visible_tiles[y][x]);
+                if (level->visible_tiles[IDX(y, x)] == '\"' || level->visible_tiles[IDX(y, x)] == '\\') {
+                    fprintf(file, "\\%c", level->visible_tiles[IDX(y, x)]);
                 } else {
-                    fprintf(file, "%c", level->visible_tiles[y][x]);
+                    fprintf(file, "%c", level->visible_tiles[IDX(y, x)]);
                 }
             }
             fprintf(file, "\"%s\n", y < NUMLINES-1 ? "," : "");
@@ -492,435 +561,668 @@ bool save_game_json(Map *map, const char *filename) {
     fclose(file);
     return true;
 }
-Map* load_game_json(const char *filename) {
-    FILE *file = fopen(filename, "r");
-    if (!file) {
-        fprintf(stderr, "Could not open save file\n");
-        return NULL;
+// Streaming parser for the JSON export. The file is pulled in 64 KB chunks
+// and tokenized in a single pass, so line breaks and spacing do not matter.
+// Keys go through json_keys, a perfect hash over every key the export
+// writes, and tile rows are decoded straight into the level layers.
+#define JSON_CHUNK (64 * 1024)
+#define JSON_HASH_BITS 7
+#define JSON_HASH_SEED 0x116a01u
+#define JSON_MAX_DEPTH 32
+enum {
+    JSON_KEY_UNKNOWN,
+    JSON_KEY_METADATA,
+    JSON_KEY_SEED,
+    JSON_KEY_PLAYER,
+    JSON_KEY_POSITION,
+    JSON_KEY_X,
+    JSON_KEY_Y,
+    JSON_KEY_CURRENT_LEVEL,
+    JSON_KEY_STATS,
+    JSON_KEY_HEALTH,
+    JSON_KEY_STRENGTH,
+    JSON_KEY_GOLD,
+    JSON_KEY_ARMOR,
+    JSON_KEY_EXP,
+    JSON_KEY_HUNGER,
+    JSON_KEY_WEAPONS,
+    JSON_KEY_TYPE,
+    JSON_KEY_OWNED,
+    JSON_KEY_AMMO,
+    JSON_KEY_TALISMANS,
+    JSON_KEY_COUNT,
+    JSON_KEY_DURATIONS,
+    JSON_KEY_CONSUMABLES,
+    JSON_KEY_NORMAL_FOOD,
+    JSON_KEY_CRIMSON_FLASK,
+    JSON_KEY_CERULEAN_FLASK,
+    JSON_KEY_ROTTEN_FOOD,
+    JSON_KEY_LEVELS,
+    JSON_KEY_LEVEL_NUMBER,
+    JSON_KEY_LEVEL_DATA,
+    JSON_KEY_NUM_ROOMS,
+    JSON_KEY_NUM_SECRET_ROOMS,
+    JSON_KEY_STAIRS_PLACED,
+    JSON_KEY_STAIRS_UP,
+    JSON_KEY_STAIRS_DOWN,
+    JSON_KEY_STAIR_COORDS,
+    JSON_KEY_SECRET_ENTRANCE,
+    JSON_KEY_FIGHTING_TRAP,
+    JSON_KEY_FIGHTING_TRAP_TRIGGERED,
+    JSON_KEY_IN_FIGHTING_ROOM,
+    JSON_KEY_ARENA_MONSTER_COUNT,
+    JSON_KEY_TALISMAN_TYPE,
+    JSON_KEY_ROOMS,
+    JSON_KEY_SIZE,
+    JSON_KEY_CENTER,
+    JSON_KEY_GONE,
+    JSON_KEY_CONNECTED,
+    JSON_KEY_SECRET_ROOMS,
+    JSON_KEY_MONSTERS,
+    JSON_KEY_MAX_HEALTH,
+    JSON_KEY_AGGRESSIVE,
+    JSON_KEY_WAS_ATTACKED,
+    JSON_KEY_IMMOBILIZED,
+    JSON_KEY_IN_ARENA,
+    JSON_KEY_TILES,
+    JSON_KEY_EXPLORED,
+    JSON_KEY_VISIBLE_TILES,
+};
+typedef struct {
+    const char *name;
+    int id;
+} JsonKey;
+// FNV-1a from JSON_HASH_SEED, top JSON_HASH_BITS bits; no two keys collide.
+static const JsonKey json_keys[1 << JSON_HASH_BITS] = {
+    [4] = {"center", JSON_KEY_CENTER},
+    [11] = {"crimson_flask", JSON_KEY_CRIMSON_FLASK},
+    [13] = {"stairs_up", JSON_KEY_STAIRS_UP},
+    [14] = {"was_attacked", JSON_KEY_WAS_ATTACKED},
+    [15] = {"rotten_food", JSON_KEY_ROTTEN_FOOD},
+    [16] = {"in_fighting_room", JSON_KEY_IN_FIGHTING_ROOM},
+    [17] = {"levels", JSON_KEY_LEVELS},
+    [18] = {"hunger", JSON_KEY_HUNGER},
+    [22] = {"explored", JSON_KEY_EXPLORED},
+    [24] = {"rooms", JSON_KEY_ROOMS},
+    [26] = {"visible_tiles", JSON_KEY_VISIBLE_TILES},
+    [27] = {"num_secret_rooms", JSON_KEY_NUM_SECRET_ROOMS},
+    [29] = {"durations", JSON_KEY_DURATIONS},
+    [30] = {"secret_entrance", JSON_KEY_SECRET_ENTRANCE},
+    [32] = {"monsters", JSON_KEY_MONSTERS},
+    [34] = {"health", JSON_KEY_HEALTH},
+    [37] = {"arena_monster_count", JSON_KEY_ARENA_MONSTER_COUNT},
+    [41] = {"position", JSON_KEY_POSITION},
+    [44] = {"owned", JSON_KEY_OWNED},
+    [50] = {"level_number", JSON_KEY_LEVEL_NUMBER},
+    [51] = {"count", JSON_KEY_COUNT},
+    [53] = {"consumables", JSON_KEY_CONSUMABLES},
+    [60] = {"player", JSON_KEY_PLAYER},
+    [61] = {"stats", JSON_KEY_STATS},
+    [63] = {"exp", JSON_KEY_EXP},
+    [70] = {"strength", JSON_KEY_STRENGTH},
+    [72] = {"fighting_trap", JSON_KEY_FIGHTING_TRAP},
+    [73] = {"y", JSON_KEY_Y},
+    [74] = {"x", JSON_KEY_X},
+    [75] = {"stairs_placed", JSON_KEY_STAIRS_PLACED},
+    [78] = {"armor", JSON_KEY_ARMOR},
+    [79] = {"stairs_down", JSON_KEY_STAIRS_DOWN},
+    [80] = {"talisman_type", JSON_KEY_TALISMAN_TYPE},
+    [81] = {"metadata", JSON_KEY_METADATA},
+    [84] = {"connected", JSON_KEY_CONNECTED},
+    [86] = {"gone", JSON_KEY_GONE},
+    [87] = {"seed", JSON_KEY_SEED},
+    [88] = {"max_health", JSON_KEY_MAX_HEALTH},
+    [90] = {"level_data", JSON_KEY_LEVEL_DATA},
+    [91] = {"type", JSON_KEY_TYPE},
+    [93] = {"gold", JSON_KEY_GOLD},
+    [96] = {"normal_food", JSON_KEY_NORMAL_FOOD},
+    [97] = {"tiles", JSON_KEY_TILES},
+    [98] = {"in_arena", JSON_KEY_IN_ARENA},
+    [99] = {"weapons", JSON_KEY_WEAPONS},
+    [104] = {"aggressive", JSON_KEY_AGGRESSIVE},
+    [106] = {"immobilized", JSON_KEY_IMMOBILIZED},
+    [108] = {"talismans", JSON_KEY_TALISMANS},
+    [113] = {"current_level", JSON_KEY_CURRENT_LEVEL},
+    [114] = {"fighting_trap_triggered", JSON_KEY_FIGHTING_TRAP_TRIGGERED},
+    [115] = {"ammo", JSON_KEY_AMMO},
+    [116] = {"stair_coords", JSON_KEY_STAIR_COORDS},
+    [118] = {"size", JSON_KEY_SIZE},
+    [121] = {"secret_rooms", JSON_KEY_SECRET_ROOMS},
+    [122] = {"num_rooms", JSON_KEY_NUM_ROOMS},
+    [127] = {"cerulean_flask", JSON_KEY_CERULEAN_FLASK},
+};
+typedef struct {
+    FILE *file;
+    size_t pos, len;
+    bool error;
+    char buf[JSON_CHUNK];
+} JsonReader;
+
+int json_peek(JsonReader *r) {
+    if (r->pos == r->len) {
+        r->len = r->error ? 0 : fread(r->buf, 1, JSON_CHUNK, r->file);
+        r->pos = 0;
+        if (r->len == 0) return EOF;
     }
-    Map *map = create_map();
-    if (!map) {
-        fclose(file);
-        return NULL;
+    return (unsigned char)r->buf[r->pos];
+}
+int json_skip_space(JsonReader *r) {
+    while (json_peek(r) != EOF) {
+        for (; r->pos < r->len; r->pos++) {
+            char c = r->buf[r->pos];
+            if (c != ' ' && c != '\n' && c != '\r' && c != '\t') return (unsigned char)c;
+        }
     }
-    char line[1024];
-    char current_section[64] = "";
-    int level_index = -1;
-    int room_index = -1;
-    while (fgets(line, sizeof(line), file)) {
-        char *trimmed = line;
-        while (*trimmed == ' ' || *trimmed == '\t') trimmed++;
-
-        if (trimmed[0] == '\n' || trimmed[0] == '}' || trimmed[0] == ']') 
-            continue;
-
-        if (strstr(trimmed, "\"metadata\"") == trimmed) {
-            strcpy(current_section, "metadata");
-            continue;
+    return EOF;
+}
+bool json_consume(JsonReader *r, int c) {
+    if (r->error || json_skip_space(r) != c) {
+        r->error = true;
+        return false;
+    }
+    r->pos++;
+    return true;
+}
+// Steps to the next member or element of a container closed by `close`.
+// Tolerates a trailing comma, which the monster list can end with.
+bool json_next(JsonReader *r, int close, bool *first) {
+    if (r->error) return false;
+    int c = json_skip_space(r);
+    if (!*first && c == ',') {
+        r->pos++;
+        c = json_skip_space(r);
+    } else if (!*first && c != close) {
+        r->error = true;
+        return false;
+    }
+    if (c == close) {
+        r->pos++;
+        return false;
+    }
+    if (c == EOF) {
+        r->error = true;
+        return false;
+    }
+    *first = false;
+    return true;
+}
+// Returns the next decoded character of the string being read, or -1 at
+// the closing quote (or on a syntax error, which sets r->error).
+int json_string_char(JsonReader *r) {
+    int c = json_peek(r);
+    if (c == EOF) {
+        r->error = true;
+        return -1;
+    }
+    r->pos++;
+    if (c == '"') return -1;
+    if (c != '\\') return c;
+    c = json_peek(r);
+    if (c == EOF) {
+        r->error = true;
+        return -1;
+    }
+    r->pos++;
+    switch (c) {
+        case 'n': return '\n';
+        case 't': return '\t';
+        case 'r': return '\r';
+        case 'b': return '\b';
+        case 'f': return '\f';
+        case 'u':
+            for (int i = 0; i < 4; i++) {
+                if (!isxdigit(json_peek(r))) {
+                    r->error = true;
+                    return -1;
+                }
+                r->pos++;
+            }
+            return '?';
+        default: return c;
+    }
+}
+// Reads `"key":` and returns its JSON_KEY_* id.
+int json_key(JsonReader *r) {
+    char key[32];
+    size_t n = 0;
+    if (!json_consume(r, '"')) return JSON_KEY_UNKNOWN;
+    for (int c; (c = json_string_char(r)) >= 0; ) {
+        if (n < sizeof(key)) key[n] = c;
+        n++;
+    }
+    if (!json_consume(r, ':') || n > sizeof(key)) return JSON_KEY_UNKNOWN;
+    uint32_t h = JSON_HASH_SEED;
+    for (size_t i = 0; i < n; i++) {
+        h = (h ^ (unsigned char)key[i]) * 16777619u;
+    }
+    const JsonKey *entry = &json_keys[h >> (32 - JSON_HASH_BITS)];
+    if (entry->name == NULL || strlen(entry->name) != n || memcmp(entry->name, key, n) != 0) {
+        return JSON_KEY_UNKNOWN;
+    }
+    return entry->id;
+}
+unsigned long long json_unsigned(JsonReader *r) {
+    int c = json_skip_space(r);
+    if (c < '0' || c > '9') {
+        r->error = true;
+        return 0;
+    }
+    unsigned long long value = 0;
+    for (; c >= '0' && c <= '9'; c = json_peek(r)) {
+        value = value * 10 + (c - '0');
+        r->pos++;
+    }
+    return value;
+}
+int json_int(JsonReader *r) {
+    if (json_skip_space(r) == '-') {
+        r->pos++;
+        return -(int)json_unsigned(r);
+    }
+    return (int)json_unsigned(r);
+}
+int json_count(JsonReader *r, int max) {
+    int count = json_int(r);
+    if (count < 0 || count > max) {
+        r->error = true;
+        return 0;
+    }
+    return count;
+}
+bool json_literal(JsonReader *r, const char *word) {
+    json_skip_space(r);
+    for (; *word; word++) {
+        if (json_peek(r) != *word) {
+            r->error = true;
+            return false;
         }
-        if (strstr(trimmed, "\"player\"") == trimmed) {
-            strcpy(current_section, "player");
-            continue;
+        r->pos++;
+    }
+    return true;
+}
+bool json_bool(JsonReader *r) {
+    if (json_skip_space(r) == 't') return json_literal(r, "true");
+    json_literal(r, "false");
+    return false;
+}
+// Skips any value, including keys this loader does not know.
+void json_skip(JsonReader *r, int depth) {
+    if (r->error) return;
+    int c = json_skip_space(r);
+    bool first = true;
+    if (depth > JSON_MAX_DEPTH) {
+        r->error = true;
+    } else if (c == '"') {
+        r->pos++;
+        while (json_string_char(r) >= 0);
+    } else if (c == '{') {
+        r->pos++;
+        while (json_next(r, '}', &first)) {
+            json_key(r);
+            json_skip(r, depth + 1);
+        }
+    } else if (c == '[') {
+        r->pos++;
+        while (json_next(r, ']', &first)) {
+            json_skip(r, depth + 1);
+        }
+    } else if (c == 't' || c == 'f') {
+        json_bool(r);
+    } else if (c == 'n') {
+        json_literal(r, "null");
+    } else {
+        json_int(r);
+        for (c = json_peek(r); c != EOF && strchr(".eE+-0123456789", c); c = json_peek(r)) {
+            r->pos++;
         }
-        if (strstr(trimmed, "\"levels\"") == trimmed) {
-            strcpy(current_section, "levels");
-            continue;
+    }
+}
+void json_coord(JsonReader *r, int *x, int *y) {
+    bool first = true;
+    if (!json_consume(r, '{')) return;
+    while (json_next(r, '}', &first)) {
+        switch (json_key(r)) {
+            case JSON_KEY_X: *x = json_int(r); break;
+            case JSON_KEY_Y: *y = json_int(r); break;
+            default: json_skip(r, 0); break;
         }
-        if (strcmp(current_section, "player") == 0) {
-            if (strstr(trimmed, "\"position\"")) {
-                int x, y;
-                if (sscanf(trimmed, "\"position\": {\"x\": %d, \"y\": %d}", &x, &y) == 2) {
-                    map->player_x = x;
-                    map->player_y = y;
-                }
-            }
-            else if (strstr(trimmed, "\"current_level\"")) {
-                int level;
-                if (sscanf(trimmed, "\"current_level\": %d", &level) == 1) {
-                    map->current_level = level;
-                }
-            }
-            else if (strstr(trimmed, "\"health\"")) {
-                sscanf(trimmed, "\"health\": %d", &map->health);
-            }
-            else if (strstr(trimmed, "\"strength\"")) {
-                sscanf(trimmed, "\"strength\": %d", &map->strength);
-            }
-            else if (strstr(trimmed, "\"gold\"")) {
-                sscanf(trimmed, "\"gold\": %d", &map->gold);
-            }
-            else if (strstr(trimmed, "\"armor\"")) {
-                sscanf(trimmed, "\"armor\": %d", &map->armor);
-            }
-            else if (strstr(trimmed, "\"exp\"")) {
-                sscanf(trimmed, "\"exp\": %d", &map->exp);
-            }
-            else if (strstr(trimmed, "\"hunger\"")) {
-                sscanf(trimmed, "\"hunger\": %d", &map->hunger);
-            }
+    }
+}
+void json_grid_cell(Level *level, int key, int y, int x, int c) {
+    if (y >= NUMLINES || x >= NUMCOLS) return;
+    if (key == JSON_KEY_EXPLORED) {
+        bit_assign(level->explored, y, x, c == '1');
+        return;
+    }
+    if (c == 'D' || c == 'F' || c == 'G' || c == 'S' || c == 'U') c = '.';
+    if (key == JSON_KEY_VISIBLE_TILES) {
+        level->visible_tiles[IDX(y, x)] = c;
+        return;
+    }
+    set_tile(level, y, x, c);
+    if (c == '$' || c == '&') {
+        bit_set(level->coins, y, x);
+        level->coin_values[IDX(y, x)] = c == '$' ? 1 : 5;
+    } else if (c == '<') {
+        level->stairs_up = (Coord){x, y};
+    } else if (c == '>') {
+        level->stairs_down = (Coord){x, y};
+    }
+}
+// Decodes row `y` of a "tiles", "explored" or "visible_tiles" grid. Runs of
+// plain characters are taken straight from the chunk buffer.
+void json_grid_row(JsonReader *r, Level *level, int key, int y) {
+    if (!json_consume(r, '"')) return;
+    int x = 0;
+    while (json_peek(r) != EOF) {
+        const char *p = r->buf + r->pos;
+        const char *end = r->buf + r->len;
+        for (; p < end && *p != '"' && *p != '\\'; p++) {
+            json_grid_cell(level, key, y, x++, (unsigned char)*p);
+        }
+        r->pos = p - r->buf;
+        if (p == end) continue;
+        int c = json_string_char(r);
+        if (c < 0) return;
+        json_grid_cell(level, key, y, x++, c);
+    }
+    r->error = true;
+}
+void json_grid(JsonReader *r, Level *level, int key) {
+    bool first = true;
+    int y = 0;
+    if (!json_consume(r, '[')) return;
+    while (json_next(r, ']', &first)) {
+        json_grid_row(r, level, key, y++);
+    }
+}
+void json_room(JsonReader *r, Room *room) {
+    bool first = true;
+    memset(room, 0, sizeof(*room));
+    if (!json_consume(r, '{')) return;
+    while (json_next(r, '}', &first)) {
+        switch (json_key(r)) {
+            case JSON_KEY_POSITION: json_coord(r, &room->pos.x, &room->pos.y); break;
+            case JSON_KEY_SIZE: json_coord(r, &room->max.x, &room->max.y); break;
+            case JSON_KEY_CENTER: json_coord(r, &room->center.x, &room->center.y); break;
+            case JSON_KEY_GONE: room->gone = json_bool(r); break;
+            case JSON_KEY_CONNECTED: room->connected = json_bool(r); break;
+            default: json_skip(r, 0); break;
         }
-        if (strcmp(current_section, "levels") == 0) {
-            if (strstr(trimmed, "\"level_number\"")) {
-                int num;
-                sscanf(trimmed, "\"level_number\": %d", &num);
-                level_index = num - 1;
-            }
+    }
+}
+// Only the geometry is restored here; walls, corridors and coins come from
+// the tile grid, and rooms are indexed once the explored grid is in.
+void json_rooms(JsonReader *r, Level *level, bool secret) {
+    bool first = true;
+    int count = 0;
+    if (!json_consume(r, '[')) return;
+    while (json_next(r, ']', &first)) {
+        Room room;
+        json_room(r, &room);
+        if (r->error || count >= MAXROOMS) continue;
+        if (secret) {
+            level->secret_rooms[count++] = room;
+        } else {
+            level->rooms[count++] = room;
         }
-        if (strstr(trimmed, "\"level_data\"")) {
-            Level *current = &map->levels[level_index];
-            while (fgets(line, sizeof(line), file)) {
-                if (strstr(line, "}")) break;
-                
-                if (strstr(line, "\"num_rooms\"")) {
-                    sscanf(line, "\"num_rooms\": %d", &current->num_rooms);
-                }
-                else if (strstr(line, "\"num_secret_rooms\"")) {
-                    sscanf(line, "\"num_secret_rooms\": %d", &current->num_secret_rooms);
-                }
-                else if (strstr(line, "\"stairs_placed\"")) {
-                    current->stairs_placed = strstr(line, "true") != NULL;
-                }
-                else if (strstr(line, "\"stairs_up\"")) {
-                    sscanf(line, "\"stairs_up\": {\"x\": %d, \"y\": %d}", 
-                           &current->stairs_up.x, &current->stairs_up.y);
-                }
-                else if (strstr(line, "\"stairs_down\"")) {
-                    sscanf(line, "\"stairs_down\": {\"x\": %d, \"y\": %d}", 
-                           &current->stairs_down.x, &current->stairs_down.y);
-                }
-                else if (strstr(line, "\"stair_coords\"")) {
-                    sscanf(line, "\"stair_coords\": {\"x\": %d, \"y\": %d}", 
-                           &current->stair_x, &current->stair_y);
-                }
-                else if (strstr(line, "\"secret_entrance\"")) {
-                    sscanf(line, "\"secret_entrance\": {\"x\": %d, \"y\": %d}", 
-                           &current->secret_entrance.x, &current->secret_entrance.y);
-                }
-                else if (strstr(line, "\"fighting_trap\"")) {
-                    sscanf(line, "\"fighting_trap\": {\"x\": %d, \"y\": %d}", 
-                           &current->fighting_trap.x, &current->fighting_trap.y);
-                }
-                else if (strstr(line, "\"fighting_trap_triggered\"")) {
-                    current->fighting_trap_triggered = strstr(line, "true") != NULL;
-                }
-                else if (strstr(line, "\"in_fighting_room\"")) {
-                    current->in_fighting_room = strstr(line, "true") != NULL;
-                }
-                else if (strstr(line, "\"arena_monster_count\"")) {
-                    sscanf(line, "\"arena_monster_count\": %d", &current->arena_monster_count);
-                }
-                else if (strstr(line, "\"talisman_type\"")) {
-                    sscanf(line, "\"talisman_type\": %d", &current->talisman_type);
-                }
-            }
+    }
+}
+void json_monster(JsonReader *r, Level *level) {
+    bool first = true;
+    Monster monster = {0};
+    monster.active = true;
+    monster.type = MONSTER_COUNT;
+    if (!json_consume(r, '{')) return;
+    while (json_next(r, '}', &first)) {
+        switch (json_key(r)) {
+            case JSON_KEY_TYPE: monster.type = json_int(r); break;
+            case JSON_KEY_POSITION: json_coord(r, &monster.x, &monster.y); break;
+            case JSON_KEY_HEALTH: monster.health = json_int(r); break;
+            case JSON_KEY_MAX_HEALTH: monster.max_health = json_int(r); break;
+            case JSON_KEY_AGGRESSIVE: monster.aggressive = json_bool(r); break;
+            case JSON_KEY_WAS_ATTACKED: monster.was_attacked = json_bool(r); break;
+            case JSON_KEY_IMMOBILIZED: monster.immobilized = json_bool(r); break;
+            case JSON_KEY_IN_ARENA: monster.in_arena = json_bool(r); break;
+            default: json_skip(r, 0); break;
+        }
+    }
+    if (r->error || monster.type < 0 || monster.type >= MONSTER_COUNT) return;
+    monster.name = level->monsters[monster.type].name;
+    monster.symbol = level->monsters[monster.type].symbol;
+    level->monsters[monster.type] = monster;
+}
+void json_level_data(JsonReader *r, Level *level) {
+    bool first = true;
+    if (!json_consume(r, '{')) return;
+    while (json_next(r, '}', &first)) {
+        switch (json_key(r)) {
+            case JSON_KEY_NUM_ROOMS: level->num_rooms = json_count(r, MAXROOMS); break;
+            case JSON_KEY_NUM_SECRET_ROOMS: level->num_secret_rooms = json_count(r, MAXROOMS); break;
+            case JSON_KEY_STAIRS_PLACED: level->stairs_placed = json_bool(r); break;
+            case JSON_KEY_STAIRS_UP: json_coord(r, &level->stairs_up.x, &level->stairs_up.y); break;
+            case JSON_KEY_STAIRS_DOWN: json_coord(r, &level->stairs_down.x, &level->stairs_down.y); break;
+            case JSON_KEY_STAIR_COORDS: json_coord(r, &level->stair_x, &level->stair_y); break;
+            case JSON_KEY_SECRET_ENTRANCE: json_coord(r, &level->secret_entrance.x, &level->secret_entrance.y); break;
+            case JSON_KEY_FIGHTING_TRAP: json_coord(r, &level->fighting_trap.x, &level->fighting_trap.y); break;
+            case JSON_KEY_FIGHTING_TRAP_TRIGGERED: level->fighting_trap_triggered = json_bool(r); break;
+            case JSON_KEY_IN_FIGHTING_ROOM: level->in_fighting_room = json_bool(r); break;
+            case JSON_KEY_ARENA_MONSTER_COUNT: level->arena_monster_count = json_int(r); break;
+            case JSON_KEY_TALISMAN_TYPE: level->talisman_type = json_int(r); break;
+            default: json_skip(r, 0); break;
         }
-        if (strstr(trimmed, "\"rooms\"") == trimmed) {
-            Level *current = &map->levels[level_index];
-            room_index = 0;
-            while (fgets(line, sizeof(line), file)) {
-                if (strstr(line, "]")) break;
-                if (strstr(line, "{")) {
-                    Room room = {0};
-                    while (fgets(line, sizeof(line), file)) {
-                        if (strstr(line, "}")) break;
-                        
-                        if (strstr(line, "\"position\"")) {
-                            sscanf(line, "\"position\": {\"x\": %d, \"y\": %d}", 
-                                   &room.pos.x, &room.pos.y);
-                        }
-                        else if (strstr(line, "\"size\"")) {
-                            sscanf(line, "\"size\": {\"x\": %d, \"y\": %d}", 
-                                   &room.max.x, &room.max.y);
-                        }
-                        else if (strstr(line, "\"center\"")) {
-                            sscanf(line, "\"center\": {\"x\": %d, \"y\": %d}", 
-                                   &room.center.x, &room.center.y);
-                        }
-                        else if (strstr(line, "\"gone\"")) {
-                            room.gone = strstr(line, "true") != NULL;
-                        }
-                        else if (strstr(line, "\"connected\"")) {
-                            room.connected = strstr(line, "true") != NULL;
-                        }
-                    }
-                    if (room_index < MAXROOMS) {
-                        current->rooms[room_index] = room;
-                        draw_room(current, &room);
-                        room_index++;
-                    }
-                }
-            }
-            for (int i = 1; i < room_index; i++) {
-                connect_rooms(current, &current->rooms[i-1], &current->rooms[i]);
+    }
+}
+// Members before "level_number" have no level to land in and are skipped.
+void json_level(JsonReader *r, Map *map) {
+    bool first = true;
+    Level *level = NULL;
+    if (!json_consume(r, '{')) return;
+    while (json_next(r, '}', &first)) {
+        int key = json_key(r);
+        if (key == JSON_KEY_LEVEL_NUMBER) {
+            int number = json_int(r);
+            if (number < 1 || number > MAX_LEVELS) {
+                r->error = true;
+                return;
             }
+            level = &map->levels[number - 1];
+            continue;
         }
-        if (strstr(trimmed, "\"secret_rooms\"") == trimmed) {
-            Level *current = &map->levels[level_index];
-            int secret_room_index = 0;
-            while (fgets(line, sizeof(line), file)) {
-                if (strstr(line, "]")) break;
-                if (strstr(line, "{")) {
-                    Room room = {0};
-                    while (fgets(line, sizeof(line), file)) {
-                        if (strstr(line, "}")) break;
-                        
-                        if (strstr(line, "\"position\"")) {
-                            sscanf(line, "\"position\": {\"x\": %d, \"y\": %d}", 
-                                   &room.pos.x, &room.pos.y);
-                        }
-                        else if (strstr(line, "\"size\"")) {
-                            sscanf(line, "\"size\": {\"x\": %d, \"y\": %d}", 
-                                   &room.max.x, &room.max.y);
-                        }
-                        else if (strstr(line, "\"center\"")) {
-                            sscanf(line, "\"center\": {\"x\": %d, \"y\": %d}", 
-                                   &room.center.x, &room.center.y);
-                        }
-                        else if (strstr(line, "\"gone\"")) {
-                            room.gone = strstr(line, "true") != NULL;
-                        }
-                        else if (strstr(line, "\"connected\"")) {
-                            room.connected = strstr(line, "true") != NULL;
-                        }
-                    }
-                    if (secret_room_index < MAXROOMS) {
-                        current->secret_rooms[secret_room_index] = room;
-                        secret_room_index++;
-                    }
-                }
-            }
+        if (level == NULL) {
+            json_skip(r, 0);
+            continue;
         }
-        if (strstr(trimmed, "\"weapons\"")) {
-            int weapon_index = -1;
-            while (fgets(line, sizeof(line), file)) {
-                if (strstr(line, "]")) break;
-                
-                if (strstr(line, "{")) {
-                    weapon_index++;
-                    continue;
-                }
-                
-                if (weapon_index >= 0 && weapon_index < WEAPON_COUNT) {
-                    int value;
-                    if (strstr(line, "\"type\"")) {
-                        if (sscanf(line, "%*[^:]: %d", &value) == 1) {
-                            map->weapons[weapon_index].type = value;
-                        }
-                    }
-                    else if (strstr(line, "\"owned\"")) {
-                        map->weapons[weapon_index].owned = strstr(line, "true") != NULL;
-                    }
-                    else if (strstr(line, "\"ammo\"")) {
-                        if (sscanf(line, "%*[^:]: %d", &value) == 1) {
-                            map->weapons[weapon_index].ammo = value;
-                        }
-                    }
+        switch (key) {
+            case JSON_KEY_LEVEL_DATA: json_level_data(r, level); break;
+            case JSON_KEY_ROOMS: json_rooms(r, level, false); break;
+            case JSON_KEY_SECRET_ROOMS: json_rooms(r, level, true); break;
+            case JSON_KEY_MONSTERS: {
+                bool first_monster = true;
+                if (!json_consume(r, '[')) return;
+                while (json_next(r, ']', &first_monster)) {
+                    json_monster(r, level);
                 }
+                break;
             }
+            case JSON_KEY_TILES:
+            case JSON_KEY_EXPLORED:
+            case JSON_KEY_VISIBLE_TILES: json_grid(r, level, key); break;
+            default: json_skip(r, 0); break;
         }
-        if (strstr(trimmed, "\"talismans\"")) {
-            int talisman_index = -1;
-            while (fgets(line, sizeof(line), file)) {
-                if (strstr(line, "]")) break;
-                
-                if (strstr(line, "{")) {
-                    talisman_index++;
-                    continue;
-                }
-                if (talisman_index >= 0 && talisman_index < TALISMAN_COUNT) {
-                    int value;
-                    if (strstr(line, "\"type\"")) {
-                        if (sscanf(line, "%*[^:]: %d", &value) == 1) {
-                            map->talismans[talisman_index].type = value;
-                        }
-                    }
-                    else if (strstr(line, "\"owned\"")) {
-                        map->talismans[talisman_index].owned = strstr(line, "true") != NULL;
-                    }
-                    else if (strstr(line, "\"count\"")) {
-                        if (sscanf(line, "%*[^:]: %d", &value) == 1) {
-                            map->talismans[talisman_index].count = value;
-                        }
-                    }
-                    else if (strstr(line, "\"durations\"")) {
-                        char *start = strchr(line, '[');
-                        if (start) {
-                            start++;
-                            char *token = strtok(start, ",]");
-                            for (int i = 0; i < 5 && token; i++) {
-                                map->talismans[talisman_index].active_durations[i] = atoi(token);
-                                token = strtok(NULL, ",]");
-                            }
-                        }
-                    }
-                }
-            }
+    }
+}
+void json_stats(JsonReader *r, Map *map) {
+    bool first = true;
+    if (!json_consume(r, '{')) return;
+    while (json_next(r, '}', &first)) {
+        switch (json_key(r)) {
+            case JSON_KEY_HEALTH: map->health = json_int(r); break;
+            case JSON_KEY_STRENGTH: map->strength = json_int(r); break;
+            case JSON_KEY_GOLD: map->gold = json_int(r); break;
+            case JSON_KEY_ARMOR: map->armor = json_int(r); break;
+            case JSON_KEY_EXP: map->exp = json_int(r); break;
+            case JSON_KEY_HUNGER: map->hunger = json_int(r); break;
+            default: json_skip(r, 0); break;
         }
-        if (strstr(trimmed, "\"consumables\"")) {
-            while (fgets(line, sizeof(line), file)) {
-                if (strstr(line, "}")) break;
-                int value;
-                if (strstr(line, "\"normal_food\"")) {
-                    if (sscanf(line, "%*[^:]: %d", &value) == 1) {
-                        map->normal_food = value;
-                    }
-                }
-                else if (strstr(line, "\"crimson_flask\"")) {
-                    if (sscanf(line, "%*[^:]: %d", &value) == 1) {
-                        map->crimson_flask = value;
-                    }
-                }
-                else if (strstr(line, "\"cerulean_flask\"")) {
-                    if (sscanf(line, "%*[^:]: %d", &value) == 1) {
-                        map->cerulean_flask = value;
-                    }
-                }
-                else if (strstr(line, "\"rotten_food\"")) {
-                    if (sscanf(line, "%*[^:]: %d", &value) == 1) {
-                        map->rotten_food = value;
-                    }
-                }
-            }
+    }
+}
+void json_consumables(JsonReader *r, Map *map) {
+    bool first = true;
+    if (!json_consume(r, '{')) return;
+    while (json_next(r, '}', &first)) {
+        switch (json_key(r)) {
+            case JSON_KEY_NORMAL_FOOD: map->normal_food = json_int(r); break;
+            case JSON_KEY_CRIMSON_FLASK: map->crimson_flask = json_int(r); break;
+            case JSON_KEY_CERULEAN_FLASK: map->cerulean_flask = json_int(r); break;
+            case JSON_KEY_ROTTEN_FOOD: map->rotten_food = json_int(r); break;
+            default: json_skip(r, 0); break;
         }
-        if (strstr(trimmed, "\"monsters\"") == trimmed) {
-            Level *current = &map->levels[level_index];
-            while (fgets(line, sizeof(line), file)) {
-                if (strstr(line, "]")) break;
-                if (strstr(line, "{")) {
-                    Monster monster = {0};
-                    monster.active = true;
-                    while (fgets(line, sizeof(line), file)) {
-                        if (strstr(line, "}")) break;
-                        if (strstr(line, "\"type\"")) {
-                            int type;
-                            sscanf(line, "\"type\": %d", &type);
-                            monster.type = type;
-                        }
-                        else if (strstr(line, "\"position\"")) {
-                            sscanf(line, "\"position\": {\"x\": %d, \"y\": %d}", 
-                                   &monster.x, &monster.y);
-                        }
-                        else if (strstr(line, "\"health\"")) {
-                            sscanf(line, "\"health\": %d", &monster.health);
-                        }
-                        else if (strstr(line, "\"max_health\"")) {
-                            sscanf(line, "\"max_health\": %d", &monster.max_health);
-                        }
-                        else if (strstr(line, "\"aggressive\"")) {
-                            monster.aggressive = strstr(line, "true") != NULL;
-                        }
-                        else if (strstr(line, "\"was_attacked\"")) {
-                            monster.was_attacked = strstr(line, "true") != NULL;
-                        }
-                        else if (strstr(line, "\"immobilized\"")) {
-                            monster.immobilized = strstr(line, "true") != NULL;
-                        }
-                        else if (strstr(line, "\"in_arena\"")) {
-                            monster.in_arena = strstr(line, "true") != NULL;
-                        }
-                    }
-                    if (monster.type < MONSTER_COUNT) {
-                        current->monsters[monster.type] = monster;
-                        if (monster.active) {
-                            current->tiles[monster.y][monster.x] = monster.symbol;
-                        }
-                    }
-                }
+    }
+}
+void json_weapons(JsonReader *r, Map *map) {
+    bool first = true;
+    if (!json_consume(r, '[')) return;
+    for (int i = 0; json_next(r, ']', &first); i++) {
+        bool first_member = true;
+        if (i >= WEAPON_COUNT) {
+            json_skip(r, 0);
+            continue;
+        }
+        if (!json_consume(r, '{')) return;
+        while (json_next(r, '}', &first_member)) {
+            switch (json_key(r)) {
+                case JSON_KEY_TYPE: map->weapons[i].type = json_int(r); break;
+                case JSON_KEY_OWNED: map->weapons[i].owned = json_bool(r); break;
+                case JSON_KEY_AMMO: map->weapons[i].ammo = json_int(r); break;
+                default: json_skip(r, 0); break;
             }
         }
-        if (strstr(trimmed, "\"tiles\"") == trimmed) {
-            Level *current = &map->levels[level_index];
-            int y = 0;
-            while (fgets(line, sizeof(line), file) && y < NUMLINES) {
-                if (strstr(line, "]")) break;
-                char *tile_data = strchr(line, '\"');
-                if (tile_data) {
-                    tile_data++;
-                    for (int x = 0; x < NUMCOLS && *tile_data && *tile_data != '\"'; x++) {
-                        if (*tile_data == '\\') tile_data++;
-                        current->tiles[y][x] = *tile_data++;
-                        if (current->tiles[y][x] == '$') {
-                            current->coins[y][x] = true;
-                            current->coin_values[y][x] = 1;
-                        }
-                        else if (current->tiles[y][x] == '&') {
-                            current->coins[y][x] = true;
-                            current->coin_values[y][x] = 5;
-                        }
-                        else if (current->tiles[y][x] == '<') {
-                            current->stairs_up.x = x;
-                            current->stairs_up.y = y;
-                        }
-                        else if (current->tiles[y][x] == '>') {
-                            current->stairs_down.x = x;
-                            current->stairs_down.y = y;
-                        }
-                    }
-                    y++;
+    }
+}
+void json_talismans(JsonReader *r, Map *map) {
+    bool first = true;
+    if (!json_consume(r, '[')) return;
+    for (int i = 0; json_next(r, ']', &first); i++) {
+        bool first_member = true;
+        if (i >= TALISMAN_COUNT) {
+            json_skip(r, 0);
+            continue;
+        }
+        if (!json_consume(r, '{')) return;
+        while (json_next(r, '}', &first_member)) {
+            int key = json_key(r);
+            if (key != JSON_KEY_DURATIONS) {
+                switch (key) {
+                    case JSON_KEY_TYPE: map->talismans[i].type = json_int(r); break;
+                    case JSON_KEY_OWNED: map->talismans[i].owned = json_bool(r); break;
+                    case JSON_KEY_COUNT: map->talismans[i].count = json_int(r); break;
+                    default: json_skip(r, 0); break;
                 }
+                continue;
             }
-        }
-        if (strstr(trimmed, "\"explored\"") == trimmed) {
-            Level *current = &map->levels[level_index];
-            int y = 0;
-            while (fgets(line, sizeof(line), file) && y < NUMLINES) {
-                if (strstr(line, "]")) break;
-                char *explored_data = strchr(line, '\"');
-                if (explored_data) {
-                    explored_data++;
-                    for (int x = 0; x < NUMCOLS && *explored_data && *explored_data != '\"'; x++) {
-                        current->explored[y][x] = (*explored_data++ == '1');
-                    }
-                    y++;
+            bool first_duration = true;
+            if (!json_consume(r, '[')) return;
+            // Older files list several durations; the longest one wins.
+            while (json_next(r, ']', &first_duration)) {
+                int turns = json_int(r);
+                if (turns > 0 && (uint32_t)turns > timer_remaining(&map->timers, TIMER_TALISMAN + i)) {
+                    timer_set(&map->timers, TIMER_TALISMAN + i, turns);
                 }
             }
         }
-        if (strstr(trimmed, "\"visible_tiles\"") == trimmed) {
-            Level *current = &map->levels[level_index];
-            int y = 0;
-            while (fgets(line, sizeof(line), file) && y < NUMLINES) {
-                if (strstr(line, "]")) break;
-                char *tile_data = strchr(line, '\"');
-                if (tile_data) {
-                    tile_data++;
-                    for (int x = 0; x < NUMCOLS && *tile_data && *tile_data != '\"'; x++) {
-                        if (*tile_data == '\\') tile_data++;
-                        current->visible_tiles[y][x] = *tile_data++;
+    }
+    refresh_effects(map);
+}
+void json_player(JsonReader *r, Map *map) {
+    bool first = true;
+    if (!json_consume(r, '{')) return;
+    while (json_next(r, '}', &first)) {
+        switch (json_key(r)) {
+            case JSON_KEY_POSITION: json_coord(r, &map->player_x, &map->player_y); break;
+            case JSON_KEY_CURRENT_LEVEL: map->current_level = json_int(r); break;
+            case JSON_KEY_STATS: json_stats(r, map); break;
+            case JSON_KEY_WEAPONS: json_weapons(r, map); break;
+            case JSON_KEY_TALISMANS: json_talismans(r, map); break;
+            case JSON_KEY_CONSUMABLES: json_consumables(r, map); break;
+            default: json_skip(r, 0); break;
+        }
+    }
+}
+void json_metadata(JsonReader *r, Map *map) {
+    bool first = true;
+    if (!json_consume(r, '{')) return;
+    while (json_next(r, '}', &first)) {
+        if (json_key(r) == JSON_KEY_SEED) {
+            seed_map(map, json_unsigned(r));
+        } else {
+            json_skip(r, 0);
+        }
+    }
+}
+Map* load_game_json(const char *filename) {
+    FILE *file = fopen(filename, "r");
+    if (!file) {
+        fprintf(stderr, "Could not open save file\n");
+        return NULL;
+    }
+    JsonReader *r = malloc(sizeof(JsonReader));
+    Map *map = r ? create_map() : NULL;
+    if (!map) {
+        free(r);
+        fclose(file);
+        return NULL;
+    }
+    r->file = file;
+    r->pos = r->len = 0;
+    r->error = false;
+    bool first = true;
+    if (json_consume(r, '{')) {
+        while (json_next(r, '}', &first)) {
+            switch (json_key(r)) {
+                case JSON_KEY_METADATA: json_metadata(r, map); break;
+                case JSON_KEY_PLAYER: json_player(r, map); break;
+                case JSON_KEY_LEVELS: {
+                    bool first_level = true;
+                    if (!json_consume(r, '[')) break;
+                    while (json_next(r, ']', &first_level)) {
+                        json_level(r, map);
                     }
-                    y++;
+                    break;
                 }
+                default: json_skip(r, 0); break;
             }
         }
     }
+    bool ok = !r->error && map->current_level >= 1 && map->current_level <= MAX_LEVELS;
+    free(r);
     fclose(file);
+    if (!ok) {
+        free_map(map);
+        return NULL;
+    }
     for (int l = 0; l < map->current_level; l++) {
         Level *current = &map->levels[l];
+        index_monsters(current);
         for (int r = 0; r < current->num_rooms; r++) {
-            Room *room = &current->rooms[r];
-            for (int y = room->pos.y; y < room->pos.y + room->max.y; y++) {
-                for (int x = room->pos.x; x < room->pos.x + room->max.x; x++) {
-                    if (y >= 0 && y < NUMLINES && x >= 0 && x < NUMCOLS) {
-                        current->explored[y][x] = true;
-                    }
-                }
-            }
+            index_room(current, r);
         }
         if (l > 0) {
             if (current->stairs_up.x > 0 && current->stairs_up.y > 0) {
-                current->tiles[current->stairs_up.y][current->stairs_up.x] = '<';
+                set_tile(current, current->stairs_up.y, current->stairs_up.x, '<');
             }
         }
         if (l < map->current_level - 1) {
             if (current->stairs_down.x > 0 && current->stairs_down.y > 0) {
-                current->tiles[current->stairs_down.y][current->stairs_down.x] = '>';
+                set_tile(current, current->stairs_down.y, current->stairs_down.x, '>');
             }
         }
         if (current->stairs_up.x > 0 && current->stairs_up.y > 0) {
             for (int y = current->stairs_up.y - 1; y <= current->stairs_up.y + 1; y++) {
                 for (int x = current->stairs_up.x - 1; x <= current->stairs_up.x + 1; x++) {
                     if (y >= 0 && y < NUMLINES && x >= 0 && x < NUMCOLS) {
-                        current->explored[y][x] = true;
-                        current->visible_tiles[y][x] = current->tiles[y][x];
+                        explore_cell(current, y, x);
+                        current->visible_tiles[IDX(y, x)] = current->tiles[IDX(y, x)];
                     }
                 }
             }
@@ -929,8 +1231,8 @@ Map* load_game_json(const char *filename) {
             for (int y = current->stairs_down.y - 1; y <= current->stairs_down.y + 1; y++) {
                 for (int x = current->stairs_down.x - 1; x <= current->stairs_down.x + 1; x++) {
                     if (y >= 0 && y < NUMLINES && x >= 0 && x < NUMCOLS) {
-                        current->explored[y][x] = true;
-                        current->visible_tiles[y][x] = current->tiles[y][x];
+                        explore_cell(current, y, x);
+                        current->visible_tiles[IDX(y, x)] = current->tiles[IDX(y, x)];
                     }
                 }
             }
@@ -940,54 +1242,1187 @@ Map* load_game_json(const char *filename) {
     return map;
 }
 
+// Binary save: a header, one fixed-layout player record, then per level a
+// fixed-layout record followed by its layers, each stored as a uint32_t
+// length and a run-length encoding of the raw bytes. Loaded with mmap.
+// Later saves append delta segments after this image (see save_game_delta).
+#define SAVE_MAGIC "RGSV"
+#define SAVE_VERSION 5
+#define SAVE_LAYERS 12
+typedef struct {
+    char magic[4];
+    uint32_t version;
+    uint32_t header_size;
+    uint32_t player_size;
+    uint32_t level_size;
+    uint32_t layer_bytes;
+    int32_t cols;
+    int32_t lines;
+    int32_t num_levels;
+} SaveHeader;
+typedef struct {
+    int32_t type;
+    int32_t health, max_health, damage;
+    int32_t x, y;
+    bool active, aggressive, was_attacked, immobilized, in_arena;
+} SaveMonster;
+typedef struct {
+    uint64_t seed;
+    uint64_t journal_id;
+    int32_t current_level;
+    int32_t player_x, player_y;
+    int32_t prev_stair_x, prev_stair_y;
+    int32_t health, strength, gold, armor, exp;
+    int32_t character_color, games_played, difficulty;
+    int32_t food_count, hunger;
+    int32_t current_weapon;
+    bool weapon_owned[5];
+    int32_t weapon_ammo[5];
+    bool talisman_owned[3];
+    int32_t talisman_count[3];
+    int32_t moves_since_activation;
+    int32_t food_freshness[5];
+    bool food_is_rotten[5];
+    int32_t food_types[5];
+    int32_t timers[TIMER_KINDS];  // turns left on each timer, 0 if idle
+    int32_t normal_food, crimson_flask, cerulean_flask, rotten_food;
+} SavePlayer;
+typedef struct {
+    Room rooms[MAXROOMS];
+    Room secret_rooms[MAXROOMS];
+    int32_t num_rooms, num_secret_rooms;
+    int32_t stair_room, current_secret_room, secret_stair_room;
+    int32_t stair_x, stair_y;
+    Coord stairs_up, stairs_down, secret_entrance, secret_stair_entrance;
+    Coord fighting_trap, return_pos;
+    bool stairs_placed, fighting_trap_triggered, in_fighting_room;
+    int32_t talisman_type, arena_monster_count;
+    SaveMonster monsters[MONSTER_COUNT];
+} SaveLevel;
+typedef struct {
+    void *data;
+    size_t size;
+} SaveLayer;
+// A delta segment: this header, the player record, then `entries` SaveEntry
+// blocks, each followed by the level record (if SAVE_RECORD_BIT is set in
+// its mask) and the masked layers in level_save_layers() order, encoded as
+// in the image.
+#define SAVE_SEGMENT_MAGIC "RGSD"
+#define SAVE_RECORD_BIT (1u << SAVE_LAYERS)
+#define SAVE_FULL_MASK ((1u << (SAVE_LAYERS + 1)) - 1)
+typedef struct {
+    char magic[4];
+    int32_t num_levels;
+    uint32_t entries;
+    uint32_t payload_bytes;
+    uint64_t checksum;
+} SaveSegment;
+typedef struct {
+    int32_t level;
+    uint32_t mask;
+} SaveEntry;
+// What savegame.bin holds as of the last successful write: the hash of
+// every level record and layer, and how many bytes of image and segments
+// precede the next append. Only the save worker writes it while a save runs.
+typedef struct {
+    bool valid;
+    int num_levels;
+    long image_bytes;
+    long segment_bytes;
+    uint64_t hashes[MAX_LEVELS][SAVE_LAYERS + 1];
+} SaveCheckpoint;
+static SaveCheckpoint save_checkpoint;
+
+void level_save_layers(Level *level, SaveLayer *layers) {
+    size_t bits = BITSET_WORDS * sizeof(uint64_t);
+    layers[0] = (SaveLayer){level->explored, bits};
+    layers[1] = (SaveLayer){level->traps, bits};
+    layers[2] = (SaveLayer){level->discovered_traps, bits};
+    layers[3] = (SaveLayer){level->secret_walls, bits};
+    layers[4] = (SaveLayer){level->secret_stairs, bits};
+    layers[5] = (SaveLayer){level->coins, bits};
+    layers[6] = (SaveLayer){level->backup_explored, bits};
+    layers[7] = (SaveLayer){level->coin_values, LAYER_CELLS * sizeof(int)};
+    layers[8] = (SaveLayer){level->tiles, LAYER_CELLS * sizeof(char)};
+    layers[9] = (SaveLayer){level->visible_tiles, LAYER_CELLS * sizeof(char)};
+    layers[10] = (SaveLayer){level->backup_tiles, LAYER_CELLS * sizeof(char)};
+    layers[11] = (SaveLayer){level->backup_visible_tiles, LAYER_CELLS * sizeof(char)};
+}
+size_t level_layer_bytes() {
+    return 7 * BITSET_WORDS * sizeof(uint64_t) + LAYER_CELLS * (sizeof(int) + 4 * sizeof(char));
+}
+int32_t save_room_index(Level *level, Room *room) {
+    if (room == NULL) return -1;
+    if (room >= level->rooms && room < level->rooms + MAXROOMS) return room - level->rooms;
+    if (room >= level->secret_rooms && room < level->secret_rooms + MAXROOMS) return MAXROOMS + (room - level->secret_rooms);
+    return -1;
+}
+Room *load_room_index(Level *level, int32_t index) {
+    if (index >= 0 && index < MAXROOMS) return &level->rooms[index];
+    if (index >= MAXROOMS && index < 2 * MAXROOMS) return &level->secret_rooms[index - MAXROOMS];
+    return NULL;
+}
+uint64_t save_hash(const void *data, size_t size) {
+    const unsigned char *p = data;
+    uint64_t h = 0xCBF29CE484222325ULL ^ size;
+    for (; size >= 8; size -= 8, p += 8) {
+        uint64_t word;
+        memcpy(&word, p, 8);
+        h = (h ^ word) * 0x9E3779B97F4A7C15ULL;
+        h ^= h >> 29;
+    }
+    for (; size > 0; size--, p++) {
+        h = (h ^ *p) * 0x100000001B3ULL;
+    }
+    return h;
+}
+int saved_level_count(Map *map) {
+    int count = map->current_level;
+    while (count < MAX_LEVELS && map->levels[count].stairs_placed) count++;
+    return count;
+}
+void fill_save_player(Map *map, SavePlayer *p) {
+    memset(p, 0, sizeof(*p));
+    p->seed = map->seed;
+    p->journal_id = map->journal_id;
+    p->current_level = map->current_level;
+    p->player_x = map->player_x;
+    p->player_y = map->player_y;
+    p->prev_stair_x = map->prev_stair_x;
+    p->prev_stair_y = map->prev_stair_y;
+    p->health = map->health;
+    p->strength = map->strength;
+    p->gold = map->gold;
+    p->armor = map->armor;
+    p->exp = map->exp;
+    p->character_color = map->character_color;
+    p->games_played = map->games_played;
+    p->difficulty = map->difficulty;
+    p->food_count = map->food_count;
+    p->hunger = map->hunger;
+    p->current_weapon = map->current_weapon;
+    for (int i = 0; i < WEAPON_COUNT; i++) {
+        p->weapon_owned[i] = map->weapons[i].owned;
+        p->weapon_ammo[i] = map->weapons[i].ammo;
+    }
+    for (int i = 0; i < TALISMAN_COUNT; i++) {
+        p->talisman_owned[i] = map->talismans[i].owned;
+        p->talisman_count[i] = map->talismans[i].count;
+    }
+    p->moves_since_activation = map->moves_since_activation;
+    for (int i = 0; i < 5; i++) {
+        p->food_freshness[i] = map->food_freshness[i];
+        p->food_is_rotten[i] = map->food_is_rotten[i];
+        p->food_types[i] = map->food_types[i];
+    }
+    for (int i = 0; i < TIMER_KINDS; i++) {
+        p->timers[i] = timer_remaining(&map->timers, i);
+    }
+    p->normal_food = map->normal_food;
+    p->crimson_flask = map->crimson_flask;
+    p->cerulean_flask = map->cerulean_flask;
+    p->rotten_food = map->rotten_food;
+}
+void apply_save_player(Map *map, const SavePlayer *p) {
+    seed_map(map, p->seed);
+    map->journal_id = p->journal_id;
+    map->current_level = p->current_level;
+    map->player_x = p->player_x;
+    map->player_y = p->player_y;
+    map->prev_stair_x = p->prev_stair_x;
+    map->prev_stair_y = p->prev_stair_y;
+    map->health = p->health;
+    map->strength = p->strength;
+    map->gold = p->gold;
+    map->armor = p->armor;
+    map->exp = p->exp;
+    map->character_color = p->character_color;
+    map->games_played = p->games_played;
+    map->difficulty = p->difficulty;
+    map->food_count = p->food_count;
+    map->hunger = p->hunger;
+    map->current_weapon = p->current_weapon;
+    for (int i = 0; i < WEAPON_COUNT; i++) {
+        map->weapons[i].owned = p->weapon_owned[i];
+        map->weapons[i].ammo = p->weapon_ammo[i];
+    }
+    for (int i = 0; i < TALISMAN_COUNT; i++) {
+        map->talismans[i].owned = p->talisman_owned[i];
+        map->talismans[i].count = p->talisman_count[i];
+    }
+    map->moves_since_activation = p->moves_since_activation;
+    for (int i = 0; i < 5; i++) {
+        map->food_freshness[i] = p->food_freshness[i];
+        map->food_is_rotten[i] = p->food_is_rotten[i];
+        map->food_types[i] = p->food_types[i];
+    }
+    timer_wheel_init(&map->timers);
+    for (int i = 0; i < TIMER_KINDS; i++) {
+        if (p->timers[i] > 0) {
+            timer_set(&map->timers, i, p->timers[i]);
+        }
+    }
+    if (!timer_pending(&map->timers, TIMER_HUNGER)) {
+        timer_set(&map->timers, TIMER_HUNGER, HUNGER_PERIOD);
+    }
+    refresh_effects(map);
+    map->normal_food = p->normal_food;
+    map->crimson_flask = p->crimson_flask;
+    map->cerulean_flask = p->cerulean_flask;
+    map->rotten_food = p->rotten_food;
+}
+void fill_save_level(Level *level, SaveLevel *rec) {
+    memset(rec, 0, sizeof(*rec));
+    memcpy(rec->rooms, level->rooms, sizeof(rec->rooms));
+    memcpy(rec->secret_rooms, level->secret_rooms, sizeof(rec->secret_rooms));
+    rec->num_rooms = level->num_rooms;
+    rec->num_secret_rooms = level->num_secret_rooms;
+    rec->stair_room = save_room_index(level, level->stair_room);
+    rec->current_secret_room = save_room_index(level, level->current_secret_room);
+    rec->secret_stair_room = save_room_index(level, level->secret_stair_room);
+    rec->stair_x = level->stair_x;
+    rec->stair_y = level->stair_y;
+    rec->stairs_up = level->stairs_up;
+    rec->stairs_down = level->stairs_down;
+    rec->secret_entrance = level->secret_entrance;
+    rec->secret_stair_entrance = level->secret_stair_entrance;
+    rec->fighting_trap = level->fighting_trap;
+    rec->return_pos = level->return_pos;
+    rec->stairs_placed = level->stairs_placed;
+    rec->fighting_trap_triggered = level->fighting_trap_triggered;
+    rec->in_fighting_room = level->in_fighting_room;
+    rec->talisman_type = level->talisman_type;
+    rec->arena_monster_count = level->arena_monster_count;
+    for (int m = 0; m < MONSTER_COUNT; m++) {
+        Monster *monster = &level->monsters[m];
+        rec->monsters[m] = (SaveMonster){monster->type, monster->health, monster->max_health, monster->damage,
+                                         monster->x, monster->y, monster->active, monster->aggressive,
+                                         monster->was_attacked, monster->immobilized, monster->in_arena};
+    }
+}
+// Fills SAVE_LAYERS + 1 hashes: one per layer, then the level record.
+void level_save_hashes(Level *level, uint64_t *hashes) {
+    SaveLevel rec;
+    fill_save_level(level, &rec);
+    hashes[SAVE_LAYERS] = save_hash(&rec, sizeof(rec));
+    SaveLayer layers[SAVE_LAYERS];
+    level_save_layers(level, layers);
+    for (int i = 0; i < SAVE_LAYERS; i++) {
+        hashes[i] = save_hash(layers[i].data, layers[i].size);
+    }
+}
+// Size of layer `i` as laid out by level_save_layers().
+size_t save_layer_size(int i) {
+    if (i < 7) return BITSET_WORDS * sizeof(uint64_t);
+    return i == 7 ? LAYER_CELLS * sizeof(int) : LAYER_CELLS * sizeof(char);
+}
+void apply_save_level(Level *level, const SaveLevel *rec) {
+    Monster templates[MONSTER_COUNT];
+    memcpy(templates, level->monsters, sizeof(templates));
+    memcpy(level->rooms, rec->rooms, sizeof(rec->rooms));
+    memcpy(level->secret_rooms, rec->secret_rooms, sizeof(rec->secret_rooms));
+    level->num_rooms = rec->num_rooms;
+    level->num_secret_rooms = rec->num_secret_rooms;
+    level->stair_room = load_room_index(level, rec->stair_room);
+    level->current_secret_room = load_room_index(level, rec->current_secret_room);
+    level->secret_stair_room = load_room_index(level, rec->secret_stair_room);
+    level->stair_x = rec->stair_x;
+    level->stair_y = rec->stair_y;
+    level->stairs_up = rec->stairs_up;
+    level->stairs_down = rec->stairs_down;
+    level->secret_entrance = rec->secret_entrance;
+    level->secret_stair_entrance = rec->secret_stair_entrance;
+    level->fighting_trap = rec->fighting_trap;
+    level->return_pos = rec->return_pos;
+    level->stairs_placed = rec->stairs_placed;
+    level->fighting_trap_triggered = rec->fighting_trap_triggered;
+    level->in_fighting_room = rec->in_fighting_room;
+    level->talisman_type = rec->talisman_type;
+    level->arena_monster_count = rec->arena_monster_count;
+    for (int m = 0; m < MONSTER_COUNT; m++) {
+        const SaveMonster *saved = &rec->monsters[m];
+        Monster *monster = &level->monsters[m];
+        int type = saved->type >= 0 && saved->type < MONSTER_COUNT ? saved->type : m;
+        *monster = templates[type];
+        monster->health = saved->health;
+        monster->max_health = saved->max_health;
+        monster->damage = saved->damage;
+        monster->x = saved->x;
+        monster->y = saved->y;
+        monster->active = saved->active;
+        monster->aggressive = saved->aggressive;
+        monster->was_attacked = saved->was_attacked;
+        monster->immobilized = saved->immobilized;
+        monster->in_arena = saved->in_arena;
+    }
+}
+// PackBits-style run-length coding for save layers. Tiles are mostly runs
+// of blanks, walls and floor, and the bitsets long runs of 0x00 or 0xFF.
+// A control byte c < 128 is followed by c + 1 literal bytes; c >= 128
+// repeats the byte after it c - 125 times (3 to 130).
+size_t rle_bound(size_t size) {
+    return size + size / 128 + 1;
+}
+size_t rle_encode(const unsigned char *src, size_t size, unsigned char *dest) {
+    unsigned char *out = dest;
+    size_t i = 0;
+    while (i < size) {
+        size_t run = 1;
+        while (i + run < size && run < 130 && src[i + run] == src[i]) run++;
+        if (run >= 3) {
+            *out++ = run + 125;
+            *out++ = src[i];
+            i += run;
+            continue;
+        }
+        size_t start = i;
+        while (i < size && i - start < 128 &&
+               !(i + 2 < size && src[i] == src[i + 1] && src[i] == src[i + 2])) {
+            i++;
+        }
+        *out++ = i - start - 1;
+        memcpy(out, src + start, i - start);
+        out += i - start;
+    }
+    return out - dest;
+}
+// Expands exactly `dest_size` bytes into `dest`, or only checks that the
+// encoding would when `dest` is NULL.
+bool rle_decode(const unsigned char *src, size_t size, unsigned char *dest, size_t dest_size) {
+    size_t in = 0, out = 0;
+    while (in < size) {
+        unsigned int c = src[in++];
+        if (c < 128) {
+            size_t count = c + 1;
+            if (count > size - in || count > dest_size - out) return false;
+            if (dest) memcpy(dest + out, src + in, count);
+            in += count;
+            out += count;
+        } else {
+            size_t count = c - 125;
+            if (in == size || count > dest_size - out) return false;
+            if (dest) memset(dest + out, src[in], count);
+            in++;
+            out += count;
+        }
+    }
+    return out == dest_size;
+}
+// Upper bound on what write_save_level() emits for `mask`.
+size_t save_level_bound(uint32_t mask) {
+    size_t bytes = sizeof(SaveLevel);
+    for (int i = 0; i < SAVE_LAYERS; i++) {
+        if (mask & (1u << i)) bytes += sizeof(uint32_t) + rle_bound(save_layer_size(i));
+    }
+    return bytes;
+}
+// Writes the record (if SAVE_RECORD_BIT is set) and the masked layers of
+// `level` at `out`. Returns the end of what was written.
+char *write_save_level(char *out, Level *level, uint32_t mask) {
+    if (mask & SAVE_RECORD_BIT) {
+        SaveLevel rec;
+        fill_save_level(level, &rec);
+        memcpy(out, &rec, sizeof(rec));
+        out += sizeof(rec);
+    }
+    SaveLayer layers[SAVE_LAYERS];
+    level_save_layers(level, layers);
+    for (int i = 0; i < SAVE_LAYERS; i++) {
+        if (!(mask & (1u << i))) continue;
+        uint32_t bytes = rle_encode(layers[i].data, layers[i].size, (unsigned char*)out + sizeof(bytes));
+        memcpy(out, &bytes, sizeof(bytes));
+        out += sizeof(bytes) + bytes;
+    }
+    return out;
+}
+// Rejects records whose counts or room rectangles would take later
+// passes over the grid out of bounds.
+bool save_level_valid(const SaveLevel *rec) {
+    if (rec->num_rooms < 0 || rec->num_rooms > MAXROOMS ||
+        rec->num_secret_rooms < 0 || rec->num_secret_rooms > MAXROOMS) {
+        return false;
+    }
+    for (int r = 0; r < 2 * MAXROOMS; r++) {
+        const Room *room = r < MAXROOMS ? &rec->rooms[r] : &rec->secret_rooms[r - MAXROOMS];
+        if (room->pos.x < -1 || room->pos.y < -1 || room->max.x < 0 || room->max.y < 0 ||
+            room->pos.x + room->max.x > NUMCOLS + 1 || room->pos.y + room->max.y > NUMLINES + 1) {
+            return false;
+        }
+    }
+    return true;
+}
+// Reads what write_save_level() wrote for `mask` into `level`, or only
+// checks it when `level` is NULL. Advances *cursor past it.
+bool read_save_level(const char **cursor, const char *end, Level *level, uint32_t mask) {
+    const char *in = *cursor;
+    if (mask & SAVE_RECORD_BIT) {
+        if ((size_t)(end - in) < sizeof(SaveLevel)) return false;
+        SaveLevel rec;
+        memcpy(&rec, in, sizeof(rec));
+        if (!save_level_valid(&rec)) return false;
+        if (level) apply_save_level(level, &rec);
+        in += sizeof(SaveLevel);
+    }
+    SaveLayer layers[SAVE_LAYERS];
+    if (level) level_save_layers(level, layers);
+    for (int i = 0; i < SAVE_LAYERS; i++) {
+        if (!(mask & (1u << i))) continue;
+        uint32_t bytes;
+        if ((size_t)(end - in) < sizeof(bytes)) return false;
+        memcpy(&bytes, in, sizeof(bytes));
+        in += sizeof(bytes);
+        if (bytes > (size_t)(end - in) ||
+            !rle_decode((const unsigned char*)in, bytes, level ? layers[i].data : NULL, save_layer_size(i))) {
+            return false;
+        }
+        in += bytes;
+    }
+    *cursor = in;
+    return true;
+}
+bool save_game_bin(Map *map, const char *filename) {
+    // The caller may have cleared save_dirty for this save, so a failure
+    // must not leave a checkpoint for the next delta to trust.
+    save_checkpoint.valid = false;
+    char tmp_name[256];
+    snprintf(tmp_name, sizeof(tmp_name), "%s.tmp", filename);
+    SaveHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, SAVE_MAGIC, 4);
+    header.version = SAVE_VERSION;
+    header.header_size = sizeof(SaveHeader);
+    header.player_size = sizeof(SavePlayer);
+    header.level_size = sizeof(SaveLevel);
+    header.layer_bytes = level_layer_bytes();
+    header.cols = NUMCOLS;
+    header.lines = NUMLINES;
+    header.num_levels = saved_level_count(map);
+    char *buffer = malloc(sizeof(header) + sizeof(SavePlayer) + header.num_levels * save_level_bound(SAVE_FULL_MASK));
+    if (buffer == NULL) return false;
+    memcpy(buffer, &header, sizeof(header));
+    SavePlayer player;
+    fill_save_player(map, &player);
+    memcpy(buffer + sizeof(header), &player, sizeof(player));
+    char *cursor = buffer + sizeof(header) + sizeof(player);
+    uint64_t hashes[MAX_LEVELS][SAVE_LAYERS + 1];
+    for (int l = 0; l < header.num_levels; l++) {
+        level_save_hashes(&map->levels[l], hashes[l]);
+        cursor = write_save_level(cursor, &map->levels[l], SAVE_FULL_MASK);
+    }
+    long image_bytes = cursor - buffer;
+    FILE *file = fopen(tmp_name, "wb");
+    bool ok = file != NULL && fwrite(buffer, image_bytes, 1, file) == 1;
+    if (file != NULL && fclose(file) != 0) ok = false;
+    free(buffer);
+    if (!ok || rename(tmp_name, filename) != 0) {
+        remove(tmp_name);
+        return false;
+    }
+    save_checkpoint.valid = true;
+    save_checkpoint.num_levels = header.num_levels;
+    save_checkpoint.image_bytes = image_bytes;
+    save_checkpoint.segment_bytes = 0;
+    memcpy(save_checkpoint.hashes, hashes, header.num_levels * sizeof(hashes[0]));
+    return true;
+}
+// Appends a segment with the player and whatever level records and layers
+// changed since the last checkpoint, so a save costs the same however many
+// levels lie below. Only the current level and levels flagged save_dirty are
+// hashed; the rest cannot have changed. Writes a full image instead when
+// there is no valid checkpoint or the segments have outgrown the image.
+bool save_game_delta(Map *map, const char *filename) {
+    int num_levels = saved_level_count(map);
+    struct stat st;
+    if (!save_checkpoint.valid || num_levels < save_checkpoint.num_levels ||
+        save_checkpoint.segment_bytes > save_checkpoint.image_bytes ||
+        stat(filename, &st) != 0 ||
+        st.st_size != save_checkpoint.image_bytes + save_checkpoint.segment_bytes) {
+        return save_game_bin(map, filename);
+    }
+    uint64_t hashes[MAX_LEVELS][SAVE_LAYERS + 1];
+    uint32_t masks[MAX_LEVELS];
+    SaveSegment segment;
+    memset(&segment, 0, sizeof(segment));
+    memcpy(segment.magic, SAVE_SEGMENT_MAGIC, 4);
+    segment.num_levels = num_levels;
+    size_t payload = sizeof(SavePlayer);
+    for (int l = 0; l < num_levels; l++) {
+        masks[l] = 0;
+        if (l < save_checkpoint.num_levels && l != map->current_level - 1 && !map->levels[l].save_dirty) {
+            memcpy(hashes[l], save_checkpoint.hashes[l], sizeof(hashes[l]));
+            continue;
+        }
+        level_save_hashes(&map->levels[l], hashes[l]);
+        for (int i = 0; i <= SAVE_LAYERS; i++) {
+            if (l >= save_checkpoint.num_levels || hashes[l][i] != save_checkpoint.hashes[l][i]) {
+                masks[l] |= 1u << i;
+            }
+        }
+        if (masks[l] == 0) continue;
+        segment.entries++;
+        payload += sizeof(SaveEntry) + save_level_bound(masks[l]);
+    }
+    char *buffer = malloc(sizeof(SaveSegment) + payload);
+    if (buffer == NULL) return false;
+    char *cursor = buffer + sizeof(SaveSegment);
+    SavePlayer player;
+    fill_save_player(map, &player);
+    memcpy(cursor, &player, sizeof(player));
+    cursor += sizeof(player);
+    for (int l = 0; l < num_levels; l++) {
+        if (masks[l] == 0) continue;
+        SaveEntry entry = {l, masks[l]};
+        memcpy(cursor, &entry, sizeof(entry));
+        cursor = write_save_level(cursor + sizeof(entry), &map->levels[l], masks[l]);
+    }
+    payload = cursor - buffer - sizeof(SaveSegment);
+    segment.payload_bytes = payload;
+    segment.checksum = save_hash(buffer + sizeof(SaveSegment), payload);
+    memcpy(buffer, &segment, sizeof(segment));
+    FILE *file = fopen(filename, "ab");
+    bool ok = file != NULL && fwrite(buffer, sizeof(SaveSegment) + payload, 1, file) == 1;
+    if (file != NULL && fclose(file) != 0) ok = false;
+    free(buffer);
+    if (!ok) {
+        // The file may now end in a torn segment; the loader drops it and the
+        // next save rewrites the image.
+        save_checkpoint.valid = false;
+        return false;
+    }
+    save_checkpoint.num_levels = num_levels;
+    save_checkpoint.segment_bytes += sizeof(SaveSegment) + payload;
+    memcpy(save_checkpoint.hashes, hashes, num_levels * sizeof(hashes[0]));
+    return true;
+}
+// Checks a segment's entries against its payload, then applies them when
+// `apply` is set. Levels at or past `*loaded` must arrive whole.
+bool replay_save_segment(Map *map, const SaveSegment *segment, int *loaded, bool apply) {
+    const char *cursor = (const char*)(segment + 1);
+    const char *end = cursor + segment->payload_bytes;
+    if (apply) {
+        SavePlayer player;
+        memcpy(&player, cursor, sizeof(player));
+        apply_save_player(map, &player);
+    }
+    cursor += sizeof(SavePlayer);
+    for (uint32_t e = 0; e < segment->entries; e++) {
+        if ((size_t)(end - cursor) < sizeof(SaveEntry)) return false;
+        SaveEntry entry;
+        memcpy(&entry, cursor, sizeof(entry));
+        cursor += sizeof(entry);
+        if (entry.level < 0 || entry.level >= segment->num_levels || (entry.mask & ~SAVE_FULL_MASK) ||
+            (entry.level >= *loaded && entry.mask != SAVE_FULL_MASK)) {
+            return false;
+        }
+        Level *level = apply ? &map->levels[entry.level] : NULL;
+        if (level && entry.level >= *loaded) clear_level_cells(level);
+        if (!read_save_level(&cursor, end, level, entry.mask)) return false;
+        if (level) level->visibility_stale = true;
+    }
+    if (cursor != end) return false;
+    if (apply && segment->num_levels > *loaded) *loaded = segment->num_levels;
+    return true;
+}
+Map* load_game_bin(const char *filename) {
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0) return NULL;
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(SaveHeader)) {
+        close(fd);
+        return NULL;
+    }
+    size_t size = st.st_size;
+    const char *data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) return NULL;
+    Map *map = load_game_data(data, size);
+    munmap((void*)data, size);
+    return map;
+}
+// Loads a save image already in memory, laid out as savegame.bin.
+Map* load_game_data(const char *data, size_t size) {
+    if (size < sizeof(SaveHeader)) return NULL;
+    SaveHeader header;
+    memcpy(&header, data, sizeof(header));
+    if (memcmp(header.magic, SAVE_MAGIC, 4) != 0 || header.version != SAVE_VERSION ||
+        header.header_size != sizeof(SaveHeader) || header.player_size != sizeof(SavePlayer) ||
+        header.level_size != sizeof(SaveLevel) || header.layer_bytes != level_layer_bytes() ||
+        header.cols != NUMCOLS || header.lines != NUMLINES ||
+        header.num_levels < 1 || header.num_levels > MAX_LEVELS ||
+        size < sizeof(SaveHeader) + sizeof(SavePlayer)) {
+        return NULL;
+    }
+    Map *map = create_map();
+    if (map == NULL) {
+        return NULL;
+    }
+    const char *cursor = data + sizeof(SaveHeader);
+    const char *end = data + size;
+    SavePlayer player;
+    memcpy(&player, cursor, sizeof(player));
+    apply_save_player(map, &player);
+    cursor += sizeof(SavePlayer);
+    for (int l = 0; l < header.num_levels; l++) {
+        clear_level_cells(&map->levels[l]);
+        if (!read_save_level(&cursor, end, &map->levels[l], SAVE_FULL_MASK)) {
+            free_map(map);
+            return NULL;
+        }
+    }
+    int num_levels = header.num_levels;
+    long image_bytes = cursor - data;
+    // Replay the delta segments in order. A torn or corrupt segment ends the
+    // replay; the next save notices the size mismatch and rewrites the image.
+    while ((size_t)(end - cursor) >= sizeof(SaveSegment)) {
+        const SaveSegment *segment = (const SaveSegment*)cursor;
+        if (memcmp(segment->magic, SAVE_SEGMENT_MAGIC, 4) != 0 ||
+            segment->num_levels < num_levels || segment->num_levels > MAX_LEVELS ||
+            segment->payload_bytes < sizeof(SavePlayer) ||
+            segment->payload_bytes > (size_t)(end - cursor) - sizeof(SaveSegment) ||
+            save_hash(segment + 1, segment->payload_bytes) != segment->checksum ||
+            !replay_save_segment(map, segment, &num_levels, false)) {
+            break;
+        }
+        replay_save_segment(map, segment, &num_levels, true);
+        cursor += sizeof(SaveSegment) + segment->payload_bytes;
+    }
+    long segment_bytes = cursor - data - image_bytes;
+    for (int l = 0; l < num_levels; l++) {
+        Level *level = &map->levels[l];
+        for (int r = 0; r < level->num_rooms; r++) {
+            index_room(level, r);
+        }
+        index_monsters(level);
+    }
+    if (map->current_level < 1 || map->current_level > num_levels) {
+        free_map(map);
+        return NULL;
+    }
+    save_checkpoint.valid = true;
+    save_checkpoint.num_levels = num_levels;
+    save_checkpoint.image_bytes = image_bytes;
+    save_checkpoint.segment_bytes = segment_bytes;
+    for (int l = 0; l < num_levels; l++) {
+        level_save_hashes(&map->levels[l], save_checkpoint.hashes[l]);
+    }
+    return map;
+}
+
+// Saves run on a worker thread against a deep copy of the map, so the
+// game keeps accepting input while the file and database are written.
+typedef struct {
+    pthread_t thread;
+    bool running;
+    bool joinable;
+    atomic_bool done;
+    bool ok;
+    bool user_data;
+    Map *snapshot;
+    pthread_mutex_t lock;
+    pthread_cond_t finished;  // signalled with `done`, for the journal writer
+} SaveJob;
+static SaveJob save_job = {.lock = PTHREAD_MUTEX_INITIALIZER, .finished = PTHREAD_COND_INITIALIZER};
+
+Room *rebase_room(Level *dest, Level *src, Room *room) {
+    return load_room_index(dest, save_room_index(src, room));
+}
+Map *snapshot_map(Map *map) {
+    Map *copy = malloc(sizeof(Map));
+    if (copy == NULL) return NULL;
+    *copy = *map;
+    copy->pregen = NULL;
+    copy->visibility_level = NULL;
+    copy->levels = calloc(MAX_LEVELS, sizeof(Level));
+    if (copy->levels == NULL) {
+        free(copy);
+        return NULL;
+    }
+    int count = saved_level_count(map);
+    for (int l = 0; l < MAX_LEVELS; l++) {
+        Level *src = &map->levels[l];
+        Level *dest = &copy->levels[l];
+        *dest = *src;
+        dest->cells = NULL;
+        if (l >= count) continue;
+        dest->cells = malloc(level_cells_bytes());
+        if (dest->cells == NULL) {
+            free_map(copy);
+            return NULL;
+        }
+        memcpy(dest->cells, src->cells, level_cells_bytes());
+        carve_level_cells(dest);
+        dest->stair_room = rebase_room(dest, src, src->stair_room);
+        dest->current_secret_room = rebase_room(dest, src, src->current_secret_room);
+        dest->secret_stair_room = rebase_room(dest, src, src->secret_stair_room);
+    }
+    return copy;
+}
+void *save_worker(void *arg) {
+    SaveJob *job = arg;
+    Map *snapshot = job->snapshot;
+    job->ok = save_game_delta(snapshot, "savegame.bin");
+    if (job->user_data) {
+        save_user_data(snapshot);
+    }
+    if (job->ok || job->user_data) {
+        save_to_database(snapshot);
+    }
+    pthread_mutex_lock(&job->lock);
+    atomic_store(&job->done, true);
+    pthread_cond_broadcast(&job->finished);
+    pthread_mutex_unlock(&job->lock);
+    return NULL;
+}
+// Snapshots the map and starts writing it. With `user_data` the score file
+// is updated too and the database is written even if the save file fails.
+bool start_save(Map *map, bool user_data) {
+    wait_for_save();
+    bool journaling = journal_stop();
+    save_job.snapshot = snapshot_map(map);
+    if (save_job.snapshot == NULL) {
+        if (journaling) journal_start(map, false, false);
+        return false;
+    }
+    for (int l = 0; l < MAX_LEVELS; l++) {
+        map->levels[l].save_dirty = false;
+    }
+    map->journal_id = save_job.snapshot->journal_id = new_journal_id();
+    save_job.user_data = user_data;
+    save_job.ok = false;
+    atomic_store(&save_job.done, false);
+    save_job.running = true;
+    save_job.joinable = pthread_create(&save_job.thread, NULL, save_worker, &save_job) == 0;
+    if (!save_job.joinable) {
+        save_worker(&save_job);
+    }
+    journal_start(map, true, true);
+    return true;
+}
+bool save_pending() {
+    return save_job.running;
+}
+// Blocks until the pending save is written. Returns whether it succeeded.
+bool wait_for_save() {
+    if (!save_job.running) return save_job.ok;
+    if (save_job.joinable) {
+        pthread_join(save_job.thread, NULL);
+    }
+    save_job.running = false;
+    free_map(save_job.snapshot);
+    save_job.snapshot = NULL;
+    return save_job.ok;
+}
+// Reports a finished background save. Returns true once per completed save.
+bool poll_save(Map *map) {
+    if (!save_job.running || !atomic_load(&save_job.done)) return false;
+    set_message(map, wait_for_save() ? "Game saved successfully!" : "Failed to save game!");
+    return true;
+}
+
+// Input journal. Every key the game reads and every clock reading that
+// affects play is appended to savegame.journal, so a crash only loses what
+// the last save had not seen yet: loading that save replays the journal on
+// top of it. Each save starts a new journal whose header carries the save's
+// journal_id and the RNG and input state the save itself does not keep.
+// Entries are buffered and written by a background thread.
+#define JOURNAL_FILE "savegame.journal"
+#define JOURNAL_MAGIC "RGJL"
+#define JOURNAL_VERSION 1
+#define JOURNAL_BUFFER 1024
+enum { JOURNAL_KEY, JOURNAL_CLOCK };
+typedef struct {
+    char magic[4];
+    uint32_t version;
+    int32_t cols, lines;
+    uint64_t id;
+    Rng map_rng;
+    Rng level_rng[MAX_LEVELS];
+    int32_t last_arrow;
+    bool fast_travel_mode;
+    bool debug_mode;
+    int64_t last_arrow_time;
+} JournalHeader;
+typedef struct {
+    int32_t type;
+    int32_t pad;
+    int64_t value;
+} JournalEntry;
+typedef struct {
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    bool active;
+    bool stop;
+    bool fresh;
+    bool after_save;
+    JournalHeader header;
+    JournalEntry pending[JOURNAL_BUFFER];
+    int count;
+    JournalEntry *replay;
+    size_t replay_count, replay_pos;
+} Journal;
+static Journal journal = {.lock = PTHREAD_MUTEX_INITIALIZER, .wake = PTHREAD_COND_INITIALIZER};
+
+uint64_t new_journal_id() {
+    static uint64_t state;
+    if (state == 0) state = (uint64_t)time(NULL) ^ ((uint64_t)getpid() << 32);
+    uint64_t id;
+    do {
+        id = splitmix64(&state);
+    } while (id == 0);
+    return id;
+}
+void fill_journal_header(Map *map, JournalHeader *h) {
+    memset(h, 0, sizeof(*h));
+    memcpy(h->magic, JOURNAL_MAGIC, 4);
+    h->version = JOURNAL_VERSION;
+    h->cols = NUMCOLS;
+    h->lines = NUMLINES;
+    h->id = map->journal_id;
+    h->map_rng = map->rng;
+    for (int l = 0; l < MAX_LEVELS; l++) {
+        h->level_rng[l] = map->levels[l].rng;
+    }
+    h->last_arrow = last_arrow;
+    h->fast_travel_mode = fast_travel_mode;
+    h->debug_mode = map->debug_mode;
+    h->last_arrow_time = last_arrow_time;
+}
+void apply_journal_header(Map *map, const JournalHeader *h) {
+    map->rng = h->map_rng;
+    for (int l = 0; l < MAX_LEVELS; l++) {
+        map->levels[l].rng = h->level_rng[l];
+    }
+    last_arrow = h->last_arrow;
+    fast_travel_mode = h->fast_travel_mode;
+    map->debug_mode = h->debug_mode;
+    last_arrow_time = (clock_t)h->last_arrow_time;
+}
+bool write_all(int fd, const void *data, size_t size) {
+    const char *p = data;
+    while (size > 0) {
+        ssize_t n = write(fd, p, size);
+        if (n <= 0) return false;
+        p += n;
+        size -= n;
+    }
+    return true;
+}
+void *journal_worker(void *arg) {
+    Journal *j = arg;
+    bool fresh = j->fresh;
+    if (j->after_save) {
+        // A new journal only replaces the old one once its save is on disk.
+        pthread_mutex_lock(&save_job.lock);
+        while (!atomic_load(&save_job.done)) {
+            pthread_cond_wait(&save_job.finished, &save_job.lock);
+        }
+        pthread_mutex_unlock(&save_job.lock);
+        if (!save_job.ok) fresh = false;
+    }
+    int fd = open(JOURNAL_FILE, O_WRONLY | O_CREAT | (fresh ? O_TRUNC : O_APPEND), 0644);
+    if (fd >= 0 && fresh && !write_all(fd, &j->header, sizeof(JournalHeader))) {
+        close(fd);
+        fd = -1;
+    }
+    JournalEntry batch[JOURNAL_BUFFER];
+    pthread_mutex_lock(&j->lock);
+    while (true) {
+        while (j->count == 0 && !j->stop) {
+            pthread_cond_wait(&j->wake, &j->lock);
+        }
+        int count = j->count;
+        bool stop = j->stop;
+        memcpy(batch, j->pending, count * sizeof(JournalEntry));
+        j->count = 0;
+        pthread_cond_broadcast(&j->wake);
+        pthread_mutex_unlock(&j->lock);
+        if (fd >= 0 && count > 0) {
+            if (write_all(fd, batch, count * sizeof(JournalEntry))) {
+                fdatasync(fd);
+            }
+        }
+        pthread_mutex_lock(&j->lock);
+        if (stop && j->count == 0) break;
+    }
+    pthread_mutex_unlock(&j->lock);
+    if (fd >= 0) close(fd);
+    return NULL;
+}
+// Flushes and stops the writer, leaving the file in place. Returns whether
+// a journal was being recorded.
+bool journal_stop() {
+    if (!journal.active) return false;
+    pthread_mutex_lock(&journal.lock);
+    journal.stop = true;
+    pthread_cond_broadcast(&journal.wake);
+    pthread_mutex_unlock(&journal.lock);
+    pthread_join(journal.thread, NULL);
+    journal.active = false;
+    journal.stop = false;
+    return true;
+}
+// Starts recording. With `fresh` a new journal is started from the current
+// state of `map`, once the save started just before it (`after_save`) has
+// succeeded; otherwise entries are appended to the old one.
+void journal_start(Map *map, bool fresh, bool after_save) {
+    journal_stop();
+    if (fresh) fill_journal_header(map, &journal.header);
+    journal.fresh = fresh;
+    journal.after_save = after_save;
+    journal.count = 0;
+    journal.active = pthread_create(&journal.thread, NULL, journal_worker, &journal) == 0;
+}
+// Stops recording and discards the journal, for when the game it belongs
+// to is over or has been replaced.
+void journal_end() {
+    journal_stop();
+    remove(JOURNAL_FILE);
+}
+bool journal_replaying() {
+    return journal.replay != NULL && journal.replay_pos < journal.replay_count;
+}
+void journal_record(int type, int64_t value) {
+    if (!journal.active || journal_replaying()) return;
+    pthread_mutex_lock(&journal.lock);
+    while (journal.count == JOURNAL_BUFFER) {
+        pthread_cond_wait(&journal.wake, &journal.lock);
+    }
+    journal.pending[journal.count++] = (JournalEntry){type, 0, value};
+    pthread_cond_broadcast(&journal.wake);
+    pthread_mutex_unlock(&journal.lock);
+}
+// Reads a key for the game. While a journal is being replayed the key
+// comes from the journal instead; once it runs out, input is live again.
+int game_getch() {
+    if (journal_replaying()) {
+        JournalEntry *entry = &journal.replay[journal.replay_pos];
+        if (entry->type == JOURNAL_KEY) {
+            journal.replay_pos++;
+            return (int)entry->value;
+        }
+        journal.replay_pos = journal.replay_count;
+    }
+    int ch = getch();
+    if (ch != ERR) journal_record(JOURNAL_KEY, ch);
+    return ch;
+}
+clock_t game_clock() {
+    if (journal_replaying()) {
+        JournalEntry *entry = &journal.replay[journal.replay_pos];
+        if (entry->type == JOURNAL_CLOCK) {
+            journal.replay_pos++;
+            return (clock_t)entry->value;
+        }
+        journal.replay_pos = journal.replay_count;
+    }
+    clock_t now = clock();
+    journal_record(JOURNAL_CLOCK, now);
+    return now;
+}
+// Replays the journal on top of `*map_ptr`, which has just been loaded from
+// savegame.bin, and keeps appending to it. Returns the number of keys
+// replayed, -1 if the journal does not continue this save, or -2 if it
+// could not be read; it is then left as it is and nothing is recorded, so
+// a later load can still recover it.
+int replay_journal(Map **map_ptr) {
+    Map *map = *map_ptr;
+    FILE *file = fopen(JOURNAL_FILE, "rb");
+    if (file == NULL) return -1;
+    JournalHeader header;
+    struct stat st;
+    if (map->journal_id == 0 || fstat(fileno(file), &st) != 0 ||
+        fread(&header, sizeof(header), 1, file) != 1 ||
+        memcmp(header.magic, JOURNAL_MAGIC, 4) != 0 || header.version != JOURNAL_VERSION ||
+        header.id != map->journal_id || header.cols != NUMCOLS || header.lines != NUMLINES) {
+        fclose(file);
+        return -1;
+    }
+    size_t count = ((size_t)st.st_size - sizeof(header)) / sizeof(JournalEntry);
+    JournalEntry *entries = NULL;
+    if (count > 0) {
+        entries = malloc(count * sizeof(JournalEntry));
+        if (entries == NULL) {
+            fclose(file);
+            return -2;
+        }
+        count = fread(entries, sizeof(JournalEntry), count, file);
+    }
+    fclose(file);
+    apply_journal_header(map, &header);
+    journal.replay = entries;
+    journal.replay_count = count;
+    journal.replay_pos = 0;
+    // Drop a torn last entry so new ones stay aligned. If that fails the
+    // journal is only replayed, not appended to.
+    if (truncate(JOURNAL_FILE, sizeof(header) + count * sizeof(JournalEntry)) == 0) {
+        journal_start(map, false, false);
+    }
+    int keys = 0;
+    while (journal_replaying() && (*map_ptr)->health > 0 && game_result == GAME_RUNNING) {
+        JournalEntry *entry = &journal.replay[journal.replay_pos];
+        if (entry->type != JOURNAL_KEY) {
+            // Out of step with the game; keep what replayed cleanly.
+            journal_stop();
+            if (truncate(JOURNAL_FILE, sizeof(header) + journal.replay_pos * sizeof(JournalEntry)) == 0) {
+                journal_start(*map_ptr, false, false);
+            }
+            break;
+        }
+        journal.replay_pos++;
+        update_visibility(*map_ptr);
+        game_step(map_ptr, (int)entry->value);
+        keys++;
+    }
+    journal.replay = NULL;
+    journal.replay_count = journal.replay_pos = 0;
+    free(entries);
+    return keys;
+}
+
 bool place_fighting_trap(Level *level, Room *room) {
     for (int y = 0; y < NUMLINES; y++) {
         for (int x = 0; x < NUMCOLS; x++) {
-            if (level->tiles[y][x] == 'v') {
+            if (level->tiles[IDX(y, x)] == 'v') {
                 return false;
             }
         }
     }
-    if (rand() % 100 < 15) {
+    if (rng_rand(&level->rng) % 100 < 15) {
         int attempts = 0;
         const int MAX_ATTEMPTS = 50;
         
         while (attempts < MAX_ATTEMPTS) {
-            int trap_x = room->pos.x + 1 + (rand() % (room->max.x - 2));
-            int trap_y = room->pos.y + 1 + (rand() % (room->max.y - 2));
-            if (level->tiles[trap_y][trap_x] == '.' && 
-                !level->traps[trap_y][trap_x] && 
-                level->tiles[trap_y][trap_x] != '>' && 
-                level->tiles[trap_y][trap_x] != '<' &&
-                level->tiles[trap_y][trap_x] != '*' &&
-                level->tiles[trap_y][trap_x] != '$' &&
-                level->tiles[trap_y][trap_x] != '&') {
+            int trap_x = room->pos.x + 1 + (rng_rand(&level->rng) % (room->max.x - 2));
+            int trap_y = room->pos.y + 1 + (rng_rand(&level->rng) % (room->max.y - 2));
+            if (level->tiles[IDX(trap_y, trap_x)] == '.' && 
+                !bit_test(level->traps, trap_y, trap_x) && 
+                level->tiles[IDX(trap_y, trap_x)] != '>' && 
+                level->tiles[IDX(trap_y, trap_x)] != '<' &&
+                level->tiles[IDX(trap_y, trap_x)] != '*' &&
+                level->tiles[IDX(trap_y, trap_x)] != '$' &&
+                level->tiles[IDX(trap_y, trap_x)] != '&') {
                 level->fighting_trap.x = trap_x;
                 level->fighting_trap.y = trap_y;
-                level->tiles[trap_y][trap_x] = '.';
+                set_tile(level, trap_y, trap_x, '.');
                 level->fighting_trap_triggered = false;
                 return true;
             }
+            GEN_STAT(placement_retries);
             attempts++;
         }
     }
     return false;
 }
-void create_fighting_room(Level *level) {
-    for (int y = 0; y < NUMLINES; y++) {
-        for (int x = 0; x < NUMCOLS; x++) {
-            level->backup_tiles[y][x] = level->tiles[y][x];
-            level->backup_visible_tiles[y][x] = level->visible_tiles[y][x];
-            level->backup_explored[y][x] = level->explored[y][x];
+void clear_level_cells(Level *level) {
+    memset(level->explored, 0, BITSET_WORDS * sizeof(uint64_t));
+    memset(level->traps, 0, BITSET_WORDS * sizeof(uint64_t));
+    memset(level->discovered_traps, 0, BITSET_WORDS * sizeof(uint64_t));
+    memset(level->secret_walls, 0, BITSET_WORDS * sizeof(uint64_t));
+    memset(level->secret_stairs, 0, BITSET_WORDS * sizeof(uint64_t));
+    memset(level->coins, 0, BITSET_WORDS * sizeof(uint64_t));
+    memset(level->coin_values, 0, LAYER_CELLS * sizeof(int));
+    memset(level->tiles, ' ', LAYER_CELLS * sizeof(char));
+    memset(level->visible_tiles, ' ', LAYER_CELLS * sizeof(char));
+    memset(level->room_ids, 0, LAYER_CELLS * sizeof(unsigned char));
+    memset(level->monster_ids, 0, LAYER_CELLS * sizeof(unsigned char));
+    memset(level->dirty_bits, 0, BITSET_WORDS * sizeof(uint64_t));
+    level->dirty_count = 0;
+    level->dirty_visible = 0;
+    level->visibility_stale = true;
+    level->save_dirty = true;
+}
+void index_room(Level *level, int index) {
+    Room *room = &level->rooms[index];
+    room->discovered = false;
+    for (int y = room->pos.y; y < room->pos.y + room->max.y; y++) {
+        for (int x = room->pos.x; x < room->pos.x + room->max.x; x++) {
+            if (y >= 0 && y < NUMLINES && x >= 0 && x < NUMCOLS) {
+                level->room_ids[IDX(y, x)] = index + 1;
+                if (bit_test(level->explored, y, x)) room->discovered = true;
+            }
         }
     }
-    for (int y = 0; y < NUMLINES; y++) {
-        for (int x = 0; x < NUMCOLS; x++) {
-            level->tiles[y][x] = ' ';
-            level->visible_tiles[y][x] = ' ';
-            level->explored[y][x] = false;
+}
+Room *room_at(Level *level, int x, int y) {
+    if (x < 0 || x >= NUMCOLS || y < 0 || y >= NUMLINES) return NULL;
+    int id = level->room_ids[IDX(y, x)];
+    return id ? &level->rooms[id - 1] : NULL;
+}
+void explore_cell(Level *level, int y, int x) {
+    if (bit_test(level->explored, y, x)) return;
+    bit_set(level->explored, y, x);
+    mark_dirty(level, y, x);
+    int id = level->room_ids[IDX(y, x)];
+    if (id) level->rooms[id - 1].discovered = true;
+}
+// Cells whose tile, explored bit or occupant changed since the last frame.
+// update_visibility recomputes them and render_frame repaints them.
+void mark_dirty(Level *level, int y, int x) {
+    if (bit_test(level->dirty_bits, y, x)) return;
+    bit_set(level->dirty_bits, y, x);
+    level->dirty_cells[level->dirty_count++] = IDX(y, x);
+}
+void set_tile(Level *level, int y, int x, char tile) {
+    if (level->tiles[IDX(y, x)] == tile) return;
+    level->tiles[IDX(y, x)] = tile;
+    mark_dirty(level, y, x);
+}
+void clear_dirty(Level *level) {
+    for (int i = 0; i < level->dirty_count; i++) {
+        int cell = level->dirty_cells[i];
+        bit_clear(level->dirty_bits, cell / NUMCOLS, cell % NUMCOLS);
+    }
+    level->dirty_count = 0;
+    level->dirty_visible = 0;
+}
+Monster *monster_at(Level *level, int x, int y) {
+    if (x < 0 || x >= NUMCOLS || y < 0 || y >= NUMLINES) return NULL;
+    int id = level->monster_ids[IDX(y, x)];
+    return id ? &level->monsters[id - 1] : NULL;
+}
+void place_monster(Level *level, Monster *monster) {
+    if (monster->x < 0 || monster->x >= NUMCOLS || monster->y < 0 || monster->y >= NUMLINES) return;
+    level->monster_ids[IDX(monster->y, monster->x)] = (monster - level->monsters) + 1;
+    mark_dirty(level, monster->y, monster->x);
+}
+void remove_monster(Level *level, Monster *monster) {
+    if (monster_at(level, monster->x, monster->y) == monster) {
+        level->monster_ids[IDX(monster->y, monster->x)] = 0;
+        mark_dirty(level, monster->y, monster->x);
+    }
+}
+void move_monster(Level *level, Monster *monster, int x, int y) {
+    remove_monster(level, monster);
+    monster->x = x;
+    monster->y = y;
+    place_monster(level, monster);
+}
+void index_monsters(Level *level) {
+    memset(level->monster_ids, 0, LAYER_CELLS * sizeof(unsigned char));
+    for (int i = 0; i < MONSTER_COUNT; i++) {
+        if (level->monsters[i].active) {
+            place_monster(level, &level->monsters[i]);
         }
     }
+}
+void backup_level_layers(Level *level) {
+    memcpy(level->backup_tiles, level->tiles, LAYER_CELLS * sizeof(char));
+    memcpy(level->backup_visible_tiles, level->visible_tiles, LAYER_CELLS * sizeof(char));
+    memcpy(level->backup_explored, level->explored, BITSET_WORDS * sizeof(uint64_t));
+}
+void restore_level_layers(Level *level) {
+    memcpy(level->tiles, level->backup_tiles, LAYER_CELLS * sizeof(char));
+    memcpy(level->visible_tiles, level->backup_visible_tiles, LAYER_CELLS * sizeof(char));
+    memcpy(level->explored, level->backup_explored, BITSET_WORDS * sizeof(uint64_t));
+    level->visibility_stale = true;
+}
+void create_fighting_room(Level *level) {
+    backup_level_layers(level);
+    memset(level->tiles, ' ', LAYER_CELLS * sizeof(char));
+    memset(level->visible_tiles, ' ', LAYER_CELLS * sizeof(char));
+    memset(level->explored, 0, BITSET_WORDS * sizeof(uint64_t));
+    level->visibility_stale = true;
     int room_width = 15;
     int room_height = 10;
     int start_x = (NUMCOLS - room_width) / 2;
@@ -995,14 +2430,14 @@ void create_fighting_room(Level *level) {
     for (int y = start_y; y < start_y + room_height; y++) {
         for (int x = start_x; x < start_x + room_width; x++) {
             if (y == start_y || y == start_y + room_height - 1)
-                level->tiles[y][x] = '_';
+                set_tile(level, y, x, '_');
             else if (x == start_x || x == start_x + room_width - 1)
-                level->tiles[y][x] = '|';
+                set_tile(level, y, x, '|');
             else
-                level->tiles[y][x] = '.';
+                set_tile(level, y, x, '.');
             
-            level->visible_tiles[y][x] = level->tiles[y][x];
-            level->explored[y][x] = true;
+            level->visible_tiles[IDX(y, x)] = level->tiles[IDX(y, x)];
+            bit_set(level->explored, y, x);
         }
     }
     int entrance_x = start_x + (room_width / 2);
@@ -1013,7 +2448,10 @@ void create_fighting_room(Level *level) {
     }
     for (int i = 0; i < 3; i++) {
         Monster *snake = &level->monsters[i];
+        remove_monster(level, snake);
         snake->type = MONSTER_SNAKE;
+        snake->name = "Snake";
+        snake->symbol = 'S';
         snake->active = true;
         snake->aggressive = true;
         snake->was_attacked = true;
@@ -1024,9 +2462,9 @@ void create_fighting_room(Level *level) {
         const int MAX_TRIES = 50;
         bool position_found = false;
         while (!position_found && tries < MAX_TRIES) {
-            snake->x = start_x + 1 + (rand() % (room_width - 2));
-            snake->y = start_y + 3 + (rand() % (room_height - 4));
-            if (level->tiles[snake->y][snake->x] == '.' && 
+            snake->x = start_x + 1 + (rng_rand(&level->rng) % (room_width - 2));
+            snake->y = start_y + 3 + (rng_rand(&level->rng) % (room_height - 4));
+            if (level->tiles[IDX(snake->y, snake->x)] == '.' && 
                 (abs(snake->x - entrance_x) > 2 || abs(snake->y - entrance_y) > 2)) {
                 bool space_occupied = false;
                 for (int j = 0; j < i; j++) {
@@ -1038,8 +2476,6 @@ void create_fighting_room(Level *level) {
                 }
                 if (!space_occupied) {
                     position_found = true;
-                    level->tiles[snake->y][snake->x] = 'S';
-                    level->visible_tiles[snake->y][snake->x] = 'S';
                 }
             }
             tries++;
@@ -1047,11 +2483,9 @@ void create_fighting_room(Level *level) {
         if (!position_found) {
             for (int y = start_y + 1; y < start_y + room_height - 1; y++) {
                 for (int x = start_x + 1; x < start_x + room_width - 1; x++) {
-                    if (level->tiles[y][x] == '.') {
+                    if (level->tiles[IDX(y, x)] == '.' && !is_monster_at(level, x, y)) {
                         snake->x = x;
                         snake->y = y;
-                        level->tiles[y][x] = 'S';
-                        level->visible_tiles[y][x] = 'S';
                         position_found = true;
                         break;
                     }
@@ -1059,12 +2493,13 @@ void create_fighting_room(Level *level) {
                 if (position_found) break;
             }
         }
+        place_monster(level, snake);
     }
     for (int y = start_y + 1; y < start_y + room_height - 1; y++) {
         for (int x = start_x + 1; x < start_x + room_width - 1; x++) {
-            if (level->tiles[y][x] == '.' && rand() % 100 < 5) {
-                level->tiles[y][x] = 'O';
-                level->visible_tiles[y][x] = 'O';
+            if (level->tiles[IDX(y, x)] == '.' && rng_rand(&level->rng) % 100 < 5) {
+                set_tile(level, y, x, 'O');
+                level->visible_tiles[IDX(y, x)] = 'O';
             }
         }
     }
@@ -1077,8 +2512,6 @@ void update_arena_monsters(Map *map) {
         Monster *monster = &current->monsters[i];
         if (monster->in_arena && monster->active) {
             all_defeated = false;
-            int orig_x = monster->x;
-            int orig_y = monster->y;
             int dx = 0, dy = 0;
             if (monster->x < map->player_x) dx = 1;
             else if (monster->x > map->player_x) dx = -1;
@@ -1086,13 +2519,8 @@ void update_arena_monsters(Map *map) {
             else if (monster->y > map->player_y) dy = -1;
             int new_x = monster->x + dx;
             int new_y = monster->y + dy;
-            if (current->tiles[new_y][new_x] == '.') {
-                monster->x = new_x;
-                monster->y = new_y;
-                current->tiles[orig_y][orig_x] = '.';
-                current->tiles[monster->y][monster->x] = 'S';
-                current->visible_tiles[orig_y][orig_x] = '.';
-                current->visible_tiles[monster->y][monster->x] = 'S';
+            if (current->tiles[IDX(new_y, new_x)] == '.' && !is_monster_at(current, new_x, new_y)) {
+                move_monster(current, monster, new_x, new_y);
             }
             if (abs(monster->x - map->player_x) <= 1 && 
                 abs(monster->y - map->player_y) <= 1) {
@@ -1106,17 +2534,11 @@ void update_arena_monsters(Map *map) {
         }
     }
     if (all_defeated) {
-        for (int y = 0; y < NUMLINES; y++) {
-            for (int x = 0; x < NUMCOLS; x++) {
-                current->tiles[y][x] = current->backup_tiles[y][x];
-                current->visible_tiles[y][x] = current->backup_visible_tiles[y][x];
-                current->explored[y][x] = current->backup_explored[y][x];
-            }
-        }
+        restore_level_layers(current);
         map->player_x = current->return_pos.x;
         map->player_y = current->return_pos.y;
-        current->tiles[current->fighting_trap.y][current->fighting_trap.x] = 'v';
-        current->visible_tiles[current->fighting_trap.y][current->fighting_trap.x] = 'v';
+        set_tile(current, current->fighting_trap.y, current->fighting_trap.x, 'v');
+        current->visible_tiles[IDX(current->fighting_trap.y, current->fighting_trap.x)] = 'v';
         current->in_fighting_room = false;
         //play_background_music("1");
         map->exp += 50;
@@ -1125,23 +2547,8 @@ void update_arena_monsters(Map *map) {
     }
 }
 int get_difficulty_from_settings() {
-    FILE *file = fopen("game_settings.txt", "r");
-    if (file == NULL) {
-        return DIFFICULTY_MEDIUM;
-    }
-
-    char line[256];
-    int difficulty = DIFFICULTY_MEDIUM;
-
-    while (fgets(line, sizeof(line), file)) {
-        if (strncmp(line, "Difficulty: ", 11) == 0) {
-            difficulty = atoi(line + 11);
-            break;
-        }
-    }
-
-    fclose(file);
-    return difficulty;
+    const SessionBlock *s = session_get();
+    return s != NULL ? s->difficulty : settings_get()->difficulty;
 }
 void display_talisman_menu(WINDOW *win, Map *map) {
     int center_y = NUMLINES / 2;
@@ -1172,15 +2579,9 @@ void display_talisman_menu(WINDOW *win, Map *map) {
     wattron(menu_win, COLOR_PAIR(2));
     mvwprintw(menu_win, 1, 2, "Talisman Collection");
     mvwprintw(menu_win, 2, 2, "Press 1-3 to activate a talisman");
-    mvwprintw(menu_win, 3, 2, "They Only work for 10 blocks");
+    mvwprintw(menu_win, 3, 2, "They only work for %d turns", EFFECT_TURNS);
     for (int i = 0; i < TALISMAN_COUNT; i++) {
-        bool is_active = false;
-        for (int j = 0; j < 5; j++) {
-            if (map->talismans[i].active_durations[j] > 0) {
-                is_active = true;
-                break;
-            }
-        }
+        bool is_active = talisman_active(map, i);
         wattron(menu_win, map->talismans[i].color);
         mvwprintw(menu_win, 4 + i * 2, 2, "%d: %s %s [%s] (%d)", 
                   i + 1,
@@ -1208,31 +2609,19 @@ void display_talisman_menu(WINDOW *win, Map *map) {
         wattroff(menu_win, map->talismans[i].color);
     }
     wattron(menu_win, COLOR_PAIR(2));
-    mvwprintw(menu_win, box_height - 2, 2, "Effects last for 10 moves");
+    mvwprintw(menu_win, box_height - 2, 2, "Effects last for %d turns", EFFECT_TURNS);
     wattroff(menu_win, COLOR_PAIR(2));
     wrefresh(menu_win);
-    int ch = getch();
+    int ch = game_getch();
     if (ch >= '1' && ch <= '3') {
         int talisman_type = ch - '1';
         if (map->talismans[talisman_type].owned) {
-            bool already_active = false;
-            for (int i = 0; i < 5; i++) {
-                if (map->talismans[talisman_type].active_durations[i] > 0) {
-                    already_active = true;
-                    break;
-                }
-            }
-            if (!already_active) {
-                for (int i = 0; i < 5; i++) {
-                    if (map->talismans[talisman_type].active_durations[i] <= 0) {
-                        map->talismans[talisman_type].active_durations[i] = 10;
-                        char msg[MAX_MESSAGE_LENGTH];
-                        snprintf(msg, MAX_MESSAGE_LENGTH, "Activated %s!", 
-                                map->talismans[talisman_type].name);
-                        set_message(map, msg);
-                        break;
-                    }
-                }
+            if (!talisman_active(map, talisman_type)) {
+                start_effect(map, TIMER_TALISMAN + talisman_type);
+                char msg[MAX_MESSAGE_LENGTH];
+                snprintf(msg, MAX_MESSAGE_LENGTH, "Activated %s!", 
+                        map->talismans[talisman_type].name);
+                set_message(map, msg);
             } else {
                 set_message(map, "This talisman is already active!");
             }
@@ -1257,15 +2646,7 @@ void cast_magic_wand(Map *map, int dir_x, int dir_y) {
         return;
     }
     const char* spell_direction = "⚪";
-    int current_x = map->player_x;
-    int current_y = map->player_y;
-    char **backup_tiles = malloc(NUMLINES * sizeof(char*));
-    for (int i = 0; i < NUMLINES; i++) {
-        backup_tiles[i] = malloc(NUMCOLS * sizeof(char));
-        for (int j = 0; j < NUMCOLS; j++) {
-            backup_tiles[i][j] = current->visible_tiles[i][j];
-        }
-    }
+    effect_begin();
     for (int dist = 1; dist <= 5 && !spell_hit; dist++) {
         int new_x = map->player_x + (dir_x * dist);
         int new_y = map->player_y + (dir_y * dist);
@@ -1274,71 +2655,43 @@ void cast_magic_wand(Map *map, int dir_x, int dir_y) {
             break;
         }
 
-        if (current->tiles[new_y][new_x] == '|' || 
-            current->tiles[new_y][new_x] == '_' || 
-            current->tiles[new_y][new_x] == ' ') {
+        if (current->tiles[IDX(new_y, new_x)] == '|' || 
+            current->tiles[IDX(new_y, new_x)] == '_' || 
+            current->tiles[IDX(new_y, new_x)] == ' ') {
             break;
         }
 
-        if (current_x != map->player_x || current_y != map->player_y) {
-            current->visible_tiles[current_y][current_x] = backup_tiles[current_y][current_x];
-        }
-
         bool hit_monster = false;
-        for (int i = 0; i < MONSTER_COUNT; i++) {
-            Monster *monster = &current->monsters[i];
-            if (monster->active && monster->x == new_x && monster->y == new_y) {
-                attron(COLOR_PAIR(5));
-                mvprintw(new_y + 4, new_x + 1, "✸"); 
-                refresh();
-                napms(100);
-                attroff(COLOR_PAIR(5));
+        Monster *monster = monster_at(current, new_x, new_y);
+        if (monster != NULL) {
+            effect_queue(new_x, new_y, "✸", 5, 100);
 
-                int damage = 15;
-                monster->health -= damage;
-                monster->was_attacked = true;
-                monster->aggressive = true;
-                monster->immobilized = true;
-                
-                if (monster->health <= 0) {
-                    monster->active = false;
-                    current->tiles[monster->y][monster->x] = '.'; 
-                    current->visible_tiles[monster->y][monster->x] = '.';  
-                    set_message(map, "Your magic spell defeated the monster!");
-                } else {
-                    char msg[MAX_MESSAGE_LENGTH];
-                    snprintf(msg, MAX_MESSAGE_LENGTH, 
-                            "Your spell hits the %s for %d damage and freezes it in place! (Monster HP: %d/%d)", 
-                            monster->name, damage, monster->health, monster->max_health);
-                    set_message(map, msg);
-                }
-                hit_monster = true;
-                spell_hit = true;
-                break;
+            int damage = 15;
+            monster->health -= damage;
+            monster->was_attacked = true;
+            monster->aggressive = true;
+            monster->immobilized = true;
+            
+            if (monster->health <= 0) {
+                monster->active = false;
+                remove_monster(current, monster);
+                set_message(map, "Your magic spell defeated the monster!");
+            } else {
+                char msg[MAX_MESSAGE_LENGTH];
+                snprintf(msg, MAX_MESSAGE_LENGTH, 
+                        "Your spell hits the %s for %d damage and freezes it in place! (Monster HP: %d/%d)", 
+                        monster->name, damage, monster->health, monster->max_health);
+                set_message(map, msg);
             }
+            hit_monster = true;
+            spell_hit = true;
         }
 
         if (!hit_monster && !spell_hit) {
-            attron(COLOR_PAIR(4));  
-            mvprintw(new_y + 4, new_x + 1, "%s", spell_direction);
-            refresh();
-            napms(50);
-            attroff(COLOR_PAIR(4));
-
-            current_x = new_x;
-            current_y = new_y;
-        }
-    }
-    for (int i = 0; i < NUMLINES; i++) {
-        for (int j = 0; j < NUMCOLS; j++) {
-            current->visible_tiles[i][j] = backup_tiles[i][j];
+            effect_queue(new_x, new_y, spell_direction, 4, 50);
         }
-        free(backup_tiles[i]);
     }
-    free(backup_tiles);
-
     map->weapons[WEAPON_WAND].ammo--;
-    refresh();
 }
 
 void shoot_arrow(Map *map, int dir_x, int dir_y) {
@@ -1358,14 +2711,7 @@ void shoot_arrow(Map *map, int dir_x, int dir_y) {
 
     int current_x = map->player_x;
     int current_y = map->player_y;
-
-    char **backup_tiles = malloc(NUMLINES * sizeof(char*));
-    for (int i = 0; i < NUMLINES; i++) {
-        backup_tiles[i] = malloc(NUMCOLS * sizeof(char));
-        for (int j = 0; j < NUMCOLS; j++) {
-            backup_tiles[i][j] = current->visible_tiles[i][j];
-        }
-    }
+    effect_begin();
 
     for (int dist = 1; dist <= 5 && !arrow_hit; dist++) {
         int new_x = map->player_x + (dir_x * dist);
@@ -1375,95 +2721,68 @@ void shoot_arrow(Map *map, int dir_x, int dir_y) {
             break;
         }
 
-        if (current->tiles[new_y][new_x] == '|' || 
-            current->tiles[new_y][new_x] == '_' || 
-            current->tiles[new_y][new_x] == ' ') {
+        if (current->tiles[IDX(new_y, new_x)] == '|' || 
+            current->tiles[IDX(new_y, new_x)] == '_' || 
+            current->tiles[IDX(new_y, new_x)] == ' ') {
             arrow_hit = true;
             if (dist > 1) {
                 new_x = map->player_x + (dir_x * (dist - 1));
                 new_y = map->player_y + (dir_y * (dist - 1));
-                if (current->tiles[new_y][new_x] == '.') {
-                    current->tiles[new_y][new_x] = 'a';
+                if (current->tiles[IDX(new_y, new_x)] == '.') {
+                    set_tile(current, new_y, new_x, 'a');
                 }
             }
             break;
         }
 
-        if (current_x != map->player_x || current_y != map->player_y) {
-            current->visible_tiles[current_y][current_x] = backup_tiles[current_y][current_x];
-        }
-
         bool hit_monster = false;
-        for (int i = 0; i < MONSTER_COUNT; i++) {
-            Monster *monster = &current->monsters[i];
-            if (monster->active && monster->x == new_x && monster->y == new_y) {
-                if (current->tiles[current_y][current_x] == '.') {
-                    current->tiles[current_y][current_x] = 'a';
-                }
-
-                attron(COLOR_PAIR(3));
-                mvprintw(new_y + 4, new_x + 1, "X");
-                refresh();
-                napms(100);
-                attroff(COLOR_PAIR(3));
+        Monster *monster = monster_at(current, new_x, new_y);
+        if (monster != NULL) {
+            if (current->tiles[IDX(current_y, current_x)] == '.') {
+                set_tile(current, current_y, current_x, 'a');
+            }
+            effect_queue(new_x, new_y, "X", 3, 100);
 
-                int damage = 5;
-                monster->health -= damage;
-                monster->was_attacked = true;
-                monster->aggressive = true;
-                
-                if (monster->health <= 0) {
-                    monster->active = false;
-                    current->tiles[monster->y][monster->x] = '.'; 
-                    current->visible_tiles[monster->y][monster->x] = '.'; 
-                    set_message(map, "Your arrow defeated the monster!");
-                } else {
-                    char msg[MAX_MESSAGE_LENGTH];
-                    snprintf(msg, MAX_MESSAGE_LENGTH, 
-                            "Your arrow hits the %s for %d damage! (Monster HP: %d/%d)", 
-                            monster->name, damage, monster->health, monster->max_health);
-                    set_message(map, msg);
-                }
-                hit_monster = true;
-                arrow_hit = true;
-                break;
+            int damage = 5;
+            monster->health -= damage;
+            monster->was_attacked = true;
+            monster->aggressive = true;
+            
+            if (monster->health <= 0) {
+                monster->active = false;
+                remove_monster(current, monster);
+                set_message(map, "Your arrow defeated the monster!");
+            } else {
+                char msg[MAX_MESSAGE_LENGTH];
+                snprintf(msg, MAX_MESSAGE_LENGTH, 
+                        "Your arrow hits the %s for %d damage! (Monster HP: %d/%d)", 
+                        monster->name, damage, monster->health, monster->max_health);
+                set_message(map, msg);
             }
+            hit_monster = true;
+            arrow_hit = true;
         }
 
         if (!hit_monster && !arrow_hit) {
-            attron(COLOR_PAIR(1)); 
-            mvprintw(new_y + 4, new_x + 1, "%s", arrow_direction);
-            refresh();
-            napms(50);
-            attroff(COLOR_PAIR(6));
-
+            effect_queue(new_x, new_y, arrow_direction, 1, 50);
             current_x = new_x;
             current_y = new_y;
 
             if (dist == 5) {
-                if (current->tiles[new_y][new_x] == '.') {
-                    current->tiles[new_y][new_x] = 'a';
+                if (current->tiles[IDX(new_y, new_x)] == '.') {
+                    set_tile(current, new_y, new_x, 'a');
                 }
-                if (current->tiles[new_y][new_x] == '#') {
-                    current->tiles[new_y][new_x] = 'a';
+                if (current->tiles[IDX(new_y, new_x)] == '#') {
+                    set_tile(current, new_y, new_x, 'a');
                 }
             }
         }
     }
-    for (int i = 0; i < NUMLINES; i++) {
-        for (int j = 0; j < NUMCOLS; j++) {
-            current->visible_tiles[i][j] = backup_tiles[i][j];
-        }
-        free(backup_tiles[i]);
-    }
-    free(backup_tiles);
-
-    if (current->tiles[current_y][current_x] == '.') {
-        current->tiles[current_y][current_x] = 'a';
+    if (current->tiles[IDX(current_y, current_x)] == '.') {
+        set_tile(current, current_y, current_x, 'a');
     }
 
     map->weapons[WEAPON_ARROW].ammo--;
-    refresh();
 }
 void load_user_stats(Map* map) {
     if (strcmp(current_username, "") == 0 || strcmp(current_username, "Guest") == 0) {
@@ -1471,39 +2790,23 @@ void load_user_stats(Map* map) {
         map->exp = 0;
         return;
     }
-    FILE *file = fopen("user_score.txt", "r");
-    if (file == NULL) {
-        map->games_played = 0;
-        map->exp = 0;
-        return;
-    }
-    char line[256];
-    bool found = false;
-    while (fgets(line, sizeof(line), file)) {
-        if (strncmp(line, "Username:", 9) == 0) {
-            char username[50];
-            sscanf(line, "Username: %s", username);
-            if (strcmp(username, current_username) == 0) {
-                found = true;
-                for (int i = 0; i < 6; i++) {
-                    fgets(line, sizeof(line), file);
-                    if (i == 5) {
-                        sscanf(line, "Exp: %d", &map->exp);
-                    }
-                }
-                fgets(line, sizeof(line), file);
-                sscanf(line, "Games Played: %d", &map->games_played);
-                break;
-            }
+    UserScore score;
+    const SessionBlock *s = session_get();
+    if (s != NULL && strcmp(s->username, current_username) == 0) {
+        score = s->stats;
+        if (!s->has_stats) {
+            score.exp = 0;
+            score.games_played = 0;
         }
+    } else if (!score_load(current_username, &score)) {
+        score.exp = 0;
+        score.games_played = 0;
     }
-    if (!found) {
-        map->games_played = 0;
-        map->exp = 0;
-    }
-    fclose(file);
+    map->exp = score.exp;
+    map->games_played = score.games_played;
 }
 void show_lose_screen(Map* map) {
+    journal_end();
     clear();
     int center_y = NUMLINES / 2;
     int center_x = NUMCOLS / 2;
@@ -1540,13 +2843,6 @@ void show_lose_screen(Map* map) {
     attroff(COLOR_PAIR(2));
     refresh();
     getch();
-    free_map(map);
-    endwin();
-    curs_set(1);
-    system("clear");
-    char *args[] = {"./Menu", NULL};
-    execv("./Menu", args);
-    exit(1);
 }
 void throw_dagger(Map *map, int dir_x, int dir_y) {
     Level *current = &map->levels[map->current_level - 1];
@@ -1565,13 +2861,7 @@ void throw_dagger(Map *map, int dir_x, int dir_y) {
 
     int current_x = map->player_x;
     int current_y = map->player_y;
-    char **backup_tiles = malloc(NUMLINES * sizeof(char*));
-    for (int i = 0; i < NUMLINES; i++) {
-        backup_tiles[i] = malloc(NUMCOLS * sizeof(char));
-        for (int j = 0; j < NUMCOLS; j++) {
-            backup_tiles[i][j] = current->visible_tiles[i][j];
-        }
-    }
+    effect_begin();
 
     for (int dist = 1; dist <= 5 && !dagger_stopped; dist++) {
         int new_x = map->player_x + (dir_x * dist);
@@ -1581,99 +2871,73 @@ void throw_dagger(Map *map, int dir_x, int dir_y) {
             break;
         }
 
-        if (current->tiles[new_y][new_x] == '|' || 
-            current->tiles[new_y][new_x] == '_' || 
-            current->tiles[new_y][new_x] == ' ') {
+        if (current->tiles[IDX(new_y, new_x)] == '|' || 
+            current->tiles[IDX(new_y, new_x)] == '_' || 
+            current->tiles[IDX(new_y, new_x)] == ' ') {
             dagger_stopped = true;
             if (dist > 1) {
                 new_x = map->player_x + (dir_x * (dist - 1));
                 new_y = map->player_y + (dir_y * (dist - 1));
-                if (current->tiles[new_y][new_x] == '.') {
-                    current->tiles[new_y][new_x] = 'd';
+                if (current->tiles[IDX(new_y, new_x)] == '.') {
+                    set_tile(current, new_y, new_x, 'd');
                 }
             }
             break;
         }
 
-        if (current_x != map->player_x || current_y != map->player_y) {
-            current->visible_tiles[current_y][current_x] = backup_tiles[current_y][current_x];
-        }
-
         bool hit_monster = false;
-        for (int i = 0; i < MONSTER_COUNT; i++) {
-            Monster *monster = &current->monsters[i];
-            if (monster->active && monster->x == new_x && monster->y == new_y) {
-                if (current->tiles[current_y][current_x] == '.') {
-                    current->tiles[current_y][current_x] = 'd';
-                }
-
-                attron(COLOR_PAIR(3));
-                mvprintw(new_y + 4, new_x + 1, "X");
-                refresh();
-                napms(100);
-                attroff(COLOR_PAIR(3));
+        Monster *monster = monster_at(current, new_x, new_y);
+        if (monster != NULL) {
+            if (current->tiles[IDX(current_y, current_x)] == '.') {
+                set_tile(current, current_y, current_x, 'd');
+            }
+            effect_queue(new_x, new_y, "X", 3, 100);
 
-                int damage = 12;
-                monster->health -= damage;
-                monster->was_attacked = true;
-                monster->aggressive = true;
-                
-                if (monster->health <= 0) {
-                    monster->active = false;
-                    current->tiles[monster->y][monster->x] = '.';  
-                    current->visible_tiles[monster->y][monster->x] = '.'; 
-                    set_message(map, "Your thrown dagger defeated the monster!");
-                } else {
-                    char msg[MAX_MESSAGE_LENGTH];
-                    snprintf(msg, MAX_MESSAGE_LENGTH, 
-                            "Your thrown dagger hits the %s for %d damage! (Monster HP: %d/%d)", 
-                            monster->name, damage, monster->health, monster->max_health);
-                    set_message(map, msg);
-                }
-                hit_monster = true;
-                dagger_stopped = true;
-                break;
+            int damage = 12;
+            monster->health -= damage;
+            monster->was_attacked = true;
+            monster->aggressive = true;
+            
+            if (monster->health <= 0) {
+                monster->active = false;
+                remove_monster(current, monster);
+                set_message(map, "Your thrown dagger defeated the monster!");
+            } else {
+                char msg[MAX_MESSAGE_LENGTH];
+                snprintf(msg, MAX_MESSAGE_LENGTH, 
+                        "Your thrown dagger hits the %s for %d damage! (Monster HP: %d/%d)", 
+                        monster->name, damage, monster->health, monster->max_health);
+                set_message(map, msg);
             }
+            hit_monster = true;
+            dagger_stopped = true;
         }
 
         if (!hit_monster && !dagger_stopped) {
-            attron(COLOR_PAIR(1)); 
-            mvprintw(new_y + 4, new_x + 1, "%s", dagger_direction);
-            refresh();
-            napms(50);
-            attroff(COLOR_PAIR(6));
-
+            effect_queue(new_x, new_y, dagger_direction, 1, 50);
             current_x = new_x;
             current_y = new_y;
 
             if (dist == 5) {
-                if (current->tiles[new_y][new_x] == '.') {
-                    current->tiles[new_y][new_x] = 'd';
+                if (current->tiles[IDX(new_y, new_x)] == '.') {
+                    set_tile(current, new_y, new_x, 'd');
                 }
-                if (current->tiles[new_y][new_x] == '#') {
-                    current->tiles[new_y][new_x] = 'd';
+                if (current->tiles[IDX(new_y, new_x)] == '#') {
+                    set_tile(current, new_y, new_x, 'd');
                 }
             }
         }
     }
 
-    for (int i = 0; i < NUMLINES; i++) {
-        for (int j = 0; j < NUMCOLS; j++) {
-            current->visible_tiles[i][j] = backup_tiles[i][j];
-        }
-        free(backup_tiles[i]);
-    }
-    free(backup_tiles);
-
-    if (current->tiles[current_y][current_x] == '.') {
-        current->tiles[current_y][current_x] = 'd';
+    if (current->tiles[IDX(current_y, current_x)] == '.') {
+        set_tile(current, current_y, current_x, 'd');
     }
 
     map->weapons[WEAPON_DAGGER].ammo--;
-    refresh();
 }
 
 void show_win_screen(Map* map) {
+    journal_end();
     clear();
     int center_y = NUMLINES / 2;
     int center_x = NUMCOLS / 2;
@@ -1712,170 +2976,101 @@ void show_win_screen(Map* map) {
     getch();
 }
 void load_username() {
-    FILE *file = fopen("game_settings.txt", "r");
-    if (file != NULL) {
-        char line[256];
-        while (fgets(line, sizeof(line), file)) {
-            if (strncmp(line, "Username:", 9) == 0) {
-                sscanf(line, "Username: %s", current_username);
-                break;
-            }
-        }
-        fclose(file);
-    }
+    const SessionBlock *s = session_get();
+    const char *username = s != NULL ? s->username : settings_get()->username;
+    snprintf(current_username, sizeof(current_username), "%s", username);
 }
 void save_user_data(Map* map) {
     if (strcmp(current_username, "") == 0 || strcmp(current_username, "Guest") == 0) {
         return;
     }
-    FILE *file = fopen("user_score.txt", "r");
-    FILE *temp = fopen("temp_score.txt", "w");
-    if (file == NULL || temp == NULL) {
-        if (temp) fclose(temp);
-        if (file) fclose(file);
-        return;
-    }
-    char line[256];
-    bool found = false;
-    char current_block[2048] = "";
-    char other_blocks[10240] = "";
-    bool copying_current_user = false;
-    while (fgets(line, sizeof(line), file)) {
-        if (strncmp(line, "Username:", 9) == 0) {
-            char username[50];
-            sscanf(line, "Username: %s", username);
-            if (strcmp(username, current_username) == 0) {
-                found = true;
-                copying_current_user = true;
-                for (int i = 0; i < 7; i++) {
-                    if (!fgets(line, sizeof(line), file)) break;
-                }
-            } 
-            else {
-                if (copying_current_user) {
-                    copying_current_user = false;
-                }
-                strcat(other_blocks, line);
-                continue;
-            }
-        } else if (!copying_current_user) {
-            strcat(other_blocks, line);
-        }
-    }
-    fprintf(temp, "Username: %s\n", current_username);
-    fprintf(temp, "Level: %d\n", map->current_level);
-    fprintf(temp, "Hit: %d\n", map->health);
-    fprintf(temp, "Strength: %d\n", map->strength);
-    fprintf(temp, "Gold: %d\n", map->gold);
-    fprintf(temp, "Armor: %d\n", map->armor);
-    fprintf(temp, "Exp: %d\n", map->exp + map->gold);
-    fprintf(temp, "Games Played: %d\n\n", map->games_played + 1);
-    fprintf(temp, "%s", other_blocks);
-    if (!found) {
-        fprintf(temp, "Username: %s\n", current_username);
-        fprintf(temp, "Level: %d\n", map->current_level);
-        fprintf(temp, "Hit: %d\n", map->health);
-        fprintf(temp, "Strength: %d\n", map->strength);
-        fprintf(temp, "Gold: %d\n", map->gold);
-        fprintf(temp, "Armor: %d\n", map->armor);
-        fprintf(temp, "Exp: %d\n", map->gold);
-        fprintf(temp, "Games Played: 1\n\n");
-    }
-    fclose(file);
-    fclose(temp);
-    remove("user_score.txt");
-    rename("temp_score.txt", "user_score.txt");
+    UserScore score;
+    score_defaults(&score, current_username);
+    score.level = map->current_level;
+    score.hit = map->health;
+    score.strength = map->strength;
+    score.gold = map->gold;
+    score.armor = map->armor;
+    score.exp = map->exp + map->gold;
+    score.games_played = map->games_played + 1;
+    score_save(&score);
 }
 
 void load_game_settings(Map* map) {
-    FILE* file = fopen("game_settings.txt", "r");
-    if (file == NULL) {
-        map->character_color = 1;
-        return;
-    }
-    char line[256];
-    while (fgets(line, sizeof(line), file)) {
-        if (strncmp(line, "CharacterColor: ", 15) == 0) {
-            map->character_color = atoi(line + 15);
-            break;
-        }
-    }
-
-    fclose(file);
+    const SessionBlock *s = session_get();
+    map->character_color = s != NULL ? s->character_color : settings_get()->character_color;
 }
 
 void add_secret_stairs(Level *level, Room *room) {
-    if (rand() % 10 == 0) {
+    if (rng_rand(&level->rng) % 10 == 0) {
         int attempts = 0;
         const int MAX_ATTEMPTS = 10;  
         while (attempts < MAX_ATTEMPTS) {
-            int stair_x = room->pos.x + 2 + rand() % (room->max.x - 4);
-            int stair_y = room->pos.y + 2 + rand() % (room->max.y - 4);
+            int stair_x = room->pos.x + 2 + rng_rand(&level->rng) % (room->max.x - 4);
+            int stair_y = room->pos.y + 2 + rng_rand(&level->rng) % (room->max.y - 4);
             bool valid = true;
             for (int dy = -1; dy <= 1; dy++) {
                 for (int dx = -1; dx <= 1; dx++) {
                     int check_x = stair_x + dx;
                     int check_y = stair_y + dy;
-                    if (level->tiles[check_y][check_x] == '+' ||
-                        level->tiles[check_y][check_x] == '>' ||
-                        level->tiles[check_y][check_x] == '<' ||
-                        level->traps[check_y][check_x] ||
-                        level->secret_walls[check_y][check_x]) {
+                    if (level->tiles[IDX(check_y, check_x)] == '+' ||
+                        level->tiles[IDX(check_y, check_x)] == '>' ||
+                        level->tiles[IDX(check_y, check_x)] == '<' ||
+                        bit_test(level->traps, check_y, check_x) ||
+                        bit_test(level->secret_walls, check_y, check_x)) {
                         valid = false;
                         break;
                     }
                 }
                 if (!valid) break;
             }
-            if (valid && level->tiles[stair_y][stair_x] == '.') {
-                level->secret_stairs[stair_y][stair_x] = true;
+            if (valid && level->tiles[IDX(stair_y, stair_x)] == '.') {
+                bit_set(level->secret_stairs, stair_y, stair_x);
                 break;
             }
+            GEN_STAT(stair_retries);
             attempts++;
         }
     }
 }
 void draw_secret_room(Level *level) {
-    for (int y = 0; y < NUMLINES; y++) {
-        for (int x = 0; x < NUMCOLS; x++) {
-            level->tiles[y][x] = ' ';
-            level->visible_tiles[y][x] = ' ';
-            level->explored[y][x] = false;
-        }
-    }
+    memset(level->tiles, ' ', LAYER_CELLS * sizeof(char));
+    memset(level->visible_tiles, ' ', LAYER_CELLS * sizeof(char));
+    memset(level->explored, 0, BITSET_WORDS * sizeof(uint64_t));
+    level->visibility_stale = true;
     int room_size = 7;
     int start_x = NUMCOLS/2 - room_size/2;
     int start_y = NUMLINES/2 - room_size/2;
     for (int y = 0; y < room_size; y++) {
         for (int x = 0; x < room_size; x++) {
             if (y == 0 || y == room_size-1) {
-                level->tiles[start_y + y][start_x + x] = '_';
+                set_tile(level, start_y + y, start_x + x, '_');
             } else if (x == 0 || x == room_size-1) {
-                level->tiles[start_y + y][start_x + x] = '|';
+                set_tile(level, start_y + y, start_x + x, '|');
             } else {
-                level->tiles[start_y + y][start_x + x] = '.';
+                set_tile(level, start_y + y, start_x + x, '.');
             }
-            level->visible_tiles[start_y + y][start_x + x] = level->tiles[start_y + y][start_x + x];
-            level->explored[start_y + y][start_x + x] = true;
+            level->visible_tiles[IDX(start_y + y, start_x + x)] = level->tiles[IDX(start_y + y, start_x + x)];
+            bit_set(level->explored, start_y + y, start_x + x);
         }
     }
-    level->tiles[start_y + room_size/2][start_x + room_size/2] = '?';
-    level->visible_tiles[start_y + room_size/2][start_x + room_size/2] = '?';
-    int talisman_y = start_y + 1 + (rand() % (room_size - 2));
-    int talisman_x = start_x + 1 + (rand() % (room_size - 2));
+    set_tile(level, start_y + room_size/2, start_x + room_size/2, '?');
+    level->visible_tiles[IDX(start_y + room_size/2, start_x + room_size/2)] = '?';
+    int talisman_y = start_y + 1 + (rng_rand(&level->rng) % (room_size - 2));
+    int talisman_x = start_x + 1 + (rng_rand(&level->rng) % (room_size - 2));
     while (talisman_x == start_x + room_size/2 && talisman_y == start_y + room_size/2) {
-        talisman_y = start_y + 1 + (rand() % (room_size - 2));
-        talisman_x = start_x + 1 + (rand() % (room_size - 2));
+        talisman_y = start_y + 1 + (rng_rand(&level->rng) % (room_size - 2));
+        talisman_x = start_x + 1 + (rng_rand(&level->rng) % (room_size - 2));
     }
-    level->tiles[talisman_y][talisman_x] = 'T';
-    level->visible_tiles[talisman_y][talisman_x] = 'T';
-    level->talisman_type = rand() % TALISMAN_COUNT;
+    set_tile(level, talisman_y, talisman_x, 'T');
+    level->visible_tiles[IDX(talisman_y, talisman_x)] = 'T';
+    level->talisman_type = rng_rand(&level->rng) % TALISMAN_COUNT;
 }
 void add_secret_walls_to_room(Level *level, Room *room) {
     int door_count = 0;
     for (int y = room->pos.y; y < room->pos.y + room->max.y; y++) {
         for (int x = room->pos.x; x < room->pos.x + room->max.x; x++) {
-            if (level->tiles[y][x] == '+') {
+            if (level->tiles[IDX(y, x)] == '+') {
                 door_count++;
             }
         }
@@ -1893,8 +3088,8 @@ void add_secret_walls_to_room(Level *level, Room *room) {
             }
         }
         if (wall_count > 0) {
-            int idx = rand() % wall_count;
-            level->secret_walls[wall_y[idx]][wall_x[idx]] = true;
+            int idx = rng_rand(&level->rng) % wall_count;
+            bit_set(level->secret_walls, wall_y[idx], wall_x[idx]);
             if (level->num_secret_rooms < MAXROOMS) {
                 Room *secret_room = &level->secret_rooms[level->num_secret_rooms];
                 secret_room->max.x = 5;
@@ -1908,7 +3103,7 @@ void add_secret_walls_to_room(Level *level, Room *room) {
 }
 
 bool is_valid_secret_wall(Level *level, int x, int y) {
-    if (level->tiles[y][x] != '|' && level->tiles[y][x] != '_') {
+    if (level->tiles[IDX(y, x)] != '|' && level->tiles[IDX(y, x)] != '_') {
         return false;
     }
     for (int dy = -1; dy <= 1; dy++) {
@@ -1916,7 +3111,7 @@ bool is_valid_secret_wall(Level *level, int x, int y) {
             int nx = x + dx;
             int ny = y + dy;
             if (nx >= 0 && nx < NUMCOLS && ny >= 0 && ny < NUMLINES) {
-                if (level->tiles[ny][nx] == '+') {
+                if (level->tiles[IDX(ny, nx)] == '+') {
                     return false;
                 }
             }
@@ -1939,7 +3134,7 @@ int MAX(int a, int b) {
 bool check_for_stairs(Level *level) {
     for (int y = 0; y < NUMLINES; y++) {
         for (int x = 0; x < NUMCOLS; x++) {
-            if (level->tiles[y][x] == '>') {
+            if (level->tiles[IDX(y, x)] == '>') {
                 return true;
             }
         }
@@ -1954,14 +3149,14 @@ void add_stairs(Level *level, Room *room, bool is_up) {
         int attempts = 0;
         const int MAX_ATTEMPTS = 100;
         while (!valid_position && attempts < MAX_ATTEMPTS) {
-            x = room->pos.x + 2 + rand() % (room->max.x - 4);
-            y = room->pos.y + 2 + rand() % (room->max.y - 4);
+            x = room->pos.x + 2 + rng_rand(&level->rng) % (room->max.x - 4);
+            y = room->pos.y + 2 + rng_rand(&level->rng) % (room->max.y - 4);
             bool near_door = false;
             for (int dy = -2; dy <= 2; dy++) {
                 for (int dx = -2; dx <= 2; dx++) {
                     if (y + dy >= 0 && y + dy < NUMLINES && 
                         x + dx >= 0 && x + dx < NUMCOLS) {
-                        if (level->tiles[y + dy][x + dx] == '+') {
+                        if (level->tiles[IDX(y + dy, x + dx)] == '+') {
                             near_door = true;
                             break;
                         }
@@ -1969,14 +3164,16 @@ void add_stairs(Level *level, Room *room, bool is_up) {
                 }
                 if (near_door) break;
             }
-            if (!near_door && !level->traps[y][x] && level->tiles[y][x] == '.') {
+            if (!near_door && !bit_test(level->traps, y, x) && level->tiles[IDX(y, x)] == '.') {
                 valid_position = true;
                 level->stairs_up.x = x;
                 level->stairs_up.y = y;
-                level->tiles[y][x] = '>';
+                set_tile(level, y, x, '>');
                 level->stair_x = x;
                 level->stair_y = y;
                 level->stair_room = room;
+            } else {
+                GEN_STAT(stair_retries);
             }
             attempts++;
         }
@@ -1986,19 +3183,20 @@ void add_stairs(Level *level, Room *room, bool is_up) {
                 if (alt_room != room) { 
                     attempts = 0;
                     while (!valid_position && attempts < MAX_ATTEMPTS) {
-                        x = alt_room->pos.x + 2 + rand() % (alt_room->max.x - 4);
-                        y = alt_room->pos.y + 2 + rand() % (alt_room->max.y - 4);
+                        x = alt_room->pos.x + 2 + rng_rand(&level->rng) % (alt_room->max.x - 4);
+                        y = alt_room->pos.y + 2 + rng_rand(&level->rng) % (alt_room->max.y - 4);
                         
-                        if (!level->traps[y][x] && level->tiles[y][x] == '.') {
+                        if (!bit_test(level->traps, y, x) && level->tiles[IDX(y, x)] == '.') {
                             valid_position = true;
                             level->stairs_up.x = x;
                             level->stairs_up.y = y;
-                            level->tiles[y][x] = '>';
+                            set_tile(level, y, x, '>');
                             level->stair_x = x;
                             level->stair_y = y;
                             level->stair_room = alt_room;
                             break;
                         }
+                        GEN_STAT(stair_retries);
                         attempts++;
                     }
                 }
@@ -2007,7 +3205,7 @@ void add_stairs(Level *level, Room *room, bool is_up) {
         }
     } 
     else {
-        level->tiles[level->stair_y][level->stair_x] = '<';
+        set_tile(level, level->stair_y, level->stair_x, '<');
     }
 }
 
@@ -2017,13 +3215,58 @@ void copy_room(Room *dest, Room *src) {
     dest->center = src->center;
     dest->gone = src->gone;
     dest->connected = src->connected;
+    dest->discovered = src->discovered;
     memcpy(dest->doors, src->doors, sizeof(src->doors));
 }
 
+size_t level_cells_bytes() {
+    return 8 * BITSET_WORDS * sizeof(uint64_t) + LAYER_CELLS * (2 * sizeof(int) + 6 * sizeof(char));
+}
+bool alloc_level_cells(Level *level) {
+    size_t n = LAYER_CELLS;
+    size_t words = BITSET_WORDS;
+    char *block = malloc(level_cells_bytes());
+    level->cells = block;
+    if (block == NULL) return false;
+    memset(block, 0, 8 * words * sizeof(uint64_t));
+    carve_level_cells(level);
+    memset(level->coin_values, 0, n * sizeof(int));
+    memset(level->tiles, ' ', 4 * n * sizeof(char));
+    memset(level->room_ids, 0, n * sizeof(unsigned char));
+    memset(level->monster_ids, 0, n * sizeof(unsigned char));
+    level->dirty_count = 0;
+    level->dirty_visible = 0;
+    level->visibility_stale = true;
+    level->save_dirty = true;
+    return true;
+}
+// Points the layer fields at their slices of level->cells.
+void carve_level_cells(Level *level) {
+    size_t n = LAYER_CELLS;
+    size_t words = BITSET_WORDS;
+    char *block = level->cells;
+    level->explored = (uint64_t*)block;         block += words * sizeof(uint64_t);
+    level->traps = (uint64_t*)block;            block += words * sizeof(uint64_t);
+    level->discovered_traps = (uint64_t*)block; block += words * sizeof(uint64_t);
+    level->secret_walls = (uint64_t*)block;     block += words * sizeof(uint64_t);
+    level->backup_explored = (uint64_t*)block;  block += words * sizeof(uint64_t);
+    level->secret_stairs = (uint64_t*)block;    block += words * sizeof(uint64_t);
+    level->coins = (uint64_t*)block;            block += words * sizeof(uint64_t);
+    level->dirty_bits = (uint64_t*)block;       block += words * sizeof(uint64_t);
+    level->coin_values = (int*)block;           block += n * sizeof(int);
+    level->dirty_cells = (int*)block;           block += n * sizeof(int);
+    level->tiles = block;                       block += n * sizeof(char);
+    level->visible_tiles = block;               block += n * sizeof(char);
+    level->backup_tiles = block;                block += n * sizeof(char);
+    level->backup_visible_tiles = block;         block += n * sizeof(char);
+    level->room_ids = (unsigned char*)block;      block += n * sizeof(unsigned char);
+    level->monster_ids = (unsigned char*)block;
+}
+
 Map* create_map() {
     Map* map = malloc(sizeof(Map));
     if (map == NULL) return NULL;
-    map->levels = malloc(MAX_LEVELS * sizeof(Level));
+    map->levels = calloc(MAX_LEVELS, sizeof(Level));
     if (map->levels == NULL) {
         free(map);
         return NULL;
@@ -2031,42 +3274,10 @@ Map* create_map() {
     map->difficulty = get_difficulty_from_settings();
     for (int l = 0; l < MAX_LEVELS; l++) {
         Level *level = &map->levels[l];
-        level->coins = malloc(NUMLINES * sizeof(bool*));
-        level->coin_values = malloc(NUMLINES * sizeof(int*));
-        if (!level->coins || !level->coin_values) {
-            free_map(map);
-            return NULL;
-        }
-        level->tiles = malloc(NUMLINES * sizeof(char*));
-        level->visible_tiles = malloc(NUMLINES * sizeof(char*));
-        level->explored = malloc(NUMLINES * sizeof(bool*));
-        level->traps = malloc(NUMLINES * sizeof(bool*));
-        level->discovered_traps = malloc(NUMLINES * sizeof(bool*));
-        level->secret_walls = malloc(NUMLINES * sizeof(bool*));
-        level->backup_tiles = malloc(NUMLINES * sizeof(char*));
-        level->backup_visible_tiles = malloc(NUMLINES * sizeof(char*));
-        level->backup_explored = malloc(NUMLINES * sizeof(bool*));
-        level->secret_stairs = malloc(NUMLINES * sizeof(bool*));
-        if (!level->tiles || !level->visible_tiles || !level->explored || 
-            !level->traps || !level->discovered_traps || !level->secret_walls ||
-            !level->backup_tiles || !level->backup_visible_tiles || 
-            !level->backup_explored || !level->secret_stairs) {
+        if (!alloc_level_cells(level)) {
             free_map(map);
             return NULL;
         }
-        for (int i = 0; i < NUMLINES; i++) {
-            level->coins[i] = malloc(NUMCOLS * sizeof(bool));
-            level->coin_values[i] = malloc(NUMCOLS * sizeof(int));
-            
-            if (!level->coins[i] || !level->coin_values[i]) {
-                free_map(map);
-                return NULL;
-            }
-            for (int j = 0; j < NUMCOLS; j++) {
-                level->coins[i][j] = false;
-                level->coin_values[i][j] = 0;
-            }
-        }
         for (int l = 0; l < MAX_LEVELS; l++) {
             Level *level = &map->levels[l];
             level->num_monsters = MONSTER_COUNT;
@@ -2076,39 +3287,6 @@ Map* create_map() {
             level->monsters[MONSTER_SNAKE] = (Monster){MONSTER_SNAKE, "Snake", 'S', 20, 20, 4, 0, 0, false, false, false, false};
             level->monsters[MONSTER_UNDEAD] = (Monster){MONSTER_UNDEAD, "Undead", 'U', 30, 30, 5, 0, 0, false, true, false, false};
         }
-        for (int i = 0; i < NUMLINES; i++) {
-            level->tiles[i] = malloc(NUMCOLS * sizeof(char));
-            level->visible_tiles[i] = malloc(NUMCOLS * sizeof(char));
-            level->explored[i] = malloc(NUMCOLS * sizeof(bool));
-            level->traps[i] = malloc(NUMCOLS * sizeof(bool));
-            level->discovered_traps[i] = malloc(NUMCOLS * sizeof(bool));
-            level->secret_walls[i] = malloc(NUMCOLS * sizeof(bool));
-            level->backup_tiles[i] = malloc(NUMCOLS * sizeof(char));
-            level->backup_visible_tiles[i] = malloc(NUMCOLS * sizeof(char));
-            level->backup_explored[i] = malloc(NUMCOLS * sizeof(bool));
-            level->secret_stairs[i] = malloc(NUMCOLS * sizeof(bool));
-            if (!level->tiles[i] || !level->visible_tiles[i] || !level->explored[i] ||
-                !level->traps[i] || !level->discovered_traps[i] || !level->secret_walls[i] ||
-                !level->backup_tiles[i] || !level->backup_visible_tiles[i] ||
-                !level->backup_explored[i] || !level->secret_stairs[i]) {
-                free_map(map);
-                return NULL;
-            }
-            for (int j = 0; j < NUMCOLS; j++) {
-                level->tiles[i][j] = ' ';
-                level->visible_tiles[i][j] = ' ';
-                level->explored[i][j] = false;
-                level->traps[i][j] = false;
-                level->discovered_traps[i][j] = false;
-                level->secret_walls[i][j] = false;
-                level->backup_tiles[i][j] = ' ';
-                level->backup_visible_tiles[i][j] = ' ';
-                level->backup_explored[i][j] = false;
-                level->secret_stairs[i][j] = false;
-                level->coins[i][j] = false;       
-                level->coin_values[i][j] = 0;    
-            }
-        }
         level->num_rooms = 0;
         level->num_secret_rooms = 0;
         level->stair_room = NULL;
@@ -2125,11 +3303,17 @@ Map* create_map() {
         map->food_types[i] = FOOD_NORMAL;
     }
     map->hunger = 100;
-    map->hunger_timer = 0;
+    timer_wheel_init(&map->timers);
+    timer_set(&map->timers, TIMER_HUNGER, HUNGER_PERIOD);
     map->food_menu_open = false;
     map->current_level = 1;
     map->player_x = 0;
     map->player_y = 0;
+    map->visibility_level = NULL;
+    map->visibility_debug = false;
+    map->pregen = NULL;
+    map->journal_id = 0;
+    seed_map(map, (uint64_t)time(NULL));
     map->debug_mode = false;
     map->current_message[0] = '\0';
     map->message_timer = 0;
@@ -2160,21 +3344,28 @@ Map* create_map() {
     map->weapons[WEAPON_SWORD] = (Weapon){WEAPON_SWORD, "Sword", "⚔", false, -1}; 
     map->current_weapon = WEAPON_MACE;
     map->weapon_menu_open = false;
-    map->talismans[TALISMAN_HEALTH] = (Talisman){TALISMAN_HEALTH, "Health Talisman", "◆", COLOR_PAIR(4), true,{0} , false, 0, 3};
-    map->talismans[TALISMAN_DAMAGE] = (Talisman){TALISMAN_DAMAGE, "Damage Talisman", "◆", COLOR_PAIR(3), true,{0} , false, 0, 3};
-    map->talismans[TALISMAN_SPEED] = (Talisman){TALISMAN_SPEED, "Speed Talisman", "◆", COLOR_PAIR(5), true,{0} , false, 0, 3};
+    map->talismans[TALISMAN_HEALTH] = (Talisman){TALISMAN_HEALTH, "Health Talisman", "◆", COLOR_PAIR(4), true, 3};
+    map->talismans[TALISMAN_DAMAGE] = (Talisman){TALISMAN_DAMAGE, "Damage Talisman", "◆", COLOR_PAIR(3), true, 3};
+    map->talismans[TALISMAN_SPEED] = (Talisman){TALISMAN_SPEED, "Speed Talisman", "◆", COLOR_PAIR(5), true, 3};
     map->talisman_menu_open = false;
     map->normal_food = 0;
     map->crimson_flask = 0;
     map->cerulean_flask = 0;
     map->rotten_food = 0;
-    map->moves_remaining = 0;
-    map->damage_doubled = false;
-    map->speed_doubled = false;
+    refresh_effects(map);
     load_game_settings(map);
     load_user_stats(map);
     return map;
 }
+// Gameplay draws from the map stream; each level is generated from its own
+// stream so a level's layout depends only on the seed and its number.
+void seed_map(Map *map, uint64_t seed) {
+    map->seed = seed;
+    rng_seed(&map->rng, seed, 0);
+    for (int l = 0; l < MAX_LEVELS; l++) {
+        rng_seed(&map->levels[l].rng, seed, l + 1);
+    }
+}
 
 void display_weapon_menu(WINDOW *win, Map *map) {
     int center_y = NUMLINES / 2;
@@ -2246,7 +3437,7 @@ void display_weapon_menu(WINDOW *win, Map *map) {
     mvwprintw(menu_win, box_height - 2, 2, "Press any other key to close");
     wattroff(menu_win, COLOR_PAIR(2)); 
     wrefresh(menu_win);
-    int ch = getch();
+    int ch = game_getch();
     if (ch >= '1' && ch <= '5') {
         int weapon_index = ch - '1';
         if (map->weapons[weapon_index].owned) {
@@ -2326,7 +3517,7 @@ void display_food_menu(WINDOW *win, Map *map) {
     wattroff(menu_win, COLOR_PAIR(2));
 
     wrefresh(menu_win);
-    int ch = getch();
+    int ch = game_getch();
     werase(menu_win);
     wrefresh(menu_win);
     delwin(menu_win);
@@ -2363,8 +3554,7 @@ void consume_food(Map *map, int type) {
             map->crimson_flask--;
             map->hunger = MIN(100, map->hunger + 50);
             map->health = MIN(25, map->health + 10);
-            map->damage_doubled = true;
-            map->moves_remaining = 10;
+            start_effect(map, TIMER_CRIMSON_FLASK);
             set_message(map, "You drink the Crimson Tears. You feel powerful and refreshed!");
             break;
             
@@ -2372,8 +3562,7 @@ void consume_food(Map *map, int type) {
             map->cerulean_flask--;
             map->hunger = MIN(100, map->hunger + 50);
             map->health = MIN(25, map->health + 10);
-            map->speed_doubled = true;
-            map->moves_remaining = 10;
+            start_effect(map, TIMER_CERULEAN_FLASK);
             set_message(map, "You drink the Cerulean Tears. You feel swift and refreshed!");
             break;
     }
@@ -2400,45 +3589,15 @@ void eat_food(Map *map) {
 
 void free_map(Map* map) {
     if (map == NULL) return;
+    if (map->pregen != NULL) {
+        stop_pregen(map);
+        free(map->pregen->level.cells);
+        free(map->pregen->room_tiles);
+        free(map->pregen);
+    }
     if (map->levels != NULL) {
         for (int l = 0; l < MAX_LEVELS; l++) {
-            Level *level = &map->levels[l];
-            if (level->tiles != NULL) {
-                for (int i = 0; i < NUMLINES; i++) {
-                    if (level->tiles[i]) free(level->tiles[i]);
-                    if (level->coins[i]) free(level->coins[i]);
-                    if (level->visible_tiles[i]) free(level->visible_tiles[i]);
-                    if (level->explored[i]) free(level->explored[i]);
-                    if (level->traps[i]) free(level->traps[i]);
-                    if (level->discovered_traps[i]) free(level->discovered_traps[i]);
-                    if (level->secret_walls[i]) free(level->secret_walls[i]);
-                    if (level->backup_tiles[i]) free(level->backup_tiles[i]);
-                    if (level->backup_visible_tiles[i]) free(level->backup_visible_tiles[i]);
-                    if (level->backup_explored[i]) free(level->backup_explored[i]);
-                }
-                free(level->coins);
-                free(level->tiles);
-                free(level->visible_tiles);
-                free(level->explored);
-                free(level->traps);
-                free(level->discovered_traps);
-                free(level->secret_walls);
-                free(level->backup_tiles);
-                free(level->backup_visible_tiles);
-                free(level->backup_explored);
-                if (level->secret_stairs != NULL) {
-                    for (int i = 0; i < NUMLINES; i++) {
-                        if (level->secret_stairs[i]) free(level->secret_stairs[i]);
-                    }
-                    free(level->secret_stairs);
-                }
-                if (level->coin_values != NULL) {
-                    for (int i = 0; i < NUMLINES; i++) {
-                        if (level->coin_values[i]) free(level->coin_values[i]);
-                    }
-                    free(level->coin_values);
-                }
-            }
+            free(map->levels[l].cells);
         }
         free(map->levels);
     }
@@ -2452,59 +3611,59 @@ bool rooms_overlap(Room *r1, Room *r2) {
              r2->pos.y + r2->max.y + 1 < r1->pos.y);
 }
 
-void draw_room(Level *level, Room *room) {
+void draw_room(Level *level, Room *room, int level_number) {
     if (room->pos.x < 0 || room->pos.x + room->max.x >= NUMCOLS ||
         room->pos.y < 0 || room->pos.y + room->max.y >= NUMLINES) {
         return;
     }
     for (int x = room->pos.x + 1; x < room->pos.x + room->max.x - 1; x++) {
-        level->tiles[room->pos.y][x] = '_';
-        level->tiles[room->pos.y + room->max.y - 1][x] = '_';
+        set_tile(level, room->pos.y, x, '_');
+        set_tile(level, room->pos.y + room->max.y - 1, x, '_');
     }
     for (int y = room->pos.y + 1; y < room->pos.y + room->max.y - 1; y++) {
-        level->tiles[y][room->pos.x] = '|';
-        level->tiles[y][room->pos.x + room->max.x - 1] = '|';
+        set_tile(level, y, room->pos.x, '|');
+        set_tile(level, y, room->pos.x + room->max.x - 1, '|');
     }
     for (int y = room->pos.y + 1; y < room->pos.y + room->max.y - 1; y++) {
         for (int x = room->pos.x + 1; x < room->pos.x + room->max.x - 1; x++) {
-            level->tiles[y][x] = '.';
-            if (rand() % 100 < 3) {
-                level->coins[y][x] = true;
-                level->coin_values[y][x] = 1;
-                level->tiles[y][x] = '$';
-            } else if (rand() % 100 < 1) {
-                level->coins[y][x] = true;
-                level->coin_values[y][x] = 5;
-                level->tiles[y][x] = '&';
+            set_tile(level, y, x, '.');
+            if (rng_rand(&level->rng) % 100 < 3) {
+                bit_set(level->coins, y, x);
+                level->coin_values[IDX(y, x)] = 1;
+                set_tile(level, y, x, '$');
+            } else if (rng_rand(&level->rng) % 100 < 1) {
+                bit_set(level->coins, y, x);
+                level->coin_values[IDX(y, x)] = 5;
+                set_tile(level, y, x, '&');
             }
         }
     }
-    if (level == 1) {
+    if (level_number == 1) {
         if (!room->gone && level->num_rooms > 0 && !level->fighting_trap_triggered) {
             bool has_fighting_trap = false;
             for (int y = 0; y < NUMLINES; y++) {
                 for (int x = 0; x < NUMCOLS; x++) {
-                    if (level->tiles[y][x] == 'v') {
+                    if (level->tiles[IDX(y, x)] == 'v') {
                         has_fighting_trap = true;
                         break;
                     }
                 }
                 if (has_fighting_trap) break;
             }
-            if (!has_fighting_trap && rand() % 100 < 15) {
+            if (!has_fighting_trap && rng_rand(&level->rng) % 100 < 15) {
                 int valid_tries = 0;
                 const int MAX_TRIES = 50;
                 
                 while (valid_tries < MAX_TRIES) {
-                    int trap_x = room->pos.x + 2 + (rand() % (room->max.x - 4)); 
-                    int trap_y = room->pos.y + 2 + (rand() % (room->max.y - 4)); 
-                    if (level->tiles[trap_y][trap_x] == '.' && 
-                        !level->traps[trap_y][trap_x] && 
-                        level->tiles[trap_y][trap_x] != '>' && 
-                        level->tiles[trap_y][trap_x] != '<' &&
-                        level->tiles[trap_y][trap_x] != '*' &&
-                        level->tiles[trap_y][trap_x] != '$' &&
-                        level->tiles[trap_y][trap_x] != '&') {
+                    int trap_x = room->pos.x + 2 + (rng_rand(&level->rng) % (room->max.x - 4)); 
+                    int trap_y = room->pos.y + 2 + (rng_rand(&level->rng) % (room->max.y - 4)); 
+                    if (level->tiles[IDX(trap_y, trap_x)] == '.' && 
+                        !bit_test(level->traps, trap_y, trap_x) && 
+                        level->tiles[IDX(trap_y, trap_x)] != '>' && 
+                        level->tiles[IDX(trap_y, trap_x)] != '<' &&
+                        level->tiles[IDX(trap_y, trap_x)] != '*' &&
+                        level->tiles[IDX(trap_y, trap_x)] != '$' &&
+                        level->tiles[IDX(trap_y, trap_x)] != '&') {
                         
                         level->fighting_trap.x = trap_x;
                         level->fighting_trap.y = trap_y;
@@ -2515,79 +3674,80 @@ void draw_room(Level *level, Room *room) {
             }
         }
     }
-    int num_traps = rand() % 2;
+    int num_traps = rng_rand(&level->rng) % 2;
     for (int i = 0; i < num_traps; i++) {
-        int trap_x = room->pos.x + 1 + (rand() % (room->max.x - 2));
-        int trap_y = room->pos.y + 1 + (rand() % (room->max.y - 2));
-        if (level->tiles[trap_y][trap_x] == '.' &&
-            level->tiles[trap_y][trap_x] != '>' && 
-            level->tiles[trap_y][trap_x] != '<') {
-            level->traps[trap_y][trap_x] = true;
-        }
-    }
-    if (rand() % 5 == 0) { 
-        int food_x = room->pos.x + 1 + (rand() % (room->max.x - 2));
-        int food_y = room->pos.y + 1 + (rand() % (room->max.y - 2));
-        if (level->tiles[food_y][food_x] == '.' && 
-            !level->traps[food_y][food_x]) {
-            int food_roll = rand() % 100;
+        int trap_x = room->pos.x + 1 + (rng_rand(&level->rng) % (room->max.x - 2));
+        int trap_y = room->pos.y + 1 + (rng_rand(&level->rng) % (room->max.y - 2));
+        if (level->tiles[IDX(trap_y, trap_x)] == '.' &&
+            level->tiles[IDX(trap_y, trap_x)] != '>' && 
+            level->tiles[IDX(trap_y, trap_x)] != '<') {
+            bit_set(level->traps, trap_y, trap_x);
+        }
+    }
+    if (rng_rand(&level->rng) % 5 == 0) { 
+        int food_x = room->pos.x + 1 + (rng_rand(&level->rng) % (room->max.x - 2));
+        int food_y = room->pos.y + 1 + (rng_rand(&level->rng) % (room->max.y - 2));
+        if (level->tiles[IDX(food_y, food_x)] == '.' && 
+            !bit_test(level->traps, food_y, food_x)) {
+            int food_roll = rng_rand(&level->rng) % 100;
             if (food_roll < 15) {
-                level->tiles[food_y][food_x] = 'C'; 
+                set_tile(level, food_y, food_x, 'C'); 
             } else if (food_roll < 30) {
-                level->tiles[food_y][food_x] = 'B'; 
+                set_tile(level, food_y, food_x, 'B'); 
             } else {
-                level->tiles[food_y][food_x] = '*'; 
+                set_tile(level, food_y, food_x, '*'); 
             }
         }
     }
     if (level->num_rooms == 0) {
-        int weapon_x = room->pos.x + 1 + (rand() % (room->max.x - 2));
-        int weapon_y = room->pos.y + 1 + (rand() % (room->max.y - 2));
-        if (level->tiles[weapon_y][weapon_x] == '.') {
-            int weapon_type = WEAPON_DAGGER + (rand() % (WEAPON_COUNT - 1));
+        int weapon_x = room->pos.x + 1 + (rng_rand(&level->rng) % (room->max.x - 2));
+        int weapon_y = room->pos.y + 1 + (rng_rand(&level->rng) % (room->max.y - 2));
+        if (level->tiles[IDX(weapon_y, weapon_x)] == '.') {
+            int weapon_type = WEAPON_DAGGER + (rng_rand(&level->rng) % (WEAPON_COUNT - 1));
             switch(weapon_type) {
                 case WEAPON_DAGGER:
-                    level->tiles[weapon_y][weapon_x] = 'd';
+                    set_tile(level, weapon_y, weapon_x, 'd');
                     break;
                 case WEAPON_WAND:
-                    level->tiles[weapon_y][weapon_x] = 'm';
+                    set_tile(level, weapon_y, weapon_x, 'm');
                     break;
                 case WEAPON_ARROW:
-                    level->tiles[weapon_y][weapon_x] = 'a';
+                    set_tile(level, weapon_y, weapon_x, 'a');
                     break;
                 case WEAPON_SWORD:
-                    level->tiles[weapon_y][weapon_x] = 's';
+                    set_tile(level, weapon_y, weapon_x, 's');
                     break;
             }
         }
         int attempts = 0;
         while (attempts < 50) {
-            int weapon2_x = room->pos.x + 1 + (rand() % (room->max.x - 2));
-            int weapon2_y = room->pos.y + 1 + (rand() % (room->max.y - 2));
-            int weapon_type = WEAPON_DAGGER + (rand() % (WEAPON_COUNT - 1));
-            if (level->tiles[weapon2_y][weapon2_x] == '.' && 
+            int weapon2_x = room->pos.x + 1 + (rng_rand(&level->rng) % (room->max.x - 2));
+            int weapon2_y = room->pos.y + 1 + (rng_rand(&level->rng) % (room->max.y - 2));
+            int weapon_type = WEAPON_DAGGER + (rng_rand(&level->rng) % (WEAPON_COUNT - 1));
+            if (level->tiles[IDX(weapon2_y, weapon2_x)] == '.' && 
                 (weapon2_x != weapon_x || weapon2_y != weapon_y)) {
                 int weapon2_type;
                 do {
-                    weapon2_type = WEAPON_DAGGER + (rand() % (WEAPON_COUNT - 1));
+                    weapon2_type = WEAPON_DAGGER + (rng_rand(&level->rng) % (WEAPON_COUNT - 1));
                 } 
                 while (weapon2_type == weapon_type);
                 switch(weapon2_type) {
                     case WEAPON_DAGGER:
-                        level->tiles[weapon2_y][weapon2_x] = 'd';
+                        set_tile(level, weapon2_y, weapon2_x, 'd');
                         break;
                     case WEAPON_WAND:
-                        level->tiles[weapon2_y][weapon2_x] = 'm';
+                        set_tile(level, weapon2_y, weapon2_x, 'm');
                         break;
                     case WEAPON_ARROW:
-                        level->tiles[weapon2_y][weapon2_x] = 'a';
+                        set_tile(level, weapon2_y, weapon2_x, 'a');
                         break;
                     case WEAPON_SWORD:
-                        level->tiles[weapon2_y][weapon2_x] = 's';
+                        set_tile(level, weapon2_y, weapon2_x, 's');
                         break;
                 }
                 break;
             }
+            GEN_STAT(placement_retries);
             attempts++;
         }
     }
@@ -2607,130 +3767,149 @@ void connect_rooms(Level *level, Room *r1, Room *r2) {
     int current_y = start_y;
     while (current_x != end_x) {
         if (current_x >= 0 && current_x < NUMCOLS && current_y >= 0 && current_y < NUMLINES) {
-            char current_tile = level->tiles[current_y][current_x];
-            if (level->tiles[current_y][current_x] == ' ' || 
-                level->tiles[current_y][current_x] == '#') {
-                level->tiles[current_y][current_x] = '#';
+            char current_tile = level->tiles[IDX(current_y, current_x)];
+            if (level->tiles[IDX(current_y, current_x)] == ' ' || 
+                level->tiles[IDX(current_y, current_x)] == '#') {
+                set_tile(level, current_y, current_x, '#');
             }
         }
         current_x += (end_x > current_x) ? 1 : -1;
     }
     while (current_y != end_y) {
         if (current_x >= 0 && current_x < NUMCOLS && current_y >= 0 && current_y < NUMLINES) {
-            if (level->tiles[current_y][current_x] == ' ' || 
-                level->tiles[current_y][current_x] == '#') {
-                level->tiles[current_y][current_x] = '#';
+            if (level->tiles[IDX(current_y, current_x)] == ' ' || 
+                level->tiles[IDX(current_y, current_x)] == '#') {
+                set_tile(level, current_y, current_x, '#');
             }
         }
         current_y += (end_y > current_y) ? 1 : -1;
     }
     for (int y = 0; y < NUMLINES; y++) {
         for (int x = 0; x < NUMCOLS; x++) {
-            if (level->tiles[y][x] == '|' || level->tiles[y][x] == '_') {
+            if (level->tiles[IDX(y, x)] == '|' || level->tiles[IDX(y, x)] == '_') {
                 bool is_edge = (x == 0 || x == NUMCOLS-1 || y == 0 || y == NUMLINES-1);
                 if (!is_edge && (
-                    (x > 0 && level->tiles[y][x-1] == '#') ||
-                    (x < NUMCOLS-1 && level->tiles[y][x+1] == '#') ||
-                    (y > 0 && level->tiles[y-1][x] == '#') ||
-                    (y < NUMLINES-1 && level->tiles[y+1][x] == '#'))) {
-                    level->tiles[y][x] = '+';
+                    (x > 0 && level->tiles[IDX(y, x-1)] == '#') ||
+                    (x < NUMCOLS-1 && level->tiles[IDX(y, x+1)] == '#') ||
+                    (y > 0 && level->tiles[IDX(y-1, x)] == '#') ||
+                    (y < NUMLINES-1 && level->tiles[IDX(y+1, x)] == '#'))) {
+                    set_tile(level, y, x, '+');
                 }
             }
         }
     }
 }
 
-void update_visibility(Map *map) {
-    Level *current = &map->levels[map->current_level - 1];
+void refresh_visible_cell(Map *map, Level *current, int y, int x) {
+    if (!map->debug_mode) {
+        current->visible_tiles[IDX(y, x)] = bit_test(current->explored, y, x) ? current->tiles[IDX(y, x)] : ' ';
+        return;
+    }
+    current->visible_tiles[IDX(y, x)] = current->tiles[IDX(y, x)];
 
-    for (int y = 0; y < NUMLINES; y++) {
-        for (int x = 0; x < NUMCOLS; x++) {
-            if (current->explored[y][x] || map->debug_mode) {
-                current->visible_tiles[y][x] = current->tiles[y][x];
-                
-                if (map->debug_mode) {
+    if (bit_test(current->traps, y, x)) {
+        current->visible_tiles[IDX(y, x)] = '^';
+    }
 
-                    if (current->traps[y][x]) {
-                        current->visible_tiles[y][x] = '^';
-                    }
+    if (x == current->fighting_trap.x && y == current->fighting_trap.y && !current->fighting_trap_triggered) {
+        current->visible_tiles[IDX(y, x)] = 'v';
+    }
 
-                    if (x == current->fighting_trap.x && y == current->fighting_trap.y && !current->fighting_trap_triggered) {
-                        current->visible_tiles[y][x] = 'v';
-                    }
+    if (bit_test(current->secret_walls, y, x) && 
+        (current->tiles[IDX(y, x)] == '|' || current->tiles[IDX(y, x)] == '_')) {
+        current->visible_tiles[IDX(y, x)] = '?';
+    }
+}
+void update_visibility(Map *map) {
+    Level *current = &map->levels[map->current_level - 1];
+    // Debug overlays depend on more than tiles and explored, so debug mode
+    // (and the frame after leaving it) always recomputes the whole level.
+    bool full = current->visibility_stale || map->visibility_level != current ||
+                map->debug_mode || map->visibility_debug;
 
-                    if (current->secret_walls[y][x] && 
-                        (current->tiles[y][x] == '|' || current->tiles[y][x] == '_')) {
-                        current->visible_tiles[y][x] = '?';
-                    }
+    for (int y = 0; y < NUMLINES && full && !map->debug_mode; y++) {
+        uint64_t *row = bit_row(current->explored, y);
+        for (int w = 0; w < BITSET_STRIDE; w++) {
+            int start = w * 64;
+            int end = start + 64 < NUMCOLS ? start + 64 : NUMCOLS;
+            if (row[w] == 0) {
+                memset(&current->visible_tiles[IDX(y, start)], ' ', end - start);
+            } else if (row[w] == UINT64_MAX) {
+                memcpy(&current->visible_tiles[IDX(y, start)], &current->tiles[IDX(y, start)], end - start);
+            } else {
+                for (int x = start; x < end; x++) {
+                    current->visible_tiles[IDX(y, x)] = ((row[w] >> (x & 63)) & 1) ? current->tiles[IDX(y, x)] : ' ';
                 }
-            } 
-            else {
-                current->visible_tiles[y][x] = ' ';
             }
         }
     }
+    for (int y = 0; y < NUMLINES && map->debug_mode; y++) {
+        for (int x = 0; x < NUMCOLS; x++) {
+            refresh_visible_cell(map, current, y, x);
+        }
+    }
+    if (full) {
+        clear_dirty(current);
+        current->visibility_stale = false;
+        map->visibility_level = current;
+        map->visibility_debug = map->debug_mode;
+        frame_rescan();
+    }
     bool in_room = false;
     Room *current_room = NULL;
-    for (int i = 0; i < current->num_rooms; i++) {
-        Room *room = &current->rooms[i];
-        if (map->player_x >= room->pos.x && 
-            map->player_x < room->pos.x + room->max.x &&
-            map->player_y >= room->pos.y && 
-            map->player_y < room->pos.y + room->max.y) {
-
-            for (int y = room->pos.y; y < room->pos.y + room->max.y; y++) {
-                for (int x = room->pos.x; x < room->pos.x + room->max.x; x++) {
-                    if (y >= 0 && y < NUMLINES && x >= 0 && x < NUMCOLS) {
-                        current->explored[y][x] = true;
-                        current->visible_tiles[y][x] = current->tiles[y][x];
-                    }
+    Room *room = room_at(current, map->player_x, map->player_y);
+    if (room != NULL) {
+        for (int y = room->pos.y; y < room->pos.y + room->max.y; y++) {
+            for (int x = room->pos.x; x < room->pos.x + room->max.x; x++) {
+                if (y >= 0 && y < NUMLINES && x >= 0 && x < NUMCOLS) {
+                    explore_cell(current, y, x);
+                    current->visible_tiles[IDX(y, x)] = current->tiles[IDX(y, x)];
                 }
             }
-            in_room = true;
-            break;
         }
+        in_room = true;
     }
     if (in_room && current_room != NULL) {
         for (int y = current_room->pos.y; y < current_room->pos.y + current_room->max.y; y++) {
             for (int x = current_room->pos.x; x < current_room->pos.x + current_room->max.x; x++) {
-                current->explored[y][x] = true;
-                current->visible_tiles[y][x] = current->tiles[y][x];
+                explore_cell(current, y, x);
+                current->visible_tiles[IDX(y, x)] = current->tiles[IDX(y, x)];
             }
         }
     } 
-    else if (current->tiles[map->player_y][map->player_x] == '#' || 
-             current->tiles[map->player_y][map->player_x] == '+') {
-        current->explored[map->player_y][map->player_x] = true;
+    else if (current->tiles[IDX(map->player_y, map->player_x)] == '#' || 
+             current->tiles[IDX(map->player_y, map->player_x)] == '+') {
+        explore_cell(current, map->player_y, map->player_x);
         bool horizontal_corridor = false;
         bool vertical_corridor = false;
-        if ((map->player_x > 0 && (current->tiles[map->player_y][map->player_x-1] == '#' || 
-                                  current->tiles[map->player_y][map->player_x-1] == '+')) ||
-            (map->player_x < NUMCOLS-1 && (current->tiles[map->player_y][map->player_x+1] == '#' || 
-                                         current->tiles[map->player_y][map->player_x+1] == '+'))) {
+        if ((map->player_x > 0 && (current->tiles[IDX(map->player_y, map->player_x-1)] == '#' || 
+                                  current->tiles[IDX(map->player_y, map->player_x-1)] == '+')) ||
+            (map->player_x < NUMCOLS-1 && (current->tiles[IDX(map->player_y, map->player_x+1)] == '#' || 
+                                         current->tiles[IDX(map->player_y, map->player_x+1)] == '+'))) {
             horizontal_corridor = true;
         }
-        if ((map->player_y > 0 && (current->tiles[map->player_y-1][map->player_x] == '#' || 
-                                  current->tiles[map->player_y-1][map->player_x] == '+')) ||
-            (map->player_y < NUMLINES-1 && (current->tiles[map->player_y+1][map->player_x] == '#' || 
-                                          current->tiles[map->player_y+1][map->player_x] == '+'))) {
+        if ((map->player_y > 0 && (current->tiles[IDX(map->player_y-1, map->player_x)] == '#' || 
+                                  current->tiles[IDX(map->player_y-1, map->player_x)] == '+')) ||
+            (map->player_y < NUMLINES-1 && (current->tiles[IDX(map->player_y+1, map->player_x)] == '#' || 
+                                          current->tiles[IDX(map->player_y+1, map->player_x)] == '+'))) {
             vertical_corridor = true;
         }
         if (horizontal_corridor) {
             for (int dx = 0; dx >= -5; dx--) {
                 int x = map->player_x + dx;
                 if (x >= 0 && x < NUMCOLS) {
-                    if (current->tiles[map->player_y][x] == '#' || 
-                        current->tiles[map->player_y][x] == '+') {
-                        current->explored[map->player_y][x] = true;
+                    if (current->tiles[IDX(map->player_y, x)] == '#' || 
+                        current->tiles[IDX(map->player_y, x)] == '+') {
+                        explore_cell(current, map->player_y, x);
                     } else break;
                 }
             }
             for (int dx = 0; dx <= 5; dx++) {
                 int x = map->player_x + dx;
                 if (x >= 0 && x < NUMCOLS) {
-                    if (current->tiles[map->player_y][x] == '#' || 
-                        current->tiles[map->player_y][x] == '+') {
-                        current->explored[map->player_y][x] = true;
+                    if (current->tiles[IDX(map->player_y, x)] == '#' || 
+                        current->tiles[IDX(map->player_y, x)] == '+') {
+                        explore_cell(current, map->player_y, x);
                     } else break;
                 }
             }
@@ -2739,42 +3918,35 @@ void update_visibility(Map *map) {
             for (int dy = 0; dy >= -5; dy--) {
                 int y = map->player_y + dy;
                 if (y >= 0 && y < NUMLINES) {
-                    if (current->tiles[y][map->player_x] == '#' || 
-                        current->tiles[y][map->player_x] == '+') {
-                        current->explored[y][map->player_x] = true;
+                    if (current->tiles[IDX(y, map->player_x)] == '#' || 
+                        current->tiles[IDX(y, map->player_x)] == '+') {
+                        explore_cell(current, y, map->player_x);
                     } else break;
                 }
             }
             for (int dy = 0; dy <= 5; dy++) {
                 int y = map->player_y + dy;
                 if (y >= 0 && y < NUMLINES) {
-                    if (current->tiles[y][map->player_x] == '#' || 
-                        current->tiles[y][map->player_x] == '+') {
-                        current->explored[y][map->player_x] = true;
+                    if (current->tiles[IDX(y, map->player_x)] == '#' || 
+                        current->tiles[IDX(y, map->player_x)] == '+') {
+                        explore_cell(current, y, map->player_x);
                     } else break;
                 }
             }
         }
     }
+    for (int i = current->dirty_visible; i < current->dirty_count; i++) {
+        int cell = current->dirty_cells[i];
+        refresh_visible_cell(map, current, cell / NUMCOLS, cell % NUMCOLS);
+    }
+    current->dirty_visible = current->dirty_count;
 }
 
 void generate_map(Map *map) {
     Level *current = &map->levels[map->current_level - 1];
         if (map->current_level == 5) {
 
-        for (int y = 0; y < NUMLINES; y++) {
-            for (int x = 0; x < NUMCOLS; x++) {
-                current->tiles[y][x] = ' ';
-                current->visible_tiles[y][x] = ' ';
-                current->explored[y][x] = false;
-                current->traps[y][x] = false;
-                current->discovered_traps[y][x] = false;
-                current->secret_walls[y][x] = false;
-                current->secret_stairs[y][x] = false;
-                current->coins[y][x] = false;
-                current->coin_values[y][x] = 0; 
-            }
-        }
+        clear_level_cells(current);
         current->num_rooms = 0;
         current->num_secret_rooms = 0;
         current->current_secret_room = NULL;
@@ -2788,25 +3960,25 @@ void generate_map(Map *map) {
         for (int y = treasure_room.pos.y; y < treasure_room.pos.y + treasure_room.max.y; y++) {
             for (int x = treasure_room.pos.x; x < treasure_room.pos.x + treasure_room.max.x; x++) {
                 if (y == treasure_room.pos.y || y == treasure_room.pos.y + treasure_room.max.y - 1)
-                    current->tiles[y][x] = '_';
+                    set_tile(current, y, x, '_');
                 else if (x == treasure_room.pos.x || x == treasure_room.pos.x + treasure_room.max.x - 1)
-                    current->tiles[y][x] = '|';
+                    set_tile(current, y, x, '|');
                 else
-                    current->tiles[y][x] = '.';
+                    set_tile(current, y, x, '.');
             }
         }
         for (int y = treasure_room.pos.y + 1; y < treasure_room.pos.y + treasure_room.max.y - 1; y++) {
             for (int x = treasure_room.pos.x + 1; x < treasure_room.pos.x + treasure_room.max.x - 1; x++) {
-                if (current->tiles[y][x] == '.' && !current->traps[y][x]) {
-                    if (rand() % 100 < 60) {
-                        current->coins[y][x] = true;
-                        current->coin_values[y][x] = 1;
-                        current->tiles[y][x] = '$';
+                if (current->tiles[IDX(y, x)] == '.' && !bit_test(current->traps, y, x)) {
+                    if (rng_rand(&current->rng) % 100 < 60) {
+                        bit_set(current->coins, y, x);
+                        current->coin_values[IDX(y, x)] = 1;
+                        set_tile(current, y, x, '$');
                     }
-                    else if (rand() % 100 < 20) {
-                        current->coins[y][x] = true;
-                        current->coin_values[y][x] = 5;
-                        current->tiles[y][x] = '&';
+                    else if (rng_rand(&current->rng) % 100 < 20) {
+                        bit_set(current->coins, y, x);
+                        current->coin_values[IDX(y, x)] = 5;
+                        set_tile(current, y, x, '&');
                     }
                 }
             }
@@ -2829,9 +4001,10 @@ void generate_map(Map *map) {
                 current->num_rooms = 0;
                 for (int y = 0; y < NUMLINES; y++) {
                     for (int x = 0; x < NUMCOLS; x++) {
-                        current->tiles[y][x] = ' ';
+                        set_tile(current, y, x, ' ');
                     }
                 }
+                GEN_STAT(restarts);
                 generate_map(map);
                 return;
             }
@@ -2843,17 +4016,15 @@ void generate_map(Map *map) {
     undead->was_attacked = false;
     int tries = 0;
     do {
-        undead->x = treasure_room.pos.x + 1 + (rand() % (treasure_room.max.x - 2));
-        undead->y = treasure_room.pos.y + 1 + (rand() % (treasure_room.max.y - 2));
+        undead->x = treasure_room.pos.x + 1 + (rng_rand(&current->rng) % (treasure_room.max.x - 2));
+        undead->y = treasure_room.pos.y + 1 + (rng_rand(&current->rng) % (treasure_room.max.y - 2));
         tries++;
     } 
-    while ((current->tiles[undead->y][undead->x] != '.' || 
-            current->traps[undead->y][undead->x]) && 
+    while ((current->tiles[IDX(undead->y, undead->x)] != '.' || 
+            bit_test(current->traps, undead->y, undead->x)) && 
             tries < 100);
 
-    if (tries < 100) {
-        current->tiles[undead->y][undead->x] = 'U';
-    }
+    place_monster(current, undead);
     Monster *undead2 = &current->monsters[MONSTER_DEMON];
     undead2->type = MONSTER_UNDEAD;
     undead2->name = "Undead";
@@ -2866,17 +4037,15 @@ void generate_map(Map *map) {
     
     tries = 0;
     do {
-        undead2->x = treasure_room.pos.x + 1 + (rand() % (treasure_room.max.x - 2));
-        undead2->y = treasure_room.pos.y + 1 + (rand() % (treasure_room.max.y - 2));
+        undead2->x = treasure_room.pos.x + 1 + (rng_rand(&current->rng) % (treasure_room.max.x - 2));
+        undead2->y = treasure_room.pos.y + 1 + (rng_rand(&current->rng) % (treasure_room.max.y - 2));
         tries++;
-    } while ((current->tiles[undead2->y][undead2->x] != '.' || 
-              current->traps[undead2->y][undead2->x] ||
+    } while ((current->tiles[IDX(undead2->y, undead2->x)] != '.' || 
+              bit_test(current->traps, undead2->y, undead2->x) ||
               (undead2->x == undead->x && undead2->y == undead->y)) && 
              tries < 100);
 
-    if (tries < 100) {
-        current->tiles[undead2->y][undead2->x] = 'U';
-    }
+    place_monster(current, undead2);
     Monster *snake = &current->monsters[MONSTER_SNAKE];
     snake->active = true;
     snake->aggressive = true;
@@ -2885,18 +4054,16 @@ void generate_map(Map *map) {
     
     tries = 0;
     do {
-        snake->x = treasure_room.pos.x + 1 + (rand() % (treasure_room.max.x - 2));
-        snake->y = treasure_room.pos.y + 1 + (rand() % (treasure_room.max.y - 2));
+        snake->x = treasure_room.pos.x + 1 + (rng_rand(&current->rng) % (treasure_room.max.x - 2));
+        snake->y = treasure_room.pos.y + 1 + (rng_rand(&current->rng) % (treasure_room.max.y - 2));
         tries++;
-    } while ((current->tiles[snake->y][snake->x] != '.' || 
-              current->traps[snake->y][snake->x] ||
+    } while ((current->tiles[IDX(snake->y, snake->x)] != '.' || 
+              bit_test(current->traps, snake->y, snake->x) ||
               (snake->x == undead->x && snake->y == undead->y) ||
               (snake->x == undead2->x && snake->y == undead2->y)) && 
              tries < 100);
 
-    if (tries < 100) {
-        current->tiles[snake->y][snake->x] = 'S';
-    }
+    place_monster(current, snake);
     for (int i = 0; i < MONSTER_COUNT; i++) {
         if (i != MONSTER_UNDEAD && i != MONSTER_DEMON && i != MONSTER_SNAKE) {
             current->monsters[i].active = false;
@@ -2907,21 +4074,8 @@ void generate_map(Map *map) {
     current->num_rooms = 0;
     int attempts = 0;
     const int MAX_ATTEMPTS = 50;
-    int target_rooms = 6 + (rand() % 4);
-    for (int y = 0; y < NUMLINES; y++) {
-        for (int x = 0; x < NUMCOLS; x++) {
-            current->tiles[y][x] = ' ';
-            current->visible_tiles[y][x] = ' ';
-            current->explored[y][x] = false;
-            current->traps[y][x] = false;
-            current->discovered_traps[y][x] = false;
-            current->secret_stairs[y][x] = false; 
-            current->secret_walls[y][x] = false;
-            current->coins[y][x] = false;    
-            current->coin_values[y][x] = 0; 
-
-        }
-    }
+    int target_rooms = 6 + (rng_rand(&current->rng) % 4);
+    clear_level_cells(current);
     int cell_width = NUMCOLS / 3;
     int cell_height = NUMLINES / 3;
     if (cell_width < MIN_ROOM_SIZE + 2 || cell_height < MIN_ROOM_SIZE + 2) {
@@ -2932,11 +4086,12 @@ void generate_map(Map *map) {
         Room new_room;
         int grid_x = current->num_rooms % 3;
         int grid_y = current->num_rooms / 3;
-        new_room.max.x = MIN_ROOM_SIZE + rand() % (MIN(MAX_ROOM_SIZE - MIN_ROOM_SIZE + 1, cell_width - 2));
-        new_room.max.y = MIN_ROOM_SIZE + rand() % (MIN(MAX_ROOM_SIZE - MIN_ROOM_SIZE + 1, cell_height - 2));
-        new_room.pos.x = grid_x * cell_width + rand() % (cell_width - new_room.max.x - 1) + 1;
-        new_room.pos.y = grid_y * cell_height + rand() % (cell_height - new_room.max.y - 1) + 1;
+        new_room.max.x = MIN_ROOM_SIZE + rng_rand(&current->rng) % (MIN(MAX_ROOM_SIZE - MIN_ROOM_SIZE + 1, cell_width - 2));
+        new_room.max.y = MIN_ROOM_SIZE + rng_rand(&current->rng) % (MIN(MAX_ROOM_SIZE - MIN_ROOM_SIZE + 1, cell_height - 2));
+        new_room.pos.x = grid_x * cell_width + rng_rand(&current->rng) % (cell_width - new_room.max.x - 1) + 1;
+        new_room.pos.y = grid_y * cell_height + rng_rand(&current->rng) % (cell_height - new_room.max.y - 1) + 1;
         if (new_room.pos.y + new_room.max.y > NUMLINES - 6) { 
+            GEN_STAT(room_retries);
             attempts++;
             continue;  
         }
@@ -2951,16 +4106,21 @@ void generate_map(Map *map) {
         }
         if (valid) {
             current->rooms[current->num_rooms] = new_room;
-            draw_room(current, &new_room);
+            draw_room(current, &new_room, map->current_level);
+            index_room(current, current->num_rooms);
             current->num_rooms++;
+        } else {
+            GEN_STAT(room_retries);
         }
         attempts++;
         if (attempts >= MAX_ATTEMPTS && current->num_rooms < 6) {
+            GEN_STAT(room_resets);
             current->num_rooms = 0;
             attempts = 0;
+            memset(current->room_ids, 0, LAYER_CELLS * sizeof(unsigned char));
             for (int y = 0; y < NUMLINES; y++) {
                 for (int x = 0; x < NUMCOLS; x++) {
-                    current->tiles[y][x] = ' ';
+                    set_tile(current, y, x, ' ');
                 }
             }
         }
@@ -2990,16 +4150,16 @@ void generate_map(Map *map) {
             Monster *monster = &current->monsters[i];
             int tries = 0;
             do {
-                monster->x = room->pos.x + 1 + (rand() % (room->max.x - 2));
-                monster->y = room->pos.y + 1 + (rand() % (room->max.y - 2));
+                monster->x = room->pos.x + 1 + (rng_rand(&current->rng) % (room->max.x - 2));
+                monster->y = room->pos.y + 1 + (rng_rand(&current->rng) % (room->max.y - 2));
                 tries++;
             } 
-            while ((current->tiles[monster->y][monster->x] != '.' || 
-                     current->traps[monster->y][monster->x]) && 
+            while ((current->tiles[IDX(monster->y, monster->x)] != '.' || 
+                     bit_test(current->traps, monster->y, monster->x)) && 
                     tries < 100);
             if (tries < 100) {
                 monster->active = true;
-                current->tiles[monster->y][monster->x] = monster->symbol;
+                place_monster(current, monster);
             }
         }
     }
@@ -3010,46 +4170,27 @@ void generate_map(Map *map) {
         
         for (int y = first_room->pos.y; y < first_room->pos.y + first_room->max.y; y++) {
             for (int x = first_room->pos.x; x < first_room->pos.x + first_room->max.x; x++) {
-                current->explored[y][x] = true;
+                explore_cell(current, y, x);
             }
         }
     }
     if (current->num_rooms > 1) {
-        int room_index = 1 + (rand() % (current->num_rooms - 1));
+        int room_index = 1 + (rng_rand(&current->rng) % (current->num_rooms - 1));
         place_fighting_trap(current, &current->rooms[room_index]);
     }
 }
 
 void transition_level(Map *map, bool going_up) {
     Level *current = &map->levels[map->current_level - 1];
+    current->save_dirty = true;
     if (going_up) {
         if (map->current_level <= MAX_LEVELS) {
-            Room *current_room = NULL;
-            for (int i = 0; i < current->num_rooms; i++) {
-                Room *room = &current->rooms[i];
-                if (map->player_x >= room->pos.x && map->player_x < room->pos.x + room->max.x &&
-                    map->player_y >= room->pos.y && map->player_y < room->pos.y + room->max.y) {
-                    current_room = room;
-                    break;
-                }
-            }
+            Room *current_room = room_at(current, map->player_x, map->player_y);
             map->current_level++;
             Level *next = &map->levels[map->current_level - 1]; 
             if (map->current_level == 5) {
                 //play_background_music("4");
-                for (int y = 0; y < NUMLINES; y++) {
-                    for (int x = 0; x < NUMCOLS; x++) {
-                        next->tiles[y][x] = ' ';
-                        next->visible_tiles[y][x] = ' ';
-                        next->explored[y][x] = false;
-                        next->traps[y][x] = false;
-                        next->discovered_traps[y][x] = false;
-                        next->coins[y][x] = false;
-                        next->coin_values[y][x] = 0;
-                        next->secret_walls[y][x] = false;
-                        next->secret_stairs[y][x] = false;
-                    }
-                }
+                clear_level_cells(next);
                 Room treasure_room;
                 int center_x = NUMCOLS / 2;
                 int center_y = NUMLINES / 2;
@@ -3064,37 +4205,37 @@ void transition_level(Map *map, bool going_up) {
                 for (int y = treasure_room.pos.y; y < treasure_room.pos.y + treasure_room.max.y; y++) {
                     for (int x = treasure_room.pos.x; x < treasure_room.pos.x + treasure_room.max.x; x++) {
                         if (y == treasure_room.pos.y || y == treasure_room.pos.y + treasure_room.max.y - 1)
-                            next->tiles[y][x] = '_';
+                            set_tile(next, y, x, '_');
                         else if (x == treasure_room.pos.x || x == treasure_room.pos.x + treasure_room.max.x - 1)
-                            next->tiles[y][x] = '|';
+                            set_tile(next, y, x, '|');
                         else
-                            next->tiles[y][x] = '.';
+                            set_tile(next, y, x, '.');
                     }
                 }
                 for (int y = treasure_room.pos.y + 1; y < treasure_room.pos.y + treasure_room.max.y - 1; y++) {
                     for (int x = treasure_room.pos.x + 1; x < treasure_room.pos.x + treasure_room.max.x - 1; x++) {
-                        if (next->tiles[y][x] == '.' && next->tiles[y][x] != '>') {
-                            if (rand() % 100 < 5) {
-                                next->coins[y][x] = true;
-                                next->coin_values[y][x] = 1;
-                                next->tiles[y][x] = '$';
+                        if (next->tiles[IDX(y, x)] == '.' && next->tiles[IDX(y, x)] != '>') {
+                            if (rng_rand(&next->rng) % 100 < 5) {
+                                bit_set(next->coins, y, x);
+                                next->coin_values[IDX(y, x)] = 1;
+                                set_tile(next, y, x, '$');
                             }
-                            else if (rand() % 100 < 3) {
-                                next->coins[y][x] = true;
-                                next->coin_values[y][x] = 5;
-                                next->tiles[y][x] = '&';
+                            else if (rng_rand(&next->rng) % 100 < 3) {
+                                bit_set(next->coins, y, x);
+                                next->coin_values[IDX(y, x)] = 5;
+                                set_tile(next, y, x, '&');
                             }
                         }
                     }
                 }
-                int num_traps = 8 + rand() % 5;
+                int num_traps = 8 + rng_rand(&next->rng) % 5;
                 for (int i = 0; i < num_traps; i++) {
-                    int trap_x = treasure_room.pos.x + 1 + rand() % (treasure_room.max.x - 2);
-                    int trap_y = treasure_room.pos.y + 1 + rand() % (treasure_room.max.y - 2);
-                    if (next->tiles[trap_y][trap_x] == '.' || 
-                        next->tiles[trap_y][trap_x] == '$' || 
-                        next->tiles[trap_y][trap_x] == '&' && next->tiles[trap_y][trap_x] != '>') {
-                        next->traps[trap_y][trap_x] = true;
+                    int trap_x = treasure_room.pos.x + 1 + rng_rand(&next->rng) % (treasure_room.max.x - 2);
+                    int trap_y = treasure_room.pos.y + 1 + rng_rand(&next->rng) % (treasure_room.max.y - 2);
+                    if (next->tiles[IDX(trap_y, trap_x)] == '.' || 
+                        next->tiles[IDX(trap_y, trap_x)] == '$' || 
+                        next->tiles[IDX(trap_y, trap_x)] == '&' && next->tiles[IDX(trap_y, trap_x)] != '>') {
+                        bit_set(next->traps, trap_y, trap_x);
                     }
                 }
                 Monster *undead1 = &next->monsters[MONSTER_UNDEAD];
@@ -3118,42 +4259,36 @@ void transition_level(Map *map, bool going_up) {
                 snake->was_attacked = false;
                 int tries = 0;
                 do {
-                    undead1->x = treasure_room.pos.x + 1 + (rand() % (treasure_room.max.x - 2));
-                    undead1->y = treasure_room.pos.y + 1 + (rand() % (treasure_room.max.y - 2));
-                } while ((next->tiles[undead1->y][undead1->x] != '.' || 
-                        next->traps[undead1->y][undead1->x]) && 
+                    undead1->x = treasure_room.pos.x + 1 + (rng_rand(&next->rng) % (treasure_room.max.x - 2));
+                    undead1->y = treasure_room.pos.y + 1 + (rng_rand(&next->rng) % (treasure_room.max.y - 2));
+                } while ((next->tiles[IDX(undead1->y, undead1->x)] != '.' || 
+                        bit_test(next->traps, undead1->y, undead1->x)) && 
                         ++tries < 100);
 
-                if (tries < 100) {
-                    next->tiles[undead1->y][undead1->x] = 'U';
-                }
+                place_monster(next, undead1);
 
                 tries = 0;
                 do {
-                    undead2->x = treasure_room.pos.x + 1 + (rand() % (treasure_room.max.x - 2));
-                    undead2->y = treasure_room.pos.y + 1 + (rand() % (treasure_room.max.y - 2));
-                } while ((next->tiles[undead2->y][undead2->x] != '.' || 
-                        next->traps[undead2->y][undead2->x] ||
+                    undead2->x = treasure_room.pos.x + 1 + (rng_rand(&next->rng) % (treasure_room.max.x - 2));
+                    undead2->y = treasure_room.pos.y + 1 + (rng_rand(&next->rng) % (treasure_room.max.y - 2));
+                } while ((next->tiles[IDX(undead2->y, undead2->x)] != '.' || 
+                        bit_test(next->traps, undead2->y, undead2->x) ||
                         (undead2->x == undead1->x && undead2->y == undead1->y)) && 
                         ++tries < 100);
 
-                if (tries < 100) {
-                    next->tiles[undead2->y][undead2->x] = 'U';
-                }
+                place_monster(next, undead2);
 
                 tries = 0;
                 do {
-                    snake->x = treasure_room.pos.x + 1 + (rand() % (treasure_room.max.x - 2));
-                    snake->y = treasure_room.pos.y + 1 + (rand() % (treasure_room.max.y - 2));
-                } while ((next->tiles[snake->y][snake->x] != '.' || 
-                        next->traps[snake->y][snake->x] ||
+                    snake->x = treasure_room.pos.x + 1 + (rng_rand(&next->rng) % (treasure_room.max.x - 2));
+                    snake->y = treasure_room.pos.y + 1 + (rng_rand(&next->rng) % (treasure_room.max.y - 2));
+                } while ((next->tiles[IDX(snake->y, snake->x)] != '.' || 
+                        bit_test(next->traps, snake->y, snake->x) ||
                         (snake->x == undead1->x && snake->y == undead1->y) ||
                         (snake->x == undead2->x && snake->y == undead2->y)) && 
                         ++tries < 100);
 
-                if (tries < 100) {
-                    next->tiles[snake->y][snake->x] = 'S';
-                }
+                place_monster(next, snake);
                 for (int i = 0; i < MONSTER_COUNT; i++) {
                     if (i != MONSTER_UNDEAD && i != MONSTER_DEMON && i != MONSTER_SNAKE) {
                         next->monsters[i].active = false;
@@ -3161,12 +4296,13 @@ void transition_level(Map *map, bool going_up) {
                 }
                 next->stairs_down.x = treasure_room.center.x;
                 next->stairs_down.y = treasure_room.pos.y + 1;
-                next->tiles[next->stairs_down.y][next->stairs_down.x] = '<';
+                set_tile(next, next->stairs_down.y, next->stairs_down.x, '<');
                 int victory_x = treasure_room.center.x;
                 int victory_y = treasure_room.pos.y + treasure_room.max.y - 2;
-                next->tiles[victory_y][victory_x] = '>';
+                set_tile(next, victory_y, victory_x, '>');
                 next->rooms[0] = treasure_room;
                 next->num_rooms = 1;
+                index_room(next, 0);
                 map->player_x = next->stairs_down.x;
                 map->player_y = next->stairs_down.y;
                 set_message(map, "You've reached the Treasure Room! Be careful of traps!");
@@ -3174,35 +4310,13 @@ void transition_level(Map *map, bool going_up) {
             }
             else if (!next->stairs_placed) {
                 //play_background_music("1");
-                for (int y = 0; y < NUMLINES; y++) {
-                    for (int x = 0; x < NUMCOLS; x++) {
-                        next->tiles[y][x] = ' ';
-                        next->visible_tiles[y][x] = ' ';
-                        next->explored[y][x] = false;
-                        next->traps[y][x] = false;
-                        next->discovered_traps[y][x] = false;
-                        next->coins[y][x] = false;
-                        next->coin_values[y][x] = 0;
-                        next->secret_walls[y][x] = false;
-                        next->secret_stairs[y][x] = false;
+                if (!take_pregen(map, current, next)) {
+                    clear_level_cells(next);
+                    if (current_room != NULL) {
+                        build_level(next, current_room, current->tiles, map->player_x, map->player_y,
+                                    map->current_level, NULL);
                     }
                 }
-                if (current_room != NULL) {
-                    next->rooms[0] = *current_room;
-                    next->num_rooms = 1;
-                    for (int y = current_room->pos.y; y < current_room->pos.y + current_room->max.y; y++) {
-                        for (int x = current_room->pos.x; x < current_room->pos.x + current_room->max.x; x++) {
-                            next->tiles[y][x] = current->tiles[y][x];
-                            if (x == map->player_x && y == map->player_y) {
-                                next->tiles[y][x] = '<';
-                                next->stairs_down.x = x;
-                                next->stairs_down.y = y;
-                            }
-                        }
-                    }
-                    generate_remaining_rooms(map);
-                    next->stairs_placed = true;
-                }
             }
             map->player_x = next->stairs_down.x;
             map->player_y = next->stairs_down.y;
@@ -3233,21 +4347,23 @@ void transition_level(Map *map, bool going_up) {
         map->prev_stair_x = map->player_x;
         map->prev_stair_y = map->player_y;
     }
+    start_pregen(map);
     update_visibility(map);
 }
 
-void generate_remaining_rooms(Map *map) {
-    Level *current = &map->levels[map->current_level - 1];
+void generate_remaining_rooms(Level *current, int level_number, atomic_bool *cancel) {
     int attempts = 0;
     const int MAX_ATTEMPTS = 50;
     bool weapon_placed = false; 
     while (current->num_rooms < MAXROOMS && attempts < MAX_ATTEMPTS) {
+        if (cancel != NULL && atomic_load(cancel)) return;
         Room new_room;
-        new_room.max.x = MIN_ROOM_SIZE + rand() % (MAX_ROOM_SIZE - MIN_ROOM_SIZE + 1);
-        new_room.max.y = MIN_ROOM_SIZE + rand() % (MAX_ROOM_SIZE - MIN_ROOM_SIZE + 1);
-        new_room.pos.x = 1 + rand() % (NUMCOLS - new_room.max.x - 2);
-        new_room.pos.y = 1 + rand() % (NUMLINES - new_room.max.y - 2);
+        new_room.max.x = MIN_ROOM_SIZE + rng_rand(&current->rng) % (MAX_ROOM_SIZE - MIN_ROOM_SIZE + 1);
+        new_room.max.y = MIN_ROOM_SIZE + rng_rand(&current->rng) % (MAX_ROOM_SIZE - MIN_ROOM_SIZE + 1);
+        new_room.pos.x = 1 + rng_rand(&current->rng) % (NUMCOLS - new_room.max.x - 2);
+        new_room.pos.y = 1 + rng_rand(&current->rng) % (NUMLINES - new_room.max.y - 2);
         if (new_room.pos.y + new_room.max.y > NUMLINES - 6) {
+            GEN_STAT(room_retries);
             attempts++;
             continue;
         }
@@ -3262,26 +4378,27 @@ void generate_remaining_rooms(Map *map) {
         }
         if (valid) {
             current->rooms[current->num_rooms] = new_room;
-            draw_room(current, &new_room);
+            draw_room(current, &new_room, level_number);
+            index_room(current, current->num_rooms);
             if (current->num_rooms > 0) {
                 connect_rooms(current, &current->rooms[current->num_rooms - 1], &new_room);
-                if (!weapon_placed && current->num_rooms >= 2 && (rand() % 3 == 0)) {
-                    int weapon_x = new_room.pos.x + 1 + (rand() % (new_room.max.x - 2));
-                    int weapon_y = new_room.pos.y + 1 + (rand() % (new_room.max.y - 2));
-                    if (current->tiles[weapon_y][weapon_x] == '.') {
-                        int weapon_type = WEAPON_DAGGER + (rand() % (WEAPON_COUNT - 1));
+                if (!weapon_placed && current->num_rooms >= 2 && (rng_rand(&current->rng) % 3 == 0)) {
+                    int weapon_x = new_room.pos.x + 1 + (rng_rand(&current->rng) % (new_room.max.x - 2));
+                    int weapon_y = new_room.pos.y + 1 + (rng_rand(&current->rng) % (new_room.max.y - 2));
+                    if (current->tiles[IDX(weapon_y, weapon_x)] == '.') {
+                        int weapon_type = WEAPON_DAGGER + (rng_rand(&current->rng) % (WEAPON_COUNT - 1));
                         switch(weapon_type) {
                             case WEAPON_DAGGER:
-                                current->tiles[weapon_y][weapon_x] = 'd';
+                                set_tile(current, weapon_y, weapon_x, 'd');
                                 break;
                             case WEAPON_WAND:
-                                current->tiles[weapon_y][weapon_x] = 'm';
+                                set_tile(current, weapon_y, weapon_x, 'm');
                                 break;
                             case WEAPON_ARROW:
-                                current->tiles[weapon_y][weapon_x] = 'a';
+                                set_tile(current, weapon_y, weapon_x, 'a');
                                 break;
                             case WEAPON_SWORD:
-                                current->tiles[weapon_y][weapon_x] = 's';
+                                set_tile(current, weapon_y, weapon_x, 's');
                                 break;
                         }
                         weapon_placed = true;
@@ -3289,37 +4406,39 @@ void generate_remaining_rooms(Map *map) {
                 }
             }
             if (current->num_rooms == MAXROOMS - 1) {
-                int stair_x = new_room.pos.x + 1 + rand() % (new_room.max.x - 2);
-                int stair_y = new_room.pos.y + 1 + rand() % (new_room.max.y - 2);
-                current->tiles[stair_y][stair_x] = '>';
+                int stair_x = new_room.pos.x + 1 + rng_rand(&current->rng) % (new_room.max.x - 2);
+                int stair_y = new_room.pos.y + 1 + rng_rand(&current->rng) % (new_room.max.y - 2);
+                set_tile(current, stair_y, stair_x, '>');
                 current->stairs_up.x = stair_x;
                 current->stairs_up.y = stair_y;
             }
             current->num_rooms++;
+        } else {
+            GEN_STAT(room_retries);
         }
         attempts++;
     }
     if (!weapon_placed && current->num_rooms > 1) {
-        int room_index = 1 + (rand() % (current->num_rooms - 1));
+        int room_index = 1 + (rng_rand(&current->rng) % (current->num_rooms - 1));
         Room *random_room = &current->rooms[room_index];
         int tries = 0;
         while (tries < 50) {
-            int weapon_x = random_room->pos.x + 1 + (rand() % (random_room->max.x - 2));
-            int weapon_y = random_room->pos.y + 1 + (rand() % (random_room->max.y - 2));
-            if (current->tiles[weapon_y][weapon_x] == '.') {
-                int weapon_type = WEAPON_DAGGER + (rand() % (WEAPON_COUNT - 1));
+            int weapon_x = random_room->pos.x + 1 + (rng_rand(&current->rng) % (random_room->max.x - 2));
+            int weapon_y = random_room->pos.y + 1 + (rng_rand(&current->rng) % (random_room->max.y - 2));
+            if (current->tiles[IDX(weapon_y, weapon_x)] == '.') {
+                int weapon_type = WEAPON_DAGGER + (rng_rand(&current->rng) % (WEAPON_COUNT - 1));
                 switch(weapon_type) {
                     case WEAPON_DAGGER:
-                        current->tiles[weapon_y][weapon_x] = 'd';
+                        set_tile(current, weapon_y, weapon_x, 'd');
                         break;
                     case WEAPON_WAND:
-                        current->tiles[weapon_y][weapon_x] = 'm';
+                        set_tile(current, weapon_y, weapon_x, 'm');
                         break;
                     case WEAPON_ARROW:
-                        current->tiles[weapon_y][weapon_x] = 'a';
+                        set_tile(current, weapon_y, weapon_x, 'a');
                         break;
                     case WEAPON_SWORD:
-                        current->tiles[weapon_y][weapon_x] = 's';
+                        set_tile(current, weapon_y, weapon_x, 's');
                         break;
                 }
                 break;
@@ -3327,8 +4446,7 @@ void generate_remaining_rooms(Map *map) {
             tries++;
         }
     }
-    if (map->current_level < 5) {
-        Level *current = &map->levels[map->current_level - 1];
+    if (level_number < 5) {
         for (int i = 0; i < MONSTER_COUNT; i++) {
             current->monsters[i].active = false;
             current->monsters[i].was_attacked = false;
@@ -3341,39 +4459,130 @@ void generate_remaining_rooms(Map *map) {
             Monster *monster = &current->monsters[i];
             int tries = 0;
             do {
-                monster->x = room->pos.x + 1 + (rand() % (room->max.x - 2));
-                monster->y = room->pos.y + 1 + (rand() % (room->max.y - 2));
+                monster->x = room->pos.x + 1 + (rng_rand(&current->rng) % (room->max.x - 2));
+                monster->y = room->pos.y + 1 + (rng_rand(&current->rng) % (room->max.y - 2));
                 tries++;
             } 
-            while ((current->tiles[monster->y][monster->x] != '.' || 
-                     current->traps[monster->y][monster->x]) && 
+            while ((current->tiles[IDX(monster->y, monster->x)] != '.' || 
+                     bit_test(current->traps, monster->y, monster->x)) && 
                     tries < 100);
             
             if (tries < 100) {
                 monster->active = true;
-                current->tiles[monster->y][monster->x] = monster->symbol;
+                place_monster(current, monster);
             }
         }
     }
 }
-
-bool is_in_same_room(Level *level, int x1, int y1, int x2, int y2) {
-    if ((level->tiles[y1][x1] != '.' && level->tiles[y1][x1] != '@') ||
-        (level->tiles[y2][x2] != '.' && level->tiles[y2][x2] != '@')) {
+// Builds level `level_number` around `room`, copied from the level below
+// with its tiles taken from `room_tiles` and the down stairs at (stair_x, stair_y).
+void build_level(Level *next, Room *room, const char *room_tiles, int stair_x, int stair_y,
+                 int level_number, atomic_bool *cancel) {
+    next->rooms[0] = *room;
+    next->num_rooms = 1;
+    index_room(next, 0);
+    for (int y = room->pos.y; y < room->pos.y + room->max.y; y++) {
+        for (int x = room->pos.x; x < room->pos.x + room->max.x; x++) {
+            set_tile(next, y, x, room_tiles[IDX(y, x)]);
+            if (x == stair_x && y == stair_y) {
+                set_tile(next, y, x, '<');
+                next->stairs_down.x = x;
+                next->stairs_down.y = y;
+            }
+        }
+    }
+    generate_remaining_rooms(next, level_number, cancel);
+    next->stairs_placed = true;
+}
+void *pregen_worker(void *arg) {
+    Pregen *job = arg;
+    clear_level_cells(&job->level);
+    build_level(&job->level, &job->room, job->room_tiles, job->stairs.x, job->stairs.y,
+                job->level_number, &job->cancel);
+    atomic_store(&job->done, true);
+    return NULL;
+}
+void stop_pregen(Map *map) {
+    Pregen *job = map->pregen;
+    if (job == NULL || !job->running) return;
+    atomic_store(&job->cancel, true);
+    pthread_join(job->thread, NULL);
+    job->running = false;
+}
+// Starts building the level above the current one, if it has not been
+// visited yet. The treasure level is cheap and is still built at the stairs.
+void start_pregen(Map *map) {
+    stop_pregen(map);
+    int number = map->current_level + 1;
+    if (number >= 5 || number > MAX_LEVELS) return;
+    Level *current = &map->levels[map->current_level - 1];
+    Level *next = &map->levels[number - 1];
+    Coord stairs = current->stairs_up;
+    if (next->stairs_placed || stairs.x < 0 || stairs.x >= NUMCOLS || stairs.y < 0 || stairs.y >= NUMLINES ||
+        current->tiles[IDX(stairs.y, stairs.x)] != '>') {
+        return;
+    }
+    Room *room = room_at(current, stairs.x, stairs.y);
+    if (room == NULL) return;
+    Pregen *job = map->pregen;
+    if (job == NULL) {
+        job = calloc(1, sizeof(Pregen));
+        if (job == NULL) return;
+        job->room_tiles = malloc(LAYER_CELLS * sizeof(char));
+        if (job->room_tiles == NULL || !alloc_level_cells(&job->level)) {
+            free(job->room_tiles);
+            free(job);
+            return;
+        }
+        map->pregen = job;
+    }
+    void *cells = job->level.cells;
+    job->level = *next;
+    job->level.cells = cells;
+    carve_level_cells(&job->level);
+    job->level_number = number;
+    job->stairs = stairs;
+    job->room = *room;
+    memcpy(job->room_tiles, current->tiles, LAYER_CELLS * sizeof(char));
+    atomic_store(&job->done, false);
+    atomic_store(&job->cancel, false);
+    job->running = pthread_create(&job->thread, NULL, pregen_worker, job) == 0;
+}
+// Swaps the pre-built level into `next` if the worker has finished it for
+// the stairs the player is on. Otherwise the caller builds it synchronously.
+bool take_pregen(Map *map, Level *current, Level *next) {
+    Pregen *job = map->pregen;
+    if (job == NULL || !job->running) return false;
+    if (!atomic_load(&job->done) || job->level_number != map->current_level ||
+        job->stairs.x != map->player_x || job->stairs.y != map->player_y) {
+        atomic_store(&job->cancel, true);
         return false;
     }
-    Room *room1 = NULL;
-    for (int i = 0; i < level->num_rooms; i++) {
-        Room *room = &level->rooms[i];
-        if (x1 >= room->pos.x && x1 < room->pos.x + room->max.x &&
-            y1 >= room->pos.y && y1 < room->pos.y + room->max.y) {
-            room1 = room;
-            break;
+    pthread_join(job->thread, NULL);
+    job->running = false;
+    Room *room = &job->room;
+    for (int y = room->pos.y; y < room->pos.y + room->max.y; y++) {
+        for (int x = room->pos.x; x < room->pos.x + room->max.x; x++) {
+            char tile = current->tiles[IDX(y, x)];
+            if (tile != job->room_tiles[IDX(y, x)] && (x != job->stairs.x || y != job->stairs.y)) {
+                set_tile(&job->level, y, x, tile);
+            }
         }
     }
+    Level built = job->level;
+    job->level = *next;
+    *next = built;
+    return true;
+}
+
+bool is_in_same_room(Level *level, int x1, int y1, int x2, int y2) {
+    if ((level->tiles[IDX(y1, x1)] != '.' && level->tiles[IDX(y1, x1)] != '@') ||
+        (level->tiles[IDX(y2, x2)] != '.' && level->tiles[IDX(y2, x2)] != '@')) {
+        return false;
+    }
+    Room *room1 = room_at(level, x1, y1);
     if (!room1) return false;
-    return (x2 >= room1->pos.x && x2 < room1->pos.x + room1->max.x &&
-            y2 >= room1->pos.y && y2 < room1->pos.y + room1->max.y);
+    return room_at(level, x2, y2) == room1;
 }
 
 void update_monsters(Map *map) {
@@ -3394,28 +4603,8 @@ void update_monsters(Map *map) {
             }
             continue;
         }
-        int orig_x = monster->x;
-        int orig_y = monster->y;
-        bool room_discovered = false;
-        Room *monster_room = NULL;
-        for (int i = 0; i < current->num_rooms; i++) {
-            Room *room = &current->rooms[i];
-            if (monster->x >= room->pos.x && monster->x < room->pos.x + room->max.x &&
-                monster->y >= room->pos.y && monster->y < room->pos.y + room->max.y) {
-                monster_room = room;
-                for (int y = room->pos.y; y < room->pos.y + room->max.y; y++) {
-                    for (int x = room->pos.x; x < room->pos.x + room->max.x; x++) {
-                        if (current->explored[y][x]) {
-                            room_discovered = true;
-                            break;
-                        }
-                    }
-                    if (room_discovered) break;
-                }
-                break;
-            }
-        }
-        if (!room_discovered || monster_room == NULL) continue;
+        Room *monster_room = room_at(current, monster->x, monster->y);
+        if (monster_room == NULL || !monster_room->discovered) continue;
         bool should_follow = false;
         int dx = 0, dy = 0;
         if (monster->type == MONSTER_UNDEAD || monster->type == MONSTER_SNAKE) {
@@ -3426,10 +4615,7 @@ void update_monsters(Map *map) {
             else if (monster->y > map->player_y) dy = -1;
         } 
         else {
-            bool in_same_room = (map->player_x >= monster_room->pos.x && 
-                               map->player_x < monster_room->pos.x + monster_room->max.x &&
-                               map->player_y >= monster_room->pos.y && 
-                               map->player_y < monster_room->pos.y + monster_room->max.y);
+            bool in_same_room = room_at(current, map->player_x, map->player_y) == monster_room;
             if (monster->was_attacked && in_same_room) {
                 should_follow = true;
                 if (monster->x < map->player_x) dx = 1;
@@ -3439,7 +4625,7 @@ void update_monsters(Map *map) {
             } 
             else if (in_same_room) {
                 should_follow = true;
-                int random_dir = rand() % 4;
+                int random_dir = rng_rand(&map->rng) % 4;
                 switch(random_dir) {
                     case 0: dx = 1; break;
                     case 1: dx = -1; break;
@@ -3452,66 +4638,129 @@ void update_monsters(Map *map) {
             int new_x = monster->x + dx;
             int new_y = monster->y + dy;
             bool valid_move = false;
-            if (new_x >= monster_room->pos.x && new_x < monster_room->pos.x + monster_room->max.x &&
-                new_y >= monster_room->pos.y && new_y < monster_room->pos.y + monster_room->max.y) {
+            if (room_at(current, new_x, new_y) == monster_room) {
                 if (!(new_x == map->player_x && new_y == map->player_y) && 
-                    current->tiles[new_y][new_x] == '.' && 
+                    current->tiles[IDX(new_y, new_x)] == '.' && 
                     !is_monster_at(current, new_x, new_y)) {
                     valid_move = true;
                 }
             }
             if (valid_move) {
-                monster->x = new_x;
-                monster->y = new_y;
-                current->tiles[orig_y][orig_x] = '.';
-                current->tiles[monster->y][monster->x] = monster->symbol;
+                move_monster(current, monster, new_x, new_y);
+            }
+            if (monster->type == MONSTER_UNDEAD || monster->was_attacked) {
+                if (abs(monster->x - map->player_x) <= 1 && 
+                    abs(monster->y - map->player_y) <= 1) {
+                    monster->aggressive = true;
+                }
+            }
+        }
+    }
+}
+// Every HUNGER_PERIOD turns: flasks lose their magic, food rots, hunger
+// drops and, when fed and out of danger, health comes back.
+void hunger_tick(Map *map) {
+    if (map->crimson_flask > 0) {
+        map->crimson_flask--;
+        map->normal_food++;
+        set_message(map, "A Flask of Crimson Tears has lost its magic and turned into normal food!");
+    }
+    else if (map->cerulean_flask > 0) {
+        map->cerulean_flask--;
+        map->normal_food++;
+        set_message(map, "A Flask of Cerulean Tears has lost its magic and turned into normal food!");
+    }
+    else if (map->normal_food > map->rotten_food) {
+        map->rotten_food++;
+        set_message(map, "Some of your food has gone rotten!");
+    }
+
+    if (map->hunger > 0) {
+        map->hunger--;
+    }
+    if (map->hunger <= 20 && map->health > 0) {
+        map->health--;
+        set_message(map, "You are starving!");
+    }
+    if (map->hunger > 50 && map->health < 25) { 
+        Level *current = &map->levels[map->current_level - 1];
+        bool monster_nearby = false;
+        
+        for (int i = 0; i < MONSTER_COUNT; i++) {
+            Monster *monster = &current->monsters[i];
+            if (monster->active && 
+                abs(monster->x - map->player_x) <= 2 && 
+                abs(monster->y - map->player_y) <= 2) {
+                monster_nearby = true;
+                break;
             }
-            if (monster->type == MONSTER_UNDEAD || monster->was_attacked) {
-                if (abs(monster->x - map->player_x) <= 1 && 
-                    abs(monster->y - map->player_y) <= 1) {
-                    monster->aggressive = true;
+        }
+        if (map->hunger > 50 && map->health < 25) {
+            if (!monster_nearby) {
+                int regen_amount = map->health_regen_doubled ? 2 : 1;
+                int new_health = map->health + regen_amount;
+                if (new_health > 30) new_health = 30;
+                
+                if (new_health > map->health) {
+                    map->health = new_health;
+                    if (map->message_timer <= 0) {
+                        if (map->health_regen_doubled) {
+                            set_message(map, "Your health is regenerating quickly!");
+                        } else {
+                            set_message(map, "You feel your health returning...");
+                        }
+                    }
                 }
             }
         }
     }
 }
-void update_talisman_effects(Map *map) {
-    for (int i = 0; i < TALISMAN_COUNT; i++) {
-        if (map->talismans[i].is_active) {
-            map->talismans[i].moves_remaining--;
-            
-            if (map->talismans[i].moves_remaining <= 0) {
-                map->talismans[i].is_active = false;
-
-                switch(i) {
-                    case TALISMAN_HEALTH:
-                        map->health_regen_doubled = false;
-                        break;
-                    case TALISMAN_DAMAGE:
-                        map->damage_doubled = false;
-                        break;
-                    case TALISMAN_SPEED:
-                        map->speed_doubled = false;
-                        break;
-                }
-                
-                char msg[MAX_MESSAGE_LENGTH];
-                snprintf(msg, MAX_MESSAGE_LENGTH, "%s effect has worn off!", 
-                        map->talismans[i].name);
-                set_message(map, msg);
-            }
+bool talisman_active(Map *map, int type) {
+    return timer_pending(&map->timers, TIMER_TALISMAN + type);
+}
+// The doubled flags are read on every move and attack, so they are worked
+// out from the pending timers only when an effect starts or wears off.
+void refresh_effects(Map *map) {
+    TimerWheel *timers = &map->timers;
+    map->health_regen_doubled = timer_pending(timers, TIMER_TALISMAN + TALISMAN_HEALTH);
+    map->damage_doubled = timer_pending(timers, TIMER_TALISMAN + TALISMAN_DAMAGE) ||
+                          timer_pending(timers, TIMER_CRIMSON_FLASK);
+    map->speed_doubled = timer_pending(timers, TIMER_TALISMAN + TALISMAN_SPEED) ||
+                         timer_pending(timers, TIMER_CERULEAN_FLASK);
+}
+// Starts (or restarts) a timed effect for EFFECT_TURNS turns.
+void start_effect(Map *map, int kind) {
+    timer_set(&map->timers, kind, EFFECT_TURNS);
+    refresh_effects(map);
+}
+// Advances the turn counter. Only timers due on this turn are touched, so
+// an effect that is not running costs nothing.
+void run_timers(Map *map) {
+    uint32_t fired = timer_advance(&map->timers);
+    if (fired == 0) return;
+    bool effects_ended = false;
+    for (int kind = 0; kind < TIMER_KINDS; kind++) {
+        if (!(fired & (1u << kind))) continue;
+        if (kind == TIMER_HUNGER) {
+            timer_set(&map->timers, TIMER_HUNGER, HUNGER_PERIOD);
+            hunger_tick(map);
+        } else if (kind < TIMER_CRIMSON_FLASK) {
+            char msg[MAX_MESSAGE_LENGTH];
+            snprintf(msg, MAX_MESSAGE_LENGTH, "%s effect has worn off!", 
+                    map->talismans[kind - TIMER_TALISMAN].name);
+            set_message(map, msg);
+            effects_ended = true;
+        } else {
+            set_message(map, "The flask's effects have worn off!");
+            effects_ended = true;
         }
     }
+    if (effects_ended) {
+        refresh_effects(map);
+    }
 }
 bool is_monster_at(Level *level, int x, int y) {
-    for (int i = 0; i < MONSTER_COUNT; i++) {
-        if (level->monsters[i].active && 
-            level->monsters[i].x == x && 
-            level->monsters[i].y == y) {
-            return true;
-        }
-    }
-    return false;
+    return monster_at(level, x, y) != NULL;
 }
 
 void handle_input(Map *map, int input) {
@@ -3521,25 +4770,12 @@ void handle_input(Map *map, int input) {
     if (input >= '1' && input <= '3') {
         int talisman_type = input - '1';
         if (map->talismans[talisman_type].owned) {
-            if (!map->talismans[talisman_type].is_active) {
-                map->talismans[talisman_type].is_active = true;
-                map->talismans[talisman_type].moves_remaining = 10;
+            if (!talisman_active(map, talisman_type)) {
+                start_effect(map, TIMER_TALISMAN + talisman_type);
                 map->talismans[talisman_type].count--; 
-                switch(talisman_type) {
-                    case TALISMAN_HEALTH:
-                        map->health_regen_doubled = true;
-                        break;
-                    case TALISMAN_DAMAGE:
-                        map->damage_doubled = true;
-                        break;
-                    case TALISMAN_SPEED:
-                        map->speed_doubled = true;
-                        break;
-                }
-                
                 char msg[MAX_MESSAGE_LENGTH];
-                snprintf(msg, MAX_MESSAGE_LENGTH, "Activated %s! (10 moves remaining)", 
-                        map->talismans[talisman_type].name);
+                snprintf(msg, MAX_MESSAGE_LENGTH, "Activated %s! (%d turns remaining)", 
+                        map->talismans[talisman_type].name, EFFECT_TURNS);
                 set_message(map, msg);
                 if (map->talismans[talisman_type].count == 0) {
                     map->talismans[talisman_type].owned = false; 
@@ -3598,26 +4834,20 @@ void handle_input(Map *map, int input) {
     }
     if (input == 't' || input == 'T') {
         display_talisman_menu(stdscr, map);
-        clear();
-        refresh();
         update_visibility(map);
         return;
     }
     if (input == 'i' || input == 'I') {
         display_weapon_menu(stdscr, map);
-        clear();
-        refresh();
         update_visibility(map);
         return;
     }
     if (input == 'e' || input == 'E') {
         display_food_menu(stdscr, map);
-        int menu_input = getch();
+        int menu_input = game_getch();
         if (menu_input == 'e' || menu_input == 'E') {
             eat_food(map);
         }
-        clear();
-        refresh();
         update_visibility(map);
         return;
     }
@@ -3637,25 +4867,22 @@ void handle_input(Map *map, int input) {
             int test_y = map->player_y + dy;
             if (test_x < 0 || test_x >= NUMCOLS || 
                 test_y < 0 || test_y >= NUMLINES ||
-                current->tiles[test_y][test_x] == '|' || 
-                current->tiles[test_y][test_x] == '_' || 
-                current->tiles[test_y][test_x] == ' ' ||
-                current->tiles[test_y][test_x] == '>' ||
-                current->tiles[test_y][test_x] == '<' ||
-                current->secret_walls[test_y][test_x] ||
-                current->tiles[test_y][test_x] == 'D' ||
-                current->tiles[test_y][test_x] == 'F' ||
-                current->tiles[test_y][test_x] == 'G' ||
-                current->tiles[test_y][test_x] == 'S' ||
-                current->tiles[test_y][test_x] == 'U') {
+                current->tiles[IDX(test_y, test_x)] == '|' || 
+                current->tiles[IDX(test_y, test_x)] == '_' || 
+                current->tiles[IDX(test_y, test_x)] == ' ' ||
+                current->tiles[IDX(test_y, test_x)] == '>' ||
+                current->tiles[IDX(test_y, test_x)] == '<' ||
+                bit_test(current->secret_walls, test_y, test_x) ||
+                monster_at(current, test_x, test_y) != NULL) {
                 break;
             }
             map->player_x = test_x;
             map->player_y = test_y;
-            if (current->traps[test_y][test_x] && !current->discovered_traps[test_y][test_x]) {
-                int damage = 2 + (rand() % 3);
+            if (bit_test(current->traps, test_y, test_x) && !bit_test(current->discovered_traps, test_y, test_x)) {
+                int damage = 2 + (rng_rand(&map->rng) % 3);
                 map->health -= damage;
-                current->discovered_traps[test_y][test_x] = true;
+                bit_set(current->discovered_traps, test_y, test_x);
+                mark_dirty(current, test_y, test_x);
                 char msg[MAX_MESSAGE_LENGTH];
                 snprintf(msg, MAX_MESSAGE_LENGTH, "You triggered a trap! Lost %d health!", damage);
                 set_message(map, msg);
@@ -3666,12 +4893,10 @@ void handle_input(Map *map, int input) {
         fast_travel_mode = false;
         return;
     }
-    static int last_arrow = -1;
-    static clock_t last_time = 0;
-    clock_t current_time = clock();
     const double delay = 0.2;
     if (input == KEY_UP || input == KEY_DOWN || input == KEY_LEFT || input == KEY_RIGHT) {
-        if (last_arrow != -1 && (current_time - last_time) / CLOCKS_PER_SEC < delay) {
+        clock_t current_time = game_clock();
+        if (last_arrow != -1 && (current_time - last_arrow_time) / CLOCKS_PER_SEC < delay) {
             if ((last_arrow == KEY_UP && input == KEY_LEFT) || 
                 (last_arrow == KEY_LEFT && input == KEY_UP)) {
                 new_x--;
@@ -3699,7 +4924,7 @@ void handle_input(Map *map, int input) {
         } 
         else {
             last_arrow = input;
-            last_time = current_time;
+            last_arrow_time = current_time;
             return;
         }
     }
@@ -3710,11 +4935,11 @@ void handle_input(Map *map, int input) {
             case 'a': case 'A': new_x--; break;
             case 'd': case 'D': new_x++; break;
             case '\n': case '\r':
-                if (current->tiles[map->player_y][map->player_x] == 'T') {
+                if (current->tiles[IDX(map->player_y, map->player_x)] == 'T') {
                     int talisman_type = current->talisman_type;
                     map->talismans[talisman_type].owned = true;
                     map->talismans[talisman_type].count++;
-                    current->tiles[map->player_y][map->player_x] = '.';
+                    set_tile(current, map->player_y, map->player_x, '.');
                     char msg[MAX_MESSAGE_LENGTH];
                     snprintf(msg, MAX_MESSAGE_LENGTH, "You obtained the %s!", 
                             map->talismans[talisman_type].name);
@@ -3722,18 +4947,12 @@ void handle_input(Map *map, int input) {
                 }
                 if (abs(map->player_x - current->current_secret_room->center.x) <= 1 &&
                     abs(map->player_y - current->current_secret_room->center.y) <= 1) {
-                    for (int y = 0; y < NUMLINES; y++) {
-                        for (int x = 0; x < NUMCOLS; x++) {
-                            current->tiles[y][x] = current->backup_tiles[y][x];
-                            current->visible_tiles[y][x] = current->backup_visible_tiles[y][x];
-                            current->explored[y][x] = current->backup_explored[y][x];
-                        }
-                    }
+                    restore_level_layers(current);
                     map->player_x = current->secret_entrance.x;
                     map->player_y = current->secret_entrance.y;
-                    if (current->secret_walls[map->player_y][map->player_x]) {
-                        current->visible_tiles[map->player_y][map->player_x] = '?';
-                        current->explored[map->player_y][map->player_x] = true;
+                    if (bit_test(current->secret_walls, map->player_y, map->player_x)) {
+                        current->visible_tiles[IDX(map->player_y, map->player_x)] = '?';
+                        bit_set(current->explored, map->player_y, map->player_x);
                     }
                     current->current_secret_room = NULL;
                     //play_background_music("1");
@@ -3745,7 +4964,7 @@ void handle_input(Map *map, int input) {
         if (new_x >= 0 && new_x < NUMCOLS && new_y >= 0 && new_y < NUMLINES) {
             if (abs(new_x - current->current_secret_room->center.x) <= 3 &&
                 abs(new_y - current->current_secret_room->center.y) <= 3) {
-                char next_tile = current->tiles[new_y][new_x];
+                char next_tile = current->tiles[IDX(new_y, new_x)];
                 if (next_tile != '|' && next_tile != '_') {
                     map->player_x = new_x;
                     map->player_y = new_y;
@@ -3768,31 +4987,28 @@ void handle_input(Map *map, int input) {
             new_x = map->player_x + (map->speed_doubled ? 2 : 1); 
             break;
         case '\n': case '\r':
-            if (new_x != map->player_x || new_y != map->player_y) {
-                update_talisman_effects(map);
-            }
-            if (current->tiles[map->player_y][map->player_x] == 's' ||
-                current->tiles[map->player_y][map->player_x] == 'd' || 
-                current->tiles[map->player_y][map->player_x] == 'm' || 
-                current->tiles[map->player_y][map->player_x] == 'a') {
+            if (current->tiles[IDX(map->player_y, map->player_x)] == 's' ||
+                current->tiles[IDX(map->player_y, map->player_x)] == 'd' || 
+                current->tiles[IDX(map->player_y, map->player_x)] == 'm' || 
+                current->tiles[IDX(map->player_y, map->player_x)] == 'a') {
                 WeaponType weapon_type;
-                switch(current->tiles[map->player_y][map->player_x]) {
+                switch(current->tiles[IDX(map->player_y, map->player_x)]) {
                     case 's': weapon_type = WEAPON_SWORD; break;
                     case 'd': weapon_type = WEAPON_DAGGER; break;
                     case 'm': weapon_type = WEAPON_WAND; break;
                     case 'a': weapon_type = WEAPON_ARROW; break;
                     default: return;
                 }
-                if (current->tiles[map->player_y][map->player_x] == 'a') {
+                if (current->tiles[IDX(map->player_y, map->player_x)] == 'a') {
                     if (!map->weapons[WEAPON_ARROW].owned) {
                         map->weapons[WEAPON_ARROW].owned = true;
                         map->weapons[WEAPON_ARROW].ammo = 20;
                         set_message(map, "You picked up 20 arrows!");
-                        current->tiles[map->player_y][map->player_x] = '.';
+                        set_tile(current, map->player_y, map->player_x, '.');
                     } else if (map->weapons[WEAPON_ARROW].ammo < 20) {
                         map->weapons[WEAPON_ARROW].ammo++;
                         set_message(map, "You replenished 1 arrow.");
-                        current->tiles[map->player_y][map->player_x] = '.';
+                        set_tile(current, map->player_y, map->player_x, '.');
                     } else {
                         set_message(map, "You already have full arrows.");
                         return;
@@ -3803,11 +5019,11 @@ void handle_input(Map *map, int input) {
                         map->weapons[weapon_type].owned = true;
                         map->weapons[weapon_type].ammo = 12;
                         set_message(map, "You picked up 12 daggers!");
-                        current->tiles[map->player_y][map->player_x] = '.';
+                        set_tile(current, map->player_y, map->player_x, '.');
                     } else if (map->weapons[weapon_type].ammo < 12) {
                         map->weapons[weapon_type].ammo++;
                         set_message(map, "You replenished 1 dagger.");
-                        current->tiles[map->player_y][map->player_x] = '.';
+                        set_tile(current, map->player_y, map->player_x, '.');
                     } else {
                         set_message(map, "You already have full daggers.");
                         return;
@@ -3820,37 +5036,37 @@ void handle_input(Map *map, int input) {
                         snprintf(msg, MAX_MESSAGE_LENGTH, "You found a %s!", 
                                 map->weapons[weapon_type].name);
                         set_message(map, msg);
-                        current->tiles[map->player_y][map->player_x] = '.';
+                        set_tile(current, map->player_y, map->player_x, '.');
                     }
                 }
                 return;
             }
-            if (current->tiles[new_y][new_x] == '*' || 
-                current->tiles[new_y][new_x] == 'C' || 
-                current->tiles[new_y][new_x] == 'B') {
+            if (current->tiles[IDX(new_y, new_x)] == '*' || 
+                current->tiles[IDX(new_y, new_x)] == 'C' || 
+                current->tiles[IDX(new_y, new_x)] == 'B') {
                 
                 int total_items = map->normal_food + map->crimson_flask + map->cerulean_flask;
                 if (total_items < 10) {
-                    if (current->tiles[new_y][new_x] == 'C') {
+                    if (current->tiles[IDX(new_y, new_x)] == 'C') {
                         map->cerulean_flask++;
                         set_message(map, "You found a Flask of Cerulean Tears!");
-                    } else if (current->tiles[new_y][new_x] == 'B') {
+                    } else if (current->tiles[IDX(new_y, new_x)] == 'B') {
                         map->crimson_flask++;
                         set_message(map, "You found a Flask of Crimson Tears!");
                     } else {
                         map->normal_food++;
                         set_message(map, "You found some food!");
                     }
-                    current->tiles[new_y][new_x] = '.';
+                    set_tile(current, new_y, new_x, '.');
                 } else {
                     set_message(map, "You can't carry any more items!");
                 }
             }
-            if (current->tiles[new_y][new_x] == 'T') {
+            if (current->tiles[IDX(new_y, new_x)] == 'T') {
                 int talisman_type = current->talisman_type;
                 if (!map->talismans[talisman_type].owned) {
                     map->talismans[talisman_type].owned = true;
-                    current->tiles[new_y][new_x] = '.';
+                    set_tile(current, new_y, new_x, '.');
                     
                     char msg[MAX_MESSAGE_LENGTH];
                     snprintf(msg, MAX_MESSAGE_LENGTH, "You obtained the %s!", 
@@ -3868,7 +5084,7 @@ void handle_input(Map *map, int input) {
                     }
                 }
             }
-            if (current->tiles[new_y][new_x] == 'W') {
+            if (current->tiles[IDX(new_y, new_x)] == 'W') {
                 int available_weapons[WEAPON_COUNT];
                 int count = 0;
                 for (int i = 0; i < WEAPON_COUNT; i++) {
@@ -3877,35 +5093,31 @@ void handle_input(Map *map, int input) {
                     }
                 }
                 if (count > 0) {
-                    int weapon_index = available_weapons[rand() % count];
+                    int weapon_index = available_weapons[rng_rand(&map->rng) % count];
                     map->weapons[weapon_index].owned = true;
-                    current->tiles[new_y][new_x] = '.';
+                    set_tile(current, new_y, new_x, '.');
                     char msg[MAX_MESSAGE_LENGTH];
                     snprintf(msg, MAX_MESSAGE_LENGTH, "You found a %s!", 
                             map->weapons[weapon_index].name);
                     set_message(map, msg);
                 }
             }
-            if (current->tiles[map->player_y][map->player_x] == '>') {
+            if (current->tiles[IDX(map->player_y, map->player_x)] == '>') {
                 set_message(map, "Press Enter to go up to next level");
                 if (input == '\n' || input == '\r') {
                     if (map->current_level == 5) {
                         save_user_data(map);
+                        wait_for_save();
                         show_win_screen(map);
-                        free_map(map);
-                        clear();
-                        refresh();
-                        endwin();
-                        curs_set(1);
-                        system("clear");
-                        exit(0);
+                        game_result = GAME_WON;
+                        return;
                     }
                     transition_level(map, true); 
                     update_visibility(map);
                     return;
                 }
             } 
-            else if (current->tiles[map->player_y][map->player_x] == '<') {
+            else if (current->tiles[IDX(map->player_y, map->player_x)] == '<') {
                 set_message(map, "Press Enter to go down to previous level");
                 if ((input == '\n' || input == '\r') && map->current_level > 1) {
                     transition_level(map, false); 
@@ -3913,14 +5125,8 @@ void handle_input(Map *map, int input) {
                     return;
                 }
             }
-            if (current->secret_stairs[map->player_y][map->player_x]) {
-                for (int y = 0; y < NUMLINES; y++) {
-                    for (int x = 0; x < NUMCOLS; x++) {
-                        current->backup_tiles[y][x] = current->tiles[y][x];
-                        current->backup_visible_tiles[y][x] = current->visible_tiles[y][x];
-                        current->backup_explored[y][x] = current->explored[y][x];
-                    }
-                }
+            if (bit_test(current->secret_stairs, map->player_y, map->player_x)) {
+                backup_level_layers(current);
                 current->secret_entrance.x = map->player_x;
                 current->secret_entrance.y = map->player_y;
                 current->current_secret_room = &current->secret_rooms[0];
@@ -3937,14 +5143,8 @@ void handle_input(Map *map, int input) {
                     int check_y = map->player_y + dy; 
                     if (check_x >= 0 && check_x < NUMCOLS && 
                         check_y >= 0 && check_y < NUMLINES) {
-                        if (current->secret_walls[check_y][check_x]) {
-                            for (int y = 0; y < NUMLINES; y++) {
-                                for (int x = 0; x < NUMCOLS; x++) {
-                                    current->backup_tiles[y][x] = current->tiles[y][x];
-                                    current->backup_visible_tiles[y][x] = current->visible_tiles[y][x];
-                                    current->backup_explored[y][x] = current->explored[y][x];
-                                }
-                            }
+                        if (bit_test(current->secret_walls, check_y, check_x)) {
+                            backup_level_layers(current);
                             current->secret_entrance.x = map->player_x;
                             current->secret_entrance.y = map->player_y;
                             current->current_secret_room = &current->secret_rooms[0];
@@ -3966,33 +5166,30 @@ void handle_input(Map *map, int input) {
         return;
     }
     bool hasCombat = false;
-    for (int i = 0; i < MONSTER_COUNT; i++) {
-        Monster *monster = &current->monsters[i];
-        if (monster->active && monster->x == new_x && monster->y == new_y) {
-            hasCombat = true;
-            int damage = calculate_damage(map, (map->current_weapon == WEAPON_MACE) ? 5 : 
-                        (map->current_weapon == WEAPON_SWORD) ? 10 : 3);
-            monster->health -= damage;
-            monster->was_attacked = true;
-            monster->aggressive = true;
-            if (monster->health <= 0) {
-                monster->active = false;
-                current->tiles[monster->y][monster->x] = '.';
-                char msg[MAX_MESSAGE_LENGTH];
-                snprintf(msg, MAX_MESSAGE_LENGTH, "You defeated a monster by bumping into it with your %s!", 
-                        map->weapons[map->current_weapon].name);
-                set_message(map, msg);
-            } else {
-                char msg[MAX_MESSAGE_LENGTH];
-                snprintf(msg, MAX_MESSAGE_LENGTH, 
-                        "You bump into the %s dealing %d damage! (Monster HP: %d/%d)", 
-                        monster->name, damage, monster->health, monster->max_health);
-                set_message(map, msg);
-            }
-            new_x = map->player_x;
-            new_y = map->player_y;
-            break;
+    Monster *monster = monster_at(current, new_x, new_y);
+    if (monster != NULL) {
+        hasCombat = true;
+        int damage = calculate_damage(map, (map->current_weapon == WEAPON_MACE) ? 5 : 
+                    (map->current_weapon == WEAPON_SWORD) ? 10 : 3);
+        monster->health -= damage;
+        monster->was_attacked = true;
+        monster->aggressive = true;
+        if (monster->health <= 0) {
+            monster->active = false;
+            remove_monster(current, monster);
+            char msg[MAX_MESSAGE_LENGTH];
+            snprintf(msg, MAX_MESSAGE_LENGTH, "You defeated a monster by bumping into it with your %s!", 
+                    map->weapons[map->current_weapon].name);
+            set_message(map, msg);
+        } else {
+            char msg[MAX_MESSAGE_LENGTH];
+            snprintf(msg, MAX_MESSAGE_LENGTH, 
+                    "You bump into the %s dealing %d damage! (Monster HP: %d/%d)", 
+                    monster->name, damage, monster->health, monster->max_health);
+            set_message(map, msg);
         }
+        new_x = map->player_x;
+        new_y = map->player_y;
     }
     if ((map->current_weapon == WEAPON_MACE || map->current_weapon == WEAPON_SWORD) &&
         (new_x != map->player_x || new_y != map->player_y)) {
@@ -4003,50 +5200,48 @@ void handle_input(Map *map, int input) {
                 int attack_y = new_y + dy;
                 if (attack_x >= 0 && attack_x < NUMCOLS && 
                     attack_y >= 0 && attack_y < NUMLINES) {
-                    for (int i = 0; i < MONSTER_COUNT; i++) {
-                        Monster *monster = &current->monsters[i];
-                        if (monster->active && monster->x == attack_x && monster->y == attack_y) {
-                            hasCombat = true;
-                            int damage = calculate_damage(map, (map->current_weapon == WEAPON_MACE) ? 5 : 10);
-                            monster->health -= damage;
-                            monster->was_attacked = true;
-                            monster->aggressive = true;
-                            if (monster->health <= 0) {
-                                monster->active = false;
-                                current->tiles[monster->y][monster->x] = '.';
-                                char msg[MAX_MESSAGE_LENGTH];
-                                snprintf(msg, MAX_MESSAGE_LENGTH, "You defeated a monster with your %s!", 
-                                        map->weapons[map->current_weapon].name);
-                                set_message(map, msg);
-                            } 
-                            else {
-                                char msg[MAX_MESSAGE_LENGTH];
-                                snprintf(msg, MAX_MESSAGE_LENGTH, 
-                                        "Your %s hits the %s for %d damage! (Monster HP: %d/%d)", 
-                                        map->weapons[map->current_weapon].name,
-                                        monster->name, damage, monster->health, monster->max_health);
-                                set_message(map, msg);
-                            }
+                    Monster *monster = monster_at(current, attack_x, attack_y);
+                    if (monster != NULL) {
+                        hasCombat = true;
+                        int damage = calculate_damage(map, (map->current_weapon == WEAPON_MACE) ? 5 : 10);
+                        monster->health -= damage;
+                        monster->was_attacked = true;
+                        monster->aggressive = true;
+                        if (monster->health <= 0) {
+                            monster->active = false;
+                            remove_monster(current, monster);
+                            char msg[MAX_MESSAGE_LENGTH];
+                            snprintf(msg, MAX_MESSAGE_LENGTH, "You defeated a monster with your %s!", 
+                                    map->weapons[map->current_weapon].name);
+                            set_message(map, msg);
+                        } 
+                        else {
+                            char msg[MAX_MESSAGE_LENGTH];
+                            snprintf(msg, MAX_MESSAGE_LENGTH, 
+                                    "Your %s hits the %s for %d damage! (Monster HP: %d/%d)", 
+                                    map->weapons[map->current_weapon].name,
+                                    monster->name, damage, monster->health, monster->max_health);
+                            set_message(map, msg);
                         }
                     }
                 }
             }
         }
     }
-    char next_tile = current->tiles[new_y][new_x];
-    if (next_tile != '|' && next_tile != '_' && next_tile != ' ' &&
-        next_tile != 'D' && next_tile != 'F' && next_tile != 'G' && 
-        next_tile != 'S' && next_tile != 'U') {
-        if (current->secret_walls[new_y][new_x]) {
+    char next_tile = current->tiles[IDX(new_y, new_x)];
+    bool next_blocked = monster_at(current, new_x, new_y) != NULL;
+    if (next_tile != '|' && next_tile != '_' && next_tile != ' ' && !next_blocked) {
+        if (bit_test(current->secret_walls, new_y, new_x)) {
             set_message(map, "You sense something strange about this wall. Press Enter to investigate.");
             return;
         }
         map->player_x = new_x;
         map->player_y = new_y;
-        if (current->traps[new_y][new_x] && !current->discovered_traps[new_y][new_x]) {
-            int damage = 2 + (rand() % 3);
+        if (bit_test(current->traps, new_y, new_x) && !bit_test(current->discovered_traps, new_y, new_x)) {
+            int damage = 2 + (rng_rand(&map->rng) % 3);
             map->health -= damage;
-            current->discovered_traps[new_y][new_x] = true;
+            bit_set(current->discovered_traps, new_y, new_x);
+            mark_dirty(current, new_y, new_x);
             char msg[MAX_MESSAGE_LENGTH];
             snprintf(msg, MAX_MESSAGE_LENGTH, "You triggered a trap! Lost %d health!", damage);
             set_message(map, msg);
@@ -4072,12 +5267,12 @@ void handle_input(Map *map, int input) {
             set_message(map, "You've triggered a fighting trap! Defeat all enemies to escape!");
             return;
         }
-        if (current->coins[new_y][new_x]) {
-            int coin_value = current->coin_values[new_y][new_x];
+        if (bit_test(current->coins, new_y, new_x)) {
+            int coin_value = current->coin_values[IDX(new_y, new_x)];
             map->gold += coin_value;
-            current->coins[new_y][new_x] = false;
-            current->coin_values[new_y][new_x] = 0;
-            current->tiles[new_y][new_x] = '.';
+            bit_clear(current->coins, new_y, new_x);
+            current->coin_values[IDX(new_y, new_x)] = 0;
+            set_tile(current, new_y, new_x, '.');
             
             char msg[MAX_MESSAGE_LENGTH];
             if (coin_value == 1) {
@@ -4105,56 +5300,8 @@ void handle_input(Map *map, int input) {
             }
         }
     }
-    for (int type = 0; type < TALISMAN_COUNT; type++) {
-        bool was_active = false;
-        bool still_active = false;
-        for (int i = 0; i < 5; i++) {
-            if (map->talismans[type].active_durations[i] > 0) {
-                was_active = true;
-                break;
-            }
-        }
-        for (int i = 0; i < 5; i++) {
-            if (map->talismans[type].active_durations[i] > 0) {
-                map->talismans[type].active_durations[i]--;
-                if (map->talismans[type].active_durations[i] > 0) {
-                    still_active = true;
-                }
-            }
-        }
-
-        if (was_active && !still_active) {
-            char msg[MAX_MESSAGE_LENGTH];
-            snprintf(msg, MAX_MESSAGE_LENGTH, "%s effect has worn off!", 
-                    map->talismans[type].name);
-            set_message(map, msg);
-        } 
-        switch(type) {
-            case TALISMAN_HEALTH:
-                map->health_regen_doubled = still_active;
-                break;
-            case TALISMAN_DAMAGE:
-                map->damage_doubled = still_active;
-                break;
-            case TALISMAN_SPEED:
-                map->speed_doubled = still_active;
-                break;
-        }
-    }
-    if (map->moves_remaining > 0) {
-        map->moves_remaining--;
-        map->speed_doubled = true;
-        map->damage_doubled = true;
-        if (map->moves_remaining == 0) {
-            map->speed_doubled = false;
-            map->damage_doubled = false;
-            set_message(map, "The flask's effects have worn off!");
-        }
-    }
     if (map->speed_doubled) {
-        if (next_tile != '|' && next_tile != '_' && next_tile != ' ' &&
-            next_tile != 'D' && next_tile != 'F' && next_tile != 'G' && 
-            next_tile != 'S' && next_tile != 'U') {
+        if (next_tile != '|' && next_tile != '_' && next_tile != ' ' && !next_blocked) {
             map->player_x = new_x;
             map->player_y = new_y;
             int dx = new_x - map->player_x;
@@ -4163,11 +5310,9 @@ void handle_input(Map *map, int input) {
             int second_y = new_y + dy;
             if (second_x >= 0 && second_x < NUMCOLS && 
                 second_y >= 0 && second_y < NUMLINES) {
-                char second_tile = current->tiles[second_y][second_x];
+                char second_tile = current->tiles[IDX(second_y, second_x)];
                 if (second_tile != '|' && second_tile != '_' && 
-                    second_tile != ' ' && second_tile != 'D' && 
-                    second_tile != 'F' && second_tile != 'G' && 
-                    second_tile != 'S' && second_tile != 'U') {
+                    second_tile != ' ' && !is_monster_at(current, second_x, second_y)) {
                     map->player_x = second_x;
                     map->player_y = second_y;
                 }
@@ -4176,19 +5321,501 @@ void handle_input(Map *map, int input) {
     }
     update_monsters(map);
 }
-int main(int argc, char *argv[]) {
-    setlocale(LC_ALL, "");
-    initscr();
-    noecho();
-    cbreak();
+#define GLYPH(color, ch) (((color) << 8) | (unsigned char)(ch))
+#define GLYPH_COLOR(glyph) ((glyph) >> 8)
+#define GLYPH_CHAR(glyph) ((char)((glyph) & 0xFF))
+#define HUD_SEGMENTS 15
+typedef struct {
+    char text[64];
+    int color;
+} HudSegment;
+typedef struct {
+    int *frame;
+    bool full_redraw;
+    bool rescan;
+    Level *level;
+    int player_cell;
+    char message[MAX_MESSAGE_LENGTH];
+    HudSegment status[HUD_SEGMENTS];
+    int status_count;
+    int status_length;
+    char talismans[32];
+    int cells_repainted;
+    int hud_repainted;
+    long frames;
+} Renderer;
+static Renderer renderer;
+
+// Projectiles are resolved at once and only their flight is animated: a
+// shot queues one frame per cell and the main loop draws them over the map
+// on the following frames, waking up with a timed getch when the next one is
+// due. Nothing is queued while a journal replays or with animations off.
+#define EFFECT_FRAMES 16
+typedef struct {
+    int x, y;
+    const char *glyph;
+    int pair;
+    int duration;
+} EffectFrame;
+typedef struct {
+    bool disabled;
+    EffectFrame frames[EFFECT_FRAMES];
+    int count;
+    int current;
+    long long shown_at;
+} Effects;
+static Effects effects;
+
+long long effect_clock() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+// A new shot replaces whatever is still in flight.
+void effect_begin() {
+    if (effects.current < effects.count && effects.shown_at != 0) {
+        frame_touch(effects.frames[effects.current].x, effects.frames[effects.current].y);
+    }
+    effects.count = effects.current = 0;
+    effects.shown_at = 0;
+}
+void effect_queue(int x, int y, const char *glyph, int pair, int duration) {
+    if (effects.disabled || journal_replaying() || effects.count == EFFECT_FRAMES) return;
+    effects.frames[effects.count++] = (EffectFrame){x, y, glyph, pair, duration};
+}
+// Drops the frames whose time is up, handing their cells back to the
+// renderer. Frames missed while the game was busy are skipped.
+void effect_update() {
+    long long now = effect_clock();
+    while (effects.current < effects.count && effects.shown_at != 0 &&
+           now - effects.shown_at >= effects.frames[effects.current].duration) {
+        EffectFrame *done = &effects.frames[effects.current++];
+        frame_touch(done->x, done->y);
+        effects.shown_at += done->duration;
+    }
+    if (effects.current == effects.count) {
+        effects.count = effects.current = 0;
+        effects.shown_at = 0;
+    }
+}
+// Draws the current frame on top of the rendered map.
+void render_effects() {
+    if (effects.current >= effects.count) return;
+    EffectFrame *frame = &effects.frames[effects.current];
+    if (effects.shown_at == 0) effects.shown_at = effect_clock();
+    attron(COLOR_PAIR(frame->pair));
+    mvprintw(frame->y + 4, frame->x + 1, "%s", frame->glyph);
+    attroff(COLOR_PAIR(frame->pair));
+}
+// Milliseconds until the current frame ends, or -1 with nothing to animate.
+int effect_timeout() {
+    if (effects.current >= effects.count) return -1;
+    long long left = effects.shown_at + effects.frames[effects.current].duration - effect_clock();
+    return left > 0 ? (int)left : 0;
+}
+void init_renderer() {
+    renderer.frame = malloc(LAYER_CELLS * sizeof(int));
+    invalidate_frame();
+}
+void free_renderer() {
+    free(renderer.frame);
+    renderer.frame = NULL;
+}
+void invalidate_frame() {
+    renderer.full_redraw = true;
+}
+void frame_touch(int x, int y) {
+    if (renderer.frame != NULL && x >= 0 && x < NUMCOLS && y >= 0 && y < NUMLINES) {
+        renderer.frame[IDX(y, x)] = -1;
+        renderer.rescan = true;
+    }
+}
+void frame_rescan() {
+    renderer.rescan = true;
+}
+void draw_frame_borders() {
+    attron(COLOR_PAIR(5));
+    mvprintw(0, 0, "╔");
+    for (int x = 1; x < NUMCOLS - 1; x++) {
+        mvprintw(0, x, "═");
+    }
+    mvprintw(0, NUMCOLS - 1, "╗");
+    attroff(COLOR_PAIR(5));
+    attron(COLOR_PAIR(3));
+    mvprintw(1, 1, "╔");
+    for (int x = 2; x < NUMCOLS - 2; x++) {
+        mvprintw(1, x, "═");
+    }
+    mvprintw(1, NUMCOLS - 2, "╗");
+    mvprintw(2, 1, "║");
+    mvprintw(2, NUMCOLS - 2, "║");
+    mvprintw(3, 1, "╚");
+    for (int x = 2; x < NUMCOLS - 2; x++) {
+        mvprintw(3, x, "═");
+    }
+    mvprintw(3, NUMCOLS - 2, "╝");
+    attroff(COLOR_PAIR(3));
+    attron(COLOR_PAIR(5));
+    for (int y = 1; y < NUMLINES; y++) {
+        mvprintw(y, 0, "║");
+        mvprintw(y, NUMCOLS - 1, "║");
+    }
+    mvprintw(NUMLINES, 0, "╚");
+    for (int x = 1; x < NUMCOLS - 1; x++) {
+        mvprintw(NUMLINES, x, "═");
+    }
+    mvprintw(NUMLINES, NUMCOLS - 1, "╝");
+    mvprintw(NUMLINES + 1, 0, "╔");
+    for (int x = 1; x < NUMCOLS - 1; x++) {
+        mvprintw(NUMLINES + 1, x, "═");
+    }
+    mvprintw(NUMLINES + 1, NUMCOLS - 1, "╗");
+    mvprintw(NUMLINES + 2, 0, "║");
+    mvprintw(NUMLINES + 2, NUMCOLS - 1, "║");
+    mvprintw(NUMLINES + 3, 0, "╚");
+    for (int x = 1; x < NUMCOLS - 1; x++) {
+        mvprintw(NUMLINES + 3, x, "═");
+    }
+    mvprintw(NUMLINES + 3, NUMCOLS - 1, "╝");
+    attroff(COLOR_PAIR(5));
+}
+int tile_glyph(Map *map, Level *current, int x, int y) {
+    char tile = current->visible_tiles[IDX(y, x)];
+    if (!map->debug_mode && tile == ' ') {
+        return GLYPH(0, ' ');
+    }
+    Monster *monster = monster_at(current, x, y);
+    if (monster != NULL && current->current_secret_room == NULL &&
+        (!current->in_fighting_room || monster->in_arena)) {
+        switch(monster->symbol) {
+            case 'D': return GLYPH(3, 'D');
+            case 'F': return GLYPH(1, 'F');
+            case 'G': return GLYPH(4, 'G');
+            case 'S': return GLYPH(5, 'S');
+            case 'U': return GLYPH(6, 'U');
+        }
+    }
+    if ((map->debug_mode && bit_test(current->traps, y, x)) || 
+        (bit_test(current->discovered_traps, y, x) && bit_test(current->explored, y, x))) {
+        return GLYPH(3, '^');
+    }
+    int color = 2;
+    switch(tile) {
+        case '>': case '<': color = 5; break;
+        case '+': color = 3; break;
+        case '|': case '_': color = 1; break;
+        case '.': color = 4; break;
+        case '#': color = 2; break;
+        case 'B': return GLYPH(3, tile);
+        case 'C': return GLYPH(5, tile);
+        case '*': return GLYPH(5, tile);
+        case '$': return GLYPH(1, tile);
+        case '&': return GLYPH(6, tile);
+        case 'T':
+            switch(current->talisman_type) {
+                case TALISMAN_HEALTH: return GLYPH(4, tile);
+                case TALISMAN_DAMAGE: return GLYPH(3, tile);
+                case TALISMAN_SPEED: return GLYPH(5, tile);
+                default: return GLYPH(2, tile);
+            }
+        case 's': case 'd': case 'm': case 'a': return GLYPH(5, tile);
+    }
+    if (bit_test(current->secret_stairs, y, x) && (map->debug_mode || bit_test(current->explored, y, x))) {
+        return GLYPH(3, '%');
+    }
+    return GLYPH(color, tile);
+}
+void draw_glyph(int row, int col, int glyph) {
+    int color = GLYPH_COLOR(glyph);
+    char ch = GLYPH_CHAR(glyph);
+    if (color == 0) {
+        mvaddch(row, col, ch);
+        return;
+    }
+    attron(COLOR_PAIR(color));
+    switch(ch) {
+        case 'B': case 'C': mvprintw(row, col, "○"); break;
+        case '*': mvprintw(row, col, "●"); break;
+        case '$': mvprintw(row, col, "▲"); break;
+        case '&': mvprintw(row, col, "△"); break;
+        case 'T': mvprintw(row, col, "◆"); break;
+        default: mvaddch(row, col, ch); break;
+    }
+    attroff(COLOR_PAIR(color));
+}
+void hud_segment(int *count, const char *text, int color) {
+    snprintf(renderer.status[*count].text, sizeof(renderer.status[*count].text), "%s", text);
+    renderer.status[*count].color = color;
+    (*count)++;
+}
+void hud_value(int *count, int value, int color) {
+    char text[16];
+    snprintf(text, sizeof(text), "%d", value);
+    hud_segment(count, text, color);
+}
+void render_status_line(Map *map) {
+    HudSegment previous[HUD_SEGMENTS];
+    int previous_count = renderer.status_count;
+    memcpy(previous, renderer.status, sizeof(previous));
+    int count = 0;
+    hud_segment(&count, "Level: ", 2);
+    hud_value(&count, map->current_level, 4);
+    hud_segment(&count, "  Health: ", 2);
+    hud_value(&count, map->health, 3);
+    hud_segment(&count, "  Str: ", 2);
+    hud_value(&count, map->strength, 3);
+    hud_segment(&count, "  Gold: ", 2);
+    hud_value(&count, map->gold, 1);
+    hud_segment(&count, "  Armor: ", 2);
+    hud_value(&count, map->armor, 5);
+    hud_segment(&count, "  Exp: ", 2);
+    hud_value(&count, map->exp, 4);
+    hud_segment(&count, "  Current User: ", 2);
+    hud_segment(&count, current_username, 4);
+    if (save_pending()) {
+        hud_segment(&count, "  saving…", 6);
+    }
+    renderer.status_count = count;
+    int first_changed = 0;
+    if (!renderer.full_redraw) {
+        while (first_changed < count && first_changed < previous_count &&
+               strcmp(previous[first_changed].text, renderer.status[first_changed].text) == 0) {
+            first_changed++;
+        }
+    }
+    int col = 2;
+    for (int i = 0; i < first_changed; i++) {
+        col += strlen(renderer.status[i].text);
+    }
+    bool changed = first_changed < count || count != previous_count;
+    if (changed) {
+        move(NUMLINES + 2, col);
+        for (int i = first_changed; i < count; i++) {
+            attron(COLOR_PAIR(renderer.status[i].color));
+            printw("%s", renderer.status[i].text);
+            attroff(COLOR_PAIR(renderer.status[i].color));
+            col += strlen(renderer.status[i].text);
+            renderer.hud_repainted++;
+        }
+        for (int x = col; x < 2 + renderer.status_length && x < NUMCOLS - 1; x++) {
+            addch(' ');
+        }
+        renderer.status_length = col - 2;
+    }
+    char talismans[32] = "";
+    if (map->health_regen_doubled || map->damage_doubled || map->speed_doubled) {
+        snprintf(talismans, sizeof(talismans), "Active Talismans: %s%s%s",
+                 map->health_regen_doubled ? "H " : "",
+                 map->damage_doubled ? "D " : "",
+                 map->speed_doubled ? "S " : "");
+    }
+    if (changed || strcmp(talismans, renderer.talismans) != 0) {
+        int old_length = strlen(renderer.talismans);
+        int new_length = strlen(talismans);
+        attron(COLOR_PAIR(6));
+        mvprintw(NUMLINES + 2, NUMCOLS - 30, "%s", talismans);
+        attroff(COLOR_PAIR(6));
+        for (int x = new_length; x < old_length; x++) {
+            addch(' ');
+        }
+        strcpy(renderer.talismans, talismans);
+        renderer.hud_repainted++;
+    }
+}
+void render_message(Map *map) {
+    const char *message = map->message_timer > 0 ? map->current_message : "";
+    if (!renderer.full_redraw && strcmp(message, renderer.message) == 0) {
+        return;
+    }
+    int width = NUMCOLS - 4;
+    int old_length = strlen(renderer.message);
+    int new_length = strlen(message);
+    attron(COLOR_PAIR(2));
+    mvprintw(2, 2, "%.*s", width, message);
+    attroff(COLOR_PAIR(2));
+    for (int x = new_length; x < old_length && x < width; x++) {
+        addch(' ');
+    }
+    snprintf(renderer.message, sizeof(renderer.message), "%s", message);
+    renderer.hud_repainted++;
+}
+void render_cell(Map *map, Level *current, int y, int x) {
+    if (y < 0 || y >= NUMLINES - 4 || x < 0 || x >= NUMCOLS - 2) return;
+    int glyph;
+    if (x == map->player_x && y == map->player_y) {
+        glyph = GLYPH(map->character_color, '@');
+    } else if (!map->debug_mode && bit_row(current->explored, y)[x >> 6] == 0) {
+        glyph = GLYPH(0, ' ');
+    } else {
+        glyph = tile_glyph(map, current, x, y);
+    }
+    if (renderer.frame[IDX(y, x)] != glyph) {
+        draw_glyph(y + 4, x + 1, glyph);
+        renderer.frame[IDX(y, x)] = glyph;
+        renderer.cells_repainted++;
+    }
+}
+void render_frame(Map *map) {
+    Level *current = &map->levels[map->current_level - 1];
+    renderer.cells_repainted = 0;
+    renderer.hud_repainted = 0;
+    if (renderer.full_redraw) {
+        erase();
+        draw_frame_borders();
+        for (int i = 0; i < NUMLINES * NUMCOLS; i++) {
+            renderer.frame[i] = -1;
+        }
+        renderer.message[0] = '\0';
+        renderer.status_length = 0;
+        renderer.talismans[0] = '\0';
+    }
+    if (renderer.full_redraw || renderer.rescan || renderer.level != current) {
+        for (int y = 0; y < NUMLINES - 4; y++) {
+            for (int x = 0; x < NUMCOLS - 2; x++) {
+                render_cell(map, current, y, x);
+            }
+        }
+    } else {
+        for (int i = 0; i < current->dirty_count; i++) {
+            int cell = current->dirty_cells[i];
+            render_cell(map, current, cell / NUMCOLS, cell % NUMCOLS);
+        }
+        render_cell(map, current, renderer.player_cell / NUMCOLS, renderer.player_cell % NUMCOLS);
+        render_cell(map, current, map->player_y, map->player_x);
+    }
+    clear_dirty(current);
+    renderer.level = current;
+    renderer.player_cell = IDX(map->player_y, map->player_x);
+    renderer.rescan = false;
+    render_message(map);
+    render_status_line(map);
+    renderer.full_redraw = false;
+    renderer.frames++;
+}
+// Runs one turn of the game for the key `ch`. Replaces `*map_ptr` when a
+// save is loaded. Also used to replay the input journal.
+void game_step(Map **map_ptr, int ch) {
+    Map *map = *map_ptr;
+    Level *current = &map->levels[map->current_level - 1];
+    bool replaying = journal_replaying();
+    // Messages last a number of keys, however often the screen is redrawn
+    // for animations and pending saves in between.
+    if (map->message_timer > 0) {
+        map->message_timer--;
+    }
+    if (current->in_fighting_room) {
+        update_arena_monsters(map);
+    }
+    run_timers(map);
+    if (replaying && (ch == 'q' || ch == 'Q' || ch == 'k' || ch == 'K' || ch == 'x' || ch == 'X' ||
+                      ch == 'L' || ch == 'l' || ch == 'j' || ch == 'J')) {
+        // Saves and loads already happened, or the journal would have
+        // ended; only their effect on the turn is replayed.
+    }
+    else if (ch == 'q' || ch == 'Q') {
+        //system("pkill mpg123 2>/dev/null");
+        if (!start_save(map, true)) {
+            save_game_bin(map, "savegame.bin");
+            save_user_data(map);
+            save_to_database(map);
+        }
+        wait_for_save();
+        journal_end();
+        game_result = GAME_QUIT;
+        return;
+    }
+    else if (ch == 'k' || ch == 'K') {
+        if (!start_save(map, false)) {
+            set_message(map, "Failed to save game!");
+        }
+    }
+    else if (ch == 'x' || ch == 'X') {
+        if (save_game_json(map, "savegame.json")) {
+            set_message(map, "Game exported to savegame.json");
+        } else {
+            set_message(map, "Failed to export game!");
+        }
+    }
+    else if (ch == 'L' || ch == 'l' || ch == 'j' || ch == 'J') {
+        // 'j' imports the JSON export; 'l' falls back to it when there is no binary save.
+        Map *loaded_map = NULL;
+        wait_for_save();
+        if (ch == 'L' || ch == 'l') {
+            // The first load after resuming uses the save the menu handed over.
+            size_t save_size;
+            const char *save = session_take_save(&save_size);
+            loaded_map = save != NULL ? load_game_data(save, save_size) : load_game_bin("savegame.bin");
+        }
+        bool from_bin = loaded_map != NULL;
+        if (loaded_map == NULL) {
+            loaded_map = load_game_json("savegame.json");
+        }
+        if (loaded_map) {
+            free_map(map);
+            map = loaded_map;
+            Level *current = &map->levels[map->current_level - 1];
+            for (int r = 0; r < current->num_rooms; r++) {
+                Room *room = &current->rooms[r];
+                for (int y = room->pos.y; y < room->pos.y + room->max.y; y++) {
+                    for (int x = room->pos.x; x < room->pos.x + room->max.x; x++) {
+                        if (bit_test(current->explored, y, x)) {
+                            current->visible_tiles[IDX(y, x)] = current->tiles[IDX(y, x)];
+                        }
+                    }
+                }
+            }
+            update_visibility(map);
+            // A journal left by an earlier run picks up where its save
+            // stopped; otherwise a new one starts from the loaded game.
+            int replayed = -1;
+            if (!from_bin) {
+                journal_end();
+            } else if (journal_stop() || (replayed = replay_journal(&map)) == -1) {
+                journal_start(map, true, false);
+            }
+            start_pregen(map);
+            if (replayed > 0) {
+                char msg[MAX_MESSAGE_LENGTH];
+                snprintf(msg, MAX_MESSAGE_LENGTH, "Game loaded, %d moves recovered from the journal.", replayed);
+                set_message(map, msg);
+            } else if (replayed == -2) {
+                set_message(map, "Game loaded, but its journal could not be read and was left as it is.");
+            } else {
+                set_message(map, "Game loaded successfully!");
+            }
+        } else {
+            set_message(map, "Failed to load save game!");
+        }
+    }
+    if (ch == 'r' || ch == 'R') {
+        generate_map(map);
+        start_pregen(map);
+    } else if (ch == 'm' || ch == 'M') {
+        map->debug_mode = !map->debug_mode;
+        set_message(map, map->debug_mode ? "Debug mode activated." : "Debug mode deactivated.");
+    } else if (ch == 'n' || ch == 'N') {
+        effects.disabled = !effects.disabled;
+        effect_begin();
+        set_message(map, effects.disabled ? "Animations off." : "Animations on.");
+    } else {
+        handle_input(map, ch);
+    }
+    *map_ptr = map;
+}
+// Plays one game on the already initialized terminal and returns once it
+// is quit, won or lost. State left over from an earlier game in the same
+// process is reset first. With a session from the menu nothing is read from
+// disk until the player loads or saves.
+GameResult play_game(bool resume_wait, bool seeded, uint64_t seed) {
     keypad(stdscr, TRUE);
     load_username();
-    init_database();
+    if (session_get() == NULL) {
+        init_database();
+    }
     getmaxyx(stdscr, NUMLINES, NUMCOLS);
     NUMLINES -= 4;
     curs_set(0);
     if (has_colors()) {
-        start_color();
         init_pair(1, COLOR_YELLOW, COLOR_BLACK); 
         init_pair(2, COLOR_WHITE, COLOR_BLACK); 
         init_pair(3, COLOR_RED, COLOR_BLACK);   
@@ -4197,371 +5824,90 @@ int main(int argc, char *argv[]) {
         init_pair(6, COLOR_MAGENTA, COLOR_BLACK); 
         init_pair(8, COLOR_YELLOW, COLOR_BLACK);
     }
-    srand(time(NULL));
+    fast_travel_mode = false;
+    effect_begin();
+    last_arrow = -1;
+    last_arrow_time = 0;
+    save_checkpoint.valid = false;
+    game_result = GAME_RUNNING;
     Map *map = create_map();
-    bool resume_wait = (argc > 1 && strcmp(argv[1], "resume_wait") == 0);
+    if (map == NULL) {
+        return GAME_FAILED;
+    }
     if (!resume_wait) {
-        map = create_map();
-        if (map == NULL) {
-            endwin();
-            fprintf(stderr, "Failed to create map\n");
-            return 1;
+        if (seeded) {
+            seed_map(map, seed);
         }
         generate_map(map);
+        start_pregen(map);
     } else {
-        map = create_map();
-        if (map == NULL) {
-            endwin();
-            fprintf(stderr, "Failed to create map\n");
-            return 1;
-        }
         set_message(map, "Press 'L' to load your saved game");
     }
     //play_background_music("1");
-    while (1) {
-        clear();
+    init_renderer();
+    while (game_result == GAME_RUNNING) {
+        poll_save(map);
+        effect_update();
         update_visibility(map);
-        Level *current = &map->levels[map->current_level - 1];
-        attron(COLOR_PAIR(5));
-        mvprintw(0, 0, "╔");
-        for (int x = 1; x < NUMCOLS - 1; x++) {
-            mvprintw(0, x, "═");
-        }
-        mvprintw(0, NUMCOLS - 1, "╗");
-        attroff(COLOR_PAIR(5));
-        attron(COLOR_PAIR(3));
-        mvprintw(1, 1, "╔");
-        for (int x = 2; x < NUMCOLS - 2; x++) {
-            mvprintw(1, x, "═");
-        }
-        mvprintw(1, NUMCOLS - 2, "╗");
-        mvprintw(2, 1, "║");
-        mvprintw(2, NUMCOLS - 2, "║");
-        mvprintw(3, 1, "╚");
-        for (int x = 2; x < NUMCOLS - 2; x++) {
-            mvprintw(3, x, "═");
-        }
-        mvprintw(3, NUMCOLS - 2, "╝");
-        attroff(COLOR_PAIR(3));
-        attron(COLOR_PAIR(5));
-        for (int y = 1; y < NUMLINES; y++) {
-            mvprintw(y, 0, "║");
-            mvprintw(y, NUMCOLS - 1, "║");
-        }
-        mvprintw(NUMLINES, 0, "╚");
-        for (int x = 1; x < NUMCOLS - 1; x++) {
-            mvprintw(NUMLINES, x, "═");
-        }
-        mvprintw(NUMLINES, NUMCOLS - 1, "╝");
-        mvprintw(NUMLINES + 1, 0, "╔");
-        for (int x = 1; x < NUMCOLS - 1; x++) {
-            mvprintw(NUMLINES + 1, x, "═");
-        }
-        mvprintw(NUMLINES + 1, NUMCOLS - 1, "╗");
-        mvprintw(NUMLINES + 2, 0, "║");
-        mvprintw(NUMLINES + 2, NUMCOLS - 1, "║");
-        mvprintw(NUMLINES + 3, 0, "╚");
-        for (int x = 1; x < NUMCOLS - 1; x++) {
-            mvprintw(NUMLINES + 3, x, "═");
-        }
-        mvprintw(NUMLINES + 3, NUMCOLS - 1, "╝");
-        attroff(COLOR_PAIR(5));
-        for (int y = 0; y < NUMLINES - 4; y++) {
-            for (int x = 0; x < NUMCOLS - 2; x++) {
-                if (map->debug_mode || current->visible_tiles[y][x] != ' ') {
-                    if ((map->debug_mode && current->traps[y][x]) || 
-                        (current->discovered_traps[y][x] && current->explored[y][x])) {
-                        attron(COLOR_PAIR(3));
-                        mvaddch(y + 4, x + 1, '^');
-                        attroff(COLOR_PAIR(3));
-                    } else {
-                        int color = 2;
-                        switch(current->visible_tiles[y][x]) {
-                            case '>': case '<': color = 5; break;
-                            case '+': color = 3; break;
-                            case '|': case '_': color = 1; break;
-                            case '.': color = 4; break;
-                            case '#': color = 2; break;
-                            case 'B': 
-                                attron(COLOR_PAIR(3));  
-                                mvprintw(y + 4, x + 1, "○");
-                                attroff(COLOR_PAIR(3));
-                                continue;
-                            case 'C': 
-                                attron(COLOR_PAIR(5));  
-                                mvprintw(y + 4, x + 1, "○");
-                                attroff(COLOR_PAIR(5));
-                                continue;
-                            case '*':
-                                color = 5;  
-                                attron(COLOR_PAIR(color));
-                                mvprintw(y + 4, x + 1, "●");
-                                attroff(COLOR_PAIR(color));
-                                continue;
-                            case '$': 
-                                color = 1;  
-                                attron(COLOR_PAIR(color));
-                                mvprintw(y + 4, x + 1, "▲");
-                                attroff(COLOR_PAIR(color));
-                                continue;
-                            case '&': 
-                                color = 6;  
-                                attron(COLOR_PAIR(color));
-                                mvprintw(y + 4, x + 1, "△");
-                                attroff(COLOR_PAIR(color));
-                                continue;
-                            case 'T': 
-                                {
-                                    int color;
-                                    switch(current->talisman_type) {
-                                        case TALISMAN_HEALTH:
-                                            color = COLOR_PAIR(4); 
-                                            break;
-                                        case TALISMAN_DAMAGE:
-                                            color = COLOR_PAIR(3); 
-                                            break;
-                                        case TALISMAN_SPEED:
-                                            color = COLOR_PAIR(5); 
-                                            break;
-                                        default:
-                                            color = COLOR_PAIR(2);
-                                            break;
-                                    }
-                                    attron(color);
-                                    mvprintw(y + 4, x + 1, "◆");
-                                    attroff(color);
-                                }
-                                continue;
-                            case 'D': case 'F': case 'G': case 'S': case 'U':
-                                {
-                                    int color;
-                                    switch(current->visible_tiles[y][x]) {
-                                        case 'D': color = 3; break; 
-                                        case 'F': color = 1; break;  
-                                        case 'G': color = 4; break; 
-                                        case 'S': color = 5; break;
-                                        case 'U': color = 6; break;  
-                                        default: color = 2;
-                                    }
-                                    attron(COLOR_PAIR(color));
-                                    mvaddch(y + 4, x + 1, current->visible_tiles[y][x]);
-                                    attroff(COLOR_PAIR(color));
-                                }
-                                continue;
-                            case 's': case 'd': case 'm': case 'a':
-                            {
-                                attron(COLOR_PAIR(5));  
-                                mvaddch(y + 4, x + 1, current->visible_tiles[y][x]);
-                                attroff(COLOR_PAIR(5));
-                                continue;
-                            }
-                        }
-                        attron(COLOR_PAIR(color));
-                        mvaddch(y + 4, x + 1, current->visible_tiles[y][x]);
-                        attroff(COLOR_PAIR(color));
-                        attron(COLOR_PAIR(3)); 
-                        if (current->secret_stairs[y][x] && (map->debug_mode || current->explored[y][x])) {
-                            attron(COLOR_PAIR(3));
-                            mvaddch(y + 4, x + 1, '%');
-                            attroff(COLOR_PAIR(3));
-                        }
-                        attroff(COLOR_PAIR(3));
-                    }
-                }
-            }
-        }
-        attron(COLOR_PAIR(map->character_color));
-        mvaddch(map->player_y + 4, map->player_x + 1, '@');
-        attroff(COLOR_PAIR(map->character_color));
-        if (map->message_timer > 0) {
-            attron(COLOR_PAIR(2));
-            mvprintw(2, 2, "%s", map->current_message);
-            attroff(COLOR_PAIR(2));
-            map->message_timer--;
-        }
-        attron(COLOR_PAIR(2));
-            attron(COLOR_PAIR(2));
-            mvprintw(NUMLINES + 2, 2, "Level: ");
-            attron(COLOR_PAIR(4));  
-            printw("%d", map->current_level);
-            attroff(COLOR_PAIR(4));
-
-            attron(COLOR_PAIR(2));
-            printw("  Health: ");
-            attron(COLOR_PAIR(3)); 
-            printw("%d", map->health);
-            attroff(COLOR_PAIR(3));
-
-            attron(COLOR_PAIR(2));
-            printw("  Str: ");
-            attron(COLOR_PAIR(3)); 
-            printw("%d", map->strength);
-            attroff(COLOR_PAIR(3));
-
-            attron(COLOR_PAIR(2));
-            printw("  Gold: ");
-            attron(COLOR_PAIR(1));  
-            printw("%d", map->gold);
-            attroff(COLOR_PAIR(1));
-
-            attron(COLOR_PAIR(2));
-            printw("  Armor: ");
-            attron(COLOR_PAIR(5));
-            printw("%d", map->armor);
-            attroff(COLOR_PAIR(5));
-
-            attron(COLOR_PAIR(2));
-            printw("  Exp: ");
-            attron(COLOR_PAIR(4));  
-            printw("%d", map->exp);
-            attroff(COLOR_PAIR(4));
-            attroff(COLOR_PAIR(2));
-
-            attron(COLOR_PAIR(2));
-            printw("  Current User: ");
-            attron(COLOR_PAIR(4));  
-            printw("%s", current_username);
-            attroff(COLOR_PAIR(4));
-            attroff(COLOR_PAIR(2));
-            if (map->health_regen_doubled || map->damage_doubled || map->speed_doubled) {
-                attron(COLOR_PAIR(6));  
-                mvprintw(NUMLINES + 2, NUMCOLS - 30, "Active Talismans: ");
-                if (map->health_regen_doubled) printw("H ");
-                if (map->damage_doubled) printw("D ");
-                if (map->speed_doubled) printw("S ");
-                attroff(COLOR_PAIR(6));
-            }
-        attroff(COLOR_PAIR(2));
+        render_frame(map);
+        render_effects();
         refresh();
-        int ch = getch();
-        if (current->in_fighting_room) {
-            update_arena_monsters(map);
-        }
-        if (++map->hunger_timer >= 100) {  
-            map->hunger_timer = 0;
-            if (map->crimson_flask > 0) {
-                map->crimson_flask--;
-                map->normal_food++;
-                set_message(map, "A Flask of Crimson Tears has lost its magic and turned into normal food!");
-            }
-            else if (map->cerulean_flask > 0) {
-                map->cerulean_flask--;
-                map->normal_food++;
-                set_message(map, "A Flask of Cerulean Tears has lost its magic and turned into normal food!");
-            }
-            else if (map->normal_food > map->rotten_food) {
-                map->rotten_food++;
-                set_message(map, "Some of your food has gone rotten!");
-            }
-
-            if (map->hunger > 0) {
-                map->hunger--;
-            }
-            if (map->hunger <= 20 && map->health > 0) {
-                map->health--;
-                set_message(map, "You are starving!");
-            }
-            if (map->hunger > 50 && map->health < 25) { 
-                Level *current = &map->levels[map->current_level - 1];
-                bool monster_nearby = false;
-                
-                for (int i = 0; i < MONSTER_COUNT; i++) {
-                    Monster *monster = &current->monsters[i];
-                    if (monster->active && 
-                        abs(monster->x - map->player_x) <= 2 && 
-                        abs(monster->y - map->player_y) <= 2) {
-                        monster_nearby = true;
-                        break;
-                    }
-                }
-                if (map->hunger > 50 && map->health < 25) {
-                    if (!monster_nearby) {
-                        int regen_amount = map->health_regen_doubled ? 2 : 1;
-                        int new_health = map->health + regen_amount;
-                        if (new_health > 30) new_health = 30;
-                        
-                        if (new_health > map->health) {
-                            map->health = new_health;
-                            if (map->message_timer <= 0) {
-                                if (map->health_regen_doubled) {
-                                    set_message(map, "Your health is regenerating quickly!");
-                                } else {
-                                    set_message(map, "You feel your health returning...");
-                                }
-                            }
-                        }
-                    }
-                }
-            }
-        }
-        if (ch == 'q' || ch == 'Q') {
-            //system("pkill mpg123 2>/dev/null");
-            if (save_game_json(map, "savegame.json")) {
-                set_message(map, "Game saved successfully!");
-            }
-            save_user_data(map);
-            save_to_database(map);
-            free_map(map);
-            clear();
-            refresh();
-            endwin();
-            curs_set(1);
-            system("clear");
-            char *args[] = {"./Menu", NULL};
-            execv("./Menu", args);
-            exit(1);
-        }
-        if (ch == 'k' || ch == 'K') {
-            if (save_game_json(map, "savegame.json")) {
-                set_message(map, "Game saved successfully!");
-                save_to_database(map);
-            } else {
-                set_message(map, "Failed to save game!");
-            }
-        }
-        else if (ch == 'L' || ch == 'l') {
-            Map *loaded_map = load_game_json("savegame.json");
-            if (loaded_map) {
-                free_map(map);
-                map = loaded_map;
-                Level *current = &map->levels[map->current_level - 1];
-                for (int r = 0; r < current->num_rooms; r++) {
-                    Room *room = &current->rooms[r];
-                    for (int y = room->pos.y; y < room->pos.y + room->max.y; y++) {
-                        for (int x = room->pos.x; x < room->pos.x + room->max.x; x++) {
-                            if (current->explored[y][x]) {
-                                current->visible_tiles[y][x] = current->tiles[y][x];
-                            }
-                        }
-                    }
-                }
-                update_visibility(map);
-                set_message(map, "Game loaded successfully!");
-            } else {
-                set_message(map, "Failed to load save game!");
-            }
-        }
-        if (ch == 'r' || ch == 'R') {
-            generate_map(map);
-        } else if (ch == 'm' || ch == 'M') {
-            map->debug_mode = !map->debug_mode;
-            set_message(map, map->debug_mode ? "Debug mode activated." : "Debug mode deactivated.");
-        } else {
-            handle_input(map, ch);
-        }
-        if (map->health <= 0) {
+        // Wake up for the next animation frame, and periodically while a save
+        // is pending to clear the HUD indicator.
+        int wait = effect_timeout();
+        if (save_pending() && (wait < 0 || wait > 50)) wait = 50;
+        timeout(wait);
+        int ch = game_getch();
+        timeout(-1);
+        if (ch == ERR) continue;
+        game_step(&map, ch);
+        if (game_result == GAME_RUNNING && map->health <= 0) {
             //system("pkill mpg123 2>/dev/null");
+            wait_for_save();
             show_lose_screen(map);
-            free_map(map);
-            clear();
-            refresh();
-            endwin();
-            curs_set(1);
-            system("clear");
-            exit(0);
+            game_result = GAME_LOST;
         }
     }
     free_map(map);
+    free_renderer();
+    clear();
+    refresh();
+    return game_result;
+}
+#ifndef MAP_NO_MAIN
+int main(int argc, char *argv[]) {
+    setlocale(LC_ALL, "");
+    initscr();
+    noecho();
+    cbreak();
+    if (has_colors()) {
+        start_color();
+    }
+    session_import();
+    const SessionBlock *s = session_get();
+    bool resume_wait = (argc > 1 && strcmp(argv[1], "resume_wait") == 0) ||
+                       (s != NULL && (s->flags & SESSION_RESUME));
+    bool seeded = argc > 2 && strcmp(argv[1], "seed") == 0;
+    GameResult result = play_game(resume_wait, seeded, seeded ? strtoull(argv[2], NULL, 10) : 0);
     endwin();
+    curs_set(1);
+    if (result == GAME_FAILED) {
+        fprintf(stderr, "Failed to create map\n");
+        return 1;
+    }
+    system("clear");
+    if (result != GAME_WON) {
+        // Tell the menu who was playing so it comes back logged in.
+        SessionBlock block;
+        session_block_init(&block);
+        snprintf(block.username, sizeof(block.username), "%s", current_username);
+        session_set(&block, NULL);
+        session_export();
+        audio_export();
+        char *args[] = {"./Menu", NULL};
+        execv("./Menu", args);
+        return 1;
+    }
     return 0;
-}
\ No newline at end of file
+}
+#endif
@@ -0,0 +1,577 @@
+// Headless benchmarks for the level generator and the per-turn visibility update.
+// gcc MapBench.c -o MapBench -lncursesw -lsqlite3 -lpthread
+// ./MapBench generate [columns] [lines] [levels]
+// ./MapBench visibility [columns] [lines] [turns]
+// ./MapBench json [columns] [lines] [loads]
+// ./MapBench db [columns] [lines] [saves]
+// ./MapBench launch [columns] [lines] [transitions]
+// ./MapBench replay [columns] [lines] [keys]
+// ./MapBench effects [columns] [lines] [shots]
+// ./MapBench save [columns] [lines] [saves]
+#define MAP_NO_MAIN
+#define DATABASE_FILE "mapbench.db"
+#include "Map.c"
+#include <sys/wait.h>
+
+long long now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+long long run_turns(int turns, bool full_recompute) {
+    Map *map = create_map();
+    if (map == NULL) return -1;
+    seed_map(map, 1);
+    generate_map(map);
+    long long total = 0;
+    for (int t = 0; t < turns; t++) {
+        Level *current = &map->levels[map->current_level - 1];
+        int new_x = map->player_x + rng_rand(&map->rng) % 3 - 1;
+        int new_y = map->player_y + rng_rand(&map->rng) % 3 - 1;
+        if (new_x >= 0 && new_x < NUMCOLS && new_y >= 0 && new_y < NUMLINES &&
+            strchr(".#+", current->tiles[IDX(new_y, new_x)])) {
+            map->player_x = new_x;
+            map->player_y = new_y;
+        }
+        update_monsters(map);
+        if (full_recompute) {
+            current->visibility_stale = true;
+        }
+        long long start = now_ns();
+        update_visibility(map);
+        total += now_ns() - start;
+        clear_dirty(current);
+    }
+    free_map(map);
+    return total;
+}
+#define HISTOGRAM_BUCKETS 16
+
+// Builds `count` levels: each seed gets level 1 from generate_map() and the
+// levels above it from build_level(), the same path taken at the stairs.
+int bench_generate(int count) {
+    Map *map = create_map();
+    if (map == NULL) return 1;
+    long histogram[HISTOGRAM_BUCKETS] = {0};
+    long long total = 0, slowest = 0;
+    int built = 0;
+    for (uint64_t seed = 1; built < count; seed++) {
+        seed_map(map, seed);
+        map->current_level = 1;
+        for (int l = 0; l < MAX_LEVELS; l++) {
+            map->levels[l].stairs_placed = false;
+        }
+        for (int number = 1; number < 5 && built < count; number++) {
+            Level *current = &map->levels[number - 1];
+            long long start = now_ns();
+            if (number == 1) {
+                generate_map(map);
+            } else {
+                Level *below = &map->levels[number - 2];
+                Room *room = room_at(below, below->stairs_up.x, below->stairs_up.y);
+                if (room == NULL || below->tiles[IDX(below->stairs_up.y, below->stairs_up.x)] != '>') break;
+                clear_level_cells(current);
+                build_level(current, room, below->tiles, below->stairs_up.x, below->stairs_up.y, number, NULL);
+            }
+            long long elapsed = now_ns() - start;
+            total += elapsed;
+            if (elapsed > slowest) slowest = elapsed;
+            int bucket = 0;
+            while (bucket < HISTOGRAM_BUCKETS - 1 && elapsed >= (1000LL << bucket)) bucket++;
+            histogram[bucket]++;
+            built++;
+        }
+    }
+    free_map(map);
+    printf("map %dx%d, %d levels\n", NUMCOLS, NUMLINES, count);
+    printf("levels/sec:        %10.1f\n", count / (total / 1e9));
+    printf("mean latency:      %10.1f us\n", total / 1e3 / count);
+    printf("slowest level:     %10.1f us\n", slowest / 1e3);
+    printf("room retries:      %10ld (%.2f/level)\n", (long)gen_stats.room_retries, (double)gen_stats.room_retries / count);
+    printf("room grid resets:  %10ld\n", (long)gen_stats.room_resets);
+    printf("generate restarts: %10ld\n", (long)gen_stats.restarts);
+    printf("stair retries:     %10ld (%.2f/level)\n", (long)gen_stats.stair_retries, (double)gen_stats.stair_retries / count);
+    printf("placement retries: %10ld (%.2f/level)\n", (long)gen_stats.placement_retries, (double)gen_stats.placement_retries / count);
+    printf("latency histogram:\n");
+    for (int b = 0; b < HISTOGRAM_BUCKETS; b++) {
+        if (histogram[b] == 0) continue;
+        if (b == HISTOGRAM_BUCKETS - 1) {
+            printf("  >= %6lld us %8ld\n", 1LL << (b - 1), histogram[b]);
+        } else {
+            printf("  <  %6lld us %8ld\n", 1LL << b, histogram[b]);
+        }
+    }
+    return 0;
+}
+int bench_visibility(int turns) {
+    long long full = run_turns(turns, true);
+    long long incremental = run_turns(turns, false);
+    if (full < 0 || incremental < 0) {
+        fprintf(stderr, "Failed to create map\n");
+        return 1;
+    }
+    printf("map %dx%d, %d turns\n", NUMCOLS, NUMLINES, turns);
+    printf("full recompute: %8.1f ns/turn\n", (double)full / turns);
+    printf("incremental:    %8.1f ns/turn\n", (double)incremental / turns);
+    printf("speedup:        %8.1fx\n", incremental > 0 ? (double)full / incremental : 0.0);
+    return 0;
+}
+// Times load_game_json() on exports holding one to four levels, so load time
+// can be read against save size.
+int bench_json(int loads) {
+    const char *path = "mapbench.json";
+    Map *map = create_map();
+    if (map == NULL) return 1;
+    seed_map(map, 1);
+    generate_map(map);
+    printf("map %dx%d, %d loads per size\n", NUMCOLS, NUMLINES, loads);
+    printf("levels      bytes     us/load      MB/s\n");
+    for (int levels = 1; levels <= 4; levels++) {
+        while (map->current_level < levels) {
+            Level *current = &map->levels[map->current_level - 1];
+            if (current->tiles[IDX(current->stairs_up.y, current->stairs_up.x)] != '>') break;
+            map->player_x = current->stairs_up.x;
+            map->player_y = current->stairs_up.y;
+            transition_level(map, true);
+        }
+        if (map->current_level < levels || !save_game_json(map, path)) break;
+        struct stat st;
+        if (stat(path, &st) != 0) break;
+        long long total = 0;
+        for (int i = 0; i < loads; i++) {
+            long long start = now_ns();
+            Map *loaded = load_game_json(path);
+            total += now_ns() - start;
+            if (loaded == NULL) {
+                fprintf(stderr, "Failed to load %s\n", path);
+                remove(path);
+                free_map(map);
+                return 1;
+            }
+            free_map(loaded);
+        }
+        printf("%6d %10ld %11.1f %9.1f\n", levels, (long)st.st_size, total / 1e3 / loads,
+               (double)st.st_size * loads / (total / 1e3));
+    }
+    remove(path);
+    free_map(map);
+    return 0;
+}
+// Times the database half of a save: the score UPSERT and the stats row
+// that save_worker() writes after the save file.
+int bench_db(int saves) {
+    Map *map = create_map();
+    if (map == NULL) return 1;
+    remove(DATABASE_FILE);
+    strcpy(current_username, "mapbench");
+    init_database();
+    long long start = now_ns();
+    for (int i = 0; i < saves; i++) {
+        map->gold = i;
+        save_user_data(map);
+        save_to_database(map);
+    }
+    long long total = now_ns() - start;
+    printf("%d saves\n", saves);
+    printf("saves/sec: %10.1f\n", saves / (total / 1e9));
+    printf("us/save:   %10.1f\n", total / 1e3 / saves);
+    free_map(map);
+    db_close();
+    remove(DATABASE_FILE);
+    remove(DATABASE_FILE "-wal");
+    remove(DATABASE_FILE "-shm");
+    return 0;
+}
+// What entering the game screen costs once the terminal is up: settings,
+// database, the first level and its first frame.
+void enter_game_screen() {
+    load_username();
+    init_database();
+    Map *map = create_map();
+    if (map == NULL) return;
+    seed_map(map, 1);
+    generate_map(map);
+    init_renderer();
+    update_visibility(map);
+    render_frame(map);
+    refresh();
+    free_renderer();
+    free_map(map);
+}
+// ncurses on /dev/null with the screen sized to the map, so rendering
+// costs what it would on a real terminal of that size.
+SCREEN *open_bench_screen() {
+    char value[16];
+    snprintf(value, sizeof(value), "%d", NUMLINES + 4);
+    setenv("LINES", value, 1);
+    snprintf(value, sizeof(value), "%d", NUMCOLS);
+    setenv("COLUMNS", value, 1);
+    setenv("TERM", getenv("TERM") ? getenv("TERM") : "xterm", 0);
+    FILE *out = fopen("/dev/null", "w");
+    FILE *in = fopen("/dev/null", "r");
+    if (out == NULL || in == NULL) return NULL;
+    SCREEN *screen = newterm(NULL, out, in);
+    if (screen != NULL && has_colors()) {
+        start_color();
+    }
+    return screen;
+}
+// One Menu -> Map hop of the two-binary launcher, run as a child: a fresh
+// process that clears the terminal, brings up ncurses and then enters the
+// game screen with nothing cached.
+int launch_hop() {
+    setlocale(LC_ALL, "");
+    system("clear > /dev/null 2>&1");
+    if (open_bench_screen() == NULL) return 1;
+    enter_game_screen();
+    endwin();
+    return 0;
+}
+// Compares a screen change through execv with one inside a single process
+// that keeps ncurses, the database connection and the settings cache up.
+int bench_launch(const char *self, int transitions) {
+    char cols[16], lines[16];
+    snprintf(cols, sizeof(cols), "%d", NUMCOLS);
+    snprintf(lines, sizeof(lines), "%d", NUMLINES);
+    long long exec_total = 0;
+    for (int i = 0; i < transitions; i++) {
+        long long start = now_ns();
+        pid_t pid = fork();
+        if (pid == 0) {
+            execl(self, self, "launch-hop", cols, lines, (char *)NULL);
+            _exit(127);
+        }
+        int status;
+        if (pid < 0 || waitpid(pid, &status, 0) != pid || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+            fprintf(stderr, "launch hop failed\n");
+            return 1;
+        }
+        exec_total += now_ns() - start;
+    }
+    long long start = now_ns();
+    SCREEN *screen = open_bench_screen();
+    if (screen == NULL) {
+        fprintf(stderr, "Failed to open a terminal\n");
+        return 1;
+    }
+    enter_game_screen();
+    long long first = now_ns() - start;
+    long long process_total = 0;
+    for (int i = 0; i < transitions; i++) {
+        start = now_ns();
+        enter_game_screen();
+        process_total += now_ns() - start;
+    }
+    endwin();
+    delscreen(screen);
+    db_close();
+    remove(DATABASE_FILE);
+    remove(DATABASE_FILE "-wal");
+    remove(DATABASE_FILE "-shm");
+    printf("map %dx%d, %d transitions\n", NUMCOLS, NUMLINES, transitions);
+    printf("execv hop:        %8.2f ms\n", exec_total / 1e6 / transitions);
+    printf("first start:      %8.2f ms\n", first / 1e6);
+    printf("in-process:       %8.2f ms\n", process_total / 1e6 / transitions);
+    printf("speedup:          %8.1fx\n", process_total > 0 ? (double)exec_total / process_total : 0.0);
+    return 0;
+}
+// The direction with the longest open run from the player, so every shot
+// flies as far as it can. Returns the length of the run.
+int longest_line(Map *map, int *dir_x, int *dir_y) {
+    static const int dirs[4][2] = {{1, 0}, {-1, 0}, {0, 1}, {0, -1}};
+    Level *current = &map->levels[map->current_level - 1];
+    int best = -1;
+    for (int d = 0; d < 4; d++) {
+        int run = 0;
+        int x = map->player_x + dirs[d][0], y = map->player_y + dirs[d][1];
+        while (x >= 0 && x < NUMCOLS && y >= 0 && y < NUMLINES &&
+               !strchr("|_ ", current->tiles[IDX(y, x)])) {
+            run++;
+            x += dirs[d][0];
+            y += dirs[d][1];
+        }
+        if (run > best) {
+            best = run;
+            *dir_x = dirs[d][0];
+            *dir_y = dirs[d][1];
+        }
+    }
+    return best;
+}
+// Shoots arrows at a monster that cannot die, with the effects overlay on and
+// off. Resolving the shot is all the turn waits for; its frames then play
+// through the main loop's update/render/timeout cycle, with napms() standing
+// in for the timed getch. The hit message must still be on screen after the
+// animation, since no key has been pressed in between.
+int bench_effects(int shots) {
+    setlocale(LC_ALL, "");
+    SCREEN *screen = open_bench_screen();
+    Map *map = create_map();
+    if (screen == NULL || map == NULL) {
+        fprintf(stderr, "Failed to set up the game screen\n");
+        return 1;
+    }
+    seed_map(map, 1);
+    generate_map(map);
+    init_renderer();
+    int dir_x = 1, dir_y = 0;
+    int range = longest_line(map, &dir_x, &dir_y);
+    Level *current = &map->levels[map->current_level - 1];
+    Monster *target = &current->monsters[0];
+    if (range < 1) {
+        fprintf(stderr, "No room to shoot in\n");
+        return 1;
+    }
+    remove_monster(current, target);
+    target->x = map->player_x + dir_x * (range < 5 ? range : 5);
+    target->y = map->player_y + dir_y * (range < 5 ? range : 5);
+    target->active = true;
+    target->max_health = 1000000;
+    place_monster(current, target);
+    long long resolve[2] = {0}, playback[2] = {0}, render[2] = {0};
+    long frames[2] = {0};
+    int lost = 0;
+    for (int pass = 0; pass < 2; pass++) {
+        effects.disabled = pass == 1;
+        for (int i = 0; i < shots; i++) {
+            map->weapons[WEAPON_ARROW].ammo = 20;
+            target->health = target->max_health;
+            map->message_timer = 0;
+            long long start = now_ns();
+            shoot_arrow(map, dir_x, dir_y);
+            long long shot = now_ns();
+            resolve[pass] += shot - start;
+            while (true) {
+                long long frame = now_ns();
+                effect_update();
+                update_visibility(map);
+                render_frame(map);
+                render_effects();
+                refresh();
+                render[pass] += now_ns() - frame;
+                frames[pass]++;
+                int wait = effect_timeout();
+                if (wait < 0) break;
+                napms(wait);
+            }
+            playback[pass] += now_ns() - shot;
+            if (map->message_timer <= 0 || strcmp(renderer.message, map->current_message) != 0) {
+                lost++;
+            }
+        }
+    }
+    free_renderer();
+    free_map(map);
+    endwin();
+    delscreen(screen);
+    printf("map %dx%d, %d shots\n", NUMCOLS, NUMLINES, shots);
+    printf("                   animated      off\n");
+    printf("resolve us/shot: %10.1f %8.1f\n", resolve[0] / 1e3 / shots, resolve[1] / 1e3 / shots);
+    printf("frames/shot:     %10.1f %8.1f\n", (double)frames[0] / shots, (double)frames[1] / shots);
+    printf("render us/frame: %10.1f %8.1f\n", render[0] / 1e3 / frames[0], render[1] / 1e3 / frames[1]);
+    printf("playback ms/shot:%10.1f %8.1f\n", playback[0] / 1e6 / shots, playback[1] / 1e6 / shots);
+    if (lost > 0) {
+        printf("FAILED: %d hit messages were gone before the next key\n", lost);
+        return 1;
+    }
+    return 0;
+}
+long journal_key_count() {
+    FILE *file = fopen(JOURNAL_FILE, "rb");
+    if (file == NULL) return -1;
+    long keys = 0;
+    JournalEntry entry;
+    fseek(file, sizeof(JournalHeader), SEEK_SET);
+    while (fread(&entry, sizeof(entry), 1, file) == 1) {
+        if (entry.type == JOURNAL_KEY) keys++;
+    }
+    fclose(file);
+    return keys;
+}
+void play_recorded(Map **map, Rng *rng, int keys) {
+    static const int moves[] = {'w', 'a', 's', 'd'};
+    for (int i = 0; i < keys && (*map)->health > 0; i++) {
+        int ch = moves[rng_rand(rng) % 4];
+        journal_record(JOURNAL_KEY, ch);
+        game_step(map, ch);
+    }
+}
+// Saves and the journal go to the working directory, so the modes that
+// write them run in a scratch directory that is removed afterwards.
+bool enter_scratch_dir(char *dir, char *cwd, size_t size) {
+    if (getcwd(cwd, size) == NULL || mkdtemp(dir) == NULL || chdir(dir) != 0) {
+        fprintf(stderr, "Failed to create a scratch directory\n");
+        return false;
+    }
+    return true;
+}
+void leave_scratch_dir(const char *dir, const char *cwd) {
+    const char *files[] = {"savegame.bin", "savegame.bin.tmp", JOURNAL_FILE, DATABASE_FILE,
+                           DATABASE_FILE "-wal", DATABASE_FILE "-shm"};
+    for (size_t i = 0; i < sizeof(files) / sizeof(files[0]); i++) {
+        remove(files[i]);
+    }
+    if (chdir(cwd) != 0 || rmdir(dir) != 0) {
+        fprintf(stderr, "Left %s behind\n", dir);
+    }
+}
+// Crash recovery with a failed save in the journal: plays `keys` moves
+// around a 'k' whose save cannot be written, stops as a crash would, then
+// loads and replays. The replayed 'k' must not save again, so the journal
+// still holds every key afterwards. Also times the replay.
+int bench_replay(int keys) {
+    char dir[] = "/tmp/mapbench-XXXXXX";
+    char cwd[4096];
+    if (!enter_scratch_dir(dir, cwd, sizeof(cwd))) return 1;
+    SCREEN *screen = open_bench_screen();
+    init_database();
+    Map *map = create_map();
+    bool ok = screen != NULL && map != NULL;
+    long recorded = -1, kept = -1;
+    int replayed = -1;
+    long long elapsed = 0;
+    if (ok) {
+        seed_map(map, 1);
+        generate_map(map);
+        ok = start_save(map, false) && wait_for_save();
+    }
+    if (ok) {
+        Rng rng;
+        rng_seed(&rng, 1, 99);
+        play_recorded(&map, &rng, keys / 2);
+        // save_game_bin() cannot open its temporary file over a directory;
+        // removing it afterwards clears the way for the replayed 'k'.
+        save_checkpoint.valid = false;
+        mkdir("savegame.bin.tmp", 0700);
+        journal_record(JOURNAL_KEY, 'k');
+        game_step(&map, 'k');
+        ok = !wait_for_save() && access("savegame.bin.tmp", F_OK) != 0;
+        play_recorded(&map, &rng, keys - keys / 2);
+        journal_stop();
+        recorded = journal_key_count();
+        int x = map->player_x, y = map->player_y, health = map->health;
+        fast_travel_mode = false;
+        last_arrow = -1;
+        last_arrow_time = 0;
+        long long start = now_ns();
+        game_step(&map, 'l');
+        elapsed = now_ns() - start;
+        wait_for_save();
+        journal_stop();
+        kept = journal_key_count();
+        if (sscanf(map->current_message, "Game loaded, %d moves", &replayed) != 1) replayed = 0;
+        ok = ok && replayed == recorded && kept == recorded &&
+             map->player_x == x && map->player_y == y && map->health == health;
+    }
+    if (map != NULL) free_map(map);
+    if (screen != NULL) {
+        endwin();
+        delscreen(screen);
+    }
+    db_close();
+    leave_scratch_dir(dir, cwd);
+    printf("map %dx%d, %d keys around a failed save\n", NUMCOLS, NUMLINES, keys);
+    printf("keys in journal:  %8ld\n", recorded);
+    printf("keys replayed:    %8d\n", replayed);
+    printf("kept after load:  %8ld\n", kept);
+    printf("load + replay:    %8.2f ms\n", elapsed / 1e6);
+    printf("%s\n", ok ? "ok" : "FAILED: the journal lost keys or the replay diverged");
+    return ok ? 0 : 1;
+}
+// A background save as the player sees it: what the 'k' turn costs, how
+// long until the save is reported, and how often the main loop redrew the
+// screen in between. Wake-ups come every millisecond rather than every 50
+// so that there are plenty of them. Every redraw must still show the
+// current message: the one on screen when 'k' was pressed, then the
+// "saved" one for MESSAGE_DURATION more wake-ups without a key.
+int bench_save(int saves) {
+    char dir[] = "/tmp/mapbench-XXXXXX";
+    char cwd[4096];
+    if (!enter_scratch_dir(dir, cwd, sizeof(cwd))) return 1;
+    SCREEN *screen = open_bench_screen();
+    init_database();
+    Map *map = create_map();
+    bool ok = screen != NULL && map != NULL;
+    long long turn = 0, reported = 0;
+    long wakeups = 0;
+    int lost = 0;
+    if (ok) {
+        seed_map(map, 1);
+        generate_map(map);
+        init_renderer();
+        for (int i = 0; i < saves; i++) {
+            set_message(map, "A message shown when the save starts.");
+            long long start = now_ns();
+            game_step(&map, 'k');
+            turn += now_ns() - start;
+            int after = 0;
+            while (after <= MESSAGE_DURATION) {
+                if (poll_save(map)) {
+                    reported += now_ns() - start;
+                }
+                render_frame(map);
+                refresh();
+                wakeups++;
+                if (map->message_timer <= 0 || strcmp(renderer.message, map->current_message) != 0) {
+                    lost++;
+                    break;
+                }
+                if (!save_pending()) after++;
+                napms(1);
+            }
+        }
+        wait_for_save();
+        journal_stop();
+        free_renderer();
+    }
+    if (map != NULL) free_map(map);
+    if (screen != NULL) {
+        endwin();
+        delscreen(screen);
+    }
+    db_close();
+    leave_scratch_dir(dir, cwd);
+    if (!ok) {
+        fprintf(stderr, "Failed to set up the game screen\n");
+        return 1;
+    }
+    printf("map %dx%d, %d saves\n", NUMCOLS, NUMLINES, saves);
+    printf("'k' turn:         %8.3f ms\n", turn / 1e6 / saves);
+    printf("save reported:    %8.3f ms\n", reported / 1e6 / saves);
+    printf("wake-ups/save:    %8.1f\n", (double)wakeups / saves);
+    if (lost > 0) {
+        printf("FAILED: %d messages were gone before the next key\n", lost);
+        return 1;
+    }
+    return 0;
+}
+int main(int argc, char *argv[]) {
+    const char *mode = argc > 1 ? argv[1] : "";
+    effects.disabled = true;
+    if (strcmp(mode, "launch-hop") == 0 && argc > 3) {
+        NUMCOLS = atoi(argv[2]);
+        NUMLINES = atoi(argv[3]);
+        return launch_hop();
+    }
+    bool generate = strcmp(mode, "generate") == 0;
+    bool json = strcmp(mode, "json") == 0;
+    bool db = strcmp(mode, "db") == 0;
+    bool launch = strcmp(mode, "launch") == 0;
+    bool replay = strcmp(mode, "replay") == 0;
+    bool shots = strcmp(mode, "effects") == 0;
+    bool save = strcmp(mode, "save") == 0;
+    NUMCOLS = argc > 2 ? atoi(argv[2]) : 240;
+    NUMLINES = argc > 3 ? atoi(argv[3]) : 70;
+    int count = argc > 4 ? atoi(argv[4]) : (generate ? 2000 : json || db || replay ? 200 : launch || shots || save ? 50 : 20000);
+    if ((!generate && !json && !db && !launch && !replay && !shots && !save && strcmp(mode, "visibility") != 0) || NUMCOLS < 40 || NUMLINES < 20 || count <= 0) {
+        fprintf(stderr, "usage: %s generate|visibility|json|db|launch|replay|effects|save [columns >= 40] [lines >= 20] [count]\n", argv[0]);
+        return 1;
+    }
+    if (json) return bench_json(count);
+    if (db) return bench_db(count);
+    if (launch) return bench_launch(argv[0], count);
+    if (replay) return bench_replay(count);
+    if (shots) return bench_effects(count);
+    if (save) return bench_save(count);
+    return generate ? bench_generate(count) : bench_visibility(count);
+}
@@ -13,17 +13,19 @@
 #include <sys/stat.h>
 #include <locale.h>
 #include <wchar.h>
+#include "Rng.h"
+#include "Database.h"
+#include "Settings.h"
+#include "Session.h"
+#include "Audio.h"
 #include <unistd.h>
 #define MUSIC_FOLDER "./Music"
 #define MAX_MUSIC_FILES 10
 #define MAX_FILENAME_LENGTH 100
 #define GAME_MENU_SIZE 6
 #define COLOR_OPTIONS 5 
-#define FILE_NAME "user_data.txt"
 #define MENU_SIZE 6
 #define LEADERBOARD_FILE "leaderboard.txt"
-#define MAX_LEADERBOARD_ENTRIES 100
-#define SETTINGS_FILE "game_settings.txt"
 #define DIFFICULTY_OPTIONS 3
 const char *game_menu[] = {
     "1. Start New Game",
@@ -40,16 +42,13 @@ char current_music[MAX_FILENAME_LENGTH] = "None";
 int music_enabled = 0;
 int logged_in = 0;
 int num_accounts = 0;
-typedef struct {
-    char username[50];
-    int level;
-    int hit;
-    int strength;
-    int gold;
-    int armor;
-    int exp;
-    int games_played;
-} UserScore;
+// What the menu hands the terminal over to when run_menu() returns.
+typedef enum {
+    MENU_STAY,
+    MENU_NEW_GAME,
+    MENU_RESUME_GAME
+} MenuResult;
+MenuResult menu_result = MENU_STAY;
 typedef struct {
     char username[50];
     char email[100];
@@ -79,7 +78,8 @@ const char *menu[] = {
     "5. Leaderboard Menu",
     "6. Exit"
 };
-int main();
+void start_menu_music();
+MenuResult run_menu();
 void handle_winch(int sig);
 void display_menu(WINDOW *menu_win, int highlight);
 void execute_option(int choice, WINDOW *menu_win);
@@ -117,15 +117,8 @@ void show_music_settings(WINDOW *menu_win);
 void init_leaderboard_colors();
 void showLeaderboardMenu(WINDOW *menu_win);
 int min(int a, int b);
-void write_game_state(const char* state);
 void update_game_settings_username(const char *username);
-void write_game_state(const char* state) {
-    FILE* f = fopen("game_state.txt", "w");
-    if (f) {
-        fprintf(f, "%s", state);
-        fclose(f);
-    }
-}
+void publish_session(bool resume);
 void handle_winch(int sig) {
     (void)sig;
     endwin();
@@ -193,37 +186,32 @@ void display_menu(WINDOW *menu_win, int highlight) {
     }
     wrefresh(menu_win);
 }
-int main() {
-    unlink("game_state.txt");
-    setlocale(LC_ALL, "");
+void start_menu_music() {
+    load_music_settings();
+    if (check_music_system() && music_enabled && strcmp(current_music, "None") != 0) {
+        play_music(current_music);
+    }
+}
+// Runs the main menu until a game is started from the game menu. The
+// terminal is already up and stays up for whatever runs next.
+MenuResult run_menu() {
     int highlight = 1;
     int choice = 0;
     int c;
-    initscr();
     clear();
-    noecho();
-    cbreak();
     curs_set(0);
-    start_color();
-    use_default_colors();
-    load_music_settings();
     init_pair(1, COLOR_YELLOW, COLOR_BLACK);
     init_pair(2, COLOR_WHITE, COLOR_BLACK);
     init_pair(3, COLOR_RED, COLOR_BLACK);
     init_pair(4, COLOR_GREEN, COLOR_BLACK);
     init_pair(5, COLOR_CYAN, COLOR_BLACK);
-    if (music_enabled && strcmp(current_music, "None") != 0) {
-        play_music(current_music);
-    }
-    signal(SIGWINCH, handle_winch);
-    if (check_music_system() && music_enabled && strcmp(current_music, "None") != 0) {
-        play_music(current_music);
-    }
+    void (*previous_winch)(int) = signal(SIGWINCH, handle_winch);
     int height, width;
     getmaxyx(stdscr, height, width);
     WINDOW *menu_win = newwin(height, width, 0, 0);
     keypad(menu_win, TRUE);
-    while (1) {
+    menu_result = MENU_STAY;
+    while (menu_result == MENU_STAY) {
         getmaxyx(stdscr, height, width);
         wresize(menu_win, height, width);
         werase(menu_win);
@@ -250,34 +238,44 @@ int main() {
             werase(menu_win);
         }
     }
+    delwin(menu_win);
+    signal(SIGWINCH, previous_winch);
+    clear();
+    refresh();
+    return menu_result;
+}
+#ifndef MENU_NO_MAIN
+int main() {
+    setlocale(LC_ALL, "");
+    db_open();
+    initscr();
+    noecho();
+    cbreak();
+    start_color();
+    use_default_colors();
+    start_menu_music();
+    // Back from a game: pick up who was playing.
+    if (session_import() && session_get()->username[0] != '\0') {
+        strcpy(current_user, session_get()->username);
+    }
+    MenuResult result = run_menu();
     endwin();
-    return 0;
+    system("clear");
+    char *args[] = {"./Map", NULL, NULL};
+    audio_export();
+    if (!session_export() && result == MENU_RESUME_GAME) {
+        // Without a session Map is told to wait for 'L' on the command line.
+        args[1] = "resume_wait";
+    }
+    execv("./Map", args);
+    fprintf(stderr, "Failed to start the game\n");
+    return 1;
 }
+#endif
 void update_game_settings_username(const char *username) {
-    FILE *file = fopen(SETTINGS_FILE, "r");
-    char lines[5][256];
-    int line_count = 0;
-
-    // Read existing settings
-    if (file != NULL) {
-        while (line_count < 5 && fgets(lines[line_count], sizeof(lines[0]), file)) {
-            // Skip the Username line if it exists
-            if (strncmp(lines[line_count], "Username:", 9) != 0) {
-                line_count++;
-            }
-        }
-        fclose(file);
-    }
-
-    // Write updated settings
-    file = fopen(SETTINGS_FILE, "w");
-    if (file != NULL) {
-        fprintf(file, "Username: %s\n", username);
-        for (int i = 0; i < line_count; i++) {
-            fprintf(file, "%s", lines[i]);
-        }
-        fclose(file);
-    }
+    Settings settings = settings_copy();
+    snprintf(settings.username, sizeof(settings.username), "%s", username);
+    settings_save(&settings);
 }
 void execute_option(int choice, WINDOW *menu_win) {
     werase(menu_win);
@@ -468,44 +466,14 @@ void create_account(WINDOW *menu_win) {
 }
 
 void save_account(User user) {
-    FILE *file = fopen(FILE_NAME, "a");
-    if (file == NULL) {
+    if (!account_add(user.username, user.password, user.email)) {
         printw("Error saving account information.\n");
         exit(1);
     }
-
-    fprintf(file, "Username: %s\n", user.username);
-    fprintf(file, "Password: %s\n", user.password);
-    fprintf(file, "Email: %s\n", user.email);
-    fprintf(file, "\n");
-
-    fclose(file);
 }
 
 bool check_account_exists(const char *username, const char *email) {
-    FILE *file = fopen(FILE_NAME, "r");
-    char line[200];
-    char stored_username[50];
-    char stored_email[100];
-
-    if (file == NULL) return false;
-
-    while (fgets(line, sizeof(line), file)) {
-        if (sscanf(line, "Username: %49s", stored_username) == 1) {
-            if (strcmp(stored_username, username) == 0) {
-                fclose(file);
-                return true;
-            }
-        } else if (sscanf(line, "Email: %99s", stored_email) == 1) {
-            if (strcmp(stored_email, email) == 0) {
-                fclose(file);
-                return true;
-            }
-        }
-    }
-
-    fclose(file);
-    return false;
+    return account_exists(username, email);
 }
 
 bool validate_password(const char *password) {
@@ -532,142 +500,24 @@ bool validate_email(const char *email) {
 void generate_random_password(char *password) {
     const char charset[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789";
     const int length = 12;
-    srand(time(NULL));
+    Rng rng;
+    rng_seed(&rng, (uint64_t)time(NULL) ^ ((uint64_t)getpid() << 32), 0);
 
     for (int i = 0; i < length; i++) {
-        password[i] = charset[rand() % (sizeof(charset) - 1)];
+        password[i] = charset[rng_rand(&rng) % (sizeof(charset) - 1)];
     }
     password[length] = '\0';
 }
 void initialize_user_score(const char *username) {
-    FILE *file = fopen("user_score.txt", "a+");
-    if (file == NULL) {
-        return;
-    }
-
-    // Check if user already exists
-    char line[256];
-    while (fgets(line, sizeof(line), file)) {
-        if (strstr(line, username) != NULL) {
-            fclose(file);
-            return; // User already exists
-        }
-    }
-
-    // Add new user with default values
-    fprintf(file, "Username: %s\n", username);
-    fprintf(file, "Level: 1\n");
-    fprintf(file, "Hit: 12\n");
-    fprintf(file, "Strength: 16\n");
-    fprintf(file, "Gold: 0\n");
-    fprintf(file, "Armor: 0\n");
-    fprintf(file, "Exp: 0\n");
-    fprintf(file, "Games Played: 0\n\n");
-
-    fclose(file);
+    score_init(username);
 }
 UserScore load_user_score(const char *username) {
     UserScore score;
-    // Initialize with default values
-    strcpy(score.username, username);
-    score.level = 1;
-    score.hit = 12;
-    score.strength = 16;
-    score.gold = 0;
-    score.armor = 0;
-    score.exp = 0;
-    score.games_played = 0;
-
-    FILE *file = fopen("user_score.txt", "r");
-    if (file == NULL) {
-        return score;
-    }
-
-    char line[256];
-    bool reading_user = false;
-
-    while (fgets(line, sizeof(line), file)) {
-        // Check for username line
-        if (strncmp(line, "Username: ", 10) == 0) {
-            char current_user[50];
-            sscanf(line, "Username: %s", current_user);
-            if (strcmp(current_user, username) == 0) {
-                reading_user = true;
-                continue;
-            }
-            reading_user = false;
-        }
-
-        // If we're reading the correct user's data, parse the stats
-        if (reading_user) {
-            if (strncmp(line, "Level: ", 7) == 0) 
-                sscanf(line, "Level: %d", &score.level);
-            else if (strncmp(line, "Hit: ", 5) == 0) 
-                sscanf(line, "Hit: %d", &score.hit);
-            else if (strncmp(line, "Strength: ", 10) == 0) 
-                sscanf(line, "Strength: %d", &score.strength);
-            else if (strncmp(line, "Gold: ", 6) == 0) 
-                sscanf(line, "Gold: %d", &score.gold);
-            else if (strncmp(line, "Armor: ", 7) == 0) 
-                sscanf(line, "Armor: %d", &score.armor);
-            else if (strncmp(line, "Exp: ", 5) == 0) 
-                sscanf(line, "Exp: %d", &score.exp);
-            else if (strncmp(line, "Games Played: ", 14) == 0) 
-                sscanf(line, "Games Played: %d", &score.games_played);
-        }
-    }
-    fclose(file);
+    score_load(username, &score);
     return score;
 }
 void save_user_score(const UserScore *score) {
-    FILE *file = fopen("user_score.txt", "r");
-    FILE *temp = fopen("temp_score.txt", "w");
-    if (file == NULL || temp == NULL) {
-        if (temp) fclose(temp);
-        if (file) fclose(file);
-        return;
-    }
-    char line[256];
-    bool copying_user = true;
-    bool user_found = false;
-    while (fgets(line, sizeof(line), file)) {
-        if (strncmp(line, "Username: ", 10) == 0) {
-            char current_user[50];
-            sscanf(line, "Username: %s", current_user);
-            if (strcmp(current_user, score->username) == 0) {
-                fprintf(temp, "Username: %s\n", score->username);
-                fprintf(temp, "Level: %d\n", score->level);
-                fprintf(temp, "Hit: %d\n", score->hit);
-                fprintf(temp, "Strength: %d\n", score->strength);
-                fprintf(temp, "Gold: %d\n", score->gold);
-                fprintf(temp, "Armor: %d\n", score->armor);
-                fprintf(temp, "Exp: %d\n", score->exp);
-                fprintf(temp, "Games Played: %d\n\n", score->games_played);              
-                copying_user = false;
-                user_found = true;
-                for (int i = 0; i < 8; i++) {
-                    fgets(line, sizeof(line), file);
-                }
-            }
-        }
-        if (copying_user) {
-            fprintf(temp, "%s", line);
-        }
-    }
-    if (!user_found) {
-        fprintf(temp, "Username: %s\n", score->username);
-        fprintf(temp, "Level: %d\n", score->level);
-        fprintf(temp, "Hit: %d\n", score->hit);
-        fprintf(temp, "Strength: %d\n", score->strength);
-        fprintf(temp, "Gold: %d\n", score->gold);
-        fprintf(temp, "Armor: %d\n", score->armor);
-        fprintf(temp, "Exp: %d\n", score->exp);
-        fprintf(temp, "Games Played: %d\n\n", score->games_played);
-    }
-    fclose(file);
-    fclose(temp);
-    remove("user_score.txt");
-    rename("temp_score.txt", "user_score.txt");
+    score_save(score);
 }
 void login_menu(WINDOW *menu_win) {
     char username[50];
@@ -747,33 +597,9 @@ void login_menu(WINDOW *menu_win) {
         noecho();
         y++;
 
-        FILE *file = fopen(FILE_NAME, "r");
-        if (file == NULL) {
-            mvwprintw(menu_win, y, (width - strlen("Invalid username or password.")) / 2, "Invalid username or password.");
-            wrefresh(menu_win);
-            wgetch(menu_win);
-            continue;
-        }
-
-        char line[200];
-        char stored_username[50];
         char stored_password[50];
-        bool found = false;
-
-        while (fgets(line, sizeof(line), file)) {
-            if (sscanf(line, "Username: %49s", stored_username) == 1) {
-                if (strcmp(stored_username, username) == 0) {
-                    fgets(line, sizeof(line), file);
-                    if (sscanf(line, "Password: %49s", stored_password) == 1) {
-                        if (strcmp(stored_password, password) == 0) {
-                            found = true;
-                            break;
-                        }
-                    }
-                }
-            }
-        }
-        fclose(file);
+        bool found = account_load(username, stored_password, sizeof(stored_password), NULL, 0) &&
+                     strcmp(stored_password, password) == 0;
 
         if (found) {
             strcpy(current_user, username);
@@ -863,39 +689,9 @@ void forgot_password(WINDOW *menu_win) {
             continue;
         }
 
-        // Check credentials in file
-        FILE *file = fopen(FILE_NAME, "r");
-        if (file == NULL) {
-            mvwprintw(menu_win, y, (width - strlen("No accounts found.")) / 2, "No accounts found.");
-            wrefresh(menu_win);
-            wgetch(menu_win);
-            continue;
-        }
-
-        char line[200];
-        char stored_username[50];
         char stored_email[100];
-        bool match_found = false;
-
-    while (fgets(line, sizeof(line), file)) {
-        if (sscanf(line, "Username: %49s", stored_username) == 1) {
-            trim_newline(stored_username);
-            if (strcmp(stored_username, username) == 0) {
-                if (fgets(line, sizeof(line), file)) {
-                    if (fgets(line, sizeof(line), file)) {
-                        if (sscanf(line, "Email: %99s", stored_email) == 1) {
-                            trim_newline(stored_email);
-                            if (strcmp(stored_email, email) == 0) {
-                                match_found = true;
-                                break;
-                            }
-                        }
-                    }
-                }
-            }
-        }
-    }
-    fclose(file);
+        bool match_found = account_load(username, NULL, 0, stored_email, sizeof(stored_email)) &&
+                           strcmp(stored_email, email) == 0;
         if (!match_found) {
             mvwprintw(menu_win, y, (width - strlen("Username or Email not found.")) / 2, "Username or Email not found.");
             wrefresh(menu_win);
@@ -918,30 +714,7 @@ void forgot_password(WINDOW *menu_win) {
             continue;
         }
 
-        // Save new password
-        FILE *temp_file = fopen("temp_user_data.txt", "w");
-        file = fopen(FILE_NAME, "r");
-        if (file == NULL || temp_file == NULL) {
-            mvwprintw(menu_win, y, (width - strlen("Error updating password.")) / 2, "Error updating password.");
-            wrefresh(menu_win);
-            wgetch(menu_win);
-            continue;
-        }
-
-        bool password_updated = false;
-        while (fgets(line, sizeof(line), file)) {
-            fputs(line, temp_file);
-            if (sscanf(line, "Username: %49s", stored_username) == 1) {
-                if (strcmp(stored_username, username) == 0) {
-                    fgets(line, sizeof(line), file); // Skip old password
-                    fprintf(temp_file, "Password: %s\n", new_password);
-                    password_updated = true;
-                }
-            }
-        }
-        fclose(file);
-        fclose(temp_file);
-        rename("temp_user_data.txt", FILE_NAME);
+        bool password_updated = account_set_password(username, new_password);
 
         if (password_updated) {
             mvwprintw(menu_win, y + 1, (width - strlen("Password updated successfully!")) / 2, "Password updated successfully!");
@@ -1025,24 +798,13 @@ void update_current_difficulty() {
     }
 }
 void save_difficulty(int difficulty) {
-    FILE *file = fopen(SETTINGS_FILE, "w");
-    if (file != NULL) {
-        fprintf(file, "Difficulty: %d\n", difficulty);
-        fclose(file);
-    }
+    Settings settings = settings_copy();
+    settings.difficulty = difficulty;
+    settings_save(&settings);
     update_current_difficulty();
 }
 int get_current_difficulty() {
-    FILE *file = fopen(SETTINGS_FILE, "r");
-    int difficulty = 2; // Default to Normal
-    if (file != NULL) {
-        char line[100];
-        if (fgets(line, sizeof(line), file)) {
-            sscanf(line, "Difficulty: %d", &difficulty);
-        }
-        fclose(file);
-    }
-    return difficulty;
+    return settings_get()->difficulty;
 }
 void show_game_settings(WINDOW *menu_win) {
     int height, width;
@@ -1110,6 +872,22 @@ void show_game_settings(WINDOW *menu_win) {
         }
     }
 }
+// Hands the game its user, settings, stats and, when resuming, the save,
+// so it starts without reading any of them back from disk.
+void publish_session(bool resume) {
+    const Settings *settings = settings_get();
+    SessionBlock block;
+    session_block_init(&block);
+    block.flags = resume ? SESSION_RESUME : 0;
+    snprintf(block.username, sizeof(block.username), "%s", settings->username);
+    block.difficulty = settings->difficulty;
+    block.character_color = settings->character_color;
+    if (block.username[0] != '\0' && strcmp(block.username, "Guest") != 0) {
+        block.has_stats = score_load(block.username, &block.stats);
+    }
+    char *save = resume ? session_read_save("savegame.bin", &block.save_size) : NULL;
+    session_set(&block, save);
+}
 void showGameMenu(WINDOW *menu_win) {
     int highlight = 1;
     int choice = 0;
@@ -1157,23 +935,17 @@ void showGameMenu(WINDOW *menu_win) {
         if (choice != 0) {
             switch (choice) {
                 case 1: // New Game
-                {
-                    clear();
-                    refresh();
-                    endwin();
-                    system("clear");
-                    remove("savegame.json");  // Remove existing save
-                    char *args[] = {"./Map", NULL};
-                    execv("./Map", args);
-                    fprintf(stderr, "Failed to start new game\n");
-                    exit(1);
-                }
-                break;
+                    remove("savegame.bin");  // Remove existing save
+                    remove("savegame.json");
+                    publish_session(false);
+                    menu_result = MENU_NEW_GAME;
+                    return;
 
                 case 2: // Resume Game
                 {
                     // First check if save file exists
-                    FILE *test = fopen("savegame.json", "r");
+                    FILE *test = fopen("savegame.bin", "r");
+                    if (test == NULL) test = fopen("savegame.json", "r");
                     if (test == NULL) {
                         mvprintw(LINES/2, (COLS-30)/2, "No saved game found!");
                         refresh();
@@ -1181,19 +953,9 @@ void showGameMenu(WINDOW *menu_win) {
                         break;
                     }
                     fclose(test);
-                    
-                    clear();
-                    refresh();
-                    endwin();
-                    system("clear");
-                    
-                    // Start Map with a special flag to indicate it should wait for 'L'
-                    char *args[] = {"./Map", "resume_wait", NULL};
-                    execv("./Map", args);
-                    
-                    // In case execv fails
-                    fprintf(stderr, "Failed to resume game\n");
-                    exit(1);
+                    publish_session(true);
+                    menu_result = MENU_RESUME_GAME;
+                    return;
                 }
                 break;
                 case 3:
@@ -1216,17 +978,7 @@ void showGameMenu(WINDOW *menu_win) {
     }
 }
 int get_difficulty() {
-    FILE *file = fopen("game_settings.txt", "r");
-    int difficulty = 2; // Default to Normal
-    if (file != NULL) {
-        char line[100];
-        if (fgets(line, sizeof(line), file)) {
-            sscanf(line, "Difficulty: %d", &difficulty);
-        }
-        fclose(file);
-    }
-    
-    return difficulty;
+    return settings_get()->difficulty;
 }
 void show_character_color_settings(WINDOW *menu_win) {
     int height, width;
@@ -1324,39 +1076,13 @@ void show_character_color_settings(WINDOW *menu_win) {
     }
 }
 void save_character_color(int color_pair) {
-    FILE *file = fopen(SETTINGS_FILE, "r");
-    int difficulty = 2; // Default
-    if (file != NULL) {
-        char line[100];
-        if (fgets(line, sizeof(line), file)) {
-            sscanf(line, "Difficulty: %d", &difficulty);
-        }
-        fclose(file);
-    }
-
-    // Save both settings
-    file = fopen(SETTINGS_FILE, "w");
-    if (file != NULL) {
-        fprintf(file, "Difficulty: %d\n", difficulty);
-        fprintf(file, "CharacterColor: %d\n", color_pair);
-        fclose(file);
-    }
+    Settings settings = settings_copy();
+    settings.character_color = color_pair;
+    settings_save(&settings);
 }
 
 int get_character_color() {
-    FILE *file = fopen(SETTINGS_FILE, "r");
-    int color_pair = 2; // Default to white (pair 2)
-    if (file != NULL) {
-        char line[100];
-        // Skip difficulty line
-        fgets(line, sizeof(line), file);
-        // Read color if it exists
-        if (fgets(line, sizeof(line), file)) {
-            sscanf(line, "CharacterColor: %d", &color_pair);
-        }
-        fclose(file);
-    }
-    return color_pair;
+    return settings_get()->character_color;
 }
 void showProfileMenu(WINDOW *menu_win) {
     int height, width;
@@ -1416,79 +1142,16 @@ void showProfileMenu(WINDOW *menu_win) {
         wgetch(menu_win);
         return;
     }
-    // Read user data from file
-    FILE *user_data = fopen("user_data.txt", "r");
     char username[100] = "", password[100] = "", email[100] = "";
-    char line[256];
-    int found_user = 0;
-    
-    if (user_data) {
-        while (fgets(line, sizeof(line), user_data)) {
-            if (strncmp(line, "Username: ", 10) == 0) {
-                char temp_user[100];
-                strcpy(temp_user, line + 10);
-                temp_user[strcspn(temp_user, "\n")] = 0;
-                
-                // If this is our user, get their data
-                if (strcmp(temp_user, current_user) == 0) {
-                    strcpy(username, temp_user);
-                    
-                    // Get password
-                    if (fgets(line, sizeof(line), user_data)) {
-                        if (strncmp(line, "Password: ", 10) == 0) {
-                            strcpy(password, line + 10);
-                            password[strcspn(password, "\n")] = 0;
-                        }
-                    }
-                    
-                    // Get email
-                    if (fgets(line, sizeof(line), user_data)) {
-                        if (strncmp(line, "Email: ", 7) == 0) {
-                            strcpy(email, line + 7);
-                            email[strcspn(email, "\n")] = 0;
-                        }
-                    }
-                    
-                    found_user = 1;
-                    break;
-                }
-            }
-        }
-        fclose(user_data);
+    int found_user = account_load(current_user, password, sizeof(password), email, sizeof(email));
+    if (found_user) {
+        strcpy(username, current_user);
     }
 
-    // Read user score from file
-    FILE *user_score = fopen("user_score.txt", "r");
-    int level = 0, hit = 0, strength = 0, gold = 0, armor = 0, exp = 0, games = 0;
-    int found_score = 0;
-    
-    if (user_score) {
-        while (fgets(line, sizeof(line), user_score)) {
-            if (strncmp(line, "Username: ", 10) == 0) {
-                char temp_user[100];
-                strcpy(temp_user, line + 10);
-                temp_user[strcspn(temp_user, "\n")] = 0;
-                
-                // If this is our user, get their stats
-                if (strcmp(temp_user, current_user) == 0) {
-                    while (fgets(line, sizeof(line), user_score)) {
-                        if (line[0] == '\n' || strncmp(line, "Username:", 9) == 0) break;
-                        
-                        if (strstr(line, "Level: ")) sscanf(line, "Level: %d", &level);
-                        else if (strstr(line, "Hit: ")) sscanf(line, "Hit: %d", &hit);
-                        else if (strstr(line, "Strength: ")) sscanf(line, "Strength: %d", &strength);
-                        else if (strstr(line, "Gold: ")) sscanf(line, "Gold: %d", &gold);
-                        else if (strstr(line, "Armor: ")) sscanf(line, "Armor: %d", &armor);
-                        else if (strstr(line, "Exp: ")) sscanf(line, "Exp: %d", &exp);
-                        else if (strstr(line, "Games Played: ")) sscanf(line, "Games Played: %d", &games);
-                    }
-                    found_score = 1;
-                    break;
-                }
-            }
-        }
-        fclose(user_score);
-    }
+    UserScore score;
+    score_load(current_user, &score);
+    int level = score.level, hit = score.hit, strength = score.strength, gold = score.gold;
+    int armor = score.armor, exp = score.exp, games = score.games_played;
 
     wattron(menu_win, COLOR_PAIR(3));
     mvwprintw(menu_win, y, box_start_x, "╔════════════ User Information ════════════╗");
@@ -1581,30 +1244,15 @@ void showProfileMenu(WINDOW *menu_win) {
     wgetch(menu_win);
 }
 void stop_current_music() {
-    system("pkill mpg123 2>/dev/null");
-    usleep(100000);
+    audio_stop();
 }
 void play_music(const char* filename) {
-    char command[256];
-    stop_current_music();
-    snprintf(command, sizeof(command), 
-            "mpg123 -q --buffer 1024 -C --loop -1 --quiet -o pulse \"%s/%s\" > /dev/null 2>&1 &", 
-            MUSIC_FOLDER, filename);
-    
-    if (system(command) != 0) {
-        // If PulseAudio fails, try with default output
-        snprintf(command, sizeof(command), 
-                "mpg123 -q --buffer 1024 -C --loop -1 --quiet \"%s/%s\" > /dev/null 2>&1 &", 
-                MUSIC_FOLDER, filename);
-        system(command);
-    }
+    char path[256];
+    snprintf(path, sizeof(path), "%s/%s", MUSIC_FOLDER, filename);
+    audio_play(path);
 }
 int check_music_system() {
-    int status = system("which mpg123 > /dev/null 2>&1");
-    if (status != 0) {
-        return 0; // mpg123 not found
-    }
-    return 1; // mpg123 is available
+    return audio_available();
 }
 void get_music_files(MusicTrack *tracks, int *count) {
     DIR *dir;
@@ -1630,52 +1278,16 @@ void get_music_files(MusicTrack *tracks, int *count) {
 }
 
 void save_music_settings(int enabled, const char* current_track) {
-    FILE *file = fopen(SETTINGS_FILE, "r");
-    int difficulty = 2;
-    int char_color = 2;
-    
-    // Read existing settings
-    if (file != NULL) {
-        char line[100];
-        if (fgets(line, sizeof(line), file)) {
-            sscanf(line, "Difficulty: %d", &difficulty);
-        }
-        if (fgets(line, sizeof(line), file)) {
-            sscanf(line, "CharacterColor: %d", &char_color);
-        }
-        fclose(file);
-    }
-
-    // Save all settings
-    file = fopen(SETTINGS_FILE, "w");
-    if (file != NULL) {
-        fprintf(file, "Difficulty: %d\n", difficulty);
-        fprintf(file, "CharacterColor: %d\n", char_color);
-        fprintf(file, "MusicEnabled: %d\n", enabled);
-        fprintf(file, "CurrentMusic: %s\n", current_track);
-        fclose(file);
-    }
+    Settings settings = settings_copy();
+    settings.music_enabled = enabled;
+    snprintf(settings.current_music, sizeof(settings.current_music), "%s", current_track);
+    settings_save(&settings);
 }
 
 void load_music_settings() {
-    FILE *file = fopen(SETTINGS_FILE, "r");
-    if (file != NULL) {
-        char line[100];
-        // Skip difficulty and color lines
-        fgets(line, sizeof(line), file);
-        fgets(line, sizeof(line), file);
-        
-        // Read music settings
-        if (fgets(line, sizeof(line), file)) {
-            sscanf(line, "MusicEnabled: %d", &music_enabled);
-        }
-        if (fgets(line, sizeof(line), file)) {
-            char music_name[MAX_FILENAME_LENGTH];
-            sscanf(line, "CurrentMusic: %s", music_name);
-            strcpy(current_music, music_name);
-        }
-        fclose(file);
-    }
+    const Settings *settings = settings_get();
+    music_enabled = settings->music_enabled;
+    snprintf(current_music, sizeof(current_music), "%s", settings->current_music);
 }
 
 void show_music_settings(WINDOW *menu_win) {
@@ -1796,53 +1408,22 @@ void showLeaderboardMenu(WINDOW *menu_win) {
     int selected_index = 0;
     int total_pages;
     
-    // Array to store user scores
-    UserScore users[MAX_LEADERBOARD_ENTRIES];
-    int user_count = 0;
-    
-    // Read all user scores from user_score.txt
-    FILE *file = fopen("user_score.txt", "r");
-    if (file != NULL) {
-        char line[200];
-        while (fgets(line, sizeof(line), file) && user_count < MAX_LEADERBOARD_ENTRIES) {
-            if (strncmp(line, "Username: ", 10) == 0) {
-                sscanf(line, "Username: %s", users[user_count].username);
-                // Read all stats for this user
-                fgets(line, sizeof(line), file); // Level
-                sscanf(line, "Level: %d", &users[user_count].level);
-                fgets(line, sizeof(line), file); // Hit
-                sscanf(line, "Hit: %d", &users[user_count].hit);
-                fgets(line, sizeof(line), file); // Strength
-                sscanf(line, "Strength: %d", &users[user_count].strength);
-                fgets(line, sizeof(line), file); // Gold
-                sscanf(line, "Gold: %d", &users[user_count].gold);
-                fgets(line, sizeof(line), file); // Armor
-                sscanf(line, "Armor: %d", &users[user_count].armor);
-                fgets(line, sizeof(line), file); // Exp
-                sscanf(line, "Exp: %d", &users[user_count].exp);
-                fgets(line, sizeof(line), file); // Games Played
-                sscanf(line, "Games Played: %d", &users[user_count].games_played);
-                fgets(line, sizeof(line), file); // Blank line
-                user_count++;
-            }
-        }
-        fclose(file);
-    }
-    
-    // Sort users by experience (or gold, depending on your preference)
-    for (int i = 0; i < user_count - 1; i++) {
-        for (int j = 0; j < user_count - i - 1; j++) {
-            if (users[j].exp < users[j + 1].exp) {
-                UserScore temp = users[j];
-                users[j] = users[j + 1];
-                users[j + 1] = temp;
-            }
-        }
-    }
+    // Only the page on screen is read from the database.
+    UserScore users[ENTRIES_PER_PAGE];
+    int loaded_page = -1;
+    int user_count = score_count();
+    int user_rank = current_user[0] != '\0' ? score_rank(current_user) : 0;
 
     total_pages = (user_count + ENTRIES_PER_PAGE - 1) / ENTRIES_PER_PAGE;
 
     while (1) {
+        if (loaded_page != current_page) {
+            int read = score_page(users, current_page * ENTRIES_PER_PAGE, ENTRIES_PER_PAGE);
+            for (int i = read; i < ENTRIES_PER_PAGE; i++) {
+                score_defaults(&users[i], "");
+            }
+            loaded_page = current_page;
+        }
         werase(menu_win);
         wattron(menu_win, COLOR_PAIR(1));
         mvwprintw(menu_win, 0, 0, "╔");
@@ -1865,6 +1446,9 @@ void showLeaderboardMenu(WINDOW *menu_win) {
         wattron(menu_win, COLOR_PAIR(4) | A_BOLD);
         wprintw(menu_win, "%s", current_user);
         wattroff(menu_win, COLOR_PAIR(4) | A_BOLD);
+        if (user_rank > 0) {
+            wprintw(menu_win, "  Rank: #%d of %d", user_rank, user_count);
+        }
 
         // Column headers with proper spacing
         mvwprintw(menu_win, 4, 2, "Rank  Title      Player Name          Level  Gold    Exp     Games");
@@ -1878,7 +1462,7 @@ void showLeaderboardMenu(WINDOW *menu_win) {
             // Apply different styles based on rank
             if (i < 3) {
                 wattron(menu_win, COLOR_PAIR(i + 1) | A_BOLD);
-            } else if (strcmp(users[i].username, current_user) == 0) {
+            } else if (strcmp(users[i - start_index].username, current_user) == 0) {
                 wattron(menu_win, COLOR_PAIR(4) | A_BOLD);
             } else {
                 wattron(menu_win, COLOR_PAIR(5));
@@ -1900,11 +1484,11 @@ void showLeaderboardMenu(WINDOW *menu_win) {
                      "%-4d %-10s%-18s %-6d %-7d %-7d %d",
                      i + 1,
                      title,
-                     users[i].username,
-                     users[i].level,
-                     users[i].gold,
-                     users[i].exp,
-                     users[i].games_played);
+                     users[i - start_index].username,
+                     users[i - start_index].level,
+                     users[i - start_index].gold,
+                     users[i - start_index].exp,
+                     users[i - start_index].games_played);
 
             if (i == selected_index) {
                 wattroff(menu_win, A_REVERSE);
@@ -1912,7 +1496,7 @@ void showLeaderboardMenu(WINDOW *menu_win) {
 
             if (i < 3) {
                 wattroff(menu_win, COLOR_PAIR(i + 1) | A_BOLD);
-            } else if (strcmp(users[i].username, current_user) == 0) {
+            } else if (strcmp(users[i - start_index].username, current_user) == 0) {
                 wattroff(menu_win, COLOR_PAIR(4) | A_BOLD);
             } else {
                 wattroff(menu_win, COLOR_PAIR(5));
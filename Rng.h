@@ -0,0 +1,43 @@
+#ifndef RNG_H
+#define RNG_H
+#include <stdint.h>
+
+// xoshiro256** generator. Each Rng is an independent stream, so a map can
+// give every level its own and keep dungeons reproducible from one seed.
+typedef struct {
+    uint64_t s[4];
+} Rng;
+
+static inline uint64_t splitmix64(uint64_t *x) {
+    uint64_t z = (*x += 0x9E3779B97F4A7C15ULL);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    return z ^ (z >> 31);
+}
+static inline uint64_t rng_rotl(uint64_t x, int k) {
+    return (x << k) | (x >> (64 - k));
+}
+// Seeds stream number `stream` of `seed`; different streams never overlap in practice.
+static inline void rng_seed(Rng *rng, uint64_t seed, uint64_t stream) {
+    uint64_t x = seed ^ (stream * 0xD1B54A32D192ED03ULL);
+    for (int i = 0; i < 4; i++) {
+        rng->s[i] = splitmix64(&x);
+    }
+}
+static inline uint64_t rng_next(Rng *rng) {
+    uint64_t *s = rng->s;
+    uint64_t result = rng_rotl(s[1] * 5, 7) * 9;
+    uint64_t t = s[1] << 17;
+    s[2] ^= s[0];
+    s[3] ^= s[1];
+    s[1] ^= s[2];
+    s[0] ^= s[3];
+    s[2] ^= t;
+    s[3] = rng_rotl(s[3], 45);
+    return result;
+}
+// Drop-in for rand(): a non-negative int in [0, 2^31).
+static inline int rng_rand(Rng *rng) {
+    return (int)(rng_next(rng) >> 33);
+}
+#endif
@@ -0,0 +1,46 @@
+// Single-process launcher: the menu and the game run as screens of one
+// ncurses session, sharing the database connection and settings cache,
+// instead of Menu and Map exec'ing each other.
+// gcc Rogue.c -o Rogue -lncursesw -lsqlite3 -lpthread
+#define MAP_NO_MAIN
+#include "Map.c"
+#define MENU_NO_MAIN
+#include "Menu.c"
+
+typedef enum {
+    SCREEN_MENU,
+    SCREEN_NEW_GAME,
+    SCREEN_RESUME_GAME,
+    SCREEN_EXIT
+} Screen;
+
+int main() {
+    setlocale(LC_ALL, "");
+    db_open();
+    initscr();
+    noecho();
+    cbreak();
+    start_color();
+    use_default_colors();
+    start_menu_music();
+    Screen screen = SCREEN_MENU;
+    while (screen != SCREEN_EXIT) {
+        switch (screen) {
+            case SCREEN_MENU:
+                screen = run_menu() == MENU_NEW_GAME ? SCREEN_NEW_GAME : SCREEN_RESUME_GAME;
+                break;
+            case SCREEN_NEW_GAME:
+            case SCREEN_RESUME_GAME:
+                // Winning ends the session, as the win screen says; quitting
+                // or dying goes back to the menu.
+                screen = play_game(screen == SCREEN_RESUME_GAME, false, 0) == GAME_WON ? SCREEN_EXIT : SCREEN_MENU;
+                break;
+            default:
+                screen = SCREEN_EXIT;
+        }
+    }
+    endwin();
+    curs_set(1);
+    system("clear");
+    return 0;
+}
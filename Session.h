@@ -0,0 +1,165 @@
+#ifndef SESSION_H
+#define SESSION_H
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "Database.h"
+
+#define SESSION_MAGIC "RSES"
+#define SESSION_VERSION 1
+#define SESSION_ENV "ROGUE_SESSION_FD"
+#define SESSION_RESUME 1u
+
+// Everything the game needs from the menu to start: who is playing, their
+// settings and stats and, when resuming, savegame.bin as the menu read it.
+// The save bytes follow the block.
+typedef struct {
+    char magic[4];
+    uint32_t version;
+    uint32_t block_size;
+    uint32_t flags;
+    char username[50];
+    int32_t difficulty;
+    int32_t character_color;
+    int32_t has_stats;
+    UserScore stats;
+    uint64_t save_size;
+} SessionBlock;
+
+// The session handed over by whoever started this screen. In one process
+// the menu sets it directly; across execv it travels in an unlinked POSIX
+// shared memory object whose descriptor survives the exec and is named in
+// SESSION_ENV, so the next program maps it instead of rereading files.
+typedef struct {
+    bool active;
+    SessionBlock block;
+    const char *save;
+    char *owned_save;
+    void *mapping;
+    size_t mapping_size;
+} Session;
+
+static Session session;
+
+static inline void session_block_init(SessionBlock *block) {
+    memset(block, 0, sizeof(*block));
+    memcpy(block->magic, SESSION_MAGIC, 4);
+    block->version = SESSION_VERSION;
+    block->block_size = sizeof(SessionBlock);
+}
+
+static inline void session_clear() {
+    free(session.owned_save);
+    if (session.mapping != NULL) {
+        munmap(session.mapping, session.mapping_size);
+    }
+    memset(&session, 0, sizeof(session));
+}
+
+// Takes ownership of `save`, a malloc'd copy of the save file, if any.
+static inline void session_set(const SessionBlock *block, char *save) {
+    session_clear();
+    session.block = *block;
+    session.owned_save = save;
+    session.save = save;
+    if (save == NULL) session.block.save_size = 0;
+    session.active = true;
+}
+
+static inline const SessionBlock *session_get() {
+    return session.active ? &session.block : NULL;
+}
+
+// The save bytes are handed out once; a later load in the same game goes
+// back to the file, which may have been saved over since.
+static inline const char *session_take_save(size_t *size) {
+    if (!session.active || session.save == NULL) return NULL;
+    const char *save = session.save;
+    *size = session.block.save_size;
+    session.save = NULL;
+    return save;
+}
+
+// Reads a whole save file for session_set(); NULL if it cannot be read.
+static inline char *session_read_save(const char *path, uint64_t *size) {
+    FILE *file = fopen(path, "rb");
+    if (file == NULL) return NULL;
+    struct stat st;
+    char *data = NULL;
+    if (fstat(fileno(file), &st) == 0 && st.st_size > 0 && (data = malloc(st.st_size)) != NULL &&
+        fread(data, 1, st.st_size, file) != (size_t)st.st_size) {
+        free(data);
+        data = NULL;
+    }
+    fclose(file);
+    if (data != NULL) *size = st.st_size;
+    return data;
+}
+
+// Moves the session into shared memory ahead of an execv. The descriptor is
+// left open without close-on-exec and named in SESSION_ENV.
+static inline bool session_export() {
+    if (!session.active) return false;
+    char name[64];
+    snprintf(name, sizeof(name), "/rogue-session-%ld", (long)getpid());
+    int fd = shm_open(name, O_CREAT | O_EXCL | O_RDWR, 0600);
+    if (fd < 0) return false;
+    shm_unlink(name);
+    size_t save_size = session.save != NULL ? session.block.save_size : 0;
+    SessionBlock block = session.block;
+    block.save_size = save_size;
+    size_t size = sizeof(block) + save_size;
+    bool ok = ftruncate(fd, size) == 0 &&
+              pwrite(fd, &block, sizeof(block), 0) == (ssize_t)sizeof(block) &&
+              (save_size == 0 || pwrite(fd, session.save, save_size, sizeof(block)) == (ssize_t)save_size) &&
+              fcntl(fd, F_SETFD, 0) == 0;
+    if (!ok) {
+        close(fd);
+        return false;
+    }
+    char value[16];
+    snprintf(value, sizeof(value), "%d", fd);
+    setenv(SESSION_ENV, value, 1);
+    return true;
+}
+
+// Picks up a session exported by the program that exec'd this one. A block
+// from another version or layout is ignored and the caller falls back to
+// the files.
+static inline bool session_import() {
+    const char *value = getenv(SESSION_ENV);
+    if (value == NULL) return false;
+    int fd = atoi(value);
+    unsetenv(SESSION_ENV);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(SessionBlock)) {
+        if (fd >= 0) close(fd);
+        return false;
+    }
+    size_t size = st.st_size;
+    void *mapping = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (mapping == MAP_FAILED) return false;
+    SessionBlock block;
+    memcpy(&block, mapping, sizeof(block));
+    if (memcmp(block.magic, SESSION_MAGIC, 4) != 0 || block.version != SESSION_VERSION ||
+        block.block_size != sizeof(SessionBlock) || block.save_size > size - sizeof(block)) {
+        munmap(mapping, size);
+        return false;
+    }
+    block.username[sizeof(block.username) - 1] = '\0';
+    session_set(&block, NULL);
+    session.block.save_size = block.save_size;
+    session.save = block.save_size > 0 ? (const char*)mapping + sizeof(block) : NULL;
+    session.mapping = mapping;
+    session.mapping_size = size;
+    return true;
+}
+
+#endif
@@ -0,0 +1,145 @@
+#ifndef SETTINGS_H
+#define SETTINGS_H
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#define SETTINGS_FILE "game_settings.txt"
+
+typedef struct {
+    char username[50];
+    int difficulty;       // 1 Easy, 2 Normal, 3 Hard
+    int character_color;  // color pair used for the player glyph
+    int music_enabled;
+    char current_music[100];
+} Settings;
+
+// game_settings.txt is parsed once into memory and every getter reads the
+// cached copy. settings_get() only stats the file and reparses it when the
+// other process (Menu or Map) has replaced it since the last look. Writes go
+// to a temporary file that is renamed over the old one, so a reader never
+// sees a half-written file and every key survives an update of another.
+typedef struct {
+    Settings values;
+    bool loaded;
+    bool present;
+    struct timespec mtime;
+    off_t size;
+    ino_t inode;
+} SettingsCache;
+
+static SettingsCache settings_cache;
+
+static inline void settings_defaults(Settings *s) {
+    memset(s, 0, sizeof(*s));
+    s->difficulty = 2;
+    s->character_color = 2;
+    s->music_enabled = 0;
+    strcpy(s->current_music, "None");
+}
+
+// Keys may appear in any order; unknown lines are ignored.
+static inline void settings_parse(FILE *file, Settings *s) {
+    char line[256];
+    settings_defaults(s);
+    while (fgets(line, sizeof(line), file)) {
+        if (strncmp(line, "Username:", 9) == 0) {
+            if (sscanf(line + 9, "%49s", s->username) != 1) {
+                s->username[0] = '\0';
+            }
+        } else if (strncmp(line, "Difficulty:", 11) == 0) {
+            s->difficulty = atoi(line + 11);
+        } else if (strncmp(line, "CharacterColor:", 15) == 0) {
+            s->character_color = atoi(line + 15);
+        } else if (strncmp(line, "MusicEnabled:", 13) == 0) {
+            s->music_enabled = atoi(line + 13);
+        } else if (strncmp(line, "CurrentMusic:", 13) == 0) {
+            if (sscanf(line + 13, "%99s", s->current_music) != 1) {
+                strcpy(s->current_music, "None");
+            }
+        }
+    }
+}
+
+static inline bool settings_stat_changed(const struct stat *st) {
+    return st->st_mtim.tv_sec != settings_cache.mtime.tv_sec ||
+           st->st_mtim.tv_nsec != settings_cache.mtime.tv_nsec ||
+           st->st_size != settings_cache.size ||
+           st->st_ino != settings_cache.inode;
+}
+
+static inline void settings_remember(const struct stat *st) {
+    settings_cache.mtime = st->st_mtim;
+    settings_cache.size = st->st_size;
+    settings_cache.inode = st->st_ino;
+}
+
+static inline const Settings *settings_get(void) {
+    struct stat st;
+    if (stat(SETTINGS_FILE, &st) != 0) {
+        if (!settings_cache.loaded || settings_cache.present) {
+            settings_defaults(&settings_cache.values);
+            settings_cache.present = false;
+            settings_cache.loaded = true;
+        }
+        return &settings_cache.values;
+    }
+    if (settings_cache.loaded && settings_cache.present && !settings_stat_changed(&st)) {
+        return &settings_cache.values;
+    }
+
+    FILE *file = fopen(SETTINGS_FILE, "r");
+    if (file == NULL) {
+        return &settings_cache.values;
+    }
+    // Stat the handle we actually read so a rename racing with us is seen
+    // again on the next call instead of being cached as already parsed.
+    fstat(fileno(file), &st);
+    settings_parse(file, &settings_cache.values);
+    fclose(file);
+    settings_remember(&st);
+    settings_cache.present = true;
+    settings_cache.loaded = true;
+    return &settings_cache.values;
+}
+
+static inline bool settings_save(const Settings *s) {
+    const char *tmp_name = SETTINGS_FILE ".tmp";
+    FILE *file = fopen(tmp_name, "w");
+    if (file == NULL) {
+        return false;
+    }
+    if (s->username[0] != '\0') {
+        fprintf(file, "Username: %s\n", s->username);
+    }
+    fprintf(file, "Difficulty: %d\n", s->difficulty);
+    fprintf(file, "CharacterColor: %d\n", s->character_color);
+    fprintf(file, "MusicEnabled: %d\n", s->music_enabled);
+    fprintf(file, "CurrentMusic: %s\n", s->current_music);
+
+    struct stat st;
+    bool ok = fflush(file) == 0 && fsync(fileno(file)) == 0 && fstat(fileno(file), &st) == 0;
+    if (fclose(file) != 0 || !ok || rename(tmp_name, SETTINGS_FILE) != 0) {
+        unlink(tmp_name);
+        return false;
+    }
+
+    // rename() keeps the inode and mtime, so the cache stays valid without
+    // reparsing what was just written.
+    if (&settings_cache.values != s) {
+        settings_cache.values = *s;
+    }
+    settings_remember(&st);
+    settings_cache.present = true;
+    settings_cache.loaded = true;
+    return true;
+}
+
+static inline Settings settings_copy(void) {
+    return *settings_get();
+}
+
+#endif
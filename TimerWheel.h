@@ -0,0 +1,91 @@
+#ifndef TIMER_WHEEL_H
+#define TIMER_WHEEL_H
+#include <stdint.h>
+#include <stdbool.h>
+
+#define TIMER_SLOTS 64   // power of two
+#define TIMER_MAX 32     // ids fit in the bitmask timer_advance() returns
+#define TIMER_NONE -1
+
+// Hashed timer wheel keyed on the turn counter. A timer due on turn `due`
+// sits in slot `due % TIMER_SLOTS`, so advancing a turn only looks at the
+// timers in one slot; one due more than TIMER_SLOTS turns out just stays
+// there for another lap. Timers are identified by a small id chosen by the
+// caller, with at most one pending per id, so idle ids cost nothing. The
+// wheel holds no pointers and can be copied with the struct around it.
+typedef struct {
+    uint32_t due;
+    int8_t next, prev;
+    bool pending;
+} Timer;
+
+typedef struct {
+    uint32_t now;
+    int8_t slots[TIMER_SLOTS];
+    Timer timers[TIMER_MAX];
+} TimerWheel;
+
+static inline void timer_wheel_init(TimerWheel *w) {
+    w->now = 0;
+    for (int i = 0; i < TIMER_SLOTS; i++) {
+        w->slots[i] = TIMER_NONE;
+    }
+    for (int i = 0; i < TIMER_MAX; i++) {
+        w->timers[i] = (Timer){0, TIMER_NONE, TIMER_NONE, false};
+    }
+}
+static inline void timer_unlink(TimerWheel *w, int id) {
+    Timer *t = &w->timers[id];
+    if (t->prev != TIMER_NONE) {
+        w->timers[t->prev].next = t->next;
+    } else {
+        w->slots[t->due & (TIMER_SLOTS - 1)] = t->next;
+    }
+    if (t->next != TIMER_NONE) {
+        w->timers[t->next].prev = t->prev;
+    }
+    t->pending = false;
+}
+// (Re)arms timer `id` to fire `delay` turns from now; a delay below one
+// fires on the next turn.
+static inline void timer_set(TimerWheel *w, int id, uint32_t delay) {
+    Timer *t = &w->timers[id];
+    if (t->pending) timer_unlink(w, id);
+    t->due = w->now + (delay > 0 ? delay : 1);
+    int8_t *head = &w->slots[t->due & (TIMER_SLOTS - 1)];
+    t->prev = TIMER_NONE;
+    t->next = *head;
+    if (*head != TIMER_NONE) {
+        w->timers[*head].prev = id;
+    }
+    *head = id;
+    t->pending = true;
+}
+static inline void timer_cancel(TimerWheel *w, int id) {
+    if (w->timers[id].pending) timer_unlink(w, id);
+}
+static inline bool timer_pending(const TimerWheel *w, int id) {
+    return w->timers[id].pending;
+}
+// Turns until timer `id` fires, 0 if it is not pending.
+static inline uint32_t timer_remaining(const TimerWheel *w, int id) {
+    return w->timers[id].pending ? w->timers[id].due - w->now : 0;
+}
+// Moves to the next turn and returns the ids that fired as a bitmask, so
+// the caller handles them in id order however they were armed.
+static inline uint32_t timer_advance(TimerWheel *w) {
+    w->now++;
+    uint32_t fired = 0;
+    int id = w->slots[w->now & (TIMER_SLOTS - 1)];
+    while (id != TIMER_NONE) {
+        int next = w->timers[id].next;
+        if (w->timers[id].due == w->now) {
+            timer_unlink(w, id);
+            fired |= 1u << id;
+        }
+        id = next;
+    }
+    return fired;
+}
+
+#endif